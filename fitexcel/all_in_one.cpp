@@ -8,10 +8,13 @@
 #include <cassert>
 #include <cmath>
 #include <iostream>
+#include <istream>
+#include <ostream>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
 #include <string>
+#include <string_view>
 #include <array>
 #include <vector>
 #include <list>
@@ -32,6 +35,14 @@
 #include <charconv>
 #include <span>
 #include <utility>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <thread>
 #include "expression.h"
 using namespace std::literals;
 using CValue = std::variant<std::monostate, double, std::string>;
@@ -43,17 +54,65 @@ constexpr unsigned SPREADSHEET_SPEED = 0x08;
 constexpr unsigned SPREADSHEET_PARSER = 0x10;
 #endif /* __PROGTEST__ */
 
+
 class CCell;
+class CDependencyGraph;
+class CValueOverlay;
 
 class CPos {
 public:
-    CPos() = default;
+    // Longest id that fits size_t: 14 column letters followed by 20 row digits
+    static constexpr size_t MAX_ID_LENGTH = 34;
+
+    constexpr CPos() = default;
     CPos(std::string_view str);
-    CPos(const CPos &pos);
+
+    /**
+     * Creates position from numeric column and row without parsing, id is normalized to upper case
+     * @param column Column position (1 = A)
+     * @param row Row number
+    */
+    constexpr CPos(size_t column, size_t row)
+        : m_Row(row)
+        , m_ColumnNumber(column) {
+        m_ColumnLength = formatColumn(column, m_Id.data());
+        m_Length = m_ColumnLength + formatRow(row, m_Id.data() + m_ColumnLength);
+    }
+
     std::string getId() const;
+
+    /**
+     * Returns id without copying, valid as long as the position exists
+     * @return Cell id
+    */
+    constexpr std::string_view getIdView() const {
+        return std::string_view(m_Id.data(), m_Length);
+    }
+
     std::string getColumn() const;
-    size_t getRow() const;
-    size_t getColumnNumber() const;
+
+    constexpr size_t getRow() const {
+        return m_Row;
+    }
+
+    constexpr size_t getColumnNumber() const {
+        return m_ColumnNumber;
+    }
+
+    /**
+     * Orders positions column by column, so positions can be keys of ordered containers
+     * @param pos Compared position
+     * @return Order of the positions
+    */
+    constexpr std::strong_ordering operator<=>(const CPos &pos) const {
+        if (auto order = m_ColumnNumber <=> pos.m_ColumnNumber; order != 0)
+            return order;
+        return m_Row <=> pos.m_Row;
+    }
+
+    constexpr bool operator==(const CPos &pos) const {
+        return m_ColumnNumber == pos.m_ColumnNumber && m_Row == pos.m_Row;
+    }
 
     /**
      * Converts numeric representation of column to coresponding string id (e.g. 1 -> A, 27 -> AA)
@@ -69,12 +128,186 @@ public:
     */
     size_t columnToNumber(const std::string& column);
 
+    /**
+     * Parses case insensitive cell id without allocating, usable in constant expressions
+     * @param str Cell id (e.g. B12)
+     * @param column Parsed column position
+     * @param row Parsed row number
+     * @return False if the id is invalid or does not fit size_t
+    */
+    static constexpr bool parse(std::string_view str, size_t &column, size_t &row) {
+        size_t i = 0;
+        column = 0;
+        row = 0;
+
+        for (; i < str.size() && isLetter(str[i]); i++) {
+            size_t letter = (str[i] | 0x20) - 'a' + 1;
+            if (column > (SIZE_MAX - letter) / 26)
+                return false;
+            column = column * 26 + letter;
+        }
+
+        // Non-empty column followed by row number without leading zeros
+        if (i == 0 || i == str.size() || (str[i] == '0' && i + 1 != str.size()))
+            return false;
+
+        for (; i < str.size(); i++) {
+            if (str[i] < '0' || str[i] > '9')
+                return false;
+            size_t digit = str[i] - '0';
+            if (row > (SIZE_MAX - digit) / 10)
+                return false;
+            row = row * 10 + digit;
+        }
+        return true;
+    }
+
+    /**
+     * Writes column id into buffer without allocating (e.g. 1 -> A, 27 -> AA)
+     * @param number Column position
+     * @param buffer Output with room for at least 14 characters
+     * @return Number of written characters
+    */
+    static constexpr size_t formatColumn(size_t number, char *buffer) {
+        size_t length = 0;
+        for (size_t rest = number; rest > 0; rest = (rest - 1) / 26)
+            length++;
+
+        for (size_t i = length; i > 0; i--) {
+            buffer[i - 1] = 'A' + (number - 1) % 26;
+            number = (number - 1) / 26;
+        }
+        return length;
+    }
+
+private:
+    static constexpr bool isLetter(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static constexpr size_t formatRow(size_t row, char *buffer) {
+        size_t length = 1;
+        for (size_t rest = row; rest >= 10; rest /= 10)
+            length++;
+
+        for (size_t i = length; i > 0; i--) {
+            buffer[i - 1] = '0' + row % 10;
+            row /= 10;
+        }
+        return length;
+    }
+
+    std::array<char, MAX_ID_LENGTH> m_Id = {};
+    uint8_t m_Length = 0;
+    uint8_t m_ColumnLength = 0;
+    size_t m_Row = 0;
+    size_t m_ColumnNumber = 0;
+};
+
+/**
+ * Fixed size string used as template argument of the _pos literal
+*/
+template <size_t N>
+struct CPosLiteral {
+    constexpr CPosLiteral(const char (&str)[N]) {
+        std::copy_n(str, N, m_Str);
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(m_Str, N - 1);
+    }
+
+    char m_Str[N] = {};
+};
+
+/**
+ * Cell position literal checked at compile time, e.g. "B12"_pos
+ * @return Cell position
+*/
+template <CPosLiteral Id>
+constexpr CPos operator""_pos() {
+    constexpr std::array<size_t, 3> parsed = [] {
+        size_t column = 0;
+        size_t row = 0;
+        bool valid = CPos::parse(Id.view(), column, row);
+        return std::array<size_t, 3>{valid, column, row};
+    }();
+    static_assert(parsed[0], "Invalid cell id");
+    return CPos(parsed[1], parsed[2]);
+}
+
+/****************************************************************************/
+
+/**
+ * Rectangular area of cells with inclusive bounds, used for range references
+*/
+struct CRect {
+    size_t m_Left;
+    size_t m_Top;
+    size_t m_Right;
+    size_t m_Bottom;
+
+    bool contains(size_t column, size_t row) const;
+
+    /**
+     * Parses range in the "A1:B5" form, corners may be given in any order
+     * @param range Range without '$' signs
+     * @return Normalized rectangle
+    */
+    static CRect parse(std::string_view range);
+    std::string toString() const;
+};
+
+/****************************************************************************/
+
+/**
+ * Insertion or deletion of whole rows or columns, or move of a block of cells. Maps positions from before
+ * the edit to positions after it
+*/
+struct CShift {
+    // Columns are edited instead of rows
+    bool m_Columns;
+    bool m_Delete;
+    // First inserted or deleted row or column
+    size_t m_Index;
+    size_t m_Count;
+
+    // Cells of the source area move to the destination instead of the row or column edit
+    bool m_Move = false;
+    CRect m_Source = {};
+    CPos m_Destination = {};
+
+    /**
+     * Checks whether the edit moves or deletes the position
+     * @param pos Position before the edit
+     * @return True if the row or column lies at or after the edited one, or the position lies in the moved block
+    */
+    bool affects(const CPos &pos) const;
+
+    /**
+     * Checks whether the edit changes the range
+     * @param rect Range before the edit
+     * @return True if the range reaches the edited rows or columns, or lies entirely in the moved block
+    */
+    bool affects(const CRect &rect) const;
+
+    /**
+     * @param pos Position before the edit, replaced by the position after it
+     * @return False if the position was deleted
+    */
+    bool apply(CPos &pos) const;
+
+    /**
+     * Maps corners of a range given in any order. Insertion inside the range grows it, deletion shrinks it
+     * and a moved block takes only ranges lying entirely inside it along
+     * @param first First corner
+     * @param second Second corner
+     * @return False if the whole range was deleted
+    */
+    bool apply(CPos &first, CPos &second) const;
+
 private:
-    bool isValidRowNumber(const std::string &rowNumber) const;
-    std::string m_Id;
-    std::string m_Column;
-    size_t m_Row;
-    size_t m_ColumnNumber;
+    bool apply(size_t &low, size_t &high) const;
 };
 
 /****************************************************************************/
@@ -93,8 +326,112 @@ public:
      * @param dst Target cell position
      * @return Pointer to copied node
     */
-    virtual std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) = 0;
+    virtual std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) = 0;
+
+    /**
+     * Method to recursively write AST back to formula text (without the leading '=')
+     * @param out Output text
+    */
+    virtual void unparse(std::string &out) const = 0;
+
+    /**
+     * Binding strength of the node, used to place parentheses when unparsing
+     * @return Precedence level
+    */
+    virtual int precedence() const;
+
+    /**
+     * Method to recursively move references after rows or columns were inserted or deleted, the AST is changed in place
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references of the node
+     * @return False if the node references deleted cells and has to be replaced
+    */
+    virtual bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies);
     virtual ~CNode() = default;
+
+    // Precedence levels of the formula grammar from the loosest binding
+    static constexpr int PRECEDENCE_EQUALITY = 1;
+    static constexpr int PRECEDENCE_RELATIONAL = 2;
+    static constexpr int PRECEDENCE_ADDITIVE = 3;
+    static constexpr int PRECEDENCE_MULTIPLICATIVE = 4;
+    static constexpr int PRECEDENCE_NEGATION = 5;
+    static constexpr int PRECEDENCE_POWER = 6;
+    static constexpr int PRECEDENCE_PRIMARY = 7;
+
+protected:
+    /**
+     * Writes operand, in parentheses when it binds looser than required
+     * @param node Operand
+     * @param minPrecedence Lowest precedence written without parentheses
+     * @param out Output text
+    */
+    static void unparseOperand(const CNode &node, int minPrecedence, std::string &out);
+
+    /**
+     * Writes left associative binary operation
+     * @param out Output text
+    */
+    static void unparseBinary(const CNode &left, const CNode &right, std::string_view op, int precedence, std::string &out);
+
+    /**
+     * Shifts operand and replaces it by an invalid reference when it references deleted cells
+     * @param node Operand
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references, those of a replaced operand are dropped
+    */
+    static void shiftOperand(std::unique_ptr<CNode> &node, const CShift &edit, CPos cell, std::vector<std::string> &dependencies);
+
+    /**
+     * Writes sheet qualifier followed by '!', names which are not plain identifiers are quoted
+     * @param sheet Sheet name, nothing is written for an empty one
+     * @param out Output text
+    */
+    static void unparseSheet(const std::string &sheet, std::string &out);
+
+    /**
+     * Builds dependency of a qualified reference, e.g. "Sheet2!A1"
+     * @param sheet Sheet name, empty for the own sheet
+     * @param reference Cell id or range
+     * @return Dependency text
+    */
+    static std::string qualify(const std::string &sheet, const std::string &reference);
+};
+
+/****************************************************************************/
+
+/**
+ * Rebuilds ASTs of evicted cells from their expression text, implemented by the owner of the parser
+*/
+class CAstLoader {
+public:
+    /**
+     * @param pos Cell position
+     * @param expression Cell formula
+     * @return Rebuilt AST or nullptr when the formula can not be parsed
+    */
+    virtual std::shared_ptr<CNode> load(const CPos &pos, const std::string &expression) = 0;
+
+    /**
+     * Called when a loaded AST is kept by its cell, private ASTs of a value overlay are not reported
+    */
+    virtual void noteResident() {}
+    virtual ~CAstLoader() = default;
+};
+
+/**
+ * Gives access to other sheets of a workbook for references qualified by a sheet name, implemented by the workbook
+*/
+class CSheetResolver {
+public:
+    /**
+     * @param sheet Sheet name
+     * @return Table of the sheet or nullptr when there is no such sheet
+    */
+    virtual std::map<std::string, CCell> *table(const std::string &sheet) = 0;
+    virtual const CDependencyGraph *graph(const std::string &sheet) const = 0;
+    virtual ~CSheetResolver() = default;
 };
 
 /****************************************************************************/
@@ -103,10 +440,18 @@ class CCell {
 public:
     CCell();
     CCell(CPos id, const std::string &expr, std::unique_ptr<CNode> AST);
+
+    /**
+     * Creates literal cell (number or text) which has value but no AST
+     * @param id Cell position
+     * @param expr Original cell contents
+     * @param value Literal value
+    */
+    CCell(CPos id, const std::string &expr, CValue value);
     CPos getPos() const;
     void setValue(CValue val);
     CValue getValue() const;
-    std::string getExpression() const;
+    const std::string &getExpression() const;
 
     /**
      * Evaluates cell and returns its value
@@ -123,13 +468,222 @@ public:
     */
     CCell copyCell(CPos dst, std::vector<std::string> &dependencies);
 
+    /**
+     * Drops AST of a formula cell and keeps only its text, the AST is rebuilt on the next evaluation
+     * @return True if AST was evicted
+    */
+    bool evictAst();
+
+    /**
+     * Rebuilds evicted AST
+     * @param loader Parser of the expression text
+    */
+    void restoreAst(CAstLoader &loader);
+    bool hasAst() const;
+    bool isFormula() const;
+
+    /**
+     * Returns and clears the reference bit set by evaluation, used by CLOCK eviction
+     * @return True if the cell was evaluated since the last call
+    */
+    bool takeReferenced();
+
+    /**
+     * Moves cell after rows or columns were inserted or deleted and updates its references, evicted AST
+     * has to be restored first
+     * @param edit Structural edit
+     * @param pos Cell position after the edit
+     * @param dependencies Output references of the formula
+    */
+    void shift(const CShift &edit, CPos pos, std::vector<std::string> &dependencies);
+
 private:
+    /**
+     * Evaluates cell without writing to it, the overlay replaces inputs and keeps values of formulas
+     * @param overlay Overlay of the running evaluation
+     * @param table Table data
+     * @return Evaluated cell value
+    */
+    CValue evaluate(CValueOverlay &overlay, std::map<std::string, CCell> &table) const;
     CPos m_Pos;
-    std::string m_Expression;
+    // Copied cells get their text from AST on first request
+    mutable std::string m_Expression;
+    mutable bool m_ExpressionStale = false;
     CValue m_Value;
     // Root of AST
     std::shared_ptr<CNode> m_Root;
     bool m_IsEmpty;
+    // Evaluation pass in which m_Value was computed
+    size_t m_Pass = 0;
+    // Formula whose AST was evicted to save memory
+    bool m_Evicted = false;
+    bool m_Referenced = false;
+};
+
+/****************************************************************************/
+
+/**
+ * Values of one evaluation with replaced input cells. Values of formulas are kept here instead of in the cells,
+ * so the table is only read and several overlays may evaluate it at once
+*/
+class CValueOverlay {
+public:
+    /**
+     * @param table Table whose cells are replaced, cells of other sheets keep their values
+     * @param inputs Values of replaced cells, which need not exist in the table
+    */
+    CValueOverlay(const std::map<std::string, CCell> &table, const std::map<CPos, CValue> &inputs);
+    CValueOverlay(const CValueOverlay &overlay) = delete;
+    CValueOverlay& operator=(const CValueOverlay &overlay) = delete;
+
+    /**
+     * @param table Table of the cell
+     * @param pos Cell position
+     * @return Input value or nullptr when the cell is not replaced
+    */
+    const CValue *input(const std::map<std::string, CCell> &table, const CPos &pos) const;
+
+    /**
+     * @param cell Formula cell
+     * @return Value computed by this evaluation or nullptr
+    */
+    const CValue *result(const CCell *cell) const;
+    void setResult(const CCell *cell, const CValue &value);
+
+    /**
+     * Parses evicted AST for this evaluation only, the loader is shared by all overlays so loads are serialized
+     * @param loader AST loader of the running pass
+     * @param pos Cell position
+     * @param expression Cell formula
+     * @return AST or nullptr when the formula can not be parsed
+    */
+    std::shared_ptr<CNode> load(CAstLoader &loader, const CPos &pos, const std::string &expression);
+
+private:
+    const std::map<std::string, CCell> *m_Table;
+    const std::map<CPos, CValue> *m_Inputs;
+    std::unordered_map<const CCell*, CValue> m_Results;
+    static std::mutex s_LoadMutex;
+};
+
+/****************************************************************************/
+
+/**
+ * Evaluation pass of the calling thread. While the pass is alive every cell is evaluated
+ * at most once and further references reuse its value, so the table must not change meanwhile
+*/
+class CEvaluationPass {
+public:
+    /**
+     * Starts new pass
+     * @param loader Rebuilds evicted ASTs reached during the pass
+     * @param sheets Resolves references to other sheets
+     * @param overlay Keeps values of the pass instead of cells, nullptr evaluates into cells
+    */
+    CEvaluationPass(CAstLoader *loader = nullptr, CSheetResolver *sheets = nullptr, CValueOverlay *overlay = nullptr);
+
+    /**
+     * Joins already running pass, used by worker threads evaluating for another thread
+     * @param id Pass id
+     * @param loader Rebuilds evicted ASTs reached during the pass
+     * @param sheets Resolves references to other sheets
+     * @param overlay Keeps values of the pass instead of cells, nullptr evaluates into cells
+    */
+    explicit CEvaluationPass(size_t id, CAstLoader *loader = nullptr, CSheetResolver *sheets = nullptr, CValueOverlay *overlay = nullptr);
+    CEvaluationPass(const CEvaluationPass &pass) = delete;
+    CEvaluationPass& operator=(const CEvaluationPass &pass) = delete;
+    ~CEvaluationPass();
+    size_t getId() const;
+
+    /**
+     * Returns pass of the calling thread
+     * @return Pass id or 0 when no pass is running
+    */
+    static size_t current();
+
+    /**
+     * Returns AST loader of the running pass
+     * @return Loader or nullptr
+    */
+    static CAstLoader *loader();
+
+    /**
+     * Returns table of another sheet of the workbook evaluated by the running pass
+     * @param sheet Sheet name
+     * @return Table or nullptr when the sheet does not exist or no workbook is attached
+    */
+    static std::map<std::string, CCell> *sheet(const std::string &sheet);
+
+    /**
+     * Returns overlay of the running pass
+     * @return Overlay or nullptr
+    */
+    static CValueOverlay *overlay();
+
+    /**
+     * Returns value of a cell missing in the table, which is empty unless the overlay replaces it
+     * @param table Table data
+     * @param pos Cell position
+     * @return Cell value
+    */
+    static CValue emptyCell(const std::map<std::string, CCell> &table, const CPos &pos);
+
+private:
+    size_t m_Id;
+    size_t m_Previous;
+    CAstLoader *m_PreviousLoader;
+    CSheetResolver *m_PreviousSheets;
+    CValueOverlay *m_PreviousOverlay;
+    static std::atomic<size_t> s_Counter;
+    static thread_local size_t s_Current;
+    static thread_local CAstLoader *s_Loader;
+    static thread_local CSheetResolver *s_Sheets;
+    static thread_local CValueOverlay *s_Overlay;
+};
+
+/****************************************************************************/
+
+/**
+ * Persistent threads sharing chunked work with the calling thread, so large aggregates do not start
+ * threads on every evaluation. One job runs at a time, callers finding the pool busy run their chunks alone
+*/
+class CWorkerPool {
+public:
+    /**
+     * Returns process wide pool, its threads are started on first demand
+     * @return Pool
+    */
+    static CWorkerPool &instance();
+    CWorkerPool(const CWorkerPool &pool) = delete;
+    CWorkerPool& operator=(const CWorkerPool &pool) = delete;
+    ~CWorkerPool();
+
+    /**
+     * Runs task for every chunk on the calling thread and at most workers - 1 pool threads
+     * @param chunks Number of chunks
+     * @param workers Number of threads including the calling one
+     * @param task Callback receiving chunk index, must not use the pool itself
+    */
+    void run(size_t chunks, size_t workers, const std::function<void(size_t)> &task);
+
+private:
+    CWorkerPool() = default;
+    void work();
+    void drain();
+
+    // Serializes jobs, held by the caller for the whole job
+    std::mutex m_JobMutex;
+    std::mutex m_Mutex;
+    std::condition_variable m_Wake;
+    std::condition_variable m_Done;
+    std::vector<std::thread> m_Threads;
+    const std::function<void(size_t)> *m_Task = nullptr;
+    size_t m_Chunks = 0;
+    std::atomic<size_t> m_Next = 0;
+    // Pool threads still allowed to join the job and those working on it
+    size_t m_Openings = 0;
+    size_t m_Running = 0;
+    bool m_Stop = false;
 };
 
 /****************************************************************************/
@@ -138,7 +692,17 @@ class CNumberNode : public CNode {
 public:
     CNumberNode(double num);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+    double getNumber() const;
+
+    /**
+     * Writes number the way the parser reads it back, infinity as 1e999
+     * @param value Number
+     * @param out Output text
+    */
+    static void unparseNumber(double value, std::string &out);
 
 private:
     double m_Value;
@@ -148,7 +712,8 @@ class CStringNode : public CNode {
 public:
     CStringNode(const std::string &str);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 
 private:
     std::string m_Value;
@@ -159,6 +724,7 @@ private:
 class CBinaryOperatorNode : public CNode {
 public:
     CBinaryOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
     
 protected:
     // Left operand
@@ -172,35 +738,90 @@ class CAddOperatorNode : public CBinaryOperatorNode {
 public:
     CAddOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Adds numbers or concatenates strings, numbers are written with std::to_string
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CSubOperatorNode : public CBinaryOperatorNode {
 public:
     CSubOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Subtracts numbers
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CDivOperatorNode : public CBinaryOperatorNode {
 public:
     CDivOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Divides numbers, division by zero is undefined
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CMulOperatorNode : public CBinaryOperatorNode {
 public:
     CMulOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Multiplies numbers
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+};
+
+class CNegOperatorNode : public CNode {
+public:
+    CNegOperatorNode(std::unique_ptr<CNode> operand);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+private:
+    std::unique_ptr<CNode> m_Operand;
 };
 
 class CPowOperatorNode : public CBinaryOperatorNode {
 public:
     CPowOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 /****************************************************************************/
@@ -208,6 +829,7 @@ public:
 class CRelationalOperatorNode : public CNode {
 public:
     CRelationalOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
     
 protected:
     std::unique_ptr<CNode> m_Left;
@@ -218,42 +840,54 @@ class CEqOperatorNode : public CRelationalOperatorNode {
 public:
     CEqOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CNeOperatorNode : public CRelationalOperatorNode {
 public:
     CNeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CLtOperatorNode : public CRelationalOperatorNode {
 public:
     CLtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CLeOperatorNode : public CRelationalOperatorNode {
 public:
     CLeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CGtOperatorNode : public CRelationalOperatorNode {
 public:
     CGtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CGeOperatorNode : public CRelationalOperatorNode {
 public:
     CGeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 /****************************************************************************/
@@ -268,8 +902,40 @@ public:
      * @return Reference value
     */
     CValue getValue(std::map<std::string, CCell> &table);
+    const CPos &getRefId() const;
+
+    /**
+     * Makes the reference point to a cell of another sheet
+     * @param sheet Sheet name
+    */
+    void setSheet(const std::string &sheet);
+    const std::string &getSheet() const;
+
+    /**
+     * Returns dependency of the reference, e.g. "A1" or "Sheet2!A1"
+     * @return Dependency text
+    */
+    std::string getDependency() const;
+
+    /**
+     * Moves referenced cell regardless of '$' signs, structural edits move the cells themselves.
+     * References to other sheets are kept, the edit belongs to the own sheet only
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references
+     * @return False if the referenced cell was deleted
+    */
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
 
 protected:
+    /**
+     * Finishes cloned reference, it keeps the sheet and reports its dependency
+     * @param node Cloned reference
+     * @param dependencies Output references
+     * @return Cloned reference
+    */
+    std::unique_ptr<CNode> qualified(std::unique_ptr<CReferenceNode> node, std::vector<std::string> &dependencies) const;
+
     // The position of the cell in which the reference is located
     CPos m_CellId;
 
@@ -278,6 +944,9 @@ protected:
 
     // String representation of reference
     std::string m_Reference;
+
+    // Sheet of the referenced cell, empty for the own sheet
+    std::string m_Sheet;
 };
 
 class CRelativeReferenceNode : public CReferenceNode {
@@ -290,7 +959,8 @@ public:
      * @param CPos Copy destination
      * @return Pointer to recalculated reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 };
 
 class CAbsoluteReferenceNode : public CReferenceNode {
@@ -303,7 +973,8 @@ public:
      * @param CPos Copy destination
      * @return Pointer to reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 };
 
 class CAbsRelReferenceNode : public CReferenceNode {
@@ -316,7 +987,8 @@ public:
      * @param CPos Copy destination
      * @return Pointer to recalculated reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 };
 
 class CRelAbsReferenceNode : public CReferenceNode {
@@ -329,999 +1001,6508 @@ public:
      * @param CPos Copy destination
      * @return Pointer to recalculated reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 };
 
-class CBuilder : public CExprBuilder {
+/**
+ * Reference whose cells were deleted, it has undefined value and is written as 1/0 which evaluates the same way
+*/
+class CInvalidReferenceNode : public CNode {
 public:
-    CBuilder(CPos pos);
-    void opAdd() override;
-    void opSub() override;
-    void opMul() override;
-    void opDiv() override;
-    void opPow() override;
-    void opNeg() override;
-    void opEq() override;
-    void opNe() override;
-    void opLt() override;
-    void opLe() override;
-    void opGt() override;
-    void opGe() override;
-    void valNumber(double num) override;
-    void valString(std::string str) override;
-    void valReference(std::string str) override;
-    void valRange(std::string str) override;
-    void funcCall(std::string fnName, int paramCnt) override;
-    std::unique_ptr<CNode> getTopNode();
-    std::vector<std::string> getDependencies() const;
-    std::unique_ptr<CNode> buildAST();
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+};
 
-private:
-    std::stack<std::unique_ptr<CNode>> m_Nodes;
+/****************************************************************************/
+
+/**
+ * Cell reference operand stored by value inside a fused node
+*/
+class CRefOperand {
+public:
+    CRefOperand(CPos refId, bool absoluteColumn, bool absoluteRow);
+    CValue value(std::map<std::string, CCell> &table) const;
+
+    /**
+     * Moves relative parts of the reference like copying a reference node does
+     * @param cell Position of the owning cell
+     * @param dst Copy destination
+     * @param dependencies Output references
+     * @return Copied operand
+    */
+    CRefOperand clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const;
+    void unparse(std::string &out) const;
+    bool shift(const CShift &edit, std::vector<std::string> &dependencies);
+
+private:
+    CPos m_RefId;
+    // Table key of the referenced cell
+    std::string m_Reference;
+    bool m_AbsoluteColumn;
+    bool m_AbsoluteRow;
+};
+
+/**
+ * Number operand stored by value inside a fused node
+*/
+class CConstOperand {
+public:
+    CConstOperand(double number);
+
+    const CValue &value(std::map<std::string, CCell> &table) const {
+        return m_Value;
+    }
+
+    CConstOperand clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const;
+    void unparse(std::string &out) const;
+    bool shift(const CShift &edit, std::vector<std::string> &dependencies);
+
+private:
+    double m_Number;
+    // Value computed once, infinite numbers are undefined
+    CValue m_Value;
+};
+
+/**
+ * Operations available to fused nodes, they share semantics with the generic operator nodes
+*/
+struct COpAdd {
+    static constexpr std::string_view SYMBOL = "+";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_ADDITIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+            return CValue(std::get<double>(left) + std::get<double>(right));
+        return CAddOperatorNode::apply(left, right);
+    }
+};
+
+struct COpSub {
+    static constexpr std::string_view SYMBOL = "-";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_ADDITIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+            return CValue(std::get<double>(left) - std::get<double>(right));
+        return CSubOperatorNode::apply(left, right);
+    }
+};
+
+struct COpMul {
+    static constexpr std::string_view SYMBOL = "*";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_MULTIPLICATIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+            return CValue(std::get<double>(left) * std::get<double>(right));
+        return CMulOperatorNode::apply(left, right);
+    }
+};
+
+struct COpDiv {
+    static constexpr std::string_view SYMBOL = "/";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_MULTIPLICATIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right) && std::get<double>(right) != 0)
+            return CValue(std::get<double>(left) / std::get<double>(right));
+        return CDivOperatorNode::apply(left, right);
+    }
+};
+
+/**
+ * Superinstruction for the most common formula shapes (e.g. A1+B1, A1*2), both operands are stored inline
+ * and the operation is evaluated by a single virtual call
+*/
+template <typename TOp, typename TLeft, typename TRight>
+class CBinaryFused : public CNode {
+public:
+    CBinaryFused(CPos cellId, TLeft left, TRight right)
+        : m_CellId(cellId)
+        , m_Left(std::move(left))
+        , m_Right(std::move(right)) {}
+
+    CValue evaluate(std::map<std::string, CCell> &table) override {
+        // Operands are evaluated left to right like in the generic tree
+        CValue left = m_Left.value(table);
+        return TOp::apply(left, m_Right.value(table));
+    }
+
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override {
+        TLeft left = m_Left.clone(m_CellId, dst, dependencies);
+        return std::make_unique<CBinaryFused>(dst, std::move(left), m_Right.clone(m_CellId, dst, dependencies));
+    }
+
+    void unparse(std::string &out) const override {
+        m_Left.unparse(out);
+        out += TOp::SYMBOL;
+        m_Right.unparse(out);
+    }
+
+    int precedence() const override {
+        return TOp::PRECEDENCE;
+    }
+
+    /**
+     * Operation with a deleted operand is undefined whatever the other one is, so the whole node is replaced
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references
+     * @return False if an operand references deleted cell
+    */
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override {
+        m_CellId = cell;
+        return m_Left.shift(edit, dependencies) && m_Right.shift(edit, dependencies);
+    }
+
+private:
+    // The position of the cell in which the operation is located
+    CPos m_CellId;
+    TLeft m_Left;
+    TRight m_Right;
+};
+
+/****************************************************************************/
+
+class CRangeNode : public CNode {
+public:
+    /**
+     * @param cellId Position of the cell in which the range is located
+     * @param range Range as written in the formula (e.g. A$7:$X29)
+    */
+    CRangeNode(CPos cellId, const std::string &range);
+
+    /**
+     * Range alone is not a value, it is consumed by functions
+     * @param table Table data
+     * @return Undefined value
+    */
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+
+    /**
+     * Clones range and shifts its relative corners
+     * @param dst Copy destination
+     * @return Pointer to recalculated range
+    */
+    std::unique_ptr<CRangeNode> cloneRange(CPos dst, std::vector<std::string> &dependencies);
+
+    /**
+     * Evaluates every cell of the range including empty ones, column by column
+     * @param table Table data
+     * @param visitor Callback receiving cell values
+    */
+    void forEachValue(std::map<std::string, CCell> &table, const std::function<void(const CValue&)> &visitor) const;
+
+    /**
+     * Folds values of the range in column-major order. Ranges of at least PARALLEL_CELLS cells are split into
+     * chunks of CHUNK_CELLS consecutive cells folded on several threads and partial results are combined pairwise
+     * in a fixed order, so the result does not depend on the number of threads. Overlay evaluations fold the same
+     * chunks serially, they are already spread over threads by scenarios
+     * @param table Table data
+     * @param fold Adds cell value to partial result
+     * @param combine Adds right partial result to the left one
+     * @return Result of the whole range
+    */
+    template<typename TPartial, typename TFold, typename TCombine>
+    TPartial reduce(std::map<std::string, CCell> &table, TFold fold, TCombine combine) const;
+    CRect getRect() const;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+    void setSheet(const std::string &sheet);
+
+    /**
+     * Returns dependency of the range, e.g. "A1:B5" or "Sheet2!A1:B5"
+     * @return Dependency text
+    */
+    std::string getDependency() const;
+    static const size_t PARALLEL_CELLS = 1 << 16;
+    static const size_t CHUNK_CELLS = 1 << 14;
+
+    /**
+     * Sets number of threads folding chunks of large ranges, results do not depend on it
+     * @param workers Number of threads, 0 uses hardware concurrency
+    */
+    static void setWorkers(size_t workers);
+
+private:
+    /**
+     * Finds cells of the range chunk by chunk on several threads, formulas are then evaluated on the calling
+     * thread because evaluation writes to cells and may reach other cells of the range
+     * @param table Table data
+     * @return Cells in column-major order, nullptr for missing ones
+    */
+    std::vector<const CCell*> resolveCells(std::map<std::string, CCell> &table) const;
+
+    /**
+     * Runs task for every chunk, chunks are taken by the calling thread and threads of the shared worker pool
+     * @param chunks Number of chunks
+     * @param task Callback receiving chunk index
+    */
+    static void forEachChunk(size_t chunks, const std::function<void(size_t)> &task);
+    static std::atomic<size_t> s_Workers;
+
+    // The position of the cell in which the range is located
+    CPos m_CellId;
+
+    // Sheet of the range, empty for the own sheet
+    std::string m_Sheet;
+
+    // Corners as written, only the rectangle is normalized
+    CPos m_Corners[2];
+    bool m_AbsoluteColumn[2];
+    bool m_AbsoluteRow[2];
+};
+
+/****************************************************************************/
+
+class CRangeFunctionNode : public CNode {
+public:
+    CRangeFunctionNode(std::unique_ptr<CRangeNode> range);
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+protected:
+    /**
+     * Finds number selected by a strict comparison. Like a serial scan keeping the first number unless a better one
+     * follows, NaN is the result only when it is the first number of the range and is skipped otherwise
+     * @param table Table data
+     * @param better Comparison of a candidate with the best number so far
+     * @return Selected number, undefined for a range without numbers
+    */
+    template<typename TBetter>
+    CValue extremum(std::map<std::string, CCell> &table, TBetter better) const;
+    std::unique_ptr<CRangeNode> m_Range;
+};
+
+class CSumFunctionNode : public CRangeFunctionNode {
+public:
+    CSumFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CCountFunctionNode : public CRangeFunctionNode {
+public:
+    CCountFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CMinFunctionNode : public CRangeFunctionNode {
+public:
+    CMinFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CMaxFunctionNode : public CRangeFunctionNode {
+public:
+    CMaxFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CCountvalFunctionNode : public CRangeFunctionNode {
+public:
+    CCountvalFunctionNode(std::unique_ptr<CNode> value, std::unique_ptr<CRangeNode> range);
+
+    /**
+     * Counts cells of the range whose value equals the evaluated value (empty cells match undefined)
+     * @param table Table data
+     * @return Number of matching cells
+    */
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+private:
+    std::unique_ptr<CNode> m_Value;
+};
+
+class CIfFunctionNode : public CNode {
+public:
+    CIfFunctionNode(std::unique_ptr<CNode> condition, std::unique_ptr<CNode> ifTrue, std::unique_ptr<CNode> ifFalse);
+
+    /**
+     * Evaluates only the selected branch, non-numeric condition gives undefined value
+     * @param table Table data
+     * @return Value of the selected branch
+    */
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+private:
+    std::unique_ptr<CNode> m_Condition;
+    std::unique_ptr<CNode> m_IfTrue;
+    std::unique_ptr<CNode> m_IfFalse;
+};
+
+/**
+ * One finished span recorded by the tracer
+*/
+struct CTraceEvent {
+    // Static span name (e.g. "parse", "evaluate")
+    const char *m_Name;
+
+    // Optional span detail, usually the cell id
+    std::string m_Argument;
+
+    // Start of the span in nanoseconds since the tracer was enabled
+    uint64_t m_Start;
+
+    // Span length in nanoseconds
+    uint64_t m_Duration;
+
+    // Hashed id of the recording thread
+    size_t m_Thread;
+};
+
+/****************************************************************************/
+
+class CTracer {
+public:
+    /**
+     * Returns process wide tracer instance
+     * @return Tracer
+    */
+    static CTracer &instance();
+
+    /**
+     * Starts recording spans into a ring buffer, the oldest spans are overwritten once it is full
+     * @param capacity Maximum number of kept spans
+    */
+    void enable(size_t capacity = 65536);
+    void disable();
+    bool isEnabled() const;
+    void clear();
+    size_t size() const;
+
+    /**
+     * Stores finished span, called by CTraceSpan
+     * @param name Span name
+     * @param argument Span detail
+     * @param start Span start
+     * @param end Span end
+    */
+    void record(const char *name, std::string argument, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+    /**
+     * Writes recorded spans as Chrome trace-event JSON (chrome://tracing, Perfetto, speedscope)
+     * @param os Output stream
+     * @return True if write was successful
+    */
+    bool dump(std::ostream &os) const;
+
+private:
+    CTracer();
+    static void writeEscaped(std::ostream &os, std::string_view str);
+    std::atomic<bool> m_Enabled;
+    mutable std::mutex m_Mutex;
+    std::vector<CTraceEvent> m_Events;
+    // Ring buffer write position and number of valid events
+    size_t m_Next;
+    size_t m_Count;
+    std::chrono::steady_clock::time_point m_Epoch;
+};
+
+/****************************************************************************/
+
+/**
+ * RAII span, measures time between construction and destruction when tracing is enabled
+*/
+class CTraceSpan {
+public:
+    CTraceSpan(const char *name);
+    CTraceSpan(const CTraceSpan &span) = delete;
+    CTraceSpan& operator=(const CTraceSpan &span) = delete;
+    ~CTraceSpan();
+    bool isActive() const;
+
+    /**
+     * Attaches detail shown in trace viewer, ignored for inactive spans
+     * @param argument Span detail
+    */
+    void setArgument(std::string_view argument);
+
+private:
+    const char *m_Name;
+    std::string m_Argument;
+    bool m_Active;
+    std::chrono::steady_clock::time_point m_Start;
+};
+
+class CBuilder : public CExprBuilder {
+public:
+    CBuilder(CPos pos);
+    void opAdd() override;
+    void opSub() override;
+    void opMul() override;
+    void opDiv() override;
+    void opPow() override;
+    void opNeg() override;
+    void opEq() override;
+    void opNe() override;
+    void opLt() override;
+    void opLe() override;
+    void opGt() override;
+    void opGe() override;
+    void valNumber(double num) override;
+    void valString(std::string str) override;
+    void valReference(std::string str) override;
+    void valRange(std::string str) override;
+    void funcCall(std::string fnName, int paramCnt) override;
+    std::unique_ptr<CNode> getTopNode();
+    std::vector<std::string> getDependencies() const;
+    std::unique_ptr<CNode> buildAST();
+
+    /**
+     * Parses formula, references may be qualified by a sheet name (e.g. Sheet2!A1, 'Q1 data'!A1:B5).
+     * Qualifiers are stripped before the text reaches parseExpression and attached to the references afterwards
+     * @param expression Formula including the '=' prefix
+     * @throws std::invalid_argument when the formula is invalid
+    */
+    void parse(const std::string &expression);
+
+    /**
+     * Classifies cell contents without the '=' prefix the same way parseExpression does, but without building AST
+     * @param contents Cell contents
+     * @return Number for numeric literals (undefined on overflow), otherwise the contents as string
+    */
+    static CValue parseLiteral(std::string_view contents);
+
+private:
+    /**
+     * Pushes binary operation, operation of two references or of a reference and a number becomes one fused node
+     * @param left Left operand
+     * @param right Right operand
+    */
+    template <typename TOp, typename TNode>
+    void pushBinary(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
+
+    static std::optional<CRefOperand> refOperand(const CNode &node);
+    static std::optional<CConstOperand> constOperand(const CNode &node);
+
+    /**
+     * Removes sheet qualifiers from the formula
+     * @param expression Formula
+     * @param sheets Output qualifier of every reference and range in order of appearance, empty when unqualified
+     * @return Formula without qualifiers
+    */
+    static std::string stripSheets(std::string_view expression, std::vector<std::string> &sheets);
+    static bool isReference(std::string_view word);
+    std::string nextSheet();
+
+    std::stack<std::unique_ptr<CNode>> m_Nodes;
     std::vector<std::string> m_Dependencies;
     CPos m_Pos;
+    // Qualifiers of references in the parsed formula and index of the next one
+    std::vector<std::string> m_Sheets;
+    size_t m_NextSheet = 0;
+};
+
+template <typename TOp, typename TNode>
+void CBuilder::pushBinary(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) {
+    std::optional<CRefOperand> leftRef = refOperand(*left);
+    std::optional<CRefOperand> rightRef = refOperand(*right);
+    std::optional<CConstOperand> leftConst = leftRef ? std::nullopt : constOperand(*left);
+    std::optional<CConstOperand> rightConst = rightRef ? std::nullopt : constOperand(*right);
+
+    if (leftRef && rightRef)
+        m_Nodes.push(std::make_unique<CBinaryFused<TOp, CRefOperand, CRefOperand>>(m_Pos, *leftRef, *rightRef));
+    else if (leftRef && rightConst)
+        m_Nodes.push(std::make_unique<CBinaryFused<TOp, CRefOperand, CConstOperand>>(m_Pos, *leftRef, *rightConst));
+    else if (leftConst && rightRef)
+        m_Nodes.push(std::make_unique<CBinaryFused<TOp, CConstOperand, CRefOperand>>(m_Pos, *leftConst, *rightRef));
+    else
+        m_Nodes.push(std::make_unique<TNode>(std::move(left), std::move(right)));
+}
+
+/**
+ * Running 64-bit FNV-1a checksum, data can be added in any number of pieces
+*/
+class CChecksum {
+public:
+    void update(std::string_view data);
+    void update(char c);
+    uint64_t get() const;
+
+    /**
+     * Formats checksum as 16 lower case hex digits
+     * @return Checksum text
+    */
+    std::string toString() const;
+
+private:
+    uint64_t m_Hash = 0xcbf29ce484222325ULL;
 };
 
-class CSpreadsheet {
-public:
-    static unsigned capabilities() {
-        return SPREADSHEET_SPEED | SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FILE_IO;
-    }
-    
-    CSpreadsheet() = default;
-    CSpreadsheet(const CSpreadsheet &sheet);
-    CSpreadsheet& operator=(const CSpreadsheet &sheet);
-    bool load(std::istream &is);
-    bool save(std::ostream &os) const;
-    bool setCell(CPos pos, std::string contents);
-    CValue getValue(CPos pos);
-    void copyRect(CPos dst, CPos src, int w = 1, int h = 1);
+/****************************************************************************/
+
+/**
+ * Buffered output keeping running checksum of everything written through it, so large payloads
+ * can be streamed without building them in memory first
+*/
+class CStreamWriter {
+public:
+    CStreamWriter(std::ostream &os, size_t capacity = 65536);
+    CStreamWriter(const CStreamWriter &writer) = delete;
+    CStreamWriter& operator=(const CStreamWriter &writer) = delete;
+    ~CStreamWriter();
+    void write(std::string_view data);
+
+    /**
+     * Passes buffered data to the stream
+     * @return True if the stream is still valid
+    */
+    bool flush();
+    const CChecksum &getChecksum() const;
+
+private:
+    std::ostream &m_Os;
+    std::string m_Buffer;
+    size_t m_Capacity;
+    CChecksum m_Checksum;
+};
+
+/****************************************************************************/
+
+/**
+ * One journaled sheet modification
+*/
+struct CJournalRecord {
+    // 'S' for setCell, 'C' for copyRect, 'M' for moveRect, 'T' for row and column insertion or deletion
+    char m_Type;
+
+    // Modified cell (setCell), copy or move destination or edit name, e.g. "insertRows" (structural edit)
+    std::string m_Target;
+
+    // Cell contents (setCell) or copy or move source
+    std::string m_Argument;
+
+    // Size of copied or moved area
+    int m_Width;
+    int m_Height;
+
+    // First edited row or column and number of edited rows or columns (structural edit)
+    size_t m_Index;
+    size_t m_Count;
+};
+
+/****************************************************************************/
+
+/**
+ * Append-only log of sheet modifications stored next to a full snapshot. Every record is written as
+ * "<type><payload length> <checksum>\n<payload>\n", the first record names the snapshot the journal extends
+*/
+class CJournal {
+public:
+    /**
+     * Starts new journal in an empty stream
+     * @param os Journal stream
+     * @param base Checksum of the snapshot the journal extends
+    */
+    CJournal(std::ostream &os, std::string_view base);
+
+    bool appendSetCell(std::string_view id, std::string_view contents);
+    bool appendCopyRect(std::string_view dst, std::string_view src, int w, int h);
+    bool appendMoveRect(std::string_view dst, std::string_view src, int w, int h);
+    bool appendShift(std::string_view operation, size_t index, size_t count);
+    bool isValid() const;
+
+    /**
+     * Reads records in order and stops at the end of stream or at the first torn or corrupted record,
+     * which is how an interrupted append looks like after a crash
+     * @param is Journal stream
+     * @param base Checksum of the loaded snapshot, journals of other snapshots are ignored
+     * @param apply Callback applying one record
+     * @return Number of applied records
+    */
+    static size_t replay(std::istream &is, std::string_view base, const std::function<void(const CJournalRecord&)> &apply);
+
+private:
+    bool append(char type, std::string_view payload);
+    bool appendRect(char type, std::string_view dst, std::string_view src, int w, int h);
+    static bool readRecord(std::istream &is, char &type, std::string &payload);
+    std::ostream &m_Os;
+};
+
+/**
+ * Byte oriented LZ77 codec in the LZ4 style. Compressed data is a series of sequences, each made of a token
+ * (literal length in the high nibble, match length - 4 in the low nibble), extra length bytes for nibbles equal
+ * to 15, literals and 2-byte little endian match offset. The last sequence carries literals only
+*/
+class CLzCodec {
+public:
+    static const size_t MIN_MATCH = 4;
+    static const size_t MAX_OFFSET = 65535;
+
+    // Every compressed byte stands for at most this many uncompressed bytes
+    static const size_t MAX_RATIO = 255;
+
+    /**
+     * @param input Uncompressed data
+     * @return Compressed data
+    */
+    static std::string compress(std::string_view input);
+
+    /**
+     * Decompresses data into a buffer of known size, malformed input never writes outside of the buffer
+     * @param input Compressed data
+     * @param output Buffer of exactly the uncompressed size
+     * @return False if the input is malformed or does not fill the buffer exactly
+    */
+    static bool decompress(std::string_view input, std::span<char> output);
+
+private:
+    static const unsigned HASH_BITS = 14;
+    static uint32_t read32(const char *data);
+    static uint32_t hash32(uint32_t sequence);
+    static void writeLength(std::string &out, size_t length);
+    static bool readLength(const unsigned char *&in, const unsigned char *end, size_t &length);
+};
+
+/****************************************************************************/
+
+/**
+ * Writes data as independently compressed blocks. The stream starts with "<BLOCKS>\n", every block is written
+ * as "<raw size> <stored size> <checksum>\n<stored bytes>" and a block of raw size 0 ends the stream.
+ * Blocks that do not shrink are stored uncompressed, which is signalled by equal sizes
+*/
+class CBlockWriter {
+public:
+    static constexpr std::string_view MAGIC = "<BLOCKS>\n";
+    static const size_t MAX_BLOCK_SIZE = 1 << 24;
+
+    /**
+     * @param os Output stream
+     * @param blockSize Uncompressed size of blocks, at most MAX_BLOCK_SIZE
+    */
+    CBlockWriter(std::ostream &os, size_t blockSize = 1 << 16);
+    CBlockWriter(const CBlockWriter &writer) = delete;
+    CBlockWriter& operator=(const CBlockWriter &writer) = delete;
+    void write(std::string_view data);
+
+    /**
+     * Writes the last partial block and the end marker, nothing can be written afterwards
+     * @return True if the stream is still valid
+    */
+    bool finish();
+
+    /**
+     * @return Checksum of the uncompressed data, the same as CStreamWriter computes for it
+    */
+    const CChecksum &getChecksum() const;
+
+private:
+    void writeBlock(std::string_view data);
+    std::ostream &m_Os;
+    std::string m_Buffer;
+    size_t m_BlockSize;
+    CChecksum m_Checksum;
+};
+
+/****************************************************************************/
+
+class CBlockReader {
+public:
+    /**
+     * @param input Stream contents
+     * @return True if the contents were written by CBlockWriter
+    */
+    static bool isBlocked(std::string_view input);
+
+    /**
+     * Checks block headers and decompresses blocks in parallel, every block is verified against its checksum.
+     * Sizes in headers are checked before anything is allocated, so the output is at most MAX_RATIO times
+     * larger than the input
+     * @param input Stream contents
+     * @param output Uncompressed data
+     * @param workers Number of decompressing threads, 0 uses hardware concurrency
+     * @return False if any block is truncated, malformed or corrupted
+    */
+    static bool decode(std::string_view input, std::string &output, size_t workers = 0);
+};
+
+/**
+ * RFC 4180 tokenizer reading the stream in large chunks. Fields without quotes are returned as views
+ * into the chunk, quoted fields and fields crossing a chunk boundary are assembled separately
+*/
+class CCsvReader {
+public:
+    CCsvReader(std::istream &is, size_t capacity = 1 << 20);
+    CCsvReader(const CCsvReader &reader) = delete;
+    CCsvReader& operator=(const CCsvReader &reader) = delete;
+
+    /**
+     * Reads next field, both '\n' and "\r\n" end a row
+     * @param field Field contents, valid until the next call
+     * @param lastInRow Set if the field ends a row
+     * @return False at the end of input
+    */
+    bool next(std::string_view &field, bool &lastInRow);
+
+    /**
+     * Checks that the input was read completely and no quoted field was left open
+     * @return True if the input was valid
+    */
+    bool isValid() const;
+
+private:
+    bool fill();
+    std::istream &m_Is;
+    std::string m_Buffer;
+    size_t m_Capacity;
+    size_t m_Pos = 0;
+    size_t m_Size = 0;
+    // Field assembled from several pieces
+    std::string m_Field;
+    // Previous row ended with '\r', a following '\n' belongs to it
+    bool m_SkipNewline = false;
+    bool m_Unterminated = false;
+};
+
+/**
+ * Immutable set of evaluated cell values published for concurrent readers. Values are split into shards
+ * by id hash, a new epoch copies only the shards its changes touch and shares the rest with the previous one
+*/
+class CValueSnapshot {
+public:
+    CValueSnapshot(size_t epoch = 0);
+    CValue getValue(const CPos &pos) const;
+    size_t getEpoch() const;
+
+private:
+    friend class CSpreadsheet;
+    using CShard = std::unordered_map<std::string, CValue>;
+    static constexpr size_t SHARD_CELLS = 1024;
+
+    /**
+     * @param id Cell id
+     * @return Stored value or nullptr for undefined cells
+    */
+    const CValue *find(const std::string &id) const;
+
+    /**
+     * Replaces value of the cell, the shard is copied on its first change within the epoch
+     * @param id Cell id
+     * @param value New value, undefined values are not stored
+     * @param copied Shards already copied within the epoch
+    */
+    void assign(const std::string &id, CValue value, std::vector<bool> &copied);
+
+    /**
+     * Redistributes values into enough shards for the given number of cells
+     * @param cells Expected number of cells
+     * @param copied Shards already copied within the epoch, all shards are new afterwards
+    */
+    void reshard(size_t cells, std::vector<bool> &copied);
+    size_t shardOf(const std::string &id) const;
+
+    size_t m_Epoch;
+    size_t m_Size = 0;
+    // Power of two shards, those not copied within the epoch are shared with earlier snapshots
+    std::vector<std::shared_ptr<CShard>> m_Shards;
+};
+
+/**
+ * Row intervals of one column. Intervals sorted by lower bound form an implicit balanced tree
+ * where every node keeps the highest upper bound of its subtree, recent changes are merged lazily
+*/
+class CIntervalTree {
+public:
+    void insert(size_t low, size_t high, const std::string &owner);
+    void erase(size_t low, size_t high, const std::string &owner);
+    bool empty() const;
+
+    /**
+     * Reports owners of all intervals containing the point
+     * @param point Row number
+     * @param visitor Callback receiving owners
+    */
+    void stab(size_t point, const std::function<void(const std::string&)> &visitor) const;
+
+private:
+    struct CInterval {
+        size_t m_Low;
+        size_t m_High;
+        std::string m_Owner;
+        bool m_Erased;
+    };
+
+    void rebuild() const;
+    size_t buildMaxHigh(size_t from, size_t to) const;
+    void stabTree(size_t from, size_t to, size_t point, const std::function<void(const std::string&)> &visitor) const;
+
+    mutable std::vector<CInterval> m_Sorted;
+    mutable std::vector<size_t> m_MaxHigh;
+    mutable size_t m_Erased = 0;
+    // Inserted intervals not merged into the tree yet, scanned linearly
+    mutable std::vector<CInterval> m_Pending;
+};
+
+/**
+ * Spatial index of range references answering which ranges contain a cell. Every column has its own
+ * interval tree, so a range is stored once per column it spans instead of once per cell
+*/
+class CRangeIndex {
+public:
+    void insert(const CRect &rect, const std::string &owner);
+    void erase(const CRect &rect, const std::string &owner);
+    void clear();
+
+    /**
+     * Point-stabbing query
+     * @param column Cell column
+     * @param row Cell row
+     * @param visitor Callback receiving owners of ranges containing the cell
+    */
+    void stab(size_t column, size_t row, const std::function<void(const std::string&)> &visitor) const;
+
+private:
+    std::map<size_t, CIntervalTree> m_Columns;
+};
+
+/**
+ * Dependencies between cells. Plain references are kept as edges in both directions,
+ * range references as rectangles which are never expanded to single cells. References to other
+ * sheets (e.g. "Sheet2!A1", "Sheet2!A1:B5") are kept as plain references. Compaction freezes
+ * edges into compressed sparse row arrays over interned cell ids, later changes are kept in
+ * a small map based overlay until the next compaction
+*/
+class CDependencyGraph {
+public:
+    /**
+     * Replaces references of the cell
+     * @param pos Cell position
+     * @param references Referenced cells, ranges are given as "A1:B5"
+    */
+    void setDependencies(const CPos &pos, const std::vector<std::string> &references);
+    void erase(const CPos &pos);
+    void clear();
+
+    /**
+     * Visits cells the cell depends on. Ranges yield only cells which have references themselves,
+     * other cells can not lie on a cycle
+     * @param id Cell id
+     * @param visitor Callback receiving cell ids, returning false stops the traversal
+     * @return False if the traversal was stopped
+    */
+    bool forEachPrecedent(const std::string &id, const std::function<bool(const std::string&)> &visitor) const;
+
+    /**
+     * Visits cells which reference the cell directly or through a range
+     * @param pos Cell position
+     * @param visitor Callback receiving cell ids
+    */
+    void forEachDependent(const CPos &pos, const std::function<void(const std::string&)> &visitor) const;
+
+    /**
+     * Visits cells with references lying in the area
+     * @param rect Area
+     * @param visitor Callback receiving cell ids, returning false stops the traversal
+     * @return False if the traversal was stopped
+    */
+    bool forEachFormula(const CRect &rect, const std::function<bool(const std::string&)> &visitor) const;
+
+    /**
+     * Returns names of other sheets referenced by cells of this sheet, may include sheets
+     * no longer referenced until the next compaction
+     * @return Sheet names
+    */
+    std::set<std::string> getReferencedSheets() const;
+
+    /**
+     * Checks whether the cell references cells moved or deleted by a structural edit
+     * @param id Cell id
+     * @param edit Structural edit
+     * @return True if some reference or range reaches the edited rows or columns
+    */
+    bool isShifted(const std::string &id, const CShift &edit) const;
+
+    /**
+     * Moves the overlay and frozen edges which are still valid into new frozen arrays,
+     * meant to run after bulk changes (load, import)
+    */
+    void compact();
+
+private:
+    /**
+     * Frozen cell with references, kept sorted by position for range lookups
+    */
+    struct CFrozenFormula {
+        size_t m_Column;
+        size_t m_Row;
+        uint32_t m_Node;
+    };
+
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+    uint32_t findNode(const std::string &id) const;
+    bool isFrozen(uint32_t node) const;
+    void drop(const std::string &id);
+
+    // Interned cell ids of the frozen graph, node number is the index
+    std::vector<std::string> m_Names;
+    std::unordered_map<std::string, uint32_t> m_Nodes;
+    // Frozen edges of node i are [offsets[i], offsets[i + 1]) of the edge arrays
+    std::vector<uint32_t> m_ReferenceOffsets;
+    std::vector<uint32_t> m_FrozenReferences;
+    std::vector<uint32_t> m_RangeOffsets;
+    std::vector<CRect> m_FrozenRanges;
+    std::vector<uint32_t> m_DependentOffsets;
+    std::vector<uint32_t> m_FrozenDependents;
+    std::vector<CFrozenFormula> m_FrozenFormulas;
+    // Frozen nodes whose references were replaced or erased after the compaction
+    std::vector<bool> m_Dropped;
+
+    // Overlay of changes made after the compaction
+    std::map<std::string, std::vector<std::string>> m_References;
+    std::map<std::string, std::vector<CRect>> m_Ranges;
+    std::map<std::string, std::set<std::string>> m_Dependents;
+    CRangeIndex m_RangeIndex;
+    // Positions of cells with references, column -> rows
+    std::map<size_t, std::set<size_t>> m_Formulas;
+};
+
+/**
+ * AST eviction counters
+*/
+struct CAstStats {
+    // Formula cells whose AST is in memory
+    size_t m_Resident;
+    size_t m_Evictions;
+    size_t m_Reparses;
+
+    // Formulas instantiated from the parse cache and formulas that had to be parsed
+    size_t m_ParseHits;
+    size_t m_ParseMisses;
+};
+
+/**
+ * Keeps number of resident formula ASTs within budget. Cold ASTs are evicted by a CLOCK sweep
+ * over the table and rebuilt from the expression text once the cell is evaluated again
+*/
+class CAstCache : public CAstLoader {
+public:
+    std::shared_ptr<CNode> load(const CPos &pos, const std::string &expression) override;
+
+    /**
+     * @param budget Maximum number of resident ASTs, 0 disables eviction
+    */
+    void setBudget(size_t budget);
+    void noteResident() override;
+
+    /**
+     * Must be called before a cell leaves the table or is overwritten
+     * @param cell Released cell
+    */
+    void noteReleased(const CCell &cell);
+
+    /**
+     * Called when the whole table is cleared
+    */
+    void noteCleared();
+
+    /**
+     * Evicts cold ASTs when the budget is exceeded, must not run while the table is being evaluated
+     * @param table Table data
+    */
+    void enforce(std::map<std::string, CCell> &table);
+    CAstStats getStats(const std::map<std::string, CCell> &table) const;
+
+private:
+    size_t m_Budget = 0;
+    // Resident ASTs kept up to date by every change of the table, the table is scanned only when over budget
+    size_t m_Resident = 0;
+    size_t m_Evictions = 0;
+    size_t m_Reparses = 0;
+    // Cell the CLOCK hand points to
+    std::string m_Hand;
+};
+
+/**
+ * Formula ready to be stored in a cell
+*/
+struct CParsedFormula {
+    std::unique_ptr<CNode> m_Root;
+    std::vector<std::string> m_Dependencies;
+};
+
+/**
+ * LRU cache of parsed formulas keyed by their relative form, in which every reference is replaced by its offset
+ * from the cell (absolute parts are kept). Formulas filled down or across a column share the form, so all but
+ * the first one are cloned from the cached AST like copyRect does instead of being parsed
+*/
+class CParseCache {
+public:
+    CParseCache(size_t capacity = 4096);
+    CParseCache(const CParseCache &cache) = delete;
+    CParseCache& operator=(const CParseCache &cache) = delete;
+
+    /**
+     * Builds AST of the formula, safe to call from several threads
+     * @param pos Cell position
+     * @param expression Formula including the '=' prefix
+     * @return Formula AST and its references
+     * @throws std::invalid_argument when the formula is invalid
+    */
+    CParsedFormula parse(const CPos &pos, const std::string &expression);
+
+    /**
+     * @param capacity Maximum number of cached formulas, 0 disables the cache
+    */
+    void setCapacity(size_t capacity);
+    size_t getHits() const;
+    size_t getMisses() const;
+
+    /**
+     * Replaces every reference outside of string literals by "{c<column offset>r<row offset>}", absolute
+     * parts by "{C<column>R<row>}"
+     * @param pos Cell position
+     * @param expression Formula
+     * @return Relative form, empty for formulas that are not cached (qualified references, oversized ids)
+    */
+    static std::string relativeForm(const CPos &pos, std::string_view expression);
+
+private:
+    struct CEntry {
+        std::string m_Key;
+        // AST of the first formula with the key, cloned for the others
+        std::shared_ptr<CNode> m_Template;
+    };
+
+    mutable std::mutex m_Mutex;
+    size_t m_Capacity;
+    // Most recently used first
+    std::list<CEntry> m_Entries;
+    std::unordered_map<std::string, std::list<CEntry>::iterator> m_Index;
+    size_t m_Hits = 0;
+    size_t m_Misses = 0;
+};
+
+/**
+ * Text format of exported values
+*/
+enum class EExportFormat {
+    // Comma separated, fields with separators, quotes or line breaks are quoted
+    CSV,
+    // Tab separated, tabs, line breaks and backslashes are escaped with a backslash
+    TSV
+};
+
+/**
+ * Layout of saved sheets, load recognizes both
+*/
+enum class ESaveFormat {
+    // Tagged cells followed by checksum trailer
+    TEXT,
+    // Tagged cells split into LZ compressed blocks with their own checksums
+    BLOCKS
+};
+
+/****************************************************************************/
+
+class CSpreadsheet {
+public:
+    static unsigned capabilities() {
+        return SPREADSHEET_SPEED | SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FILE_IO | SPREADSHEET_FUNCTIONS;
+    }
+    
+    CSpreadsheet() = default;
+    CSpreadsheet(const CSpreadsheet &sheet);
+    CSpreadsheet& operator=(const CSpreadsheet &sheet);
+    ~CSpreadsheet();
+    bool load(std::istream &is);
+
+    /**
+     * Saves all cells, block format is smaller and loads faster as blocks are decompressed in parallel
+     * @param os Output stream
+     * @param format Layout of the saved data
+     * @return True if write was successful
+    */
+    bool save(std::ostream &os, ESaveFormat format = ESaveFormat::TEXT) const;
+
+    /**
+     * Loads snapshot and replays journal records written after it, torn tail of the journal is ignored
+     * @param snapshot Snapshot input
+     * @param journal Journal input, ignored when it belongs to another snapshot
+     * @return False if the snapshot is invalid
+    */
+    bool load(std::istream &snapshot, std::istream &journal);
+
+    /**
+     * Writes full snapshot and starts a new journal, every following setCell and copyRect is appended
+     * to the journal, so a checkpoint costs only the changes made since the last compaction.
+     * Loading or assigning another sheet stops the journal
+     * @param snapshot Snapshot output
+     * @param journal Empty journal output, must stay alive while journaling
+     * @param format Layout of the snapshot
+     * @return True if both streams were written
+    */
+    bool compact(std::ostream &snapshot, std::ostream &journal, ESaveFormat format = ESaveFormat::TEXT);
+    void stopJournal();
+    bool setCell(CPos pos, std::string contents);
+    CValue getValue(CPos pos);
+
+    /**
+     * Evaluates rectangular area at once with shared cycle analysis, every cell is evaluated only once
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param values Output buffer of at least w * h items, filled row by row
+     * @return False if the area or buffer size is invalid
+    */
+    bool getValues(CPos topLeft, int w, int h, std::span<CValue> values);
+
+    /**
+     * Numeric variant of getValues, non-numeric cells are stored as 0 with cleared validity bit
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param values Output buffer of at least w * h numbers, filled row by row
+     * @param valid Validity bitmap of at least (w * h + 7) / 8 bytes, bit i % 8 of byte i / 8 belongs to values[i]
+     * @return False if the area or buffer size is invalid
+    */
+    bool getNumericValues(CPos topLeft, int w, int h, std::span<double> values, std::span<uint8_t> valid);
+
+    /**
+     * Evaluates outputs under several sets of input values without changing the sheet. Scenarios are evaluated
+     * in parallel, each one keeps its values in its own overlay. Inputs only replace cell values, so outputs
+     * depending on a cycle of the sheet stay undefined even if an input replaces a cell of the cycle
+     * @param inputs Replaced cell values of every scenario, cells need not exist
+     * @param outputs Evaluated cells
+     * @param workers Number of evaluating threads, 0 uses hardware concurrency
+     * @return Output values of every scenario in the order of outputs
+    */
+    std::vector<std::vector<CValue>> evaluateScenarios(const std::vector<std::map<CPos, CValue>> &inputs, const std::vector<CPos> &outputs, size_t workers = 0);
+
+    /**
+     * Copies rectangular area, relative references of copied formulas are shifted. Areas of at least 4096 cells
+     * are cloned on several threads
+     * @param dst Top left cell of the destination
+     * @param src Top left cell of the source
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param workers Number of cloning threads, 0 uses hardware concurrency
+    */
+    void copyRect(CPos dst, CPos src, int w = 1, int h = 1, size_t workers = 0);
+
+    /**
+     * Moves rectangular area like cut and paste. Moved formulas keep referencing the same cells and references
+     * to moved cells (or ranges lying entirely in the area) follow them, cells overwritten at the destination are dropped
+     * @param dst Top left cell of the destination
+     * @param src Top left cell of the moved area
+     * @param w Number of columns
+     * @param h Number of rows
+    */
+    void moveRect(CPos dst, CPos src, int w = 1, int h = 1);
+
+    /**
+     * Streams computed values of rectangular area as one text line per row, undefined cells are empty fields.
+     * The area is evaluated chunk by chunk and every chunk is formatted by several threads
+     * @param os Output stream
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param format Output format
+     * @return True if the area is valid and write was successful
+    */
+    bool exportValues(std::ostream &os, CPos topLeft, int w, int h, EExportFormat format = EExportFormat::CSV);
+
+    /**
+     * Reads CSV rows into cells starting at origin, every field behaves like setCell of its text and empty
+     * fields keep the cell unchanged. Literals are stored directly, formulas are parsed afterwards by several threads
+     * @param is CSV input
+     * @param origin Cell receiving the first field of the first row
+     * @return False if the input could not be read completely or ends inside a quoted field
+    */
+    bool importCsv(std::istream &is, CPos origin);
+
+    /**
+     * Inserts empty rows before the row, cells below move down and references to them follow,
+     * ranges spanning the row grow
+     * @param row First inserted row
+     * @param count Number of inserted rows
+     * @return True if the rows were inserted
+    */
+    bool insertRows(size_t row, size_t count = 1);
+
+    /**
+     * Deletes rows, cells below move up. Ranges spanning deleted rows shrink and references to deleted
+     * cells become invalid with undefined value
+     * @param row First deleted row
+     * @param count Number of deleted rows
+     * @return True if the rows were deleted
+    */
+    bool deleteRows(size_t row, size_t count = 1);
+    bool insertColumns(size_t column, size_t count = 1);
+    bool deleteColumns(size_t column, size_t count = 1);
+
+    /**
+     * Switches getValue to read published snapshots, so it can be called from many threads
+     * while a single writer thread modifies the sheet. Readers caught by switching it off fall back
+     * to the table, which is safe only while nobody writes
+     * @param enabled Enable/disable concurrent reads
+    */
+    void setConcurrentReads(bool enabled);
+
+    /**
+     * Recalculates cells changed since the last publish together with their dependents
+     * and atomically replaces the snapshot seen by readers (writer thread only)
+    */
+    void publish();
+
+    /**
+     * Returns the last published snapshot, useful for consistent reads of several cells
+     * @return Snapshot or nullptr when concurrent reads are disabled
+    */
+    std::shared_ptr<const CValueSnapshot> getSnapshot() const;
+
+    /**
+     * Moves recalculation to a background worker, writes then only update the table
+     * and getValue waits just for cells that are still dirty
+     * @param enabled Enable/disable background recalculation
+    */
+    void setAsyncRecalc(bool enabled);
+
+    /**
+     * Returns cell value once the background worker has recalculated the cell
+     * @param pos Cell position
+     * @return Future resolved with the cell value
+    */
+    std::future<CValue> getValueAsync(CPos pos);
+
+    /**
+     * Bounds memory taken by formula ASTs, ASTs of cells not evaluated recently are dropped
+     * and re-parsed from the expression text on demand
+     * @param maxAsts Maximum number of resident ASTs, 0 keeps all of them
+    */
+    void setAstBudget(size_t maxAsts);
+    CAstStats getAstStats() const;
+
+    /**
+     * Bounds number of formulas kept by the parse cache, repeated formulas in relative form (e.g. =A1*2 in B1
+     * and =A2*2 in B2) are cloned from the cache instead of being parsed again
+     * @param entries Maximum number of cached formulas, 0 disables the cache
+    */
+    void setParseCacheCapacity(size_t entries);
+
+    using CChangeCallback = std::function<void(const std::vector<std::pair<CPos, CValue>>&)>;
+
+    /**
+     * Registers callback which receives cells of the area whose value changed. It is called once after
+     * every write, after publish with concurrent reads, or after every batch of the background worker
+     * (from the worker thread)
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param callback Receives changed cells and their new values
+     * @return Subscription id, 0 for an empty area
+    */
+    size_t subscribe(CPos topLeft, int w, int h, CChangeCallback callback);
+    void unsubscribe(size_t id);
+
+private:
+    friend class CWorkbook;
+    std::map<std::string, CCell> m_Table;
+    CDependencyGraph m_Dependencies;
+    // Workbook owning the sheet and the name of the sheet in it, copies are detached
+    CSheetResolver *m_Sheets = nullptr;
+    std::string m_SheetName;
+    std::atomic<bool> m_ConcurrentReads = false;
+    // Worker publishes snapshots already before readers are switched to them
+    bool m_PublishSnapshots = false;
+    std::atomic<std::shared_ptr<const CValueSnapshot>> m_Snapshot;
+    // Cells modified since the last publish
+    std::set<std::string> m_Changed;
+    bool m_PublishAll = false;
+    std::atomic<bool> m_AsyncRecalc = false;
+    bool m_StopWorker = false;
+    std::thread m_Worker;
+    // Guards the table while background recalculation is enabled
+    mutable std::mutex m_Mutex;
+    std::condition_variable m_WorkAvailable;
+    std::condition_variable m_CellClean;
+    // Cells waiting for background recalculation and their order
+    std::unordered_set<std::string> m_Dirty;
+    std::deque<std::string> m_Queue;
+    std::multimap<std::string, std::promise<CValue>> m_Waiters;
+    // Journal of changes made since the last compaction
+    std::unique_ptr<CJournal> m_Journal;
+    CAstCache m_AstCache;
+    CParseCache m_ParseCache;
+
+    struct CSubscription {
+        CRect m_Rect;
+        CChangeCallback m_Callback;
+        // Last delivered value of every defined cell of the area
+        std::unordered_map<std::string, CValue> m_Values;
+    };
+    using CNotifications = std::vector<std::pair<CChangeCallback, std::vector<std::pair<CPos, CValue>>>>;
+    std::map<size_t, CSubscription> m_Subscriptions;
+    size_t m_NextSubscription = 1;
+    bool m_DeferNotifications = false;
+
+    /**
+     * Compares recalculated cells with values last delivered to subscribers
+     * @param ids Recalculated cells
+     * @return Notifications to deliver, outside of the table lock
+    */
+    CNotifications collectChanges(const std::vector<std::string> &ids);
+    void deliverChanges(const CNotifications &notifications);
+    void notifySubscribers();
+    void replayJournal(std::istream &journal, const std::string &checksum);
+    void compactDependencies();
+
+    /**
+     * Evaluates every cell with one shared cycle analysis
+     * @return Values of all defined cells
+    */
+    std::shared_ptr<const CValueSnapshot> evaluateAll();
+
+    /**
+     * Moves cells by a structural edit. Moved cells and cells with references crossing the edit get their
+     * references rewritten in place, other formulas are not touched
+     * @param edit Structural edit
+     * @param operation Edit name stored in the journal
+     * @return False for column 0
+    */
+    bool shiftCells(const CShift &edit, std::string_view operation);
+
+    /**
+     * Restores AST if needed, applies the edit to the cell and registers its new references
+     * @param cell Rewritten cell
+     * @param edit Structural edit
+     * @param pos Cell position after the edit
+    */
+    void rewriteCell(CCell &cell, const CShift &edit, CPos pos);
+
+    /**
+     * Inserts the cell or overwrites the existing one, keeping the resident AST count up to date
+     * @param id Cell id
+     * @param cell New cell
+    */
+    void storeCell(std::string id, CCell &&cell);
+
+    /**
+     * Removes the cell, keeping the resident AST count up to date
+     * @param id Cell id
+     * @return True if the cell existed
+    */
+    bool eraseCell(const std::string &id);
+
+    /**
+     * Copies large area by cloning cells on several threads, storage and dependency graph are updated
+     * afterwards in one pass, the result is the same as with the serial copy
+     * @param dst Top left cell of the destination
+     * @param src Top left cell of the source
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param workers Number of cloning threads
+    */
+    void copyRectParallel(const CPos &dst, const CPos &src, int w, int h, size_t workers);
+    size_t hashTableContent(const std::string& str) const;
+    bool loadSnapshot(std::istream &is, std::string &checksum);
+    bool saveSnapshot(std::ostream &os, std::string &checksum, ESaveFormat format) const;
+
+    /**
+     * Writes tagged cells and checksum trailer, the checksum does not depend on the save format
+     * @param writer Stream or block writer
+     * @param checksum Checksum of the body
+    */
+    template <typename TWriter>
+    void writeSnapshot(TWriter &writer, std::string &checksum) const;
+    void markChanged(const std::string &id);
+    std::unique_lock<std::mutex> lockTable() const;
+
+    /**
+     * Takes cells changed since the last recalculation and adds all their transitive dependents
+     * @return Ids of cells that need to be recalculated
+    */
+    std::vector<std::string> collectAffected();
+    void storeSnapshot(const std::vector<std::string> &ids, bool full);
+
+    /**
+     * Marks cell and everything that transitively depends on it for background recalculation
+     * @param id Changed cell
+    */
+    void markDirty(const std::string &id);
+    bool isClean(const std::string &id) const;
+    CValue cachedValue(const std::string &id) const;
+    void resolveWaiters();
+    void recalcWorker();
+
+    /**
+     * Appends rows [fromRow, toRow) of evaluated chunk to output text
+     * @param values Chunk values, row by row
+     * @param w Number of columns
+     * @param fromRow First formatted row
+     * @param toRow Row after the last formatted one
+     * @param format Output format
+     * @param out Output text
+    */
+    static void formatRows(const std::vector<CValue> &values, size_t w, size_t fromRow, size_t toRow, EExportFormat format, std::string &out);
+
+    /**
+     * Appends one value, numbers in the shortest form that reads back exactly, undefined values as empty fields.
+     * CSV quotes texts containing separators, quotes or line breaks, TSV escapes tabs, line breaks and backslashes
+     * @param value Cell value
+     * @param format Output format
+     * @param out Output text
+    */
+    static void formatField(const CValue &value, EExportFormat format, std::string &out);
+
+    /**
+     * Evaluates area row by row and passes every value to the callback
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param store Callback receiving index of the cell within the area and its value
+    */
+    void evaluateRegion(const CPos &topLeft, int w, int h, const std::function<void(size_t, const CValue&)> &store);
+};
+
+class CDependencyChecker {
+public:
+    /**
+     * @param dependencies Graph of the checked sheet
+     * @param sheets Graphs of other sheets of the workbook, cycles may pass through them
+     * @param sheet Name of the checked sheet in the workbook
+    */
+    CDependencyChecker(const CDependencyGraph& dependencies, const CSheetResolver *sheets = nullptr, const std::string &sheet = "");
+
+    /**
+     * Checks whether the cell lies on a cycle or depends on one. Results are cached,
+     * so one checker can answer queries for many cells of an unchanged sheet
+     * @param vertex Cell id
+     * @return True if the cell value can not be evaluated
+    */
+    bool containsCycle(const std::string& vertex);
+
+private:
+    const CDependencyGraph& m_Dependencies;
+    const CSheetResolver *m_Sheets;
+    std::string m_Sheet;
+    std::unordered_map<std::string, bool> results;
+    std::unordered_set<std::string> recursionStack;
+    bool isCyclicUtil(const std::string& vertex);
+
+    /**
+     * Visits precedents of a vertex, vertices of other sheets are qualified by the sheet name
+     * @param vertex Cell id, qualified for cells of other sheets
+     * @param visitor Callback receiving precedents, returning false stops the traversal
+     * @return False if the traversal was stopped
+    */
+    bool forEachPrecedent(const std::string &vertex, const std::function<bool(const std::string&)> &visitor) const;
+};
+
+/**
+ * Named sheets whose formulas may reference each other (e.g. =Sheet2!A1*2, =sum('Q1 data'!A1:B5)).
+ * Cycles are detected across sheets and sheets not linked by references are recalculated concurrently
+*/
+class CWorkbook : public CSheetResolver {
+public:
+    CWorkbook() = default;
+    CWorkbook(const CWorkbook &workbook) = delete;
+    CWorkbook& operator=(const CWorkbook &workbook) = delete;
+
+    /**
+     * Adds empty sheet
+     * @param name Sheet name, it must not be empty or contain '!'
+     * @return False if the name is invalid or already used
+    */
+    bool addSheet(const std::string &name);
+
+    /**
+     * Removes sheet, references to its cells from other sheets become undefined
+     * @param name Sheet name
+     * @return False if there is no such sheet
+    */
+    bool removeSheet(const std::string &name);
+
+    /**
+     * @param name Sheet name
+     * @return Sheet or nullptr when there is no such sheet
+    */
+    CSpreadsheet *getSheet(const std::string &name);
+    std::vector<std::string> getSheetNames() const;
+    bool setCell(const std::string &sheet, CPos pos, std::string contents);
+    CValue getValue(const std::string &sheet, CPos pos);
+
+    /**
+     * Evaluates every cell of every sheet. Sheets linked by references are evaluated together,
+     * independent groups of sheets by separate threads
+     * @return Values of every sheet
+    */
+    std::map<std::string, std::shared_ptr<const CValueSnapshot>> recalculate();
+
+    /**
+     * Writes every sheet as "<name length> <name> <sheet length>\n<sheet>\n", sheets use the CSpreadsheet format
+     * @param os Output stream
+     * @param format Layout of every sheet
+     * @return True if write was successful
+    */
+    bool save(std::ostream &os, ESaveFormat format = ESaveFormat::TEXT) const;
+
+    /**
+     * Replaces all sheets by those stored by save, the workbook is kept when the input is invalid
+     * @param is Input stream
+     * @return True if load was successful
+    */
+    bool load(std::istream &is);
+
+    std::map<std::string, CCell> *table(const std::string &sheet) override;
+    const CDependencyGraph *graph(const std::string &sheet) const override;
+
+private:
+    /**
+     * Splits sheets into groups not linked by references in either direction
+     * @return Sheet groups
+    */
+    std::vector<std::vector<std::pair<const std::string, std::unique_ptr<CSpreadsheet>>*>> groupSheets();
+    void attach(const std::string &name, CSpreadsheet &sheet);
+
+    /**
+     * Reads field of a length given by the input in bounded pieces, so a damaged length does not allocate
+     * more than the stream really holds
+     * @param is Input stream
+     * @param length Field length
+     * @param out Field contents
+     * @return False if the stream ends before the field does
+    */
+    static bool readField(std::istream &is, size_t length, std::string &out);
+
+    // Sheets are kept at stable addresses, their formulas reach other sheets through the workbook
+    std::map<std::string, std::unique_ptr<CSpreadsheet>> m_Sheets;
+};
+/******************************************************
+ * Filename: cell.cpp
+ * Author: David Kopelent
+ * Date: 24.04.2024
+ * Description: This code implements methods for cell representation and is responsible for building AST nodes
+ * 
+ ******************************************************/
+
+
+/***********************************************
+*        Cell Position Section
+***********************************************/
+
+CPos::CPos(std::string_view str) {
+    size_t column = 0;
+    size_t row = 0;
+    if (!parse(str, column, row))
+        throw std::invalid_argument("Invalid ID!");
+    *this = CPos(column, row);
+}
+
+size_t CPos::columnToNumber(const std::string& column) {
+    size_t result = 0;
+    for (char c : column) {
+        result = result * 26 + (std::toupper(c) - 'A' + 1);
+    }
+    return result;
+}
+
+std::string CPos::numberToColumn(size_t number) {
+    char buffer[MAX_ID_LENGTH];
+    return std::string(buffer, formatColumn(number, buffer));
+}
+
+std::string CPos::getId() const {
+    return std::string(m_Id.data(), m_Length);
+}
+
+std::string CPos::getColumn() const {
+    return std::string(m_Id.data(), m_ColumnLength);
+}
+
+/***********************************************
+*        Cell Rectangle Section
+***********************************************/
+
+bool CRect::contains(size_t column, size_t row) const {
+    return column >= m_Left && column <= m_Right && row >= m_Top && row <= m_Bottom;
+}
+
+CRect CRect::parse(std::string_view range) {
+    size_t separator = range.find(':');
+    if (separator == std::string_view::npos)
+        throw std::invalid_argument("Invalid range!");
+
+    CPos from(range.substr(0, separator));
+    CPos to(range.substr(separator + 1));
+    return CRect{std::min(from.getColumnNumber(), to.getColumnNumber()), std::min(from.getRow(), to.getRow()),
+                 std::max(from.getColumnNumber(), to.getColumnNumber()), std::max(from.getRow(), to.getRow())};
+}
+
+std::string CRect::toString() const {
+    return CPos(m_Left, m_Top).getId() + ":" + CPos(m_Right, m_Bottom).getId();
+}
+
+/***********************************************
+*        Structural Edit Section
+***********************************************/
+
+bool CShift::affects(const CPos &pos) const {
+    if (m_Move)
+        return m_Source.contains(pos.getColumnNumber(), pos.getRow());
+    return (m_Columns ? pos.getColumnNumber() : pos.getRow()) >= m_Index;
+}
+
+bool CShift::affects(const CRect &rect) const {
+    if (m_Move)
+        return m_Source.contains(rect.m_Left, rect.m_Top) && m_Source.contains(rect.m_Right, rect.m_Bottom);
+    return (m_Columns ? rect.m_Right : rect.m_Bottom) >= m_Index;
+}
+
+bool CShift::apply(CPos &pos) const {
+    if (m_Move) {
+        if (affects(pos)) {
+            pos = CPos(pos.getColumnNumber() - m_Source.m_Left + m_Destination.getColumnNumber(),
+                       pos.getRow() - m_Source.m_Top + m_Destination.getRow());
+        }
+        return true;
+    }
+
+    size_t column = pos.getColumnNumber();
+    size_t row = pos.getRow();
+    size_t &coordinate = m_Columns ? column : row;
+    size_t high = coordinate;
+    if (!apply(coordinate, high))
+        return false;
+    pos = CPos(column, row);
+    return true;
+}
+
+bool CShift::apply(CPos &first, CPos &second) const {
+    if (m_Move) {
+        CRect rect{std::min(first.getColumnNumber(), second.getColumnNumber()), std::min(first.getRow(), second.getRow()),
+                   std::max(first.getColumnNumber(), second.getColumnNumber()), std::max(first.getRow(), second.getRow())};
+        if (affects(rect)) {
+            apply(first);
+            apply(second);
+        }
+        return true;
+    }
+
+    size_t coordinates[2];
+    for (size_t i = 0; i < 2; i++)
+        coordinates[i] = m_Columns ? (i ? second : first).getColumnNumber() : (i ? second : first).getRow();
+
+    // The edit maps the span between the corners
+    size_t lower = coordinates[0] <= coordinates[1] ? 0 : 1;
+    size_t low = coordinates[lower];
+    size_t high = coordinates[1 - lower];
+    if (!apply(low, high))
+        return false;
+    coordinates[lower] = low;
+    coordinates[1 - lower] = high;
+
+    first = m_Columns ? CPos(coordinates[0], first.getRow()) : CPos(first.getColumnNumber(), coordinates[0]);
+    second = m_Columns ? CPos(coordinates[1], second.getRow()) : CPos(second.getColumnNumber(), coordinates[1]);
+    return true;
+}
+
+bool CShift::apply(size_t &low, size_t &high) const {
+    if (!m_Delete) {
+        if (low >= m_Index)
+            low += m_Count;
+        if (high >= m_Index)
+            high += m_Count;
+        return true;
+    }
+
+    size_t end = m_Index + m_Count;
+    if (low >= m_Index && high < end)
+        return false;
+
+    // Bounds inside the deleted part move to the nearest kept row or column
+    if (high >= end)
+        high -= m_Count;
+    else if (high >= m_Index)
+        high = m_Index - 1;
+    if (low >= end)
+        low -= m_Count;
+    else if (low >= m_Index)
+        low = m_Index;
+    return true;
+}
+
+/***********************************************
+*        Cell Section
+***********************************************/
+
+CCell::CCell() 
+    : m_IsEmpty(true) {}   
+
+CCell::CCell(CPos id, const std::string &expr, std::unique_ptr<CNode> AST)
+    : m_Pos(id)
+    , m_Expression(expr)
+    , m_Root(std::move(AST))
+    , m_IsEmpty(false) {}
+
+CCell::CCell(CPos id, const std::string &expr, CValue value)
+    : m_Pos(id)
+    , m_Expression(expr)
+    , m_Value(std::move(value))
+    , m_IsEmpty(false) {}
+
+CPos CCell::getPos() const {
+    return m_Pos;
+}
+
+void CCell::setValue(CValue val) {
+    m_Value = val;
+}
+
+CValue CCell::getValue() const {
+    return m_Value;
+}
+
+const std::string &CCell::getExpression() const {
+    if (m_ExpressionStale) {
+        m_Expression = "=";
+        m_Root->unparse(m_Expression);
+        m_ExpressionStale = false;
+    }
+    return m_Expression;
+}
+
+CValue CCell::evaluate(std::map<std::string, CCell> &table) {
+    if (CValueOverlay *overlay = CEvaluationPass::overlay())
+        return evaluate(*overlay, table);
+
+    // Already evaluated within the running pass
+    size_t pass = CEvaluationPass::current();
+    if (pass != 0 && m_Pass == pass)
+        return m_Value;
+
+    CTraceSpan span("evaluate");
+    if (span.isActive())
+        span.setArgument(m_Pos.getId());
+
+    // Literal and empty cells keep their value
+    if (m_Root == nullptr) {
+        if (!m_Evicted || CEvaluationPass::loader() == nullptr)
+            return m_Value;
+        restoreAst(*CEvaluationPass::loader());
+        if (m_Root == nullptr)
+            return m_Value = CValue();
+    }
+    m_Referenced = true;
+
+    m_Value = m_Root->evaluate(table);
+    m_Pass = pass;
+    return m_Value;
+}
+
+CValue CCell::evaluate(CValueOverlay &overlay, std::map<std::string, CCell> &table) const {
+    if (const CValue *input = overlay.input(table, m_Pos))
+        return *input;
+    if (m_Root == nullptr && !m_Evicted)
+        return m_Value;
+    if (const CValue *result = overlay.result(this))
+        return *result;
+
+    // Evicted AST is parsed privately, restoring it would write to the shared cell
+    std::shared_ptr<CNode> root = m_Root;
+    if (root == nullptr) {
+        if (CEvaluationPass::loader() == nullptr)
+            return m_Value;
+        root = overlay.load(*CEvaluationPass::loader(), m_Pos, m_Expression);
+    }
+
+    CValue value = root != nullptr ? root->evaluate(table) : CValue();
+    overlay.setResult(this, value);
+    return value;
+}
+
+bool CCell::isEmpty() const {
+    return m_IsEmpty;
+}
+
+bool CCell::evictAst() {
+    if (m_Root == nullptr)
+        return false;
+
+    // Text must exist before the AST it could be regenerated from is gone
+    getExpression();
+    m_Root.reset();
+    m_Evicted = true;
+    m_Referenced = false;
+    return true;
+}
+
+void CCell::restoreAst(CAstLoader &loader) {
+    if (!m_Evicted)
+        return;
+    m_Root = loader.load(m_Pos, m_Expression);
+    m_Evicted = false;
+    if (m_Root != nullptr)
+        loader.noteResident();
+}
+
+bool CCell::hasAst() const {
+    return m_Root != nullptr;
+}
+
+bool CCell::isFormula() const {
+    return m_Root != nullptr || m_Evicted;
+}
+
+bool CCell::takeReferenced() {
+    bool referenced = m_Referenced;
+    m_Referenced = false;
+    return referenced;
+}
+
+void CCell::shift(const CShift &edit, CPos pos, std::vector<std::string> &dependencies) {
+    if (m_Root != nullptr) {
+        // AST shared with a copy of the sheet is rewritten privately
+        if (m_Root.use_count() > 1) {
+            std::vector<std::string> references;
+            m_Root = m_Root->clone(m_Pos, references);
+        }
+
+        if (!m_Root->shift(edit, pos, dependencies)) {
+            dependencies.clear();
+            m_Root = std::make_unique<CInvalidReferenceNode>();
+        }
+        m_ExpressionStale = true;
+    }
+    m_Pos = pos;
+}
+
+CCell CCell::copyCell(CPos dst, std::vector<std::string> &dependencies) {
+    if (m_Root == nullptr)
+        return CCell(dst, m_Expression, m_Value);
+
+    // Text of the copy is generated from its AST only when somebody asks for it
+    CCell cell(dst, "", m_Root->clone(dst, dependencies));
+    cell.m_ExpressionStale = true;
+    return cell;
+}   
+
+/***********************************************
+*        Evaluation Pass Section
+***********************************************/
+
+std::atomic<size_t> CEvaluationPass::s_Counter = 0;
+thread_local size_t CEvaluationPass::s_Current = 0;
+thread_local CAstLoader *CEvaluationPass::s_Loader = nullptr;
+thread_local CSheetResolver *CEvaluationPass::s_Sheets = nullptr;
+thread_local CValueOverlay *CEvaluationPass::s_Overlay = nullptr;
+
+CEvaluationPass::CEvaluationPass(CAstLoader *loader, CSheetResolver *sheets, CValueOverlay *overlay)
+    : CEvaluationPass(++s_Counter, loader, sheets, overlay) {}
+
+CEvaluationPass::CEvaluationPass(size_t id, CAstLoader *loader, CSheetResolver *sheets, CValueOverlay *overlay)
+    : m_Id(id)
+    , m_Previous(s_Current)
+    , m_PreviousLoader(s_Loader)
+    , m_PreviousSheets(s_Sheets)
+    , m_PreviousOverlay(s_Overlay) {
+    s_Current = m_Id;
+    s_Loader = loader;
+    s_Sheets = sheets;
+    s_Overlay = overlay;
+}
+
+CEvaluationPass::~CEvaluationPass() {
+    s_Current = m_Previous;
+    s_Loader = m_PreviousLoader;
+    s_Sheets = m_PreviousSheets;
+    s_Overlay = m_PreviousOverlay;
+}
+
+size_t CEvaluationPass::getId() const {
+    return m_Id;
+}
+
+size_t CEvaluationPass::current() {
+    return s_Current;
+}
+
+CAstLoader *CEvaluationPass::loader() {
+    return s_Loader;
+}
+
+std::map<std::string, CCell> *CEvaluationPass::sheet(const std::string &sheet) {
+    return s_Sheets != nullptr ? s_Sheets->table(sheet) : nullptr;
+}
+
+CValueOverlay *CEvaluationPass::overlay() {
+    return s_Overlay;
+}
+
+CValue CEvaluationPass::emptyCell(const std::map<std::string, CCell> &table, const CPos &pos) {
+    const CValue *input = s_Overlay != nullptr ? s_Overlay->input(table, pos) : nullptr;
+    return input != nullptr ? *input : CValue();
+}
+
+/***********************************************
+*        Value Overlay Section
+***********************************************/
+
+std::mutex CValueOverlay::s_LoadMutex;
+
+CValueOverlay::CValueOverlay(const std::map<std::string, CCell> &table, const std::map<CPos, CValue> &inputs)
+    : m_Table(&table)
+    , m_Inputs(&inputs) {}
+
+const CValue *CValueOverlay::input(const std::map<std::string, CCell> &table, const CPos &pos) const {
+    if (&table != m_Table)
+        return nullptr;
+    auto input = m_Inputs->find(pos);
+    return input != m_Inputs->end() ? &input->second : nullptr;
+}
+
+const CValue *CValueOverlay::result(const CCell *cell) const {
+    auto result = m_Results.find(cell);
+    return result != m_Results.end() ? &result->second : nullptr;
+}
+
+void CValueOverlay::setResult(const CCell *cell, const CValue &value) {
+    m_Results.insert_or_assign(cell, value);
+}
+
+std::shared_ptr<CNode> CValueOverlay::load(CAstLoader &loader, const CPos &pos, const std::string &expression) {
+    std::lock_guard<std::mutex> lock(s_LoadMutex);
+    return loader.load(pos, expression);
+}
+
+/***********************************************
+*        AST Node Types Section
+***********************************************/
+
+int CNode::precedence() const {
+    return PRECEDENCE_PRIMARY;
+}
+
+bool CNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    return true;
+}
+
+void CNode::shiftOperand(std::unique_ptr<CNode> &node, const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    size_t count = dependencies.size();
+    if (node->shift(edit, cell, dependencies))
+        return;
+    dependencies.resize(count);
+    node = std::make_unique<CInvalidReferenceNode>();
+}
+
+void CNode::unparseOperand(const CNode &node, int minPrecedence, std::string &out) {
+    if (node.precedence() >= minPrecedence) {
+        node.unparse(out);
+        return;
+    }
+    out += '(';
+    node.unparse(out);
+    out += ')';
+}
+
+void CNode::unparseBinary(const CNode &left, const CNode &right, std::string_view op, int precedence, std::string &out) {
+    unparseOperand(left, precedence, out);
+    out += op;
+    unparseOperand(right, precedence + 1, out);
+}
+
+void CNode::unparseSheet(const std::string &sheet, std::string &out) {
+    if (sheet.empty())
+        return;
+
+    bool plain = !std::isdigit(static_cast<unsigned char>(sheet[0])) && std::all_of(sheet.begin(), sheet.end(), [](unsigned char c) {
+        return std::isalnum(c) || c == '_';
+    });
+    if (plain) {
+        out += sheet;
+    } else {
+        // Quotes inside quoted name are doubled
+        out += '\'';
+        for (char c : sheet) {
+            if (c == '\'')
+                out += '\'';
+            out += c;
+        }
+        out += '\'';
+    }
+    out += '!';
+}
+
+std::string CNode::qualify(const std::string &sheet, const std::string &reference) {
+    if (sheet.empty())
+        return reference;
+    return sheet + '!' + reference;
+}
+
+CNumberNode::CNumberNode(double num) 
+    : m_Value(num) {}
+
+CValue CNumberNode::evaluate(std::map<std::string, CCell> &table) {
+    if (std::isinf(m_Value)) return CValue();
+    return CValue(m_Value);
+}
+
+std::unique_ptr<CNode> CNumberNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CNumberNode>(m_Value);
+}
+
+void CNumberNode::unparse(std::string &out) const {
+    unparseNumber(m_Value, out);
+}
+
+void CNumberNode::unparseNumber(double value, std::string &out) {
+    if (std::isinf(value)) {
+        out += value < 0 ? "-1e999" : "1e999";
+        return;
+    }
+
+    char buffer[32];
+    auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, end);
+}
+
+double CNumberNode::getNumber() const {
+    return m_Value;
+}
+
+int CNumberNode::precedence() const {
+    return std::signbit(m_Value) ? PRECEDENCE_NEGATION : PRECEDENCE_PRIMARY;
+}
+
+CStringNode::CStringNode(const std::string &str) 
+    : m_Value(str) {}
+
+CValue CStringNode::evaluate(std::map<std::string, CCell> &table) {
+    return CValue(m_Value);
+}
+
+std::unique_ptr<CNode> CStringNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CStringNode>(m_Value);
+}
+
+void CStringNode::unparse(std::string &out) const {
+    out += '"';
+    for (char c : m_Value) {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+/***********************************************
+*        Arithmetics Operators Section
+***********************************************/
+
+CBinaryOperatorNode::CBinaryOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : m_Left(std::move(left))
+    , m_Right(std::move(right)) {}
+
+bool CBinaryOperatorNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Left, edit, cell, dependencies);
+    shiftOperand(m_Right, edit, cell, dependencies);
+    return true;
+}
+
+CAddOperatorNode::CAddOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CAddOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
+
+CValue CAddOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
+    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        return CValue(std::get<std::string>(leftValue) + std::to_string(std::get<double>(rightValue)));
+
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue(std::to_string(std::get<double>(leftValue)) + std::get<std::string>(rightValue));
+
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        double result = std::get<double>(leftValue) + std::get<double>(rightValue);
+        return CValue(result);
+
+    } else if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue(std::get<std::string>(leftValue) + std::get<std::string>(rightValue));
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CAddOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CAddOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CAddOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "+", PRECEDENCE_ADDITIVE, out);
+}
+
+int CAddOperatorNode::precedence() const {
+    return PRECEDENCE_ADDITIVE;
+}
+
+CSubOperatorNode::CSubOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CSubOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
+
+CValue CSubOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
+    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        double result = std::get<double>(leftValue) - std::get<double>(rightValue);
+        return CValue(result);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CSubOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CSubOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CSubOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "-", PRECEDENCE_ADDITIVE, out);
+}
+
+int CSubOperatorNode::precedence() const {
+    return PRECEDENCE_ADDITIVE;
+}
+
+CDivOperatorNode::CDivOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CDivOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
+
+CValue CDivOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
+    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        if (std::get<double>(rightValue) == 0) return CValue();
+        double result = std::get<double>(leftValue) / std::get<double>(rightValue);
+        return CValue(result);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CDivOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CDivOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CDivOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "/", PRECEDENCE_MULTIPLICATIVE, out);
+}
+
+int CDivOperatorNode::precedence() const {
+    return PRECEDENCE_MULTIPLICATIVE;
+}
+
+CMulOperatorNode::CMulOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CMulOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
+
+CValue CMulOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
+    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        double result = std::get<double>(leftValue) * std::get<double>(rightValue);
+        return CValue(result);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CMulOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CMulOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CMulOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "*", PRECEDENCE_MULTIPLICATIVE, out);
+}
+
+int CMulOperatorNode::precedence() const {
+    return PRECEDENCE_MULTIPLICATIVE;
+}
+
+CNegOperatorNode::CNegOperatorNode(std::unique_ptr<CNode> operand)
+    : m_Operand(std::move(operand)) {}
+
+CValue CNegOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto value = m_Operand->evaluate(table);
+    if (std::holds_alternative<double>(value))
+        return CValue(-std::get<double>(value));
+    return CValue();
+}
+
+std::unique_ptr<CNode> CNegOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CNegOperatorNode>(m_Operand->clone(dst, dependencies));
+}
+
+void CNegOperatorNode::unparse(std::string &out) const {
+    out += '-';
+    unparseOperand(*m_Operand, PRECEDENCE_NEGATION, out);
+}
+
+int CNegOperatorNode::precedence() const {
+    return PRECEDENCE_NEGATION;
+}
+
+bool CNegOperatorNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Operand, edit, cell, dependencies);
+    return true;
+}
+
+CPowOperatorNode::CPowOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CPowOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    auto rightValue = m_Right->evaluate(table);
+
+    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        double result = std::pow(std::get<double>(leftValue), std::get<double>(rightValue));
+        return CValue(result);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CPowOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CPowOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CPowOperatorNode::unparse(std::string &out) const {
+    // Power is left associative and does not take negation as its right operand
+    unparseOperand(*m_Left, PRECEDENCE_POWER, out);
+    out += '^';
+    unparseOperand(*m_Right, PRECEDENCE_PRIMARY, out);
+}
+
+int CPowOperatorNode::precedence() const {
+    return PRECEDENCE_POWER;
+}
+
+/***********************************************
+*        Relational Operators Section
+***********************************************/
+
+CRelationalOperatorNode::CRelationalOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : m_Left(std::move(left))
+    , m_Right(std::move(right)) {}
+
+bool CRelationalOperatorNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Left, edit, cell, dependencies);
+    shiftOperand(m_Right, edit, cell, dependencies);
+    return true;
+}
+
+CEqOperatorNode::CEqOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CEqOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    auto rightValue = m_Right->evaluate(table);
+
+    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue((std::get<std::string>(leftValue) == std::get<std::string>(rightValue)) ? 1.0 : 0.0);
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        return CValue((std::get<double>(leftValue) == std::get<double>(rightValue)) ? 1.0 : 0.0);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CEqOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CEqOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CEqOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "=", PRECEDENCE_EQUALITY, out);
+}
+
+int CEqOperatorNode::precedence() const {
+    return PRECEDENCE_EQUALITY;
+}
+
+CNeOperatorNode::CNeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CNeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    auto rightValue = m_Right->evaluate(table);
+
+    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue((std::get<std::string>(leftValue) != std::get<std::string>(rightValue)) ? 1.0 : 0.0);
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        return CValue((std::get<double>(leftValue) != std::get<double>(rightValue)) ? 1.0 : 0.0);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CNeOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CNeOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CNeOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "<>", PRECEDENCE_EQUALITY, out);
+}
+
+int CNeOperatorNode::precedence() const {
+    return PRECEDENCE_EQUALITY;
+}
+
+CLtOperatorNode::CLtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CLtOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    auto rightValue = m_Right->evaluate(table);
+
+    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue((std::get<std::string>(leftValue) < std::get<std::string>(rightValue)) ? 1.0 : 0.0);
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        return CValue((std::get<double>(leftValue) < std::get<double>(rightValue)) ? 1.0 : 0.0);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CLtOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CLtOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CLtOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "<", PRECEDENCE_RELATIONAL, out);
+}
+
+int CLtOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
+}
+
+CLeOperatorNode::CLeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CLeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    auto rightValue = m_Right->evaluate(table);
+
+    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue((std::get<std::string>(leftValue) <= std::get<std::string>(rightValue)) ? 1.0 : 0.0);
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        return CValue((std::get<double>(leftValue) <= std::get<double>(rightValue)) ? 1.0 : 0.0);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CLeOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CLeOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CLeOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "<=", PRECEDENCE_RELATIONAL, out);
+}
+
+int CLeOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
+}
+
+CGtOperatorNode::CGtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CGtOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    auto rightValue = m_Right->evaluate(table);
+
+    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue((std::get<std::string>(leftValue) > std::get<std::string>(rightValue)) ? 1.0 : 0.0);
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        return CValue((std::get<double>(leftValue) > std::get<double>(rightValue)) ? 1.0 : 0.0);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CGtOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CGtOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CGtOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, ">", PRECEDENCE_RELATIONAL, out);
+}
+
+int CGtOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
+}
+
+CGeOperatorNode::CGeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
+    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+
+CValue CGeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto leftValue = m_Left->evaluate(table);
+    auto rightValue = m_Right->evaluate(table);
+
+    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
+        return CValue((std::get<std::string>(leftValue) >= std::get<std::string>(rightValue)) ? 1.0 : 0.0);
+    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
+        return CValue((std::get<double>(leftValue) >= std::get<double>(rightValue)) ? 1.0 : 0.0);
+    }
+
+    return CValue();
+}
+
+std::unique_ptr<CNode> CGeOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CGeOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CGeOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, ">=", PRECEDENCE_RELATIONAL, out);
+}
+
+int CGeOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
+}
+
+/***********************************************
+*        References Section
+***********************************************/
+
+CReferenceNode::CReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
+    : m_CellId(cellId)
+    , m_RefId(refId)
+    , m_Reference(ref) {}
+
+CValue CReferenceNode::getValue(std::map<std::string, CCell> &table) {
+    // Cells of other sheets are evaluated within their own table
+    std::map<std::string, CCell> *source = m_Sheet.empty() ? &table : CEvaluationPass::sheet(m_Sheet);
+    if (source == nullptr)
+        return CValue();
+
+    auto cell = source->find(m_Reference);
+    if (cell != source->end()) {
+        return cell->second.evaluate(*source);
+    }
+    return CEvaluationPass::emptyCell(*source, m_RefId);
+}
+
+const CPos &CReferenceNode::getRefId() const {
+    return m_RefId;
+}
+
+void CReferenceNode::setSheet(const std::string &sheet) {
+    m_Sheet = sheet;
+}
+
+const std::string &CReferenceNode::getSheet() const {
+    return m_Sheet;
+}
+
+std::string CReferenceNode::getDependency() const {
+    return qualify(m_Sheet, m_Reference);
+}
+
+bool CReferenceNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    m_CellId = cell;
+    if (m_Sheet.empty()) {
+        if (!edit.apply(m_RefId))
+            return false;
+        m_Reference = m_RefId.getId();
+    }
+    dependencies.push_back(getDependency());
+    return true;
+}
+
+std::unique_ptr<CNode> CReferenceNode::qualified(std::unique_ptr<CReferenceNode> node, std::vector<std::string> &dependencies) const {
+    node->m_Sheet = m_Sheet;
+    dependencies.push_back(node->getDependency());
+    return node;
+}
+
+CRelativeReferenceNode::CRelativeReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
+    : CReferenceNode(cellId, refId, ref) {}
+
+CValue CRelativeReferenceNode::evaluate(std::map<std::string, CCell> &table) {
+    return this->getValue(table);
+}
+
+std::unique_ptr<CNode> CRelativeReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    size_t rowOffset = dst.getRow() - m_CellId.getRow();
+    size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
+
+    size_t refRow = m_RefId.getRow();
+    size_t refCol = m_RefId.getColumnNumber();
+
+    // Adjust row and column based on offsets
+    refRow += rowOffset;
+    refCol += colOffset;
+    CPos newPos(refCol, refRow);
+    std::string newReference = newPos.getId();
+
+
+    return qualified(std::make_unique<CRelativeReferenceNode>(dst, newPos, newReference), dependencies);
+}
+
+void CRelativeReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += m_RefId.getColumn();
+    out += std::to_string(m_RefId.getRow());
+}
+
+CAbsoluteReferenceNode::CAbsoluteReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
+    : CReferenceNode(cellId, refId, ref) {}
+
+CValue CAbsoluteReferenceNode::evaluate(std::map<std::string, CCell> &table) {
+    return this->getValue(table);
+}
+
+std::unique_ptr<CNode> CAbsoluteReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return qualified(std::make_unique<CAbsoluteReferenceNode>(dst, m_RefId, m_Reference), dependencies);
+}
+
+void CAbsoluteReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += "$";
+    out += m_RefId.getColumn();
+    out += "$";
+    out += std::to_string(m_RefId.getRow());
+}
+
+CAbsRelReferenceNode::CAbsRelReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
+    : CReferenceNode(cellId, refId, ref) {}
+
+CValue CAbsRelReferenceNode::evaluate(std::map<std::string, CCell> &table) {
+    return this->getValue(table);
+}
+
+std::unique_ptr<CNode> CAbsRelReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    size_t rowOffset = dst.getRow() - m_CellId.getRow();
+    size_t refRow = m_RefId.getRow();
+
+    // Construct the adjusted reference
+    CPos newPos(m_RefId.getColumnNumber(), refRow + rowOffset);
+    std::string newReference = newPos.getId();
+
+
+    return qualified(std::make_unique<CAbsRelReferenceNode>(dst, newPos, newReference), dependencies);
+}
+
+void CAbsRelReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += "$";
+    out += m_RefId.getColumn();
+    out += std::to_string(m_RefId.getRow());
+}
+
+CRelAbsReferenceNode::CRelAbsReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
+    : CReferenceNode(cellId, refId, ref) {}
+
+CValue CRelAbsReferenceNode::evaluate(std::map<std::string, CCell> &table) {
+    return this->getValue(table);
+}
+
+std::unique_ptr<CNode> CRelAbsReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
+    size_t refRow = m_RefId.getRow();
+    size_t refCol = m_RefId.getColumnNumber();
+    refCol += colOffset;
+
+    // Construct the adjusted reference
+    CPos newPos(refCol, refRow);
+    std::string newReference = newPos.getId();
+
+
+    return qualified(std::make_unique<CRelAbsReferenceNode>(dst, newPos, newReference), dependencies);
+}
+
+void CRelAbsReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += m_RefId.getColumn();
+    out += "$";
+    out += std::to_string(m_RefId.getRow());
+}
+
+CValue CInvalidReferenceNode::evaluate(std::map<std::string, CCell> &table) {
+    return CValue();
+}
+
+std::unique_ptr<CNode> CInvalidReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CInvalidReferenceNode>();
+}
+
+void CInvalidReferenceNode::unparse(std::string &out) const {
+    out += "1/0";
+}
+
+int CInvalidReferenceNode::precedence() const {
+    return PRECEDENCE_MULTIPLICATIVE;
+}
+
+/***********************************************
+*        Fused Operands Section
+***********************************************/
+
+CRefOperand::CRefOperand(CPos refId, bool absoluteColumn, bool absoluteRow)
+    : m_RefId(refId)
+    , m_Reference(refId.getId())
+    , m_AbsoluteColumn(absoluteColumn)
+    , m_AbsoluteRow(absoluteRow) {}
+
+CValue CRefOperand::value(std::map<std::string, CCell> &table) const {
+    auto cell = table.find(m_Reference);
+    if (cell != table.end())
+        return cell->second.evaluate(table);
+    return CEvaluationPass::emptyCell(table, m_RefId);
+}
+
+CRefOperand CRefOperand::clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const {
+    size_t column = m_RefId.getColumnNumber() + (m_AbsoluteColumn ? 0 : dst.getColumnNumber() - cell.getColumnNumber());
+    size_t row = m_RefId.getRow() + (m_AbsoluteRow ? 0 : dst.getRow() - cell.getRow());
+    CRefOperand operand(CPos(column, row), m_AbsoluteColumn, m_AbsoluteRow);
+    dependencies.push_back(operand.m_Reference);
+    return operand;
+}
+
+void CRefOperand::unparse(std::string &out) const {
+    if (m_AbsoluteColumn)
+        out += '$';
+    out += m_RefId.getColumn();
+    if (m_AbsoluteRow)
+        out += '$';
+    out += std::to_string(m_RefId.getRow());
+}
+
+bool CRefOperand::shift(const CShift &edit, std::vector<std::string> &dependencies) {
+    if (!edit.apply(m_RefId))
+        return false;
+    m_Reference = m_RefId.getId();
+    dependencies.push_back(m_Reference);
+    return true;
+}
+
+CConstOperand::CConstOperand(double number)
+    : m_Number(number)
+    , m_Value(std::isinf(number) ? CValue() : CValue(number)) {}
+
+CConstOperand CConstOperand::clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const {
+    return *this;
+}
+
+void CConstOperand::unparse(std::string &out) const {
+    CNumberNode::unparseNumber(m_Number, out);
+}
+
+bool CConstOperand::shift(const CShift &edit, std::vector<std::string> &dependencies) {
+    return true;
+}
+
+/***********************************************
+*        Worker Pool Section
+***********************************************/
+
+CWorkerPool &CWorkerPool::instance() {
+    static CWorkerPool pool;
+    return pool;
+}
+
+CWorkerPool::~CWorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_Wake.notify_all();
+    for (auto &thread : m_Threads)
+        thread.join();
+}
+
+void CWorkerPool::run(size_t chunks, size_t workers, const std::function<void(size_t)> &task) {
+    std::unique_lock<std::mutex> job(m_JobMutex, std::try_to_lock);
+    size_t helpers = job ? std::min(workers, chunks) : 0;
+    if (helpers <= 1) {
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+            task(chunk);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (m_Threads.size() < helpers - 1)
+        m_Threads.emplace_back(&CWorkerPool::work, this);
+    m_Task = &task;
+    m_Chunks = chunks;
+    m_Next = 0;
+    m_Openings = helpers - 1;
+    lock.unlock();
+    m_Wake.notify_all();
+
+    drain();
+
+    // Threads which have not woken up yet are not waited for
+    lock.lock();
+    m_Openings = 0;
+    m_Done.wait(lock, [this] { return m_Running == 0; });
+    m_Task = nullptr;
+}
+
+void CWorkerPool::work() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (true) {
+        m_Wake.wait(lock, [this] { return m_Stop || m_Openings > 0; });
+        if (m_Stop)
+            return;
+
+        m_Openings--;
+        m_Running++;
+        lock.unlock();
+        drain();
+        lock.lock();
+        if (--m_Running == 0)
+            m_Done.notify_one();
+    }
+}
+
+void CWorkerPool::drain() {
+    for (size_t chunk = m_Next++; chunk < m_Chunks; chunk = m_Next++)
+        (*m_Task)(chunk);
+}
+
+/***********************************************
+*        Ranges Section
+***********************************************/
+
+CRangeNode::CRangeNode(CPos cellId, const std::string &range)
+    : m_CellId(cellId) {
+    size_t separator = range.find(':');
+    if (separator == std::string::npos)
+        throw std::invalid_argument("Invalid range!");
+
+    std::string corners[2] = {range.substr(0, separator), range.substr(separator + 1)};
+    for (size_t i = 0; i < 2; i++) {
+        std::string &corner = corners[i];
+        m_AbsoluteColumn[i] = !corner.empty() && corner[0] == '$';
+        m_AbsoluteRow[i] = corner.find('$', 1) != std::string::npos;
+        corner.erase(std::remove(corner.begin(), corner.end(), '$'), corner.end());
+        m_Corners[i] = CPos(corner);
+    }
+}
+
+CValue CRangeNode::evaluate(std::map<std::string, CCell> &table) {
+    return CValue();
+}
+
+std::unique_ptr<CNode> CRangeNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return cloneRange(dst, dependencies);
+}
+
+void CRangeNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    for (size_t i = 0; i < 2; i++) {
+        if (i)
+            out += ':';
+        if (m_AbsoluteColumn[i])
+            out += '$';
+        out += m_Corners[i].getColumn();
+        if (m_AbsoluteRow[i])
+            out += '$';
+        out += std::to_string(m_Corners[i].getRow());
+    }
+}
+
+std::unique_ptr<CRangeNode> CRangeNode::cloneRange(CPos dst, std::vector<std::string> &dependencies) {
+    size_t rowOffset = dst.getRow() - m_CellId.getRow();
+    size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
+
+    // Shift relative parts of both corners
+    auto range = std::make_unique<CRangeNode>(*this);
+    range->m_CellId = dst;
+    for (size_t i = 0; i < 2; i++) {
+        size_t column = m_Corners[i].getColumnNumber() + (m_AbsoluteColumn[i] ? 0 : colOffset);
+        size_t row = m_Corners[i].getRow() + (m_AbsoluteRow[i] ? 0 : rowOffset);
+        range->m_Corners[i] = CPos(column, row);
+    }
+
+    dependencies.push_back(range->getDependency());
+    return range;
+}
+
+void CRangeNode::forEachValue(std::map<std::string, CCell> &table, const std::function<void(const CValue&)> &visitor) const {
+    CRect rect = getRect();
+    std::map<std::string, CCell> *source = m_Sheet.empty() ? &table : CEvaluationPass::sheet(m_Sheet);
+    for (size_t column = rect.m_Left; column <= rect.m_Right; column++) {
+        for (size_t row = rect.m_Top; row <= rect.m_Bottom; row++) {
+            if (source == nullptr) {
+                visitor(CValue());
+                continue;
+            }
+            CPos pos(column, row);
+            auto cell = source->find(pos.getId());
+            visitor(cell != source->end() ? cell->second.evaluate(*source) : CEvaluationPass::emptyCell(*source, pos));
+        }
+    }
+}
+
+bool CRangeNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    m_CellId = cell;
+    if (m_Sheet.empty() && !edit.apply(m_Corners[0], m_Corners[1]))
+        return false;
+    dependencies.push_back(getDependency());
+    return true;
+}
+
+void CRangeNode::setSheet(const std::string &sheet) {
+    m_Sheet = sheet;
+}
+
+std::string CRangeNode::getDependency() const {
+    return qualify(m_Sheet, getRect().toString());
+}
+
+CRect CRangeNode::getRect() const {
+    return CRect{std::min(m_Corners[0].getColumnNumber(), m_Corners[1].getColumnNumber()),
+                 std::min(m_Corners[0].getRow(), m_Corners[1].getRow()),
+                 std::max(m_Corners[0].getColumnNumber(), m_Corners[1].getColumnNumber()),
+                 std::max(m_Corners[0].getRow(), m_Corners[1].getRow())};
+}
+
+template<typename TPartial, typename TFold, typename TCombine>
+TPartial CRangeNode::reduce(std::map<std::string, CCell> &table, TFold fold, TCombine combine) const {
+    CRect rect = getRect();
+    size_t count = (rect.m_Right - rect.m_Left + 1) * (rect.m_Bottom - rect.m_Top + 1);
+    if (count < PARALLEL_CELLS) {
+        TPartial partial{};
+        forEachValue(table, [&partial, &fold](const CValue &value) {
+            fold(partial, value);
+        });
+        return partial;
+    }
+
+    CTraceSpan span("reduceRange");
+    size_t chunks = (count + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    std::vector<TPartial> partials(chunks);
+    if (CEvaluationPass::overlay() != nullptr) {
+        // Same chunks on the calling thread, so the result matches the parallel fold bit for bit
+        size_t index = 0;
+        forEachValue(table, [&partials, &fold, &index](const CValue &value) {
+            fold(partials[index++ / CHUNK_CELLS], value);
+        });
+    } else {
+        std::vector<const CCell*> cells = resolveCells(table);
+        forEachChunk(chunks, [&cells, &partials, &fold](size_t chunk) {
+            const CValue empty;
+            size_t end = std::min(cells.size(), (chunk + 1) * CHUNK_CELLS);
+            for (size_t i = chunk * CHUNK_CELLS; i < end; i++)
+                fold(partials[chunk], cells[i] != nullptr ? cells[i]->getValue() : empty);
+        });
+    }
+
+    // Neighbours are combined level by level, the tree depends only on the number of chunks
+    for (size_t step = 1; step < chunks; step *= 2) {
+        for (size_t i = 0; i + step < chunks; i += 2 * step)
+            combine(partials[i], partials[i + step]);
+    }
+    return partials[0];
+}
+
+std::vector<const CCell*> CRangeNode::resolveCells(std::map<std::string, CCell> &table) const {
+    CRect rect = getRect();
+    size_t rows = rect.m_Bottom - rect.m_Top + 1;
+    std::vector<const CCell*> cells((rect.m_Right - rect.m_Left + 1) * rows, nullptr);
+    std::map<std::string, CCell> *source = m_Sheet.empty() ? &table : CEvaluationPass::sheet(m_Sheet);
+    if (source == nullptr)
+        return cells;
+
+    size_t chunks = (cells.size() + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    std::vector<std::vector<CCell*>> formulas(chunks);
+    forEachChunk(chunks, [&](size_t chunk) {
+        size_t end = std::min(cells.size(), (chunk + 1) * CHUNK_CELLS);
+        for (size_t i = chunk * CHUNK_CELLS; i < end; i++) {
+            auto cell = source->find(CPos(rect.m_Left + i / rows, rect.m_Top + i % rows).getId());
+            if (cell == source->end())
+                continue;
+            cells[i] = &cell->second;
+            if (cell->second.isFormula())
+                formulas[chunk].push_back(&cell->second);
+        }
+    });
+
+    // Evaluated formulas keep their value in the cell, so the fold reads it without evaluating again
+    for (const auto &chunk : formulas) {
+        for (CCell *cell : chunk)
+            cell->evaluate(*source);
+    }
+    return cells;
+}
+
+std::atomic<size_t> CRangeNode::s_Workers = 0;
+
+void CRangeNode::setWorkers(size_t workers) {
+    s_Workers = workers;
+}
+
+void CRangeNode::forEachChunk(size_t chunks, const std::function<void(size_t)> &task) {
+    size_t workers = s_Workers ? s_Workers.load() : std::thread::hardware_concurrency();
+    CWorkerPool::instance().run(chunks, std::max<size_t>(workers, 1), task);
+}
+
+/***********************************************
+*        Functions Section
+***********************************************/
+
+CRangeFunctionNode::CRangeFunctionNode(std::unique_ptr<CRangeNode> range)
+    : m_Range(std::move(range)) {}
+
+bool CRangeFunctionNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    return m_Range->shift(edit, cell, dependencies);
+}
+
+template<typename TBetter>
+CValue CRangeFunctionNode::extremum(std::map<std::string, CCell> &table, TBetter better) const {
+    struct CExtremum {
+        std::optional<double> m_First;
+        std::optional<double> m_Best;
+    };
+
+    // First number is kept apart from the best one so that chunks combine exactly like a serial scan
+    CExtremum result = m_Range->reduce<CExtremum>(table, [&better](CExtremum &partial, const CValue &value) {
+        if (!std::holds_alternative<double>(value))
+            return;
+        double number = std::get<double>(value);
+        if (!partial.m_First)
+            partial.m_First = number;
+        if (!std::isnan(number) && (!partial.m_Best || better(number, *partial.m_Best)))
+            partial.m_Best = number;
+    }, [&better](CExtremum &left, const CExtremum &right) {
+        if (!left.m_First)
+            left.m_First = right.m_First;
+        if (right.m_Best && (!left.m_Best || better(*right.m_Best, *left.m_Best)))
+            left.m_Best = right.m_Best;
+    });
+
+    if (!result.m_First)
+        return CValue();
+    if (std::isnan(*result.m_First))
+        return CValue(*result.m_First);
+    return CValue(*result.m_Best);
+}
+
+CSumFunctionNode::CSumFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CSumFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    // Sum stays empty until the first number is found
+    auto sum = m_Range->reduce<std::optional<double>>(table, [](std::optional<double> &partial, const CValue &value) {
+        if (std::holds_alternative<double>(value))
+            partial = partial.value_or(0) + std::get<double>(value);
+    }, [](std::optional<double> &left, const std::optional<double> &right) {
+        if (right)
+            left = left.value_or(0) + *right;
+    });
+
+    if (!sum)
+        return CValue();
+    return CValue(*sum);
+}
+
+std::unique_ptr<CNode> CSumFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CSumFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CSumFunctionNode::unparse(std::string &out) const {
+    out += "sum(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CCountFunctionNode::CCountFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CCountFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    return CValue(m_Range->reduce<double>(table, [](double &count, const CValue &value) {
+        if (!std::holds_alternative<std::monostate>(value))
+            count++;
+    }, [](double &left, double right) {
+        left += right;
+    }));
+}
+
+std::unique_ptr<CNode> CCountFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CCountFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CCountFunctionNode::unparse(std::string &out) const {
+    out += "count(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CMinFunctionNode::CMinFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CMinFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    return extremum(table, std::less<double>());
+}
+
+std::unique_ptr<CNode> CMinFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CMinFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CMinFunctionNode::unparse(std::string &out) const {
+    out += "min(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CMaxFunctionNode::CMaxFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CMaxFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    return extremum(table, std::greater<double>());
+}
+
+std::unique_ptr<CNode> CMaxFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CMaxFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CMaxFunctionNode::unparse(std::string &out) const {
+    out += "max(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CCountvalFunctionNode::CCountvalFunctionNode(std::unique_ptr<CNode> value, std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range))
+    , m_Value(std::move(value)) {}
+
+CValue CCountvalFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    CValue target = m_Value->evaluate(table);
+    return CValue(m_Range->reduce<double>(table, [&target](double &count, const CValue &value) {
+        if (value == target)
+            count++;
+    }, [](double &left, double right) {
+        left += right;
+    }));
+}
+
+std::unique_ptr<CNode> CCountvalFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    auto value = m_Value->clone(dst, dependencies);
+    return std::make_unique<CCountvalFunctionNode>(std::move(value), m_Range->cloneRange(dst, dependencies));
+}
+
+bool CCountvalFunctionNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Value, edit, cell, dependencies);
+    return m_Range->shift(edit, cell, dependencies);
+}
+
+void CCountvalFunctionNode::unparse(std::string &out) const {
+    out += "countval(";
+    m_Value->unparse(out);
+    out += ", ";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CIfFunctionNode::CIfFunctionNode(std::unique_ptr<CNode> condition, std::unique_ptr<CNode> ifTrue, std::unique_ptr<CNode> ifFalse)
+    : m_Condition(std::move(condition))
+    , m_IfTrue(std::move(ifTrue))
+    , m_IfFalse(std::move(ifFalse)) {}
+
+CValue CIfFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    CValue condition = m_Condition->evaluate(table);
+    if (!std::holds_alternative<double>(condition))
+        return CValue();
+    return std::get<double>(condition) != 0 ? m_IfTrue->evaluate(table) : m_IfFalse->evaluate(table);
+}
+
+std::unique_ptr<CNode> CIfFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    auto condition = m_Condition->clone(dst, dependencies);
+    auto ifTrue = m_IfTrue->clone(dst, dependencies);
+    return std::make_unique<CIfFunctionNode>(std::move(condition), std::move(ifTrue), m_IfFalse->clone(dst, dependencies));
+}
+
+bool CIfFunctionNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Condition, edit, cell, dependencies);
+    shiftOperand(m_IfTrue, edit, cell, dependencies);
+    shiftOperand(m_IfFalse, edit, cell, dependencies);
+    return true;
+}
+
+void CIfFunctionNode::unparse(std::string &out) const {
+    out += "if(";
+    m_Condition->unparse(out);
+    out += ", ";
+    m_IfTrue->unparse(out);
+    out += ", ";
+    m_IfFalse->unparse(out);
+    out += ')';
+}
+/******************************************************
+ * Filename: tracer.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements opt-in span tracer used for profiling of cell parsing, evaluation and file IO.
+ *              Recorded spans can be exported as Chrome trace-event JSON.
+ ******************************************************/
+
+
+/***********************************************
+*        Tracer Section
+***********************************************/
+
+CTracer::CTracer()
+    : m_Enabled(false)
+    , m_Next(0)
+    , m_Count(0)
+    , m_Epoch(std::chrono::steady_clock::now()) {}
+
+CTracer &CTracer::instance() {
+    static CTracer tracer;
+    return tracer;
+}
+
+void CTracer::enable(size_t capacity) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Events.assign(capacity == 0 ? 1 : capacity, CTraceEvent());
+    m_Next = 0;
+    m_Count = 0;
+    m_Epoch = std::chrono::steady_clock::now();
+    m_Enabled = true;
+}
+
+void CTracer::disable() {
+    m_Enabled = false;
+}
+
+bool CTracer::isEnabled() const {
+    return m_Enabled.load(std::memory_order_relaxed);
+}
+
+void CTracer::clear() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Next = 0;
+    m_Count = 0;
+}
+
+size_t CTracer::size() const {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Count;
+}
+
+void CTracer::record(const char *name, std::string argument, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_Events.empty() || start < m_Epoch)
+        return;
+
+    CTraceEvent &event = m_Events[m_Next];
+    event.m_Name = name;
+    event.m_Argument = std::move(argument);
+    event.m_Start = std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_Epoch).count();
+    event.m_Duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    event.m_Thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+    // Overwrite the oldest span once the buffer is full
+    m_Next = (m_Next + 1) % m_Events.size();
+    if (m_Count < m_Events.size())
+        m_Count++;
+}
+
+void CTracer::writeEscaped(std::ostream &os, std::string_view str) {
+    static const char *hex = "0123456789abcdef";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            os << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        } else {
+            os << c;
+        }
+    }
+}
+
+bool CTracer::dump(std::ostream &os) const {
+    if (os.fail())
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    size_t first = (m_Next + m_Events.size() - m_Count) % std::max<size_t>(m_Events.size(), 1);
+
+    // Fractions are zero padded, the caller gets its own fill character back
+    char fill = os.fill('0');
+
+    os << "{\"traceEvents\":[";
+    for (size_t i = 0; i < m_Count; i++) {
+        const CTraceEvent &event = m_Events[(first + i) % m_Events.size()];
+
+        // Chrome expects timestamps in microseconds, keep nanosecond precision as fraction
+        os << (i ? ",\n" : "\n") << "{\"name\":\"";
+        writeEscaped(os, event.m_Name);
+        os << "\",\"cat\":\"fitexcel\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (event.m_Thread % 1000000)
+           << ",\"ts\":" << event.m_Start / 1000 << '.' << std::setw(3) << event.m_Start % 1000
+           << ",\"dur\":" << event.m_Duration / 1000 << '.' << std::setw(3) << event.m_Duration % 1000;
+
+        if (!event.m_Argument.empty()) {
+            os << ",\"args\":{\"cell\":\"";
+            writeEscaped(os, event.m_Argument);
+            os << "\"}";
+        }
+        os << '}';
+    }
+    os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    os.fill(fill);
+    return !os.fail();
+}
+
+/***********************************************
+*        Trace Span Section
+***********************************************/
+
+CTraceSpan::CTraceSpan(const char *name)
+    : m_Name(name)
+    , m_Active(CTracer::instance().isEnabled()) {
+    if (m_Active)
+        m_Start = std::chrono::steady_clock::now();
+}
+
+CTraceSpan::~CTraceSpan() {
+    if (m_Active)
+        CTracer::instance().record(m_Name, std::move(m_Argument), m_Start, std::chrono::steady_clock::now());
+}
+
+bool CTraceSpan::isActive() const {
+    return m_Active;
+}
+
+void CTraceSpan::setArgument(std::string_view argument) {
+    if (m_Active)
+        m_Argument = argument;
+}
+/******************************************************
+ * Filename: builder.cpp
+ * Author: David Kopelent
+ * Date: 24.04.2024
+ * Description: This code implements methods for building AST of parsed expression
+ * 
+ ******************************************************/
+
+
+CBuilder::CBuilder(CPos pos)
+    : m_Pos(pos) {}
+
+void CBuilder::opAdd() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    pushBinary<COpAdd, CAddOperatorNode>(std::move(right), std::move(left));
+}
+
+void CBuilder::opSub() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    pushBinary<COpSub, CSubOperatorNode>(std::move(right), std::move(left));
+}
+
+void CBuilder::opMul() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    pushBinary<COpMul, CMulOperatorNode>(std::move(right), std::move(left));
+}
+
+void CBuilder::opDiv() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    pushBinary<COpDiv, CDivOperatorNode>(std::move(right), std::move(left));
+}
+
+void CBuilder::opPow() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CPowOperatorNode>(std::move(right), std::move(left)));
+}
+
+void CBuilder::opNeg() {
+    if (m_Nodes.empty()) return;
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CNegOperatorNode>(std::move(right)));
+}
+
+void CBuilder::opEq() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CEqOperatorNode>(std::move(right), std::move(left)));
+}
+
+void CBuilder::opNe() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CNeOperatorNode>(std::move(right), std::move(left)));
+}
+
+void CBuilder::opLt() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CLtOperatorNode>(std::move(right), std::move(left)));
+}
+
+void CBuilder::opLe() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CLeOperatorNode>(std::move(right), std::move(left)));
+}
+
+void CBuilder::opGt() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CGtOperatorNode>(std::move(right), std::move(left)));
+}
+
+void CBuilder::opGe() {
+    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
+    auto left = getTopNode();
+    auto right = getTopNode();
+    m_Nodes.push(std::make_unique<CGeOperatorNode>(std::move(right), std::move(left)));
+}
+
+void CBuilder::valNumber(double num) {
+    m_Nodes.push(std::make_unique<CNumberNode>(num));
+}
+
+void CBuilder::valString(std::string str) {
+    m_Nodes.push(std::make_unique<CStringNode>(str));
+}
+
+void CBuilder::valReference(std::string str) {
+    bool absoluteColumn = (str[0] == '$'); // Check if the first character is '$'
+    bool absoluteRow = false; // Check if the last character is '$'
+
+    // Check if any character between the first and last is '$'
+    for (size_t i = 1; i < str.length() - 1; ++i) {
+        if (str[i] == '$') {
+            absoluteRow = true;
+            break;
+        }
+    }
+
+    bool relative = !absoluteColumn && !absoluteRow;
+    if (!relative)
+        str.erase(std::remove_if(str.begin(), str.end(), [](char c) { return c == '$'; }), str.end());
+
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) {
+        return std::toupper(c);
+    });
+
+    std::unique_ptr<CReferenceNode> reference;
+    if (relative) {
+        // Relative
+        reference = std::make_unique<CRelativeReferenceNode>(m_Pos, CPos(str), str);
+    } else if (absoluteColumn && absoluteRow) {
+        // Absolute
+        reference = std::make_unique<CAbsoluteReferenceNode>(m_Pos, CPos(str), str);
+    } else if (absoluteColumn) {
+        // Absolute column Relative row
+        reference = std::make_unique<CAbsRelReferenceNode>(m_Pos, CPos(str), str);
+    } else {
+        // Relative column Absolute row
+        reference = std::make_unique<CRelAbsReferenceNode>(m_Pos, CPos(str), str);
+    }
+
+    reference->setSheet(nextSheet());
+    m_Dependencies.push_back(reference->getDependency());
+    m_Nodes.push(std::move(reference));
+}
+
+void CBuilder::valRange(std::string str) {
+    auto range = std::make_unique<CRangeNode>(m_Pos, str);
+    range->setSheet(nextSheet());
+
+    // Range is kept as a single dependency instead of one per cell
+    m_Dependencies.push_back(range->getDependency());
+    m_Nodes.push(std::move(range));
+}
+
+void CBuilder::funcCall(std::string fnName, int paramCnt) {
+    if (paramCnt < 0 || m_Nodes.size() < static_cast<size_t>(paramCnt))
+        throw std::invalid_argument("Invalid function call!");
+
+    std::vector<std::unique_ptr<CNode>> params(paramCnt);
+    for (int i = paramCnt - 1; i >= 0; i--)
+        params[i] = getTopNode();
+
+    std::transform(fnName.begin(), fnName.end(), fnName.begin(), [](unsigned char c) {
+        return std::tolower(c);
+    });
+
+    if (fnName == "if" && paramCnt == 3) {
+        m_Nodes.push(std::make_unique<CIfFunctionNode>(std::move(params[0]), std::move(params[1]), std::move(params[2])));
+        return;
+    }
+
+    // Remaining functions take range as the last parameter
+    CRangeNode *rangeNode = paramCnt > 0 ? dynamic_cast<CRangeNode*>(params.back().get()) : nullptr;
+    if (rangeNode == nullptr)
+        throw std::invalid_argument("Invalid function call!");
+    params.back().release();
+    std::unique_ptr<CRangeNode> range(rangeNode);
+
+    if (fnName == "sum" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CSumFunctionNode>(std::move(range)));
+    } else if (fnName == "count" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CCountFunctionNode>(std::move(range)));
+    } else if (fnName == "min" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CMinFunctionNode>(std::move(range)));
+    } else if (fnName == "max" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CMaxFunctionNode>(std::move(range)));
+    } else if (fnName == "countval" && paramCnt == 2) {
+        m_Nodes.push(std::make_unique<CCountvalFunctionNode>(std::move(params[0]), std::move(range)));
+    } else {
+        throw std::invalid_argument("Unknown function!");
+    }
+}
+
+std::optional<CRefOperand> CBuilder::refOperand(const CNode &node) {
+    // References to other sheets need the workbook, they keep the generic node
+    auto base = dynamic_cast<const CReferenceNode*>(&node);
+    if (base == nullptr || !base->getSheet().empty())
+        return std::nullopt;
+
+    if (auto reference = dynamic_cast<const CRelativeReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), false, false);
+    if (auto reference = dynamic_cast<const CAbsoluteReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), true, true);
+    if (auto reference = dynamic_cast<const CAbsRelReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), true, false);
+    if (auto reference = dynamic_cast<const CRelAbsReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), false, true);
+    return std::nullopt;
+}
+
+std::optional<CConstOperand> CBuilder::constOperand(const CNode &node) {
+    if (auto number = dynamic_cast<const CNumberNode*>(&node))
+        return CConstOperand(number->getNumber());
+    return std::nullopt;
+}
+
+void CBuilder::parse(const std::string &expression) {
+    if (expression.find('!') == std::string::npos) {
+        parseExpression(expression, *this);
+        return;
+    }
+
+    m_Sheets.clear();
+    m_NextSheet = 0;
+    parseExpression(stripSheets(expression, m_Sheets), *this);
+}
+
+std::string CBuilder::nextSheet() {
+    return m_NextSheet < m_Sheets.size() ? m_Sheets[m_NextSheet++] : std::string();
+}
+
+bool CBuilder::isReference(std::string_view word) {
+    size_t i = word.size() > 0 && word[0] == '$';
+    size_t letters = i;
+    while (i < word.size() && std::isalpha(static_cast<unsigned char>(word[i])))
+        i++;
+    if (i == letters)
+        return false;
+    if (i < word.size() && word[i] == '$')
+        i++;
+    size_t digits = i;
+    while (i < word.size() && std::isdigit(static_cast<unsigned char>(word[i])))
+        i++;
+    return i > digits && i == word.size();
+}
+
+std::string CBuilder::stripSheets(std::string_view expression, std::vector<std::string> &sheets) {
+    auto isWord = [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+    };
+    auto wordEnd = [&expression, &isWord](size_t i) {
+        while (i < expression.size() && isWord(expression[i]))
+            i++;
+        return i;
+    };
+
+    std::string out;
+    out.reserve(expression.size());
+    std::string sheet;
+    bool qualified = false;
+    size_t i = 0;
+    while (i < expression.size()) {
+        char c = expression[i];
+        size_t end = i + 1;
+
+        if (std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$') {
+            end = wordEnd(i);
+            std::string_view word = expression.substr(i, end - i);
+            if (end < expression.size() && expression[end] == '!' && !qualified && word.find('$') == std::string_view::npos) {
+                sheet = word;
+                qualified = true;
+                i = end + 1;
+                continue;
+            }
+
+            // Every reference and range gets an entry, so that they can be matched with builder calls
+            if (isReference(word)) {
+                if (end + 1 < expression.size() && expression[end] == ':') {
+                    size_t second = wordEnd(end + 1);
+                    if (isReference(expression.substr(end + 1, second - end - 1)))
+                        end = second;
+                }
+                sheets.push_back(qualified ? sheet : std::string());
+                qualified = false;
+                out.append(expression.substr(i, end - i));
+                i = end;
+                continue;
+            }
+        } else if (c == '\'' && !qualified) {
+            // Quoted sheet name, quote inside is doubled
+            sheet.clear();
+            for (; end < expression.size(); end++) {
+                if (expression[end] == '\'' && (end + 1 >= expression.size() || expression[end + 1] != '\''))
+                    break;
+                if (expression[end] == '\'')
+                    end++;
+                sheet += expression[end];
+            }
+            if (end + 1 >= expression.size() || expression[end + 1] != '!')
+                throw std::invalid_argument("Invalid sheet name!");
+            qualified = true;
+            i = end + 2;
+            continue;
+        } else if (c == '"') {
+            // String literals are copied as they are, doubled quote does not end them
+            while (end < expression.size() && (expression[end] != '"' || (end + 1 < expression.size() && expression[end + 1] == '"')))
+                end += expression[end] == '"' ? 2 : 1;
+            end = std::min(end + 1, expression.size());
+        } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            // Exponent of a number is not a reference
+            end = wordEnd(i);
+            if (end < expression.size() && (expression[end] == '+' || expression[end] == '-') && std::tolower(expression[end - 1]) == 'e')
+                end = wordEnd(end + 1);
+            while (end < expression.size() && expression[end] == '.')
+                end = wordEnd(end + 1);
+        }
+
+        if (qualified)
+            throw std::invalid_argument("Sheet name must be followed by a reference!");
+        out.append(expression.substr(i, end - i));
+        i = end;
+    }
+
+    if (qualified)
+        throw std::invalid_argument("Sheet name must be followed by a reference!");
+    return out;
+}
+
+CValue CBuilder::parseLiteral(std::string_view contents) {
+    // Number literal: -?digits(.digits?)?([eE][+-]?digits)? followed by optional whitespace
+    size_t i = (!contents.empty() && contents[0] == '-') ? 1 : 0;
+    size_t digits = i;
+    while (i < contents.size() && std::isdigit(static_cast<unsigned char>(contents[i])))
+        i++;
+    if (i == digits)
+        return CValue(std::string(contents));
+
+    if (i < contents.size() && contents[i] == '.') {
+        i++;
+        while (i < contents.size() && std::isdigit(static_cast<unsigned char>(contents[i])))
+            i++;
+    }
+
+    if (i < contents.size() && (contents[i] == 'e' || contents[i] == 'E')) {
+        size_t exponent = i + 1;
+        if (exponent < contents.size() && (contents[exponent] == '+' || contents[exponent] == '-'))
+            exponent++;
+        size_t exponentDigits = exponent;
+        while (exponent < contents.size() && std::isdigit(static_cast<unsigned char>(contents[exponent])))
+            exponent++;
+        if (exponent == exponentDigits)
+            return CValue(std::string(contents));
+        i = exponent;
+    }
+
+    size_t end = i;
+    while (i < contents.size() && std::isspace(static_cast<unsigned char>(contents[i])))
+        i++;
+    if (i != contents.size())
+        return CValue(std::string(contents));
+
+    double number = 0;
+    auto [ptr, error] = std::from_chars(contents.data(), contents.data() + end, number);
+    if (error == std::errc::result_out_of_range) {
+        // Overflow and underflow behave like the parser (inf, 0)
+        number = std::strtod(std::string(contents.substr(0, end)).c_str(), nullptr);
+    }
+
+    if (std::isinf(number))
+        return CValue();
+    return CValue(number);
+}
+
+std::unique_ptr<CNode> CBuilder::getTopNode() {
+    auto node = std::move(m_Nodes.top());
+    m_Nodes.pop();
+    return node;
+}
+
+std::vector<std::string> CBuilder::getDependencies() const {
+    return m_Dependencies;
+}
+
+std::unique_ptr<CNode> CBuilder::buildAST() {
+    if (m_Nodes.empty() || m_Nodes.size() != 1) return nullptr;
+    return getTopNode();
+}
+/******************************************************
+ * Filename: journal.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements append-only journal of sheet modifications used for incremental saves
+ *              and crash recovery, together with the running checksum and buffered stream writer used by file IO.
+ ******************************************************/
+
+
+/***********************************************
+*        Checksum Section
+***********************************************/
+
+void CChecksum::update(std::string_view data) {
+    for (char c : data)
+        update(c);
+}
+
+void CChecksum::update(char c) {
+    m_Hash ^= static_cast<unsigned char>(c);
+    m_Hash *= 0x100000001b3ULL;
+}
+
+uint64_t CChecksum::get() const {
+    return m_Hash;
+}
+
+std::string CChecksum::toString() const {
+    static const char *hex = "0123456789abcdef";
+    std::string result(16, '0');
+    for (size_t i = 0; i < 16; i++)
+        result[15 - i] = hex[(m_Hash >> (i * 4)) & 0xf];
+    return result;
+}
+
+/***********************************************
+*        Stream Writer Section
+***********************************************/
+
+CStreamWriter::CStreamWriter(std::ostream &os, size_t capacity)
+    : m_Os(os)
+    , m_Capacity(capacity) {
+    m_Buffer.reserve(capacity);
+}
+
+CStreamWriter::~CStreamWriter() {
+    flush();
+}
+
+void CStreamWriter::write(std::string_view data) {
+    m_Checksum.update(data);
+    if (m_Buffer.size() + data.size() > m_Capacity)
+        flush();
+
+    // Data larger than the buffer goes straight to the stream
+    if (data.size() >= m_Capacity)
+        m_Os.write(data.data(), data.size());
+    else
+        m_Buffer.append(data);
+}
+
+bool CStreamWriter::flush() {
+    if (!m_Buffer.empty()) {
+        m_Os.write(m_Buffer.data(), m_Buffer.size());
+        m_Buffer.clear();
+    }
+    return !m_Os.fail();
+}
+
+const CChecksum &CStreamWriter::getChecksum() const {
+    return m_Checksum;
+}
+
+/***********************************************
+*        Journal Section
+***********************************************/
+
+CJournal::CJournal(std::ostream &os, std::string_view base)
+    : m_Os(os) {
+    append('B', base);
+}
+
+bool CJournal::appendSetCell(std::string_view id, std::string_view contents) {
+    std::string payload;
+    payload.reserve(id.size() + contents.size() + 1);
+    payload.append(id).append(1, ' ').append(contents);
+    return append('S', payload);
+}
+
+bool CJournal::appendCopyRect(std::string_view dst, std::string_view src, int w, int h) {
+    return appendRect('C', dst, src, w, h);
+}
+
+bool CJournal::appendMoveRect(std::string_view dst, std::string_view src, int w, int h) {
+    return appendRect('M', dst, src, w, h);
+}
+
+bool CJournal::appendShift(std::string_view operation, size_t index, size_t count) {
+    std::string payload(operation);
+    payload.append(1, ' ').append(std::to_string(index)).append(1, ' ').append(std::to_string(count));
+    return append('T', payload);
+}
+
+bool CJournal::isValid() const {
+    return !m_Os.fail();
+}
+
+bool CJournal::appendRect(char type, std::string_view dst, std::string_view src, int w, int h) {
+    std::string payload;
+    payload.append(dst).append(1, ' ').append(src).append(1, ' ')
+           .append(std::to_string(w)).append(1, ' ').append(std::to_string(h));
+    return append(type, payload);
+}
+
+bool CJournal::append(char type, std::string_view payload) {
+    if (m_Os.fail())
+        return false;
+
+    CChecksum checksum;
+    checksum.update(type);
+    checksum.update(payload);
+
+    // Record reaches the stream as a whole, so a crash can only tear the last one
+    m_Os << type << payload.size() << ' ' << checksum.toString() << '\n';
+    m_Os.write(payload.data(), payload.size());
+    m_Os << '\n';
+    m_Os.flush();
+    return !m_Os.fail();
+}
+
+bool CJournal::readRecord(std::istream &is, char &type, std::string &payload) {
+    size_t length = 0;
+    std::string expected;
+    if (!is.get(type) || !(is >> length) || is.get() != ' ' || !(is >> expected) || is.get() != '\n')
+        return false;
+
+    payload.resize(length);
+    if (!is.read(payload.data(), length) || is.get() != '\n')
+        return false;
+
+    CChecksum checksum;
+    checksum.update(type);
+    checksum.update(payload);
+    return checksum.toString() == expected;
+}
+
+size_t CJournal::replay(std::istream &is, std::string_view base, const std::function<void(const CJournalRecord&)> &apply) {
+    char type;
+    std::string payload;
+    if (!readRecord(is, type, payload) || type != 'B' || payload != base)
+        return 0;
+
+    size_t applied = 0;
+    while (readRecord(is, type, payload)) {
+        CJournalRecord record{type, "", "", 1, 1, 0, 0};
+        size_t separator = payload.find(' ');
+        if (separator == std::string::npos)
+            break;
+        record.m_Target = payload.substr(0, separator);
+
+        if (type == 'S') {
+            record.m_Argument = payload.substr(separator + 1);
+        } else if (type == 'C' || type == 'M') {
+            std::istringstream arguments(payload.substr(separator + 1));
+            if (!(arguments >> record.m_Argument >> record.m_Width >> record.m_Height))
+                break;
+        } else if (type == 'T') {
+            std::istringstream arguments(payload.substr(separator + 1));
+            if (!(arguments >> record.m_Index >> record.m_Count))
+                break;
+        } else {
+            break;
+        }
+
+        apply(record);
+        applied++;
+    }
+    return applied;
+}
+/******************************************************
+ * Filename: codec.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements LZ family codec without external dependencies and block container
+ *              built on top of it, which is used for compressed saves. Blocks carry their own checksums
+ *              and are decompressed in parallel on load.
+ ******************************************************/
+
+
+/***********************************************
+*        LZ Codec Section
+***********************************************/
+
+uint32_t CLzCodec::read32(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint32_t CLzCodec::hash32(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+void CLzCodec::writeLength(std::string &out, size_t length) {
+    for (; length >= 255; length -= 255)
+        out.push_back(static_cast<char>(255));
+    out.push_back(static_cast<char>(length));
+}
+
+bool CLzCodec::readLength(const unsigned char *&in, const unsigned char *end, size_t &length) {
+    unsigned char byte;
+    do {
+        if (in == end)
+            return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+std::string CLzCodec::compress(std::string_view input) {
+    std::string out;
+    out.reserve(input.size() / 2 + 16);
+    // Positions are stored shifted by one, 0 marks an empty slot
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    auto emit = [&](size_t literals, size_t offset, size_t match) {
+        size_t matchCode = match ? match - MIN_MATCH : 0;
+        out.push_back(static_cast<char>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(matchCode, 15)));
+        if (literals >= 15)
+            writeLength(out, literals - 15);
+        out.append(input.data() + anchor, literals);
+        if (!match)
+            return;
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15)
+            writeLength(out, matchCode - 15);
+    };
+
+    while (pos + MIN_MATCH <= input.size()) {
+        uint32_t sequence = read32(input.data() + pos);
+        uint32_t &slot = table[hash32(sequence)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(pos + 1);
+
+        if (!candidate || pos - (candidate - 1) > MAX_OFFSET || read32(input.data() + candidate - 1) != sequence) {
+            pos++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t length = MIN_MATCH;
+        while (pos + length < input.size() && input[match + length] == input[pos + length])
+            length++;
+
+        emit(pos - anchor, pos - match, length);
+        pos += length;
+        anchor = pos;
+    }
+
+    // Final sequence holds the remaining literals, possibly none
+    emit(input.size() - anchor, 0, 0);
+    return out;
+}
+
+bool CLzCodec::decompress(std::string_view input, std::span<char> output) {
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(input.data());
+    const unsigned char *end = in + input.size();
+    size_t written = 0;
+
+    while (in != end) {
+        unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(in, end, literals))
+            return false;
+        if (literals > size_t(end - in) || literals > output.size() - written)
+            return false;
+        std::memcpy(output.data() + written, in, literals);
+        in += literals;
+        written += literals;
+
+        // Only the last sequence ends after its literals
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return false;
+        size_t offset = in[0] | (size_t(in[1]) << 8);
+        in += 2;
+        size_t length = token & 0xf;
+        if (length == 15 && !readLength(in, end, length))
+            return false;
+        length += MIN_MATCH;
+        if (offset == 0 || offset > written || length > output.size() - written)
+            return false;
+
+        // Source and destination may overlap, repeating the last offset bytes
+        char *dst = output.data() + written;
+        const char *src = dst - offset;
+        if (offset >= length) {
+            std::memcpy(dst, src, length);
+        } else {
+            for (size_t i = 0; i < length; i++)
+                dst[i] = src[i];
+        }
+        written += length;
+    }
+    return written == output.size();
+}
+
+/***********************************************
+*        Block Writer Section
+***********************************************/
+
+CBlockWriter::CBlockWriter(std::ostream &os, size_t blockSize)
+    : m_Os(os)
+    , m_BlockSize(std::clamp<size_t>(blockSize, 1, MAX_BLOCK_SIZE)) {
+    m_Buffer.reserve(m_BlockSize);
+    m_Os.write(MAGIC.data(), MAGIC.size());
+}
+
+void CBlockWriter::write(std::string_view data) {
+    m_Checksum.update(data);
+    while (!data.empty()) {
+        // Whole blocks of large pieces are compressed without copying them into the buffer
+        if (m_Buffer.empty() && data.size() >= m_BlockSize) {
+            writeBlock(data.substr(0, m_BlockSize));
+            data.remove_prefix(m_BlockSize);
+            continue;
+        }
+
+        size_t take = std::min(m_BlockSize - m_Buffer.size(), data.size());
+        m_Buffer.append(data.substr(0, take));
+        data.remove_prefix(take);
+        if (m_Buffer.size() == m_BlockSize) {
+            writeBlock(m_Buffer);
+            m_Buffer.clear();
+        }
+    }
+}
+
+bool CBlockWriter::finish() {
+    if (!m_Buffer.empty()) {
+        writeBlock(m_Buffer);
+        m_Buffer.clear();
+    }
+    writeBlock("");
+    m_Os.flush();
+    return !m_Os.fail();
+}
+
+const CChecksum &CBlockWriter::getChecksum() const {
+    return m_Checksum;
+}
+
+void CBlockWriter::writeBlock(std::string_view data) {
+    CChecksum checksum;
+    checksum.update(data);
+
+    std::string compressed = CLzCodec::compress(data);
+    std::string_view stored = compressed.size() < data.size() ? std::string_view(compressed) : data;
+    m_Os << data.size() << ' ' << stored.size() << ' ' << checksum.toString() << '\n';
+    m_Os.write(stored.data(), stored.size());
+}
+
+/***********************************************
+*        Block Reader Section
+***********************************************/
+
+bool CBlockReader::isBlocked(std::string_view input) {
+    return input.substr(0, CBlockWriter::MAGIC.size()) == CBlockWriter::MAGIC;
+}
+
+bool CBlockReader::decode(std::string_view input, std::string &output, size_t workers) {
+    struct CBlock {
+        std::string_view m_Stored;
+        size_t m_Offset;
+        size_t m_Size;
+        std::string_view m_Checksum;
+    };
+
+    if (!isBlocked(input))
+        return false;
+    input.remove_prefix(CBlockWriter::MAGIC.size());
+
+    // Headers are read serially to find where every block starts in the input and in the output
+    std::vector<CBlock> blocks;
+    size_t total = 0;
+    while (true) {
+        size_t lineEnd = input.find('\n');
+        if (lineEnd == std::string_view::npos)
+            return false;
+        std::string_view line = input.substr(0, lineEnd);
+        input.remove_prefix(lineEnd + 1);
+
+        size_t rawSize = 0;
+        size_t storedSize = 0;
+        const char *end = line.data() + line.size();
+        auto raw = std::from_chars(line.data(), end, rawSize);
+        if (raw.ec != std::errc() || raw.ptr == end || *raw.ptr != ' ')
+            return false;
+        auto stored = std::from_chars(raw.ptr + 1, end, storedSize);
+        if (stored.ec != std::errc() || stored.ptr == end || *stored.ptr != ' ' || end - stored.ptr != 17)
+            return false;
+        if (storedSize > rawSize || storedSize > input.size())
+            return false;
+        if (rawSize > CBlockWriter::MAX_BLOCK_SIZE || rawSize > storedSize * CLzCodec::MAX_RATIO || rawSize > SIZE_MAX - total)
+            return false;
+
+        std::string_view checksum(stored.ptr + 1, 16);
+        if (rawSize == 0) {
+            // End marker closes the stream, nothing may follow it
+            CChecksum empty;
+            if (checksum != empty.toString() || !input.empty())
+                return false;
+            break;
+        }
 
-private:
-    std::map<std::string, CCell> m_Table;
-    std::map<std::string, std::vector<std::string>> m_Dependencies;
-    size_t hashTableContent(const std::string& str) const;
-};
+        blocks.push_back({input.substr(0, storedSize), total, rawSize, checksum});
+        input.remove_prefix(storedSize);
+        total += rawSize;
+    }
 
-class CDependencyChecker {
-public:
-    CDependencyChecker(const std::map<std::string, std::vector<std::string>>& dependencies);
-    bool containsCycle(const std::string& vertex);
+    output.assign(total, '\0');
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::clamp<size_t>(workers, 1, std::max<size_t>(blocks.size(), 1));
+
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> valid = true;
+    auto work = [&]() {
+        for (size_t i = next++; i < blocks.size() && valid.load(std::memory_order_relaxed); i = next++) {
+            const CBlock &block = blocks[i];
+            std::span<char> target(output.data() + block.m_Offset, block.m_Size);
+            if (block.m_Stored.size() == block.m_Size)
+                std::memcpy(target.data(), block.m_Stored.data(), block.m_Size);
+            else if (!CLzCodec::decompress(block.m_Stored, target)) {
+                valid = false;
+                break;
+            }
 
-private:
-    std::map<std::string, std::vector<std::string>> m_Dependencies;
-    std::unordered_set<std::string> visited;
-    std::unordered_set<std::string> recursionStack;
-    bool isCyclicUtil(const std::string& vertex);
-};
+            CChecksum checksum;
+            checksum.update(std::string_view(target.data(), target.size()));
+            if (checksum.toString() != block.m_Checksum)
+                valid = false;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+        threads.emplace_back(work);
+    work();
+    for (auto &thread : threads)
+        thread.join();
+
+    if (!valid)
+        output.clear();
+    return valid;
+}
 /******************************************************
- * Filename: cell.cpp
+ * Filename: csv.cpp
  * Author: David Kopelent
- * Date: 24.04.2024
- * Description: This code implements methods for cell representation and is responsible for building AST nodes
- * 
+ * Date: 19.10.2026
+ * Description: This code implements buffered RFC 4180 tokenizer used by CSV import.
  ******************************************************/
 
 
 /***********************************************
-*        Cell Position Section
+*        CSV Reader Section
 ***********************************************/
 
-CPos::CPos(std::string_view str) {
-    if (str.empty())
-        throw std::invalid_argument("Invalid ID!");
+CCsvReader::CCsvReader(std::istream &is, size_t capacity)
+    : m_Is(is)
+    , m_Capacity(std::max<size_t>(capacity, 1)) {
+    m_Buffer.resize(m_Capacity);
+}
 
-    size_t pos = str.find_first_of("0123456789");
-    if (pos == std::string::npos)
-        throw std::invalid_argument("Invalid ID!");
+bool CCsvReader::fill() {
+    m_Pos = 0;
+    m_Size = 0;
+    if (!m_Is.read(m_Buffer.data(), m_Capacity) && !m_Is.eof())
+        return false;
+    m_Size = m_Is.gcount();
+    return m_Size > 0;
+}
 
-    for (size_t i = 0; i < pos; i++) {
-        if (!std::isalpha(str[i]))
-            throw std::invalid_argument("Invalid ID!");
-        m_Column.push_back(std::toupper(str[i]));
+bool CCsvReader::next(std::string_view &field, bool &lastInRow) {
+    if (m_Pos == m_Size && !fill())
+        return false;
+    if (m_SkipNewline) {
+        m_SkipNewline = false;
+        if (m_Buffer[m_Pos] == '\n' && ++m_Pos == m_Size && !fill())
+            return false;
     }
 
-    std::string row(str.substr(pos));
-    if (!isValidRowNumber(row))
-        throw std::invalid_argument("Invalid ID!");
+    m_Field.clear();
+    bool assembled = false;
+    if (m_Buffer[m_Pos] == '"') {
+        // Quoted field, doubled quote stands for a quote character
+        assembled = true;
+        m_Pos++;
+        while (true) {
+            if (m_Pos == m_Size && !fill()) {
+                m_Unterminated = true;
+                break;
+            }
+            size_t quote = m_Buffer.find('"', m_Pos);
+            if (quote == std::string::npos || quote >= m_Size) {
+                m_Field.append(m_Buffer, m_Pos, m_Size - m_Pos);
+                m_Pos = m_Size;
+                continue;
+            }
+            m_Field.append(m_Buffer, m_Pos, quote - m_Pos);
+            m_Pos = quote + 1;
+            if ((m_Pos < m_Size || fill()) && m_Buffer[m_Pos] == '"') {
+                m_Field.push_back('"');
+                m_Pos++;
+                continue;
+            }
+            break;
+        }
+    }
+
+    // Unquoted field or text following the closing quote runs to the next separator
+    lastInRow = true;
+    while (true) {
+        if (m_Pos == m_Size) {
+            if (!fill())
+                break;
+            assembled = true;
+        }
+        size_t end = m_Pos;
+        while (end < m_Size && m_Buffer[end] != ',' && m_Buffer[end] != '\n' && m_Buffer[end] != '\r')
+            end++;
+
+        if (end == m_Size) {
+            m_Field.append(m_Buffer, m_Pos, end - m_Pos);
+            m_Pos = m_Size;
+            assembled = true;
+            continue;
+        }
+
+        if (assembled)
+            m_Field.append(m_Buffer, m_Pos, end - m_Pos);
+        else
+            field = std::string_view(m_Buffer.data() + m_Pos, end - m_Pos);
+        lastInRow = m_Buffer[end] != ',';
+        m_SkipNewline = m_Buffer[end] == '\r';
+        m_Pos = end + 1;
+        break;
+    }
+
+    if (assembled)
+        field = m_Field;
+    return true;
+}
+
+bool CCsvReader::isValid() const {
+    return !m_Unterminated && !m_Is.bad();
+}
+/******************************************************
+ * Filename: spreadsheet.cpp
+ * Author: David Kopelent
+ * Date: 24.04.2024
+ * Description: This file implements methods for representing and manipulating spreadsheets.
+ *              It contains the definitions of the member functions of the CSpreadsheet, CDependencyGraph
+ *              and CDependencyChecker class.
+ ******************************************************/
+
+
+CValueSnapshot::CValueSnapshot(size_t epoch)
+    : m_Epoch(epoch), m_Shards{std::make_shared<CShard>()} {}
+
+CValue CValueSnapshot::getValue(const CPos &pos) const {
+    const CValue *value = find(pos.getId());
+    return value != nullptr ? *value : CValue();
+}
+
+size_t CValueSnapshot::getEpoch() const {
+    return m_Epoch;
+}
+
+const CValue *CValueSnapshot::find(const std::string &id) const {
+    const CShard &shard = *m_Shards[shardOf(id)];
+    auto value = shard.find(id);
+    return value != shard.end() ? &value->second : nullptr;
+}
+
+void CValueSnapshot::assign(const std::string &id, CValue value, std::vector<bool> &copied) {
+    size_t index = shardOf(id);
+    if (!copied[index]) {
+        m_Shards[index] = std::make_shared<CShard>(*m_Shards[index]);
+        copied[index] = true;
+    }
+
+    CShard &shard = *m_Shards[index];
+    m_Size -= shard.erase(id);
+    if (!std::holds_alternative<std::monostate>(value)) {
+        shard.emplace(id, std::move(value));
+        m_Size++;
+    }
+}
+
+void CValueSnapshot::reshard(size_t cells, std::vector<bool> &copied) {
+    size_t count = std::bit_ceil(std::max<size_t>(cells / SHARD_CELLS, 1));
+    std::vector<std::shared_ptr<CShard>> shards(count);
+    for (auto &shard : shards)
+        shard = std::make_shared<CShard>();
+
+    std::swap(m_Shards, shards);
+    for (const auto &shard : shards) {
+        for (const auto &[id, value] : *shard)
+            m_Shards[shardOf(id)]->emplace(id, value);
+    }
+    copied.assign(count, true);
+}
+
+size_t CValueSnapshot::shardOf(const std::string &id) const {
+    return std::hash<std::string>{}(id) & (m_Shards.size() - 1);
+}
+
+// Copies never take over a running background worker
+CSpreadsheet::CSpreadsheet(const CSpreadsheet &sheet) {
+    auto lock = sheet.lockTable();
+    m_Table = sheet.m_Table;
+    m_Dependencies = sheet.m_Dependencies;
+    m_AstCache = sheet.m_AstCache;
+    m_ConcurrentReads = sheet.m_ConcurrentReads.load();
+    m_PublishSnapshots = m_ConcurrentReads;
+    m_Snapshot = sheet.m_Snapshot.load();
+    m_Changed = sheet.m_Changed;
+    m_PublishAll = sheet.m_PublishAll || sheet.m_AsyncRecalc;
+}
+
+CSpreadsheet& CSpreadsheet::operator=(const CSpreadsheet &sheet) {
+    if (&sheet == this) return *this;
+    std::map<std::string, CCell> table;
+    CDependencyGraph dependencies;
+    CAstCache astCache;
+    bool concurrentReads;
+    std::shared_ptr<const CValueSnapshot> snapshot;
+    {
+        auto lock = sheet.lockTable();
+        table = sheet.m_Table;
+        dependencies = sheet.m_Dependencies;
+        astCache = sheet.m_AstCache;
+        concurrentReads = sheet.m_ConcurrentReads;
+        snapshot = sheet.m_Snapshot.load();
+    }
+
+    // Assigned table is not a delta of the last compaction, the journal no longer matches the sheet
+    auto lock = lockTable();
+    m_Journal.reset();
+    m_Table = std::move(table);
+    m_Dependencies = std::move(dependencies);
+    m_AstCache = std::move(astCache);
+    m_ConcurrentReads = concurrentReads;
+    m_PublishSnapshots = concurrentReads;
+    m_Snapshot = snapshot;
+    m_Changed.clear();
+    m_PublishAll = true;
+    m_WorkAvailable.notify_one();
+    return *this;
+}
+
+CSpreadsheet::~CSpreadsheet() {
+    setAsyncRecalc(false);
+}
+
+// Load spreadsheet data from an input stream
+bool CSpreadsheet::load(std::istream &is) {
+    std::string checksum;
+    m_DeferNotifications = true;
+    bool loaded = loadSnapshot(is, checksum);
+    compactDependencies();
+    m_DeferNotifications = false;
+    notifySubscribers();
+    return loaded;
+}
+
+bool CSpreadsheet::load(std::istream &snapshot, std::istream &journal) {
+    std::string checksum;
+    m_DeferNotifications = true;
+    bool loaded = loadSnapshot(snapshot, checksum);
+    if (loaded)
+        replayJournal(journal, checksum);
+    compactDependencies();
+    m_DeferNotifications = false;
+    notifySubscribers();
+    return loaded;
+}
+
+void CSpreadsheet::replayJournal(std::istream &journal, const std::string &checksum) {
+    CTraceSpan span("replay");
+    try {
+        CJournal::replay(journal, checksum, [this](const CJournalRecord &record) {
+            if (record.m_Type == 'S')
+                setCell(CPos(record.m_Target), record.m_Argument);
+            else if (record.m_Type == 'C')
+                copyRect(CPos(record.m_Target), CPos(record.m_Argument), record.m_Width, record.m_Height);
+            else if (record.m_Type == 'M')
+                moveRect(CPos(record.m_Target), CPos(record.m_Argument), record.m_Width, record.m_Height);
+            else if (record.m_Target == "insertRows")
+                insertRows(record.m_Index, record.m_Count);
+            else if (record.m_Target == "deleteRows")
+                deleteRows(record.m_Index, record.m_Count);
+            else if (record.m_Target == "insertColumns")
+                insertColumns(record.m_Index, record.m_Count);
+            else if (record.m_Target == "deleteColumns")
+                deleteColumns(record.m_Index, record.m_Count);
+        });
+    } catch(std::invalid_argument &e) {
+        // Keep the records applied before the damaged one
+    }
+}
 
-    m_Row = std::stoi(row);
-    m_Id = str;
-    m_ColumnNumber = columnToNumber(m_Column);
+void CSpreadsheet::compactDependencies() {
+    auto lock = lockTable();
+    m_Dependencies.compact();
 }
 
-CPos::CPos(const CPos &pos) 
-    : m_Id(pos.m_Id)
-    , m_Column(pos.m_Column)
-    , m_Row(pos.m_Row)
-    , m_ColumnNumber(pos.m_ColumnNumber) {}
+bool CSpreadsheet::loadSnapshot(std::istream &is, std::string &checksum) {
+    CTraceSpan span("load");
+    if (is.fail()) {
+        return false;
+    }
+
+    // Store input stream inside string
+    std::stringstream buffer;
+    buffer << is.rdbuf();
+    std::string content = buffer.str();
+
+    // Block files hold the same data compressed, corrupted block fails the whole load
+    if (CBlockReader::isBlocked(content)) {
+        std::string decoded;
+        if (!CBlockReader::decode(content, decoded))
+            return false;
+        content = std::move(decoded);
+    }
+
+    // Streamed files carry checksum of the body in a trailer, older files in a header
+    if (content.compare(0, 6, "<BODY>") == 0) {
+        size_t tailStart = content.rfind("<TAIL>");
+        if (tailStart == std::string::npos || content.size() < tailStart + 13 || content.compare(content.size() - 7, 7, "</TAIL>") != 0)
+            return false;
+
+        CChecksum body;
+        body.update(std::string_view(content).substr(0, tailStart));
+        if (content.compare(tailStart + 6, content.size() - tailStart - 13, body.toString()) != 0)
+            return false;
+
+        checksum = body.toString();
+        content.resize(tailStart);
+        content.erase(0, 6);
+    } else {
+        size_t headStart = content.find("<HEAD>");
+        size_t headEnd = content.find("</HEAD>");
+
+        if (headStart == std::string::npos || headEnd == std::string::npos)
+            return false;
+
+        // Check headers for file corruption
+        std::string head = content.substr(headStart + 6, headEnd - headStart - 6);
+        content.erase(0, headEnd + 7);
+        if (head != std::to_string(hashTableContent(content)))
+            return false;
+        checksum = head;
+    }
+
+    // Clear existing data, the journal no longer matches the sheet
+    {
+        auto lock = lockTable();
+        m_Journal.reset();
+        m_Table.clear();
+        m_AstCache.noteCleared();
+        m_Dependencies.clear();
+        m_PublishAll = true;
+    }
+
+    if (content == "<EMPTY>")
+        return true;
+
+    size_t idStart = content.find("<ID>");
+    size_t valStart = content.find("<VAL>");
+    
+    while (idStart != std::string::npos && valStart != std::string::npos) {
+        size_t idEnd = content.find("</ID>", idStart);
+
+        if (idEnd == std::string::npos) {
+            return false;
+        }
 
-bool CPos::isValidRowNumber(const std::string &rowNumber) const {
-    for (size_t i = 0; i < rowNumber.length(); i++) {
-        if (!std::isdigit(rowNumber[i]))
+        std::string cell = content.substr(idStart + 4, idEnd - idStart - 4);
+        idStart = content.find("<ID>", idEnd);
+
+        size_t valEnd = content.find("</VAL>", valStart);
+
+        if (valEnd == std::string::npos) {
+            return false;
+        }
+
+        std::string value = content.substr(valStart + 5, valEnd - valStart - 5);
+        valStart = content.find("<VAL>", valEnd);
+
+        try {
+            setCell(CPos(cell), value);
+        } catch(std::invalid_argument &e) {
+            auto lock = lockTable();
+            m_Table.clear();
+            m_AstCache.noteCleared();
+            m_Dependencies.clear();
+            m_PublishAll = true;
             return false;
+        }
     }
-    return !(rowNumber.size() > 1 && rowNumber[0] == '0');
+
+    return true;
 }
 
-size_t CPos::columnToNumber(const std::string& column) {
-    size_t result = 0;
-    size_t size = column.size();
-    for (size_t i = 0; i < size; ++i) {
-        result += (column[size - i - 1] - 'A' + 1) * std::pow(26, i);
+size_t CSpreadsheet::hashTableContent(const std::string& str) const {
+    std::hash<std::string> hasher;
+    return hasher(str);
+}
+
+// Save spreadsheet data to an output stream
+bool CSpreadsheet::save(std::ostream &os, ESaveFormat format) const {
+    std::string checksum;
+    return saveSnapshot(os, checksum, format);
+}
+
+bool CSpreadsheet::compact(std::ostream &snapshot, std::ostream &journal, ESaveFormat format) {
+    std::string checksum;
+    if (!saveSnapshot(snapshot, checksum, format))
+        return false;
+
+    auto lock = lockTable();
+    m_Journal = std::make_unique<CJournal>(journal, checksum);
+    return m_Journal->isValid();
+}
+
+void CSpreadsheet::stopJournal() {
+    auto lock = lockTable();
+    m_Journal.reset();
+}
+
+bool CSpreadsheet::saveSnapshot(std::ostream &os, std::string &checksum, ESaveFormat format) const {
+    CTraceSpan span("save");
+    if (os.fail())
+        return false;
+
+    auto lock = lockTable();
+    os.clear();
+    if (format == ESaveFormat::BLOCKS) {
+        CBlockWriter writer(os);
+        writeSnapshot(writer, checksum);
+        return writer.finish();
     }
-    return result;
+
+    CStreamWriter writer(os);
+    writeSnapshot(writer, checksum);
+    return writer.flush();
 }
 
-std::string CPos::numberToColumn(size_t number) {
-    std::string result = "";
-    while (number > 0) {
-        int remainder = (number - 1) % 26; // Adjusted to 0-based index
-        result = char('A' + remainder) + result;
-        number = (number - 1) / 26;
+template <typename TWriter>
+void CSpreadsheet::writeSnapshot(TWriter &writer, std::string &checksum) const {
+    // Cells are streamed as they are visited, checksum of the body follows in the trailer
+    writer.write("<BODY>");
+    for (const auto &d: m_Table) {
+        writer.write("<ID>");
+        writer.write(d.first);
+        writer.write("</ID><VAL>");
+        writer.write(d.second.getExpression());
+        writer.write("</VAL>");
     }
-    return result;
+
+    checksum = writer.getChecksum().toString();
+    writer.write("<TAIL>");
+    writer.write(checksum);
+    writer.write("</TAIL>");
 }
 
-std::string CPos::getId() const {
-    return m_Id;
+// Set the contents of a cell
+bool CSpreadsheet::setCell(CPos pos, std::string contents) {
+    if (contents.empty())
+        return false;
+
+    CTraceSpan span("setCell");
+    if (span.isActive())
+        span.setArgument(pos.getId());
+
+    std::string expression = contents;
+    std::optional<CValue> literal;
+    CParsedFormula formula;
+    bool parsed = true;
+
+    // Only formulas need the parser, literals are stored directly as values
+    if (contents[0] != '=') {
+        CTraceSpan literalSpan("literal");
+        literal = CBuilder::parseLiteral(contents);
+    } else {
+        try {
+            CTraceSpan parseSpan("parse");
+            formula = m_ParseCache.parse(pos, contents);
+        } catch(std::invalid_argument &e) {
+            parsed = false;
+        }
+    }
+
+    // Parsing does not touch the table, lock only for the update
+    auto lock = lockTable();
+    if (!parsed) {
+        if (eraseCell(pos.getId()))
+            markChanged(pos.getId());
+        m_Dependencies.erase(pos);
+        if (m_Journal)
+            m_Journal->appendSetCell(pos.getIdView(), contents);
+        notifySubscribers();
+        return false;
+    }
+
+    {
+        CTraceSpan buildSpan("build");
+
+        // Create a new cell object, replacing the existing one
+        storeCell(pos.getId(), literal ? CCell(pos, expression, std::move(*literal)) : CCell(pos, expression, std::move(formula.m_Root)));
+        markChanged(pos.getId());
+    }
+
+    CTraceSpan dependencySpan("dependencies");
+    m_Dependencies.setDependencies(pos, formula.m_Dependencies);
+    if (m_Journal)
+        m_Journal->appendSetCell(pos.getIdView(), contents);
+
+    if (!literal)
+        m_AstCache.enforce(m_Table);
+    notifySubscribers();
+    return true;
 }
 
-std::string CPos::getColumn() const {
-    return m_Column;
+// Get the value of a cell
+CValue CSpreadsheet::getValue(CPos pos) {
+    CTraceSpan span("getValue");
+    if (span.isActive())
+        span.setArgument(pos.getId());
+
+    // Readers never touch the table while the writer may be modifying it
+    // Snapshot is loaded once, switching concurrent reads off may clear it right after the flag
+    if (m_ConcurrentReads.load(std::memory_order_acquire)) {
+        if (std::shared_ptr<const CValueSnapshot> snapshot = m_Snapshot.load())
+            return snapshot->getValue(pos);
+    }
+
+    if (m_AsyncRecalc.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_CellClean.wait(lock, [this, &pos] { return isClean(pos.getId()); });
+        return cachedValue(pos.getId());
+    }
+
+    auto cell = m_Table.find(pos.getId());
+    if (cell != m_Table.end()) {
+        {
+            CTraceSpan cycleSpan("cycleCheck");
+            CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+            if (checker.containsCycle(pos.getId())) {
+                return CValue();
+            }
+        }
+        CValue value;
+        {
+            CEvaluationPass pass(&m_AstCache, m_Sheets);
+            value = cell->second.evaluate(m_Table);
+        }
+        m_AstCache.enforce(m_Table);
+        return value;
+    }
+    return CValue();
 }
 
-size_t CPos::getRow() const {
-    return m_Row;
+bool CSpreadsheet::getValues(CPos topLeft, int w, int h, std::span<CValue> values) {
+    if (w < 0 || h < 0 || values.size() < static_cast<size_t>(w) * h)
+        return false;
+
+    evaluateRegion(topLeft, w, h, [&values](size_t i, const CValue &value) {
+        values[i] = value;
+    });
+    return true;
 }
 
-size_t CPos::getColumnNumber() const {
-    return m_ColumnNumber;
+bool CSpreadsheet::getNumericValues(CPos topLeft, int w, int h, std::span<double> values, std::span<uint8_t> valid) {
+    size_t count = static_cast<size_t>(std::max(w, 0)) * std::max(h, 0);
+    if (w < 0 || h < 0 || values.size() < count || valid.size() < (count + 7) / 8)
+        return false;
+
+    std::fill(valid.begin(), valid.begin() + (count + 7) / 8, 0);
+    evaluateRegion(topLeft, w, h, [&values, &valid](size_t i, const CValue &value) {
+        if (std::holds_alternative<double>(value)) {
+            values[i] = std::get<double>(value);
+            valid[i / 8] |= 1 << (i % 8);
+        } else {
+            values[i] = 0;
+        }
+    });
+    return true;
 }
 
-/***********************************************
-*        Cell Section
-***********************************************/
+void CSpreadsheet::evaluateRegion(const CPos &topLeft, int w, int h, const std::function<void(size_t, const CValue&)> &store) {
+    CTraceSpan span("getValues");
 
-CCell::CCell() 
-    : m_IsEmpty(true) {}   
+    std::vector<std::string> ids;
+    ids.reserve(static_cast<size_t>(w) * h);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++)
+            ids.push_back(CPos(topLeft.getColumnNumber() + i, topLeft.getRow() + j).getId());
+    }
 
-CCell::CCell(CPos id, const std::string &expr, std::unique_ptr<CNode> AST)
-    : m_Pos(id)
-    , m_Expression(expr)
-    , m_Root(std::move(AST))
-    , m_IsEmpty(false) {}
+    std::shared_ptr<const CValueSnapshot> snapshot = m_ConcurrentReads.load(std::memory_order_acquire) ? m_Snapshot.load() : nullptr;
+    if (snapshot != nullptr) {
+        for (size_t i = 0; i < ids.size(); i++) {
+            const CValue *value = snapshot->find(ids[i]);
+            store(i, value != nullptr ? *value : CValue());
+        }
+        return;
+    }
 
-CPos CCell::getPos() const {
-    return m_Pos;
+    if (m_AsyncRecalc.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_CellClean.wait(lock, [this, &ids] {
+            return std::all_of(ids.begin(), ids.end(), [this](const std::string &id) { return isClean(id); });
+        });
+        for (size_t i = 0; i < ids.size(); i++)
+            store(i, cachedValue(ids[i]));
+        return;
+    }
+
+    // Shared precedents are evaluated once thanks to the common pass
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (size_t i = 0; i < ids.size(); i++) {
+            auto cell = m_Table.find(ids[i]);
+            if (cell == m_Table.end() || checker.containsCycle(ids[i]))
+                store(i, CValue());
+            else
+                store(i, cell->second.evaluate(m_Table));
+        }
+    }
+    m_AstCache.enforce(m_Table);
 }
 
-void CCell::setValue(CValue val) {
-    m_Value = val;
+std::vector<std::vector<CValue>> CSpreadsheet::evaluateScenarios(const std::vector<std::map<CPos, CValue>> &inputs, const std::vector<CPos> &outputs, size_t workers) {
+    CTraceSpan span("evaluateScenarios");
+    std::vector<std::vector<CValue>> results(inputs.size(), std::vector<CValue>(outputs.size()));
+    auto lock = lockTable();
+
+    // Cycles and output cells are found once, scenarios only read them
+    std::vector<CCell*> cells(outputs.size(), nullptr);
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    for (size_t i = 0; i < outputs.size(); i++) {
+        std::string id = outputs[i].getId();
+        auto cell = m_Table.find(id);
+        if (cell != m_Table.end() && !checker.containsCycle(id))
+            cells[i] = &cell->second;
+    }
+
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::clamp<size_t>(workers, 1, std::max<size_t>(inputs.size(), 1));
+
+    std::atomic<size_t> next = 0;
+    auto work = [&]() {
+        for (size_t scenario = next++; scenario < inputs.size(); scenario = next++) {
+            CValueOverlay overlay(m_Table, inputs[scenario]);
+            CEvaluationPass pass(&m_AstCache, m_Sheets, &overlay);
+            for (size_t i = 0; i < outputs.size(); i++) {
+                const CValue *input = overlay.input(m_Table, outputs[i]);
+                if (input != nullptr)
+                    results[scenario][i] = *input;
+                else if (cells[i] != nullptr)
+                    results[scenario][i] = cells[i]->evaluate(m_Table);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+        threads.emplace_back(work);
+    work();
+    for (auto &thread : threads)
+        thread.join();
+    return results;
 }
 
-CValue CCell::getValue() const {
-    return m_Value;
+bool CSpreadsheet::exportValues(std::ostream &os, CPos topLeft, int w, int h, EExportFormat format) {
+    if (w < 0 || h < 0 || os.fail())
+        return false;
+
+    CTraceSpan span("export");
+    // Bounds memory held by values of one chunk, slices below the minimum are not worth a thread
+    static constexpr size_t CHUNK_CELLS = 1 << 16;
+    static constexpr size_t MIN_SLICE_CELLS = 4096;
+    size_t columns = w;
+    size_t chunkRows = std::max<size_t>(1, CHUNK_CELLS / std::max<size_t>(columns, 1));
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+
+    CStreamWriter writer(os, 1 << 20);
+    std::vector<CValue> values;
+    std::vector<std::string> slices(workers);
+    for (size_t row = 0; row < static_cast<size_t>(h); row += chunkRows) {
+        size_t rows = std::min(chunkRows, h - row);
+        values.assign(columns * rows, CValue());
+        evaluateRegion(CPos(topLeft.getColumnNumber(), topLeft.getRow() + row), w, rows, [&values](size_t i, const CValue &value) {
+            values[i] = value;
+        });
+
+        // Evaluation shares cell caches, so only formatting runs in parallel
+        size_t count = std::clamp<size_t>(columns * rows / MIN_SLICE_CELLS, 1, std::min(workers, rows));
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < count; i++) {
+            threads.emplace_back(formatRows, std::cref(values), columns, rows * i / count, rows * (i + 1) / count,
+                                 format, std::ref(slices[i]));
+        }
+        formatRows(values, columns, 0, rows / count, format, slices[0]);
+        for (auto &thread : threads)
+            thread.join();
+
+        for (size_t i = 0; i < count; i++) {
+            writer.write(slices[i]);
+            slices[i].clear();
+        }
+    }
+    return writer.flush();
 }
 
-std::string CCell::getExpression() const {
-    return m_Expression;
+void CSpreadsheet::formatRows(const std::vector<CValue> &values, size_t w, size_t fromRow, size_t toRow, EExportFormat format, std::string &out) {
+    for (size_t row = fromRow; row < toRow; row++) {
+        for (size_t column = 0; column < w; column++) {
+            if (column)
+                out.push_back(format == EExportFormat::CSV ? ',' : '\t');
+            formatField(values[row * w + column], format, out);
+        }
+        out.push_back('\n');
+    }
 }
 
-CValue CCell::evaluate(std::map<std::string, CCell> &table) {
-    if (m_Root == nullptr) {
-        m_Value = CValue();
-        return m_Value;
+void CSpreadsheet::formatField(const CValue &value, EExportFormat format, std::string &out) {
+    if (std::holds_alternative<double>(value)) {
+        // Shortest representation which reads back as the same double
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), std::get<double>(value));
+        out.append(buffer, result.ptr);
+        return;
+    }
+    if (!std::holds_alternative<std::string>(value))
+        return;
+
+    const std::string &str = std::get<std::string>(value);
+    if (format == EExportFormat::TSV) {
+        for (char c : str) {
+            if (c == '\t')
+                out.append("\\t");
+            else if (c == '\n')
+                out.append("\\n");
+            else if (c == '\r')
+                out.append("\\r");
+            else if (c == '\\')
+                out.append("\\\\");
+            else
+                out.push_back(c);
+        }
+        return;
     }
 
-    m_Value = m_Root->evaluate(table);
-    return m_Value;
+    if (str.find_first_of(",\"\r\n") == std::string::npos) {
+        out.append(str);
+        return;
+    }
+    out.push_back('"');
+    for (char c : str) {
+        if (c == '"')
+            out.push_back('"');
+        out.push_back(c);
+    }
+    out.push_back('"');
 }
 
-bool CCell::isEmpty() const {
-    return m_IsEmpty;
-}
+bool CSpreadsheet::importCsv(std::istream &is, CPos origin) {
+    CTraceSpan span("importCsv");
+    CCsvReader reader(is);
+    std::vector<std::pair<CPos, std::string>> formulas;
+
+    auto lock = lockTable();
+    size_t column = 0;
+    size_t row = 0;
+    std::string_view field;
+    bool lastInRow;
+    {
+        CTraceSpan literalSpan("literal");
+        while (reader.next(field, lastInRow)) {
+            CPos pos(origin.getColumnNumber() + column, origin.getRow() + row);
+            column++;
+            if (lastInRow) {
+                column = 0;
+                row++;
+            }
+            if (field.empty())
+                continue;
 
-CCell CCell::copyCell(CPos dst, std::vector<std::string> &dependencies) {
-    std::string expression = m_Expression;
-    std::unique_ptr<CNode> root = m_Root->clone(dst, expression, dependencies);
-    return CCell(dst, expression, std::move(root));
-}   
+            if (field[0] == '=') {
+                formulas.emplace_back(pos, field);
+                continue;
+            }
 
-/***********************************************
-*        AST Node Types Section
-***********************************************/
+            std::string id = pos.getId();
+            storeCell(id, CCell(pos, std::string(field), CBuilder::parseLiteral(field)));
+            m_Dependencies.erase(pos);
+            markChanged(id);
+            if (m_Journal)
+                m_Journal->appendSetCell(pos.getIdView(), field);
+        }
+    }
 
-CNumberNode::CNumberNode(double num) 
-    : m_Value(num) {}
+    // Parsing is independent for every formula, the table is only updated afterwards
+    std::vector<std::optional<CParsedFormula>> parsed(formulas.size());
+    auto parseSlice = [this, &formulas, &parsed](size_t from, size_t to) {
+        for (size_t i = from; i < to; i++) {
+            try {
+                parsed[i] = m_ParseCache.parse(formulas[i].first, formulas[i].second);
+            } catch(std::invalid_argument &e) {
+                // Invalid formula clears the cell like setCell does
+            }
+        }
+    };
+    {
+        CTraceSpan parseSpan("parse");
+        static constexpr size_t MIN_SLICE_FORMULAS = 1024;
+        size_t count = std::clamp<size_t>(formulas.size() / MIN_SLICE_FORMULAS, 1, std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < count; i++)
+            threads.emplace_back(parseSlice, formulas.size() * i / count, formulas.size() * (i + 1) / count);
+        parseSlice(0, formulas.size() / count);
+        for (auto &thread : threads)
+            thread.join();
+    }
 
-CValue CNumberNode::evaluate(std::map<std::string, CCell> &table) {
-    if (std::isinf(m_Value)) return CValue();
-    return CValue(m_Value);
+    {
+        CTraceSpan buildSpan("build");
+        for (size_t i = 0; i < formulas.size(); i++) {
+            const auto &[pos, contents] = formulas[i];
+            std::string id = pos.getId();
+            if (parsed[i]) {
+                storeCell(id, CCell(pos, contents, std::move(parsed[i]->m_Root)));
+                m_Dependencies.setDependencies(pos, parsed[i]->m_Dependencies);
+            } else {
+                eraseCell(id);
+                m_Dependencies.erase(pos);
+            }
+            markChanged(id);
+            if (m_Journal)
+                m_Journal->appendSetCell(pos.getIdView(), contents);
+        }
+    }
+
+    m_Dependencies.compact();
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
+    return reader.isValid();
 }
 
-std::unique_ptr<CNode> CNumberNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CNumberNode>(m_Value);
+bool CSpreadsheet::insertRows(size_t row, size_t count) {
+    return shiftCells(CShift{false, false, row, count}, "insertRows");
 }
 
-CStringNode::CStringNode(const std::string &str) 
-    : m_Value(str) {}
+bool CSpreadsheet::deleteRows(size_t row, size_t count) {
+    return shiftCells(CShift{false, true, row, count}, "deleteRows");
+}
 
-CValue CStringNode::evaluate(std::map<std::string, CCell> &table) {
-    return CValue(m_Value);
+bool CSpreadsheet::insertColumns(size_t column, size_t count) {
+    return shiftCells(CShift{true, false, column, count}, "insertColumns");
 }
 
-std::unique_ptr<CNode> CStringNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CStringNode>(m_Value);
+bool CSpreadsheet::deleteColumns(size_t column, size_t count) {
+    return shiftCells(CShift{true, true, column, count}, "deleteColumns");
 }
 
-/***********************************************
-*        Arithmetics Operators Section
-***********************************************/
+bool CSpreadsheet::shiftCells(const CShift &edit, std::string_view operation) {
+    // Rows and columns are numbered from 1
+    if (edit.m_Index == 0)
+        return false;
+    if (edit.m_Count == 0)
+        return true;
 
-CBinaryOperatorNode::CBinaryOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : m_Left(std::move(left))
-    , m_Right(std::move(right)) {}
+    CTraceSpan span("shift");
+    auto lock = lockTable();
+
+    // Moved cells leave the table so that their new ids can not collide with cells not moved yet
+    std::vector<std::map<std::string, CCell>::node_type> moved;
+    std::vector<std::map<std::string, CCell>::iterator> rewritten;
+    for (auto cell = m_Table.begin(); cell != m_Table.end();) {
+        CPos pos = cell->second.getPos();
+        if (edit.affects(pos)) {
+            markChanged(cell->first);
+            m_Dependencies.erase(pos);
+            moved.push_back(m_Table.extract(cell++));
+            continue;
+        }
+        if (cell->second.isFormula() && m_Dependencies.isShifted(cell->first, edit))
+            rewritten.push_back(cell);
+        ++cell;
+    }
 
-CAddOperatorNode::CAddOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+    for (auto cell : rewritten) {
+        rewriteCell(cell->second, edit, cell->second.getPos());
+        markChanged(cell->first);
+    }
 
-CValue CAddOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+    for (auto &node : moved) {
+        CPos pos = node.mapped().getPos();
+        if (!edit.apply(pos)) {
+            m_AstCache.noteReleased(node.mapped());
+            continue;
+        }
+        rewriteCell(node.mapped(), edit, pos);
+        node.key() = pos.getId();
+        markChanged(node.key());
+        m_Table.insert(std::move(node));
+    }
 
-    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        return CValue(std::get<std::string>(leftValue) + std::to_string(std::get<double>(rightValue)));
+    if (m_Journal)
+        m_Journal->appendShift(operation, edit.m_Index, edit.m_Count);
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
+    return true;
+}
 
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue(std::to_string(std::get<double>(leftValue)) + std::get<std::string>(rightValue));
+// Copy a rectangular range of cells within the spreadsheet
+void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h, size_t workers) {
+    auto lock = lockTable();
+    static constexpr size_t PARALLEL_COPY_CELLS = 4096;
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    if (w > 0 && h > 0 && static_cast<size_t>(w) * h >= PARALLEL_COPY_CELLS && workers > 1) {
+        copyRectParallel(dst, src, w, h, workers);
+        if (m_Journal)
+            m_Journal->appendCopyRect(dst.getIdView(), src.getIdView(), w, h);
+        m_AstCache.enforce(m_Table);
+        notifySubscribers();
+        return;
+    }
 
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        double result = std::get<double>(leftValue) + std::get<double>(rightValue);
-        return CValue(result);
+    // Traversal against the copy direction reads every source cell before the copy can overwrite it
+    bool columnsBackward = dst.getColumnNumber() > src.getColumnNumber();
+    bool rowsBackward = dst.getRow() > src.getRow();
+    std::vector<std::string> dependencies;
+    for (int i = 0; i < w; i++) {
+        size_t column = columnsBackward ? w - 1 - i : i;
+        for (int j = 0; j < h; j++) {
+            size_t row = rowsBackward ? h - 1 - j : j;
+            CPos from(src.getColumnNumber() + column, src.getRow() + row);
+            CPos to(dst.getColumnNumber() + column, dst.getRow() + row);
+            std::string id = to.getId();
+            markChanged(id);
+
+            auto cell = m_Table.find(from.getId());
+            if (cell == m_Table.end()) {
+                eraseCell(id);
+
+                // Remove cell dependencies
+                m_Dependencies.erase(to);
+                continue;
+            }
 
-    } else if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue(std::get<std::string>(leftValue) + std::get<std::string>(rightValue));
+            cell->second.restoreAst(m_AstCache);
+            dependencies.clear();
+            storeCell(std::move(id), cell->second.copyCell(to, dependencies));
+            m_Dependencies.setDependencies(to, dependencies);
+        }
     }
 
-    return CValue();
+    if (m_Journal)
+        m_Journal->appendCopyRect(dst.getIdView(), src.getIdView(), w, h);
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
 }
 
-std::unique_ptr<CNode> CAddOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CAddOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
-}
+void CSpreadsheet::copyRectParallel(const CPos &dst, const CPos &src, int w, int h, size_t workers) {
+    CTraceSpan span("copyRectParallel");
+    size_t count = static_cast<size_t>(w) * h;
 
-CSubOperatorNode::CSubOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+    // Restoring evicted ASTs changes the cells, so it is done before the table is shared by the workers
+    for (int column = 0; column < w; column++) {
+        for (int row = 0; row < h; row++) {
+            auto cell = m_Table.find(CPos(src.getColumnNumber() + column, src.getRow() + row).getId());
+            if (cell != m_Table.end())
+                cell->second.restoreAst(m_AstCache);
+        }
+    }
 
-CValue CSubOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+    // Every source is read before anything is written, so overlapping areas need no traversal order
+    std::vector<std::optional<CCell>> copies(count);
+    std::vector<std::vector<std::string>> dependencies(count);
+    auto cloneSlice = [this, &dst, &src, h, &copies, &dependencies](size_t from, size_t to) {
+        for (size_t i = from; i < to; i++) {
+            size_t column = i / h;
+            size_t row = i % h;
+            auto cell = m_Table.find(CPos(src.getColumnNumber() + column, src.getRow() + row).getId());
+            if (cell != m_Table.end())
+                copies[i] = cell->second.copyCell(CPos(dst.getColumnNumber() + column, dst.getRow() + row), dependencies[i]);
+        }
+    };
+
+    workers = std::min(workers, count);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+        threads.emplace_back(cloneSlice, count * i / workers, count * (i + 1) / workers);
+    cloneSlice(0, count / workers);
+    for (auto &thread : threads)
+        thread.join();
+
+    for (size_t i = 0; i < count; i++) {
+        CPos to(dst.getColumnNumber() + i / h, dst.getRow() + i % h);
+        std::string id = to.getId();
+        markChanged(id);
+        if (!copies[i]) {
+            eraseCell(id);
+            m_Dependencies.erase(to);
+            continue;
+        }
 
-    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        double result = std::get<double>(leftValue) - std::get<double>(rightValue);
-        return CValue(result);
+        storeCell(std::move(id), std::move(*copies[i]));
+        m_Dependencies.setDependencies(to, dependencies[i]);
     }
-
-    return CValue();
 }
 
-std::unique_ptr<CNode> CSubOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CSubOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
-}
+void CSpreadsheet::moveRect(CPos dst, CPos src, int w, int h) {
+    if (w <= 0 || h <= 0)
+        return;
+
+    CTraceSpan span("moveRect");
+    CShift edit{false, false, 0, 0, true,
+                CRect{src.getColumnNumber(), src.getRow(), src.getColumnNumber() + w - 1, src.getRow() + h - 1}, dst};
+    auto lock = lockTable();
+
+    // Moved cells leave the table first, the destination may overlap the source
+    std::vector<std::map<std::string, CCell>::node_type> moved;
+    for (size_t column = edit.m_Source.m_Left; column <= edit.m_Source.m_Right; column++) {
+        for (size_t row = edit.m_Source.m_Top; row <= edit.m_Source.m_Bottom; row++) {
+            CPos pos(column, row);
+            std::string id = pos.getId();
+            markChanged(id);
+            auto node = m_Table.extract(id);
+            if (node.empty())
+                continue;
+            m_Dependencies.erase(pos);
+            moved.push_back(std::move(node));
+        }
+    }
 
-CDivOperatorNode::CDivOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+    // Cells overwritten by the block are dropped, references to them see the moved cells
+    for (size_t column = dst.getColumnNumber(); column < dst.getColumnNumber() + w; column++) {
+        for (size_t row = dst.getRow(); row < dst.getRow() + h; row++) {
+            CPos pos(column, row);
+            std::string id = pos.getId();
+            if (eraseCell(id)) {
+                m_Dependencies.erase(pos);
+                markChanged(id);
+            }
+        }
+    }
 
-CValue CDivOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+    // Only cells referencing the block are rewritten
+    std::set<std::string> dependents;
+    for (size_t column = edit.m_Source.m_Left; column <= edit.m_Source.m_Right; column++) {
+        for (size_t row = edit.m_Source.m_Top; row <= edit.m_Source.m_Bottom; row++) {
+            m_Dependencies.forEachDependent(CPos(column, row), [&dependents](const std::string &id) {
+                dependents.insert(id);
+            });
+        }
+    }
+    for (const auto &id : dependents) {
+        auto cell = m_Table.find(id);
+        if (cell == m_Table.end() || !m_Dependencies.isShifted(id, edit))
+            continue;
+        rewriteCell(cell->second, edit, cell->second.getPos());
+        markChanged(id);
+    }
 
-    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        if (std::get<double>(rightValue) == 0) return CValue();
-        double result = std::get<double>(leftValue) / std::get<double>(rightValue);
-        return CValue(result);
+    // Moved ASTs keep their references, only those pointing into the block follow it
+    for (auto &node : moved) {
+        CPos pos = node.mapped().getPos();
+        edit.apply(pos);
+        rewriteCell(node.mapped(), edit, pos);
+        node.key() = pos.getId();
+        markChanged(node.key());
+        m_Table.insert(std::move(node));
     }
 
-    return CValue();
+    if (m_Journal)
+        m_Journal->appendMoveRect(dst.getIdView(), src.getIdView(), w, h);
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
 }
 
-std::unique_ptr<CNode> CDivOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CDivOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
-}
+void CSpreadsheet::rewriteCell(CCell &cell, const CShift &edit, CPos pos) {
+    cell.restoreAst(m_AstCache);
 
-CMulOperatorNode::CMulOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
+    std::vector<std::string> dependencies;
+    cell.shift(edit, pos, dependencies);
+    m_Dependencies.setDependencies(pos, dependencies);
+}
 
-CValue CMulOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+void CSpreadsheet::storeCell(std::string id, CCell &&cell) {
+    if (cell.hasAst())
+        m_AstCache.noteResident();
 
-    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        double result = std::get<double>(leftValue) * std::get<double>(rightValue);
-        return CValue(result);
+    auto existing = m_Table.lower_bound(id);
+    if (existing != m_Table.end() && existing->first == id) {
+        m_AstCache.noteReleased(existing->second);
+        existing->second = std::move(cell);
+    } else {
+        m_Table.emplace_hint(existing, std::move(id), std::move(cell));
     }
-
-    return CValue();
 }
 
-std::unique_ptr<CNode> CMulOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CMulOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+bool CSpreadsheet::eraseCell(const std::string &id) {
+    auto cell = m_Table.find(id);
+    if (cell == m_Table.end())
+        return false;
+    m_AstCache.noteReleased(cell->second);
+    m_Table.erase(cell);
+    return true;
 }
 
-CPowOperatorNode::CPowOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CBinaryOperatorNode(std::move(left), std::move(right)) {}
-
-CValue CPowOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+size_t CSpreadsheet::subscribe(CPos topLeft, int w, int h, CChangeCallback callback) {
+    if (w <= 0 || h <= 0)
+        return 0;
 
-    if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        double result = std::pow(std::get<double>(leftValue), std::get<double>(rightValue));
-        return CValue(result);
-    }
+    // Changes are reported against the values visible right now
+    CSubscription subscription{CRect{topLeft.getColumnNumber(), topLeft.getRow(), topLeft.getColumnNumber() + w - 1, topLeft.getRow() + h - 1},
+                               std::move(callback), {}};
+    evaluateRegion(topLeft, w, h, [&subscription, &topLeft, w](size_t i, const CValue &value) {
+        if (!std::holds_alternative<std::monostate>(value))
+            subscription.m_Values.emplace(CPos(topLeft.getColumnNumber() + i % w, topLeft.getRow() + i / w).getId(), value);
+    });
 
-    return CValue();
+    auto lock = lockTable();
+    size_t id = m_NextSubscription++;
+    m_Subscriptions.emplace(id, std::move(subscription));
+    return id;
 }
 
-std::unique_ptr<CNode> CPowOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CPowOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+void CSpreadsheet::unsubscribe(size_t id) {
+    auto lock = lockTable();
+    m_Subscriptions.erase(id);
 }
 
-/***********************************************
-*        Relational Operators Section
-***********************************************/
+CSpreadsheet::CNotifications CSpreadsheet::collectChanges(const std::vector<std::string> &ids) {
+    CNotifications notifications;
+    for (auto &[id, subscription] : m_Subscriptions) {
+        std::vector<std::pair<CPos, CValue>> changes;
+        for (const auto &cellId : ids) {
+            CPos pos(cellId);
+            if (!subscription.m_Rect.contains(pos.getColumnNumber(), pos.getRow()))
+                continue;
+
+            // Values equal to the last delivered one are not reported
+            CValue value = cachedValue(cellId);
+            auto previous = subscription.m_Values.find(cellId);
+            if (previous == subscription.m_Values.end() ? std::holds_alternative<std::monostate>(value) : previous->second == value)
+                continue;
+
+            if (std::holds_alternative<std::monostate>(value))
+                subscription.m_Values.erase(previous);
+            else
+                subscription.m_Values.insert_or_assign(cellId, value);
+            changes.emplace_back(pos, std::move(value));
+        }
 
-CRelationalOperatorNode::CRelationalOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : m_Left(std::move(left))
-    , m_Right(std::move(right)) {}
+        if (!changes.empty())
+            notifications.emplace_back(subscription.m_Callback, std::move(changes));
+    }
+    return notifications;
+}
 
-CEqOperatorNode::CEqOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+void CSpreadsheet::deliverChanges(const CNotifications &notifications) {
+    for (const auto &[callback, changes] : notifications)
+        callback(changes);
+}
 
-CValue CEqOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+void CSpreadsheet::notifySubscribers() {
+    // Snapshot and background modes notify after publish or batch
+    if (m_Subscriptions.empty() || m_DeferNotifications || m_ConcurrentReads || m_AsyncRecalc)
+        return;
+
+    // Only subscribed cells are evaluated, everything else stays lazy
+    std::vector<std::string> watched;
+    for (auto &id : collectAffected()) {
+        CPos pos(id);
+        for (const auto &subscription : m_Subscriptions) {
+            if (subscription.second.m_Rect.contains(pos.getColumnNumber(), pos.getRow())) {
+                watched.push_back(std::move(id));
+                break;
+            }
+        }
+    }
 
-    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue((std::get<std::string>(leftValue) == std::get<std::string>(rightValue)) ? 1.0 : 0.0);
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        return CValue((std::get<double>(leftValue) == std::get<double>(rightValue)) ? 1.0 : 0.0);
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (const auto &id : watched) {
+            auto cell = m_Table.find(id);
+            if (cell == m_Table.end())
+                continue;
+            if (checker.containsCycle(id))
+                cell->second.setValue(CValue());
+            else
+                cell->second.evaluate(m_Table);
+        }
     }
+    m_AstCache.enforce(m_Table);
+    deliverChanges(collectChanges(watched));
+}
 
-    return CValue();
+void CSpreadsheet::setAstBudget(size_t maxAsts) {
+    auto lock = lockTable();
+    m_AstCache.setBudget(maxAsts);
+    m_AstCache.enforce(m_Table);
 }
 
-std::unique_ptr<CNode> CEqOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CEqOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+CAstStats CSpreadsheet::getAstStats() const {
+    auto lock = lockTable();
+    CAstStats stats = m_AstCache.getStats(m_Table);
+    stats.m_ParseHits = m_ParseCache.getHits();
+    stats.m_ParseMisses = m_ParseCache.getMisses();
+    return stats;
 }
 
-CNeOperatorNode::CNeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+void CSpreadsheet::setParseCacheCapacity(size_t entries) {
+    m_ParseCache.setCapacity(entries);
+}
 
-CValue CNeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+void CSpreadsheet::markChanged(const std::string &id) {
+    if (!m_ConcurrentReads.load(std::memory_order_relaxed) && !m_AsyncRecalc.load(std::memory_order_relaxed) && m_Subscriptions.empty())
+        return;
+    m_Changed.insert(id);
+    if (m_AsyncRecalc.load(std::memory_order_relaxed))
+        markDirty(id);
+    m_WorkAvailable.notify_one();
+}
 
-    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue((std::get<std::string>(leftValue) != std::get<std::string>(rightValue)) ? 1.0 : 0.0);
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        return CValue((std::get<double>(leftValue) != std::get<double>(rightValue)) ? 1.0 : 0.0);
+void CSpreadsheet::markDirty(const std::string &id) {
+    // Dependents already dirty are walked too, their own dependents may have been recalculated meanwhile
+    std::unordered_set<std::string> seen = {id};
+    std::queue<std::string> queue;
+    queue.push(id);
+    while (!queue.empty()) {
+        std::string next = std::move(queue.front());
+        queue.pop();
+        m_Dependencies.forEachDependent(CPos(next), [&seen, &queue](const std::string &dependent) {
+            if (seen.insert(dependent).second)
+                queue.push(dependent);
+        });
+        if (m_Dirty.insert(next).second)
+            m_Queue.push_back(std::move(next));
     }
-
-    return CValue();
 }
 
-std::unique_ptr<CNode> CNeOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CNeOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_lock<std::mutex> CSpreadsheet::lockTable() const {
+    if (!m_AsyncRecalc.load(std::memory_order_acquire))
+        return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(m_Mutex);
 }
 
-CLtOperatorNode::CLtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
-
-CValue CLtOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+std::vector<std::string> CSpreadsheet::collectAffected() {
+    std::vector<std::string> affected;
 
-    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue((std::get<std::string>(leftValue) < std::get<std::string>(rightValue)) ? 1.0 : 0.0);
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        return CValue((std::get<double>(leftValue) < std::get<double>(rightValue)) ? 1.0 : 0.0);
+    if (m_PublishAll) {
+        for (const auto &cell : m_Table)
+            affected.push_back(cell.first);
+    } else {
+        // Collect changed cells and everything that transitively depends on them
+        std::set<std::string> seen(m_Changed);
+        std::queue<std::string> queue;
+        for (const auto &id : m_Changed)
+            queue.push(id);
+
+        while (!queue.empty()) {
+            std::string id = queue.front();
+            queue.pop();
+            m_Dependencies.forEachDependent(CPos(id), [&seen, &queue](const std::string &next) {
+                if (seen.insert(next).second)
+                    queue.push(next);
+            });
+            affected.push_back(std::move(id));
+        }
     }
 
-    return CValue();
-}
-
-std::unique_ptr<CNode> CLtOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CLtOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+    m_Changed.clear();
+    m_PublishAll = false;
+    return affected;
 }
 
-CLeOperatorNode::CLeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
-
-CValue CLeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+void CSpreadsheet::storeSnapshot(const std::vector<std::string> &ids, bool full) {
+    std::shared_ptr<const CValueSnapshot> previous = m_Snapshot.load();
+    if (previous == nullptr)
+        return;
 
-    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue((std::get<std::string>(leftValue) <= std::get<std::string>(rightValue)) ? 1.0 : 0.0);
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        return CValue((std::get<double>(leftValue) <= std::get<double>(rightValue)) ? 1.0 : 0.0);
+    auto snapshot = std::make_shared<CValueSnapshot>(previous->m_Epoch + 1);
+    std::vector<bool> copied;
+    if (full) {
+        snapshot->reshard(ids.size(), copied);
+    } else {
+        // Shards without changes stay shared with the previous epoch
+        snapshot->m_Shards = previous->m_Shards;
+        snapshot->m_Size = previous->m_Size;
+        copied.assign(snapshot->m_Shards.size(), false);
     }
 
-    return CValue();
-}
+    for (const auto &id : ids)
+        snapshot->assign(id, cachedValue(id), copied);
 
-std::unique_ptr<CNode> CLeOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CLeOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+    // Growing sheet gets more shards, so that a publish keeps copying only a small part of it
+    if (snapshot->m_Size > 2 * CValueSnapshot::SHARD_CELLS * snapshot->m_Shards.size())
+        snapshot->reshard(snapshot->m_Size, copied);
+    m_Snapshot.store(std::move(snapshot), std::memory_order_release);
 }
 
-CGtOperatorNode::CGtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
-
-CValue CGtOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+void CSpreadsheet::setConcurrentReads(bool enabled) {
+    if (enabled == m_ConcurrentReads.load())
+        return;
+
+    auto lock = lockTable();
+    if (!enabled) {
+        m_ConcurrentReads = false;
+        m_PublishSnapshots = false;
+        m_Snapshot.store(nullptr);
+        if (!m_AsyncRecalc)
+            m_Changed.clear();
+        return;
+    }
 
-    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue((std::get<std::string>(leftValue) > std::get<std::string>(rightValue)) ? 1.0 : 0.0);
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        return CValue((std::get<double>(leftValue) > std::get<double>(rightValue)) ? 1.0 : 0.0);
+    // Readers must see a complete snapshot before they are allowed in
+    m_PublishAll = true;
+    m_Snapshot.store(std::make_shared<const CValueSnapshot>());
+    m_PublishSnapshots = true;
+    if (m_AsyncRecalc) {
+        m_WorkAvailable.notify_one();
+        m_CellClean.wait(lock, [this] { return m_Snapshot.load()->getEpoch() > 0; });
+        m_ConcurrentReads.store(true, std::memory_order_release);
+        return;
     }
 
-    return CValue();
+    publish();
+    m_ConcurrentReads.store(true, std::memory_order_release);
 }
 
-std::unique_ptr<CNode> CGtOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CGtOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+void CSpreadsheet::publish() {
+    // Background worker publishes on its own after every batch
+    if (m_AsyncRecalc || m_Snapshot.load() == nullptr)
+        return;
+
+    CTraceSpan span("publish");
+    bool full = m_PublishAll;
+    std::vector<std::string> affected = collectAffected();
+
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (const auto &id : affected) {
+            auto cell = m_Table.find(id);
+            if (cell == m_Table.end())
+                continue;
+            if (checker.containsCycle(id))
+                cell->second.setValue(CValue());
+            else
+                cell->second.evaluate(m_Table);
+        }
+    }
+    m_AstCache.enforce(m_Table);
+
+    storeSnapshot(affected, full);
+    deliverChanges(collectChanges(affected));
 }
 
-CGeOperatorNode::CGeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
-    : CRelationalOperatorNode(std::move(left), std::move(right)) {}
+std::shared_ptr<const CValueSnapshot> CSpreadsheet::evaluateAll() {
+    CTraceSpan span("evaluateAll");
+    auto lock = lockTable();
+    auto snapshot = std::make_shared<CValueSnapshot>();
+    std::vector<bool> copied;
+    snapshot->reshard(m_Table.size(), copied);
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (auto &[id, cell] : m_Table) {
+            if (!checker.containsCycle(id))
+                snapshot->assign(id, cell.evaluate(m_Table), copied);
+        }
+    }
+    m_AstCache.enforce(m_Table);
+    return snapshot;
+}
 
-CValue CGeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
-    auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+std::shared_ptr<const CValueSnapshot> CSpreadsheet::getSnapshot() const {
+    return m_Snapshot.load();
+}
 
-    if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<std::string>(rightValue)) {
-        return CValue((std::get<std::string>(leftValue) >= std::get<std::string>(rightValue)) ? 1.0 : 0.0);
-    } else if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
-        return CValue((std::get<double>(leftValue) >= std::get<double>(rightValue)) ? 1.0 : 0.0);
+void CSpreadsheet::setAsyncRecalc(bool enabled) {
+    if (enabled == m_AsyncRecalc.load())
+        return;
+
+    if (enabled) {
+        // Cached values of all cells are refreshed by the first batch
+        m_StopWorker = false;
+        m_PublishAll = true;
+        m_AsyncRecalc = true;
+        m_Worker = std::thread(&CSpreadsheet::recalcWorker, this);
+        return;
     }
 
-    return CValue();
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_StopWorker = true;
+    }
+    m_WorkAvailable.notify_all();
+    m_Worker.join();
+    m_AsyncRecalc = false;
 }
 
-std::unique_ptr<CNode> CGeOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CGeOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::future<CValue> CSpreadsheet::getValueAsync(CPos pos) {
+    std::promise<CValue> promise;
+    std::future<CValue> future = promise.get_future();
+
+    if (!m_AsyncRecalc.load(std::memory_order_acquire)) {
+        promise.set_value(getValue(pos));
+        return future;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (isClean(pos.getId()))
+        promise.set_value(cachedValue(pos.getId()));
+    else
+        m_Waiters.emplace(pos.getId(), std::move(promise));
+    return future;
 }
 
-/***********************************************
-*        References Section
-***********************************************/
+bool CSpreadsheet::isClean(const std::string &id) const {
+    return !m_PublishAll && !m_Dirty.count(id);
+}
 
-CReferenceNode::CReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
-    : m_CellId(cellId)
-    , m_RefId(refId)
-    , m_Reference(ref) {}
+CValue CSpreadsheet::cachedValue(const std::string &id) const {
+    auto cell = m_Table.find(id);
+    if (cell != m_Table.end())
+        return cell->second.getValue();
+    return CValue();
+}
 
-CValue CReferenceNode::getValue(std::map<std::string, CCell> &table) {
-    auto cell = table.find(m_Reference);
-    if (cell != table.end()) {
-        return cell->second.evaluate(table);
+void CSpreadsheet::resolveWaiters() {
+    for (auto waiter = m_Waiters.begin(); waiter != m_Waiters.end();) {
+        if (!isClean(waiter->first)) {
+            ++waiter;
+            continue;
+        }
+        waiter->second.set_value(cachedValue(waiter->first));
+        waiter = m_Waiters.erase(waiter);
     }
-    return CValue();
 }
 
-CRelativeReferenceNode::CRelativeReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
-    : CReferenceNode(cellId, refId, ref) {}
+void CSpreadsheet::recalcWorker() {
+    // Bounds time for which writers and readers wait for the worker
+    static const size_t RECALC_SLICE = 256;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    std::vector<std::string> recalculated;
+    bool full = false;
+
+    // Cycle analysis and evaluation pass are shared by all cells recalculated until the next write
+    std::optional<CDependencyChecker> checker;
+    size_t passId = 0;
+
+    while (true) {
+        bool pending = !m_Changed.empty() || m_PublishAll;
+        if (m_Queue.empty() && !pending) {
+            // Batch finished, hand the values over to snapshot readers
+            if (m_PublishSnapshots && (full || !recalculated.empty())) {
+                storeSnapshot(recalculated, full);
+                m_CellClean.notify_all();
+            }
 
-CValue CRelativeReferenceNode::evaluate(std::map<std::string, CCell> &table) {
-    return this->getValue(table);
-}
+            // Subscribers may read the sheet from their callbacks
+            CNotifications notifications = collectChanges(recalculated);
+            recalculated.clear();
+            full = false;
+            if (!notifications.empty()) {
+                lock.unlock();
+                deliverChanges(notifications);
+                lock.lock();
+                continue;
+            }
 
-std::unique_ptr<CNode> CRelativeReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    size_t rowOffset = dst.getRow() - m_CellId.getRow();
-    size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
+            if (m_StopWorker)
+                break;
+            m_WorkAvailable.wait(lock, [this] { return m_StopWorker || !m_Changed.empty() || m_PublishAll; });
+            continue;
+        }
 
-    std::string newReference = m_Reference;
-    size_t refRow = m_RefId.getRow();
-    size_t refCol = m_RefId.getColumnNumber();
+        // Writes already marked their dependents dirty, only a full refresh is expanded here
+        if (pending) {
+            if (m_PublishAll) {
+                full = true;
+                for (const auto &cell : m_Table) {
+                    if (m_Dirty.insert(cell.first).second)
+                        m_Queue.push_back(cell.first);
+                }
+            }
+            m_Changed.clear();
+            m_PublishAll = false;
+            checker.reset();
+            passId = 0;
+            resolveWaiters();
+            m_CellClean.notify_all();
+            continue;
+        }
 
-    // Adjust row and column based on offsets
-    refRow += rowOffset;
-    refCol += colOffset;
-    newReference = CPos::numberToColumn(refCol) + std::to_string(refRow);
+        if (!checker)
+            checker.emplace(m_Dependencies, m_Sheets, m_SheetName);
+        {
+            std::optional<CEvaluationPass> pass;
+            if (passId)
+                pass.emplace(passId, &m_AstCache, m_Sheets);
+            else
+                passId = pass.emplace(&m_AstCache, m_Sheets).getId();
+
+            for (size_t i = 0; i < RECALC_SLICE && !m_Queue.empty(); i++) {
+                std::string id = std::move(m_Queue.front());
+                m_Queue.pop_front();
+                auto cell = m_Table.find(id);
+                if (cell != m_Table.end()) {
+                    if (checker->containsCycle(id))
+                        cell->second.setValue(CValue());
+                    else
+                        cell->second.evaluate(m_Table);
+                }
+                m_Dirty.erase(id);
+                recalculated.push_back(std::move(id));
+            }
+        }
+        m_AstCache.enforce(m_Table);
+        resolveWaiters();
+        m_CellClean.notify_all();
+
+        // Let writers and readers in between slices
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
+std::shared_ptr<CNode> CAstCache::load(const CPos &pos, const std::string &expression) {
+    CTraceSpan span("reparse");
+    if (span.isActive())
+        span.setArgument(pos.getId());
 
-    size_t start_pos = 0;
-    std::string from = m_Reference;
-    std::string to =  newReference;
-    while ((start_pos = expr.find(from, start_pos)) != std::string::npos) {
-        expr.replace(start_pos, from.length(), to);
-        start_pos += to.length();
+    CBuilder builder(pos);
+    try {
+        builder.parse(expression);
+    } catch(std::invalid_argument &e) {
+        return nullptr;
     }
 
-    return std::make_unique<CRelativeReferenceNode>(dst, CPos(newReference), newReference);
+    m_Reparses++;
+    return builder.buildAST();
 }
 
-CAbsoluteReferenceNode::CAbsoluteReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
-    : CReferenceNode(cellId, refId, ref) {}
-
-CValue CAbsoluteReferenceNode::evaluate(std::map<std::string, CCell> &table) {
-    return this->getValue(table);
+void CAstCache::setBudget(size_t budget) {
+    m_Budget = budget;
 }
 
-std::unique_ptr<CNode> CAbsoluteReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CAbsoluteReferenceNode>(dst, m_RefId, m_Reference);
+void CAstCache::noteResident() {
+    m_Resident++;
 }
 
-CAbsRelReferenceNode::CAbsRelReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
-    : CReferenceNode(cellId, refId, ref) {}
+void CAstCache::noteReleased(const CCell &cell) {
+    // Cell restored by a pass of another workbook sheet was never counted here
+    if (cell.hasAst() && m_Resident > 0)
+        m_Resident--;
+}
 
-CValue CAbsRelReferenceNode::evaluate(std::map<std::string, CCell> &table) {
-    return this->getValue(table);
+void CAstCache::noteCleared() {
+    m_Resident = 0;
 }
 
-std::unique_ptr<CNode> CAbsRelReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    size_t rowOffset = dst.getRow() - m_CellId.getRow();
-    size_t refRow = m_RefId.getRow();
+void CAstCache::enforce(std::map<std::string, CCell> &table) {
+    if (m_Budget == 0 || m_Resident <= m_Budget)
+        return;
 
-    // Construct the adjusted reference
-    std::string newReference = m_RefId.getColumn() + std::to_string(refRow + rowOffset);
+    // Passes of other workbook sheets may restore ASTs in this table, recount before sweeping
+    m_Resident = 0;
+    for (const auto &cell : table) {
+        if (cell.second.hasAst())
+            m_Resident++;
+    }
 
-    size_t start_pos = 0;
-    std::string from = "$" + m_RefId.getColumn() + std::to_string(m_RefId.getRow());
-    std::string to =  "$" + m_RefId.getColumn() + std::to_string(refRow + rowOffset);
-    while ((start_pos = expr.find(from, start_pos)) != std::string::npos) {
-        expr.replace(start_pos, from.length(), to);
-        start_pos += to.length();
+    // Sweep down below the budget, so the next sweep comes only after more new ASTs
+    size_t target = m_Budget - m_Budget / 8;
+    auto cell = table.lower_bound(m_Hand);
+    for (size_t visited = 0; m_Resident > target && visited < 2 * table.size(); visited++) {
+        if (cell == table.end())
+            cell = table.begin();
+
+        // Recently evaluated cells get a second chance
+        if (cell->second.hasAst() && !cell->second.takeReferenced() && cell->second.evictAst()) {
+            m_Resident--;
+            m_Evictions++;
+        }
+        ++cell;
     }
 
-    return std::make_unique<CAbsRelReferenceNode>(dst, CPos(newReference), newReference);
+    m_Hand = cell == table.end() ? "" : cell->first;
 }
 
-CRelAbsReferenceNode::CRelAbsReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
-    : CReferenceNode(cellId, refId, ref) {}
-
-CValue CRelAbsReferenceNode::evaluate(std::map<std::string, CCell> &table) {
-    return this->getValue(table);
+CAstStats CAstCache::getStats(const std::map<std::string, CCell> &table) const {
+    CAstStats stats{0, m_Evictions, m_Reparses, 0, 0};
+    for (const auto &cell : table) {
+        if (cell.second.hasAst())
+            stats.m_Resident++;
+    }
+    return stats;
 }
 
-std::unique_ptr<CNode> CRelAbsReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
-    size_t refRow = m_RefId.getRow();
-    size_t refCol = m_RefId.getColumnNumber();
-    refCol += colOffset;
-
-    // Construct the adjusted reference
-    std::string newReference = CPos::numberToColumn(refCol) + std::to_string(refRow);
+CParseCache::CParseCache(size_t capacity)
+    : m_Capacity(capacity) {}
+
+CParsedFormula CParseCache::parse(const CPos &pos, const std::string &expression) {
+    std::string key = m_Capacity ? relativeForm(pos, expression) : std::string();
+    CParsedFormula formula;
+    if (!key.empty()) {
+        std::shared_ptr<CNode> cached;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            auto entry = m_Index.find(key);
+            if (entry != m_Index.end()) {
+                m_Entries.splice(m_Entries.begin(), m_Entries, entry->second);
+                cached = entry->second->m_Template;
+                m_Hits++;
+            }
+        }
 
-    size_t start_pos = 0;
-    std::string from = m_RefId.getColumn() + "$" + std::to_string(m_RefId.getRow());
-    std::string to = CPos::numberToColumn(refCol) + "$" + std::to_string(m_RefId.getRow());
-    while ((start_pos = expr.find(from, start_pos)) != std::string::npos) {
-        expr.replace(start_pos, from.length(), to);
-        start_pos += to.length();
+        // Template is never modified, so it can be cloned outside of the lock, its nodes know the cell they were parsed for
+        if (cached) {
+            CTraceSpan span("parseCacheHit");
+            formula.m_Root = cached->clone(pos, formula.m_Dependencies);
+            return formula;
+        }
     }
 
-    return std::make_unique<CRelAbsReferenceNode>(dst, CPos(newReference), newReference);
+    CBuilder builder(pos);
+    builder.parse(expression);
+    formula.m_Root = builder.buildAST();
+    formula.m_Dependencies = builder.getDependencies();
+    if (key.empty() || formula.m_Root == nullptr)
+        return formula;
+
+    // Cells own their ASTs, the cache keeps a private copy
+    std::vector<std::string> dependencies;
+    std::shared_ptr<CNode> cached = formula.m_Root->clone(pos, dependencies);
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Misses++;
+    if (m_Index.count(key) || m_Capacity == 0)
+        return formula;
+    m_Entries.push_front(CEntry{key, std::move(cached)});
+    m_Index.emplace(std::move(key), m_Entries.begin());
+    while (m_Entries.size() > m_Capacity) {
+        m_Index.erase(m_Entries.back().m_Key);
+        m_Entries.pop_back();
+    }
+    return formula;
 }
-/******************************************************
- * Filename: builder.cpp
- * Author: David Kopelent
- * Date: 24.04.2024
- * Description: This code implements methods for building AST of parsed expression
- * 
- ******************************************************/
-
-
-CBuilder::CBuilder(CPos pos)
-    : m_Pos(pos) {}
 
-void CBuilder::opAdd() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CAddOperatorNode>(std::move(right), std::move(left)));
+void CParseCache::setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Capacity = capacity;
+    while (m_Entries.size() > m_Capacity) {
+        m_Index.erase(m_Entries.back().m_Key);
+        m_Entries.pop_back();
+    }
 }
 
-void CBuilder::opSub() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CSubOperatorNode>(std::move(right), std::move(left)));
+size_t CParseCache::getHits() const {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Hits;
 }
 
-void CBuilder::opMul() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CMulOperatorNode>(std::move(right), std::move(left)));
+size_t CParseCache::getMisses() const {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Misses;
 }
 
-void CBuilder::opDiv() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CDivOperatorNode>(std::move(right), std::move(left)));
+std::string CParseCache::relativeForm(const CPos &pos, std::string_view expression) {
+    // Sheet names could look like references, qualified formulas are always parsed
+    if (expression.find('!') != std::string_view::npos)
+        return "";
+
+    std::string key;
+    key.reserve(expression.size() + 16);
+    size_t i = 0;
+    while (i < expression.size()) {
+        char c = expression[i];
+        if (c == '"') {
+            // String literal is copied as is, doubled quote stays inside it
+            size_t end = i + 1;
+            while (end < expression.size() && (expression[end] != '"' || (end + 1 < expression.size() && expression[end + 1] == '"')))
+                end += expression[end] == '"' ? 2 : 1;
+            end = std::min(end + 1, expression.size());
+            key.append(expression.substr(i, end - i));
+            i = end;
+            continue;
+        }
+
+        // Exponent of a number (e.g. 1e5) is not a reference
+        bool number = i > 0 && (std::isalnum(static_cast<unsigned char>(expression[i - 1])) || expression[i - 1] == '.');
+        if ((!std::isalpha(static_cast<unsigned char>(c)) && c != '$') || number) {
+            key.push_back(c);
+            i++;
+            continue;
+        }
+
+        // Reference is [$]letters[$]digits not followed by a letter, digit or '(' (function call)
+        size_t end = i;
+        bool absoluteColumn = expression[end] == '$';
+        end += absoluteColumn;
+        size_t letters = end;
+        while (end < expression.size() && std::isalpha(static_cast<unsigned char>(expression[end])))
+            end++;
+        bool hasLetters = end > letters;
+        bool absoluteRow = end < expression.size() && expression[end] == '$';
+        end += absoluteRow;
+        size_t digits = end;
+        while (end < expression.size() && std::isdigit(static_cast<unsigned char>(expression[end])))
+            end++;
+        bool word = end < expression.size() && (std::isalnum(static_cast<unsigned char>(expression[end])) || expression[end] == '_' || expression[end] == '(');
+
+        if (!hasLetters || end == digits || word) {
+            // Function name or other word, copied up to its end so its digits are not read as a reference
+            size_t wordEnd = std::max(end, i + 1);
+            while (wordEnd < expression.size() && (std::isalnum(static_cast<unsigned char>(expression[wordEnd])) || expression[wordEnd] == '_'))
+                wordEnd++;
+            key.append(expression.substr(i, wordEnd - i));
+            i = wordEnd;
+            continue;
+        }
+
+        std::string id(expression.substr(i, end - i));
+        id.erase(std::remove(id.begin(), id.end(), '$'), id.end());
+        size_t column, row;
+        if (!CPos::parse(id, column, row))
+            return "";
+
+        key.push_back('{');
+        key.append(absoluteColumn ? "C" + std::to_string(column) : "c" + std::to_string(static_cast<long long>(column - pos.getColumnNumber())));
+        key.append(absoluteRow ? "R" + std::to_string(row) : "r" + std::to_string(static_cast<long long>(row - pos.getRow())));
+        key.push_back('}');
+        i = end;
+    }
+    return key;
 }
 
-void CBuilder::opPow() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CPowOperatorNode>(std::move(right), std::move(left)));
+void CIntervalTree::insert(size_t low, size_t high, const std::string &owner) {
+    m_Pending.push_back({low, high, owner, false});
 }
 
-void CBuilder::opNeg() {
-    if (m_Nodes.empty()) return;
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CMulOperatorNode>(std::make_unique<CNumberNode>(-1.0), std::move(right)));
+void CIntervalTree::erase(size_t low, size_t high, const std::string &owner) {
+    for (auto interval = m_Pending.begin(); interval != m_Pending.end(); ++interval) {
+        if (interval->m_Low == low && interval->m_High == high && interval->m_Owner == owner) {
+            m_Pending.erase(interval);
+            return;
+        }
+    }
+
+    // Merged intervals are only marked, the tree is compacted once too many of them are gone
+    auto interval = std::lower_bound(m_Sorted.begin(), m_Sorted.end(), low, [](const CInterval &interval, size_t low) {
+        return interval.m_Low < low;
+    });
+    for (; interval != m_Sorted.end() && interval->m_Low == low; ++interval) {
+        if (!interval->m_Erased && interval->m_High == high && interval->m_Owner == owner) {
+            interval->m_Erased = true;
+            m_Erased++;
+            break;
+        }
+    }
+
+    if (m_Erased * 2 > m_Sorted.size())
+        rebuild();
 }
 
-void CBuilder::opEq() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CEqOperatorNode>(std::move(right), std::move(left)));
+bool CIntervalTree::empty() const {
+    return m_Pending.empty() && m_Erased == m_Sorted.size();
 }
 
-void CBuilder::opNe() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CNeOperatorNode>(std::move(right), std::move(left)));
+void CIntervalTree::stab(size_t point, const std::function<void(const std::string&)> &visitor) const {
+    if (m_Pending.size() > 16 + m_Sorted.size() / 4)
+        rebuild();
+
+    stabTree(0, m_Sorted.size(), point, visitor);
+    for (const auto &interval : m_Pending) {
+        if (interval.m_Low <= point && point <= interval.m_High)
+            visitor(interval.m_Owner);
+    }
 }
 
-void CBuilder::opLt() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CLtOperatorNode>(std::move(right), std::move(left)));
+void CIntervalTree::rebuild() const {
+    std::vector<CInterval> intervals;
+    intervals.reserve(m_Sorted.size() - m_Erased + m_Pending.size());
+    for (auto &interval : m_Sorted) {
+        if (!interval.m_Erased)
+            intervals.push_back(std::move(interval));
+    }
+    std::move(m_Pending.begin(), m_Pending.end(), std::back_inserter(intervals));
+    std::sort(intervals.begin(), intervals.end(), [](const CInterval &a, const CInterval &b) {
+        return a.m_Low < b.m_Low;
+    });
+
+    m_Sorted = std::move(intervals);
+    m_Pending.clear();
+    m_Erased = 0;
+    m_MaxHigh.assign(m_Sorted.size(), 0);
+    buildMaxHigh(0, m_Sorted.size());
 }
 
-void CBuilder::opLe() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CLeOperatorNode>(std::move(right), std::move(left)));
+size_t CIntervalTree::buildMaxHigh(size_t from, size_t to) const {
+    if (from >= to)
+        return 0;
+
+    // Middle of the slice is the root of its subtree
+    size_t middle = from + (to - from) / 2;
+    m_MaxHigh[middle] = std::max({m_Sorted[middle].m_High, buildMaxHigh(from, middle), buildMaxHigh(middle + 1, to)});
+    return m_MaxHigh[middle];
 }
 
-void CBuilder::opGt() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CGtOperatorNode>(std::move(right), std::move(left)));
+void CIntervalTree::stabTree(size_t from, size_t to, size_t point, const std::function<void(const std::string&)> &visitor) const {
+    if (from >= to)
+        return;
+
+    size_t middle = from + (to - from) / 2;
+    if (m_MaxHigh[middle] < point)
+        return;
+
+    stabTree(from, middle, point, visitor);
+    const CInterval &interval = m_Sorted[middle];
+    if (interval.m_Low > point)
+        return;
+
+    if (!interval.m_Erased && point <= interval.m_High)
+        visitor(interval.m_Owner);
+    stabTree(middle + 1, to, point, visitor);
 }
 
-void CBuilder::opGe() {
-    if (m_Nodes.empty() || m_Nodes.size() < 2) return;
-    auto left = getTopNode();
-    auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CGeOperatorNode>(std::move(right), std::move(left)));
+void CRangeIndex::insert(const CRect &rect, const std::string &owner) {
+    for (size_t column = rect.m_Left; column <= rect.m_Right; column++)
+        m_Columns[column].insert(rect.m_Top, rect.m_Bottom, owner);
 }
 
-void CBuilder::valNumber(double num) {
-    m_Nodes.push(std::make_unique<CNumberNode>(num));
+void CRangeIndex::erase(const CRect &rect, const std::string &owner) {
+    for (size_t column = rect.m_Left; column <= rect.m_Right; column++) {
+        auto tree = m_Columns.find(column);
+        if (tree == m_Columns.end())
+            continue;
+        tree->second.erase(rect.m_Top, rect.m_Bottom, owner);
+        if (tree->second.empty())
+            m_Columns.erase(tree);
+    }
 }
 
-void CBuilder::valString(std::string str) {
-    m_Nodes.push(std::make_unique<CStringNode>(str));
+void CRangeIndex::clear() {
+    m_Columns.clear();
 }
 
-void CBuilder::valReference(std::string str) {
-    bool absoluteColumn = (str[0] == '$'); // Check if the first character is '$'
-    bool absoluteRow = false; // Check if the last character is '$'
+void CRangeIndex::stab(size_t column, size_t row, const std::function<void(const std::string&)> &visitor) const {
+    auto tree = m_Columns.find(column);
+    if (tree != m_Columns.end())
+        tree->second.stab(row, visitor);
+}
 
-    // Check if any character between the first and last is '$'
-    for (size_t i = 1; i < str.length() - 1; ++i) {
-        if (str[i] == '$') {
-            absoluteRow = true;
-            break;
+void CDependencyGraph::setDependencies(const CPos &pos, const std::vector<std::string> &references) {
+    erase(pos);
+    if (references.empty())
+        return;
+
+    std::string id = pos.getId();
+    std::vector<std::string> cells;
+    std::vector<CRect> ranges;
+    for (const auto &reference : references) {
+        if (reference.find(':') != std::string::npos && reference.find('!') == std::string::npos) {
+            CRect rect = CRect::parse(reference);
+            m_RangeIndex.insert(rect, id);
+            ranges.push_back(rect);
+        } else {
+            m_Dependents[reference].insert(id);
+            cells.push_back(reference);
         }
     }
 
-    bool relative = !absoluteColumn && !absoluteRow;
-    if (!relative)
-        str.erase(std::remove_if(str.begin(), str.end(), [](char c) { return c == '$'; }), str.end());
+    if (!cells.empty())
+        m_References.emplace(id, std::move(cells));
+    if (!ranges.empty())
+        m_Ranges.emplace(id, std::move(ranges));
+    m_Formulas[pos.getColumnNumber()].insert(pos.getRow());
+}
 
-    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) {
-        return std::toupper(c);
-    });
+bool CDependencyGraph::isShifted(const std::string &id, const CShift &edit) const {
+    auto references = m_References.find(id);
+    if (references != m_References.end()) {
+        for (const auto &reference : references->second) {
+            if (reference.find('!') == std::string::npos && edit.affects(CPos(reference)))
+                return true;
+        }
+    }
 
-    if (relative) {
-        // Relative
-        m_Nodes.push(std::make_unique<CRelativeReferenceNode>(m_Pos, CPos(str), str));
-    } else if (absoluteColumn && absoluteRow) {
-        // Absolute
-        m_Nodes.push(std::make_unique<CAbsoluteReferenceNode>(m_Pos, CPos(str), str));
-    } else if (absoluteColumn) {
-        // Absolute column Relative row
-        m_Nodes.push(std::make_unique<CAbsRelReferenceNode>(m_Pos, CPos(str), str));
-    } else {
-        // Relative column Absolute row
-        m_Nodes.push(std::make_unique<CRelAbsReferenceNode>(m_Pos, CPos(str), str));
+    auto ranges = m_Ranges.find(id);
+    if (ranges != m_Ranges.end()) {
+        for (const auto &rect : ranges->second) {
+            if (edit.affects(rect))
+                return true;
+        }
     }
 
-    m_Dependencies.push_back(str);
+    uint32_t node = findNode(id);
+    if (!isFrozen(node))
+        return false;
+    for (uint32_t i = m_ReferenceOffsets[node]; i < m_ReferenceOffsets[node + 1]; i++) {
+        const std::string &reference = m_Names[m_FrozenReferences[i]];
+        if (reference.find('!') == std::string::npos && edit.affects(CPos(reference)))
+            return true;
+    }
+    for (uint32_t i = m_RangeOffsets[node]; i < m_RangeOffsets[node + 1]; i++) {
+        if (edit.affects(m_FrozenRanges[i]))
+            return true;
+    }
+    return false;
 }
 
-void CBuilder::valRange(std::string str) {
-    // todo
-}
+void CDependencyGraph::erase(const CPos &pos) {
+    auto column = m_Formulas.find(pos.getColumnNumber());
+    if (column == m_Formulas.end() || !column->second.erase(pos.getRow())) {
+        // Cell is not in the overlay, but it may still have frozen references
+        if (!m_Names.empty())
+            drop(pos.getId());
+        return;
+    }
+    if (column->second.empty())
+        m_Formulas.erase(column);
+
+    std::string id = pos.getId();
+    auto references = m_References.find(id);
+    if (references != m_References.end()) {
+        for (const auto &reference : references->second) {
+            auto dependents = m_Dependents.find(reference);
+            if (dependents == m_Dependents.end())
+                continue;
+            dependents->second.erase(id);
+            if (dependents->second.empty())
+                m_Dependents.erase(dependents);
+        }
+        m_References.erase(references);
+    }
 
-void CBuilder::funcCall(std::string fnName, int paramCnt) {
-    // todo
+    auto ranges = m_Ranges.find(id);
+    if (ranges != m_Ranges.end()) {
+        for (const auto &rect : ranges->second)
+            m_RangeIndex.erase(rect, id);
+        m_Ranges.erase(ranges);
+    }
 }
 
-std::unique_ptr<CNode> CBuilder::getTopNode() {
-    auto node = std::move(m_Nodes.top());
-    m_Nodes.pop();
-    return node;
+void CDependencyGraph::clear() {
+    m_Names.clear();
+    m_Nodes.clear();
+    m_ReferenceOffsets.clear();
+    m_FrozenReferences.clear();
+    m_RangeOffsets.clear();
+    m_FrozenRanges.clear();
+    m_DependentOffsets.clear();
+    m_FrozenDependents.clear();
+    m_FrozenFormulas.clear();
+    m_Dropped.clear();
+    m_References.clear();
+    m_Ranges.clear();
+    m_Dependents.clear();
+    m_RangeIndex.clear();
+    m_Formulas.clear();
 }
 
-std::vector<std::string> CBuilder::getDependencies() const {
-    return m_Dependencies;
-}
+bool CDependencyGraph::forEachPrecedent(const std::string &id, const std::function<bool(const std::string&)> &visitor) const {
+    auto references = m_References.find(id);
+    if (references != m_References.end()) {
+        for (const auto &reference : references->second) {
+            if (!visitor(reference))
+                return false;
+        }
+    }
 
-std::unique_ptr<CNode> CBuilder::buildAST() {
-    if (m_Nodes.empty() || m_Nodes.size() != 1) return nullptr;
-    return getTopNode();
-}
-/******************************************************
- * Filename: spreadsheet.cpp
- * Author: David Kopelent
- * Date: 24.04.2024
- * Description: This file implements methods for representing and manipulating spreadsheets.
- *              It contains the definitions of the member functions of the CSpreadsheet and CDependencyChecker class.
- ******************************************************/
+    // Cell has references either in the overlay or in the frozen arrays
+    auto ranges = m_Ranges.find(id);
+    const CRect *first = nullptr;
+    const CRect *last = nullptr;
+    if (ranges != m_Ranges.end()) {
+        first = ranges->second.data();
+        last = first + ranges->second.size();
+    } else if (references == m_References.end()) {
+        uint32_t node = findNode(id);
+        if (!isFrozen(node))
+            return true;
+        for (uint32_t i = m_ReferenceOffsets[node]; i < m_ReferenceOffsets[node + 1]; i++) {
+            if (!visitor(m_Names[m_FrozenReferences[i]]))
+                return false;
+        }
+        first = m_FrozenRanges.data() + m_RangeOffsets[node];
+        last = m_FrozenRanges.data() + m_RangeOffsets[node + 1];
+    }
 
+    // Only cells with references inside the range are visited, not the whole area
+    for (const CRect *rect = first; rect != last; ++rect) {
+        if (!forEachFormula(*rect, visitor))
+            return false;
+    }
+    return true;
+}
 
-CSpreadsheet::CSpreadsheet(const CSpreadsheet &sheet) 
-    : m_Table(sheet.m_Table)
-    , m_Dependencies(sheet.m_Dependencies) {}
+bool CDependencyGraph::forEachFormula(const CRect &rect, const std::function<bool(const std::string&)> &visitor) const {
+    for (auto column = m_Formulas.lower_bound(rect.m_Left); column != m_Formulas.end() && column->first <= rect.m_Right; ++column) {
+        for (auto row = column->second.lower_bound(rect.m_Top); row != column->second.end() && *row <= rect.m_Bottom; ++row) {
+            if (!visitor(CPos(column->first, *row).getId()))
+                return false;
+        }
+    }
 
-CSpreadsheet& CSpreadsheet::operator=(const CSpreadsheet &sheet) {
-    if (&sheet == this) return *this;
-    m_Table = sheet.m_Table;
-    m_Dependencies = sheet.m_Dependencies;
-    return *this;
+    auto before = [](const CFrozenFormula &formula, const std::pair<size_t, size_t> &pos) {
+        return std::make_pair(formula.m_Column, formula.m_Row) < pos;
+    };
+    auto formula = std::lower_bound(m_FrozenFormulas.begin(), m_FrozenFormulas.end(), std::make_pair(rect.m_Left, rect.m_Top), before);
+    while (formula != m_FrozenFormulas.end() && formula->m_Column <= rect.m_Right) {
+        // Jump over rows of the column outside of the range
+        if (formula->m_Row < rect.m_Top || formula->m_Row > rect.m_Bottom) {
+            size_t column = formula->m_Column + (formula->m_Row > rect.m_Bottom);
+            formula = std::lower_bound(formula, m_FrozenFormulas.end(), std::make_pair(column, rect.m_Top), before);
+            continue;
+        }
+        if (!m_Dropped[formula->m_Node] && !visitor(m_Names[formula->m_Node]))
+            return false;
+        ++formula;
+    }
+    return true;
 }
 
-// Load spreadsheet data from an input stream
-bool CSpreadsheet::load(std::istream &is) {
-    if (is.fail()) {
-        return false;
+std::set<std::string> CDependencyGraph::getReferencedSheets() const {
+    std::set<std::string> sheets;
+    auto add = [&sheets](const std::string &reference) {
+        size_t separator = reference.find('!');
+        if (separator != std::string::npos)
+            sheets.insert(reference.substr(0, separator));
+    };
+    for (const auto &[id, references] : m_References) {
+        for (const auto &reference : references)
+            add(reference);
     }
+    for (size_t node = 0; node < m_Names.size(); node++) {
+        if (m_DependentOffsets[node] != m_DependentOffsets[node + 1])
+            add(m_Names[node]);
+    }
+    return sheets;
+}
 
-    // Store input stream inside string
-    std::stringstream buffer;
-    buffer << is.rdbuf();
-    std::string content = buffer.str();
+void CDependencyGraph::forEachDependent(const CPos &pos, const std::function<void(const std::string&)> &visitor) const {
+    std::string id = pos.getId();
+    auto dependents = m_Dependents.find(id);
+    if (dependents != m_Dependents.end()) {
+        for (const auto &dependent : dependents->second)
+            visitor(dependent);
+    }
 
-    size_t headStart = content.find("<HEAD>");
-    size_t headEnd = content.find("</HEAD>");
+    // Frozen dependents whose references changed since are in the overlay already
+    uint32_t node = findNode(id);
+    if (node != NO_NODE) {
+        for (uint32_t i = m_DependentOffsets[node]; i < m_DependentOffsets[node + 1]; i++) {
+            if (!m_Dropped[m_FrozenDependents[i]])
+                visitor(m_Names[m_FrozenDependents[i]]);
+        }
+    }
+    m_RangeIndex.stab(pos.getColumnNumber(), pos.getRow(), visitor);
+}
 
-    if (headStart == std::string::npos || headEnd == std::string::npos)
-        return false;
+void CDependencyGraph::compact() {
+    std::vector<std::string> names;
+    std::unordered_map<std::string, uint32_t> nodes;
+    auto intern = [&names, &nodes](const std::string &id) {
+        auto [node, inserted] = nodes.emplace(id, names.size());
+        if (inserted)
+            names.push_back(id);
+        return node->second;
+    };
+
+    // Edges are collected as pairs first and then bucketed by their source node
+    std::vector<std::pair<uint32_t, uint32_t>> references;
+    std::vector<std::pair<uint32_t, CRect>> ranges;
+    std::vector<CFrozenFormula> formulas;
+    for (const auto &formula : m_FrozenFormulas) {
+        if (m_Dropped[formula.m_Node])
+            continue;
+        uint32_t node = intern(m_Names[formula.m_Node]);
+        formulas.push_back(CFrozenFormula{formula.m_Column, formula.m_Row, node});
+        for (uint32_t i = m_ReferenceOffsets[formula.m_Node]; i < m_ReferenceOffsets[formula.m_Node + 1]; i++)
+            references.emplace_back(node, intern(m_Names[m_FrozenReferences[i]]));
+        for (uint32_t i = m_RangeOffsets[formula.m_Node]; i < m_RangeOffsets[formula.m_Node + 1]; i++)
+            ranges.emplace_back(node, m_FrozenRanges[i]);
+    }
+    for (const auto &[column, rows] : m_Formulas) {
+        for (size_t row : rows) {
+            std::string id = CPos(column, row).getId();
+            uint32_t node = intern(id);
+            formulas.push_back(CFrozenFormula{column, row, node});
+            auto cells = m_References.find(id);
+            if (cells != m_References.end()) {
+                for (const auto &reference : cells->second)
+                    references.emplace_back(node, intern(reference));
+            }
+            auto rects = m_Ranges.find(id);
+            if (rects != m_Ranges.end()) {
+                for (const auto &rect : rects->second)
+                    ranges.emplace_back(node, rect);
+            }
+        }
+    }
+    std::sort(formulas.begin(), formulas.end(), [](const CFrozenFormula &a, const CFrozenFormula &b) {
+        return std::make_pair(a.m_Column, a.m_Row) < std::make_pair(b.m_Column, b.m_Row);
+    });
 
-    // Check headers for file corruption
-    std::string head = content.substr(headStart + 6, headEnd - headStart - 6);
-    if (head != std::to_string(hashTableContent(content.substr(headEnd + 7))))
-        return false;
+    // Counting sort of edges into compressed sparse rows
+    auto bucket = [count = names.size()](const auto &edges, auto source, auto target, std::vector<uint32_t> &offsets, auto &values) {
+        offsets.assign(count + 1, 0);
+        for (const auto &edge : edges)
+            offsets[source(edge) + 1]++;
+        for (size_t i = 0; i < count; i++)
+            offsets[i + 1] += offsets[i];
+        std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+        values.resize(edges.size());
+        for (const auto &edge : edges)
+            values[next[source(edge)]++] = target(edge);
+    };
+    auto first = [](const auto &edge) { return edge.first; };
+    auto second = [](const auto &edge) { return edge.second; };
+    bucket(references, first, second, m_ReferenceOffsets, m_FrozenReferences);
+    bucket(references, second, first, m_DependentOffsets, m_FrozenDependents);
+    bucket(ranges, first, second, m_RangeOffsets, m_FrozenRanges);
+
+    m_Names = std::move(names);
+    m_Nodes = std::move(nodes);
+    m_FrozenFormulas = std::move(formulas);
+    m_Dropped.assign(m_Names.size(), false);
+    m_References.clear();
+    m_Ranges.clear();
+    m_Dependents.clear();
+    m_Formulas.clear();
+}
 
-    // Clear existing data
-    m_Table.clear();
-    m_Dependencies.clear();
+uint32_t CDependencyGraph::findNode(const std::string &id) const {
+    auto node = m_Nodes.find(id);
+    return node != m_Nodes.end() ? node->second : NO_NODE;
+}
 
-    if (content.substr(headEnd + 7) == "<EMPTY>")
-        return true;
+bool CDependencyGraph::isFrozen(uint32_t node) const {
+    return node != NO_NODE && !m_Dropped[node]
+        && (m_ReferenceOffsets[node] != m_ReferenceOffsets[node + 1] || m_RangeOffsets[node] != m_RangeOffsets[node + 1]);
+}
 
-    size_t idStart = content.find("<ID>");
-    size_t valStart = content.find("<VAL>");
-    
-    while (idStart != std::string::npos && valStart != std::string::npos) {
-        size_t idEnd = content.find("</ID>", idStart);
+void CDependencyGraph::drop(const std::string &id) {
+    uint32_t node = findNode(id);
+    if (!isFrozen(node))
+        return;
 
-        if (idEnd == std::string::npos) {
-            return false;
-        }
+    // Range index is shared by both layers, it has to forget the frozen ranges now
+    m_Dropped[node] = true;
+    for (uint32_t i = m_RangeOffsets[node]; i < m_RangeOffsets[node + 1]; i++)
+        m_RangeIndex.erase(m_FrozenRanges[i], id);
+}
 
-        std::string cell = content.substr(idStart + 4, idEnd - idStart - 4);
-        idStart = content.find("<ID>", idEnd);
+CDependencyChecker::CDependencyChecker(const CDependencyGraph& dependencies, const CSheetResolver *sheets, const std::string &sheet)
+    : m_Dependencies(dependencies)
+    , m_Sheets(sheets)
+    , m_Sheet(sheet) {}
 
-        size_t valEnd = content.find("</VAL>", valStart);
+bool CDependencyChecker::isCyclicUtil(const std::string& vertex) {
+    auto result = results.find(vertex);
+    if (result != results.end())
+        return result->second;
 
-        if (valEnd == std::string::npos) {
-            return false;
-        }
+    // Back edge to a vertex on the current path closes a cycle
+    if (recursionStack.count(vertex))
+        return true;
 
-        std::string value = content.substr(valStart + 5, valEnd - valStart - 5);
-        valStart = content.find("<VAL>", valEnd);
+    bool cyclic = false;
+    recursionStack.insert(vertex);
+    cyclic = !forEachPrecedent(vertex, [this](const std::string& precedent) {
+        return !isCyclicUtil(precedent);
+    });
+    recursionStack.erase(vertex);
+    results[vertex] = cyclic;
+    return cyclic;
+}
 
-        try {
-            setCell(CPos(cell), value);
-        } catch(std::invalid_argument &e) {
-            m_Table.clear();
-            m_Dependencies.clear();
-            return false;
-        }
-    }
+bool CDependencyChecker::forEachPrecedent(const std::string &vertex, const std::function<bool(const std::string&)> &visitor) const {
+    size_t separator = vertex.find('!');
+    std::string sheet = separator != std::string::npos ? vertex.substr(0, separator) : "";
+    std::string id = separator != std::string::npos ? vertex.substr(separator + 1) : vertex;
+    const CDependencyGraph *graph = sheet.empty() ? &m_Dependencies : m_Sheets != nullptr ? m_Sheets->graph(sheet) : nullptr;
+    if (graph == nullptr)
+        return true;
 
-    return true;
+    // References to the checked sheet become local vertices, local cells of other sheets get qualified
+    auto qualified = [this, &sheet, &visitor](const std::string &precedent) {
+        size_t separator = precedent.find('!');
+        if (separator == std::string::npos)
+            return visitor(sheet.empty() ? precedent : sheet + '!' + precedent);
+        if (precedent.compare(0, separator, m_Sheet) == 0 && separator == m_Sheet.size())
+            return visitor(precedent.substr(separator + 1));
+        return visitor(precedent);
+    };
+
+    // Range of another sheet is a vertex of its own, its precedents are the formulas inside
+    if (id.find(':') != std::string::npos)
+        return graph->forEachFormula(CRect::parse(id), qualified);
+    return graph->forEachPrecedent(id, qualified);
 }
 
-size_t CSpreadsheet::hashTableContent(const std::string& str) const {
-    std::hash<std::string> hasher;
-    return hasher(str);
+bool CDependencyChecker::containsCycle(const std::string &vertex) {
+    return isCyclicUtil(vertex);
 }
+/******************************************************
+ * Filename: workbook.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements workbook of named sheets with references between sheets,
+ *              cycle detection across sheets and concurrent recalculation of independent sheets.
+ ******************************************************/
 
-// Save spreadsheet data to an output stream
-bool CSpreadsheet::save(std::ostream &os) const {
-    if (os.fail())
-        return false;
 
-    os.clear();
-    std::string head;
-    std::string content = "";
+/***********************************************
+*        Sheets Section
+***********************************************/
 
-    if (m_Table.empty()) {
-        content = "<EMPTY>";
-        head = "<HEAD>" + std::to_string(hashTableContent(content)) + "</HEAD>";
-        os << head << content;
-        return !os.fail();
-    }
+bool CWorkbook::addSheet(const std::string &name) {
+    if (name.empty() || name.find('!') != std::string::npos || m_Sheets.count(name))
+        return false;
 
-    for (const auto &d: m_Table) {
-        content += "<ID>" + d.second.getPos().getId() + "</ID><VAL>" + d.second.getExpression() + "</VAL>";
-    }
+    auto sheet = std::make_unique<CSpreadsheet>();
+    attach(name, *sheet);
+    m_Sheets.emplace(name, std::move(sheet));
+    return true;
+}
 
-    head = "<HEAD>" + std::to_string(hashTableContent(content)) + "</HEAD>";
-    os << head << content;
-    return !os.fail();
+bool CWorkbook::removeSheet(const std::string &name) {
+    return m_Sheets.erase(name) > 0;
 }
 
-// Set the contents of a cell
-bool CSpreadsheet::setCell(CPos pos, std::string contents) {
-    if (contents.empty())
-        return false;
-        
-    CBuilder builder(pos);
-    std::string expression = contents;
+CSpreadsheet *CWorkbook::getSheet(const std::string &name) {
+    auto sheet = m_Sheets.find(name);
+    return sheet != m_Sheets.end() ? sheet->second.get() : nullptr;
+}
 
-    try {
-        parseExpression(contents, builder); 
-    } catch(std::invalid_argument &e) {
-        auto cell = m_Table.find(pos.getId());
-        if (cell != m_Table.end()) {
-            m_Table.erase(cell);
-        }
+std::vector<std::string> CWorkbook::getSheetNames() const {
+    std::vector<std::string> names;
+    for (const auto &sheet : m_Sheets)
+        names.push_back(sheet.first);
+    return names;
+}
 
-        auto dependencyIterator = m_Dependencies.find(pos.getId());
-        if (dependencyIterator != m_Dependencies.end()) {
-            m_Dependencies.erase(dependencyIterator->first);
-        }
-        return false;
-    }
+bool CWorkbook::setCell(const std::string &sheet, CPos pos, std::string contents) {
+    CSpreadsheet *target = getSheet(sheet);
+    return target != nullptr && target->setCell(pos, std::move(contents));
+}
 
-    // Create a new cell object
-    CCell newCell(pos, expression, builder.buildAST());
+CValue CWorkbook::getValue(const std::string &sheet, CPos pos) {
+    CSpreadsheet *target = getSheet(sheet);
+    return target != nullptr ? target->getValue(pos) : CValue();
+}
 
-    // Check if the cell already exists in the table
-    auto cell = m_Table.find(pos.getId());
-    if (cell != m_Table.end()) {
-        cell->second = newCell;
-    } else {
-        // Insert the new cell into the table
-        m_Table.insert({pos.getId(), newCell});
-    }
+std::map<std::string, CCell> *CWorkbook::table(const std::string &sheet) {
+    auto target = m_Sheets.find(sheet);
+    return target != m_Sheets.end() ? &target->second->m_Table : nullptr;
+}
 
-    auto dependencyIterator = m_Dependencies.find(pos.getId());
-    if (dependencyIterator != m_Dependencies.end()) {
-        dependencyIterator->second = builder.getDependencies();
-    } else {
-        m_Dependencies.insert({pos.getId(), builder.getDependencies()});
-    }
+const CDependencyGraph *CWorkbook::graph(const std::string &sheet) const {
+    auto target = m_Sheets.find(sheet);
+    return target != m_Sheets.end() ? &target->second->m_Dependencies : nullptr;
+}
 
-    return true;
+void CWorkbook::attach(const std::string &name, CSpreadsheet &sheet) {
+    sheet.m_Sheets = this;
+    sheet.m_SheetName = name;
 }
 
-// Get the value of a cell
-CValue CSpreadsheet::getValue(CPos pos) {
-    auto cell = m_Table.find(pos.getId());
-    if (cell != m_Table.end()) {
-        CDependencyChecker checker(m_Dependencies);
-        if (checker.containsCycle(pos.getId())) {
-            return CValue();
+/***********************************************
+*        Recalculation Section
+***********************************************/
+
+std::map<std::string, std::shared_ptr<const CValueSnapshot>> CWorkbook::recalculate() {
+    CTraceSpan span("recalculate");
+    auto groups = groupSheets();
+
+    // Evaluation of a group touches cell caches of all its sheets, so a group never spans threads
+    std::vector<std::vector<std::shared_ptr<const CValueSnapshot>>> values(groups.size());
+    std::atomic<size_t> next = 0;
+    auto worker = [&groups, &values, &next]() {
+        for (size_t group = next++; group < groups.size(); group = next++) {
+            for (auto *sheet : groups[group])
+                values[group].push_back(sheet->second->evaluateAll());
         }
-        return cell->second.evaluate(m_Table);
+    };
+
+    size_t count = std::clamp<size_t>(groups.size(), 1, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+
+    std::map<std::string, std::shared_ptr<const CValueSnapshot>> result;
+    for (size_t group = 0; group < groups.size(); group++) {
+        for (size_t i = 0; i < groups[group].size(); i++)
+            result.emplace(groups[group][i]->first, std::move(values[group][i]));
     }
-    return CValue();
+    return result;
 }
 
-// Copy a rectangular range of cells within the spreadsheet
-void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h) {
-    // Determine start and destination positions
-    size_t startCol = src.getColumnNumber();
-    size_t startRow = src.getRow();
-    size_t dstCol = dst.getColumnNumber();
-    size_t dstRow = dst.getRow();
-    std::vector<std::pair<CPos, CCell>> from;
-    std::vector<CPos> to;
-
-    // Get list of cells for copying
-    for (size_t i = startCol; i < startCol + w; i++) {
-        std::string col = CPos::numberToColumn(i);
-    
-        for (size_t j = startRow; j < startRow + h; j++) {
-            auto cell = m_Table.find(col + std::to_string(j));
-            if (cell != m_Table.end()) {
-                from.push_back({CPos(col + std::to_string(j)), cell->second});
-            } else {
-                from.push_back({CPos(col + std::to_string(j)), CCell()});
-            }
+std::vector<std::vector<std::pair<const std::string, std::unique_ptr<CSpreadsheet>>*>> CWorkbook::groupSheets() {
+    // Union-find over sheets, a reference joins the sheets at both of its ends
+    std::map<std::string, std::string> parent;
+    std::function<std::string(const std::string&)> root = [&parent, &root](const std::string &name) {
+        std::string &up = parent[name];
+        if (up.empty() || up == name)
+            return up = name;
+        return up = root(up);
+    };
+    for (const auto &[name, sheet] : m_Sheets) {
+        for (const auto &referenced : sheet->m_Dependencies.getReferencedSheets()) {
+            if (m_Sheets.count(referenced))
+                parent[root(referenced)] = root(name);
         }
     }
 
-    // Get list of target cell positions
-    for (size_t i = dstCol; i < dstCol + w; i++) {
-        std::string col = CPos::numberToColumn(i);
-
-        for (size_t j = dstRow; j < dstRow + h; j++) {
-            to.push_back(CPos(col + std::to_string(j)));
-        }
+    std::map<std::string, size_t> indices;
+    std::vector<std::vector<std::pair<const std::string, std::unique_ptr<CSpreadsheet>>*>> groups;
+    for (auto &sheet : m_Sheets) {
+        auto [index, inserted] = indices.emplace(root(sheet.first), groups.size());
+        if (inserted)
+            groups.emplace_back();
+        groups[index->second].push_back(&sheet);
     }
-    
-    // Copy cells
-    for (size_t i = 0; i < from.size(); i++) {
-        auto dependencyIterator = m_Dependencies.find(to[i].getId());
-
-        if (from[i].second.isEmpty()) {
-            m_Table.erase(to[i].getId());
-            
-            // Remove cell dependencies
-            if (dependencyIterator != m_Dependencies.end())
-                m_Dependencies.erase(to[i].getId());
-            continue;
-        } 
+    return groups;
+}
 
-        std::vector<std::string> dependencies;
-        CCell newCell = from[i].second.copyCell(to[i], dependencies);
-        auto cell = m_Table.find(to[i].getId());
+/***********************************************
+*        File IO Section
+***********************************************/
 
-        if (cell != m_Table.end()) {
-            m_Table.at(cell->first) = newCell;
-        } else {
-            m_Table.insert({to[i].getId(), newCell});
-        }
+bool CWorkbook::save(std::ostream &os, ESaveFormat format) const {
+    if (os.fail())
+        return false;
 
-        if (dependencyIterator != m_Dependencies.end()) {
-            m_Dependencies.at(dependencyIterator->first) = dependencies;
-        }
+    CTraceSpan span("saveWorkbook");
+    for (const auto &[name, sheet] : m_Sheets) {
+        std::ostringstream data;
+        if (!sheet->save(data, format))
+            return false;
+        std::string payload = data.str();
+        os << name.size() << ' ' << name << ' ' << payload.size() << '\n';
+        os.write(payload.data(), payload.size());
+        os << '\n';
+    }
+    return !os.fail();
+}
+
+bool CWorkbook::readField(std::istream &is, size_t length, std::string &out) {
+    static const size_t PIECE = 1 << 16;
+    out.clear();
+    while (out.size() < length) {
+        size_t piece = std::min(PIECE, length - out.size());
+        size_t offset = out.size();
+        out.resize(offset + piece);
+        if (!is.read(out.data() + offset, piece))
+            return false;
     }
+    return true;
 }
 
-CDependencyChecker::CDependencyChecker(const std::map<std::string, std::vector<std::string>>& dependencies) 
-    : m_Dependencies(dependencies) {}
+bool CWorkbook::load(std::istream &is) {
+    if (is.fail())
+        return false;
 
-bool CDependencyChecker::isCyclicUtil(const std::string& vertex) {
-    if (!visited.count(vertex)) {
-        visited.insert(vertex);
-        recursionStack.insert(vertex);
+    CTraceSpan span("loadWorkbook");
+    std::map<std::string, std::unique_ptr<CSpreadsheet>> sheets;
+    size_t nameLength;
+    while (is >> nameLength) {
+        std::string name;
+        size_t payloadLength;
+        if (is.get() != ' ' || !readField(is, nameLength, name) || is.get() != ' ' || !(is >> payloadLength) || is.get() != '\n')
+            return false;
 
-        for (const auto& dependent : m_Dependencies[vertex]) {
-            if (!visited.count(dependent) && isCyclicUtil(dependent))
-                return true;
-            else if (recursionStack.count(dependent))
-                return true;
-        }
+        std::string payload;
+        if (!readField(is, payloadLength, payload) || is.get() != '\n')
+            return false;
+        if (name.empty() || name.find('!') != std::string::npos || sheets.count(name))
+            return false;
+
+        // Formulas are only parsed while loading, so sheets may reference sheets loaded later
+        auto sheet = std::make_unique<CSpreadsheet>();
+        attach(name, *sheet);
+        std::istringstream data(payload);
+        if (!sheet->load(data))
+            return false;
+        sheets.emplace(name, std::move(sheet));
     }
-    recursionStack.erase(vertex);
-    return false;
-}
+    if (!is.eof())
+        return false;
 
-bool CDependencyChecker::containsCycle(const std::string &vertex) {
-    return isCyclicUtil(vertex);
+    m_Sheets = std::move(sheets);
+    return true;
 }
 #ifndef __PROGTEST__
 
@@ -1606,6 +7787,1051 @@ int main() {
     assert(valueMatch(x3.getValue(CPos("B2")), CValue(1.0)));
     assert(valueMatch(x3.getValue(CPos("B3")), CValue(2.0)));
     assert(valueMatch(x3.getValue(CPos("C0")), CValue(1.0)));
+
+    CTracer::instance().enable(1024);
+    CSpreadsheet x4;
+    assert(x4.setCell(CPos("A1"), "5"));
+    assert(x4.setCell(CPos("A2"), "=A1*2"));
+    assert(valueMatch(x4.getValue(CPos("A2")), CValue(10.0)));
+    oss.clear();
+    oss.str("");
+    assert(x4.save(oss));
+    CTracer::instance().disable();
+    assert(x4.setCell(CPos("A3"), "=A2"));
+    assert(CTracer::instance().size() > 0);
+    oss.clear();
+    oss.str("");
+    assert(CTracer::instance().dump(oss));
+    data = oss.str();
+    assert(oss.fill() == ' ');
+    assert(data.find("{\"traceEvents\":[") == 0);
+    assert(data.find("\"name\":\"parse\"") != std::string::npos);
+    assert(data.find("\"name\":\"cycleCheck\"") != std::string::npos);
+    assert(data.find("\"name\":\"evaluate\",\"cat\":\"fitexcel\",\"ph\":\"X\"") != std::string::npos);
+    assert(data.find("\"args\":{\"cell\":\"A1\"}") != std::string::npos);
+    assert(data.find("\"args\":{\"cell\":\"A3\"}") == std::string::npos);
+    CTracer::instance().enable(4);
+    assert(valueMatch(x4.getValue(CPos("A3")), CValue(10.0)));
+    assert(valueMatch(x4.getValue(CPos("A3")), CValue(10.0)));
+    CTracer::instance().disable();
+    assert(CTracer::instance().size() == 4);
+    CTracer::instance().clear();
+    assert(CTracer::instance().size() == 0);
+
+    CSpreadsheet x5;
+    assert(x5.setCell(CPos("A1"), "1"));
+    assert(x5.setCell(CPos("B1"), "=A1*2"));
+    assert(x5.setCell(CPos("C1"), "=D1"));
+    assert(x5.setCell(CPos("D1"), "=C1"));
+    x5.setConcurrentReads(true);
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(2.0)));
+    assert(valueMatch(x5.getValue(CPos("C1")), CValue()));
+    assert(x5.setCell(CPos("A1"), "5"));
+    x5.copyRect(CPos("B2"), CPos("B1"));
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(2.0)));
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue()));
+    x5.publish();
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(10.0)));
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue()));
+    assert(x5.setCell(CPos("A2"), "=B1"));
+    assert(x5.setCell(CPos("D1"), "7"));
+    x5.publish();
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue(20.0)));
+    assert(valueMatch(x5.getValue(CPos("C1")), CValue(7.0)));
+
+    std::atomic<bool> done = false;
+    std::atomic<bool> consistent = true;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&x5, &done, &consistent]() {
+            while (!done) {
+                auto snapshot = x5.getSnapshot();
+                CValue a = snapshot->getValue(CPos("A1"));
+                if (!valueMatch(snapshot->getValue(CPos("B1")), CValue(std::get<double>(a) * 2)))
+                    consistent = false;
+                if (!std::holds_alternative<double>(x5.getValue(CPos("B1"))))
+                    consistent = false;
+            }
+        });
+    }
+    for (int i = 0; i < 200; i++) {
+        assert(x5.setCell(CPos("A1"), std::to_string(i)));
+        x5.publish();
+    }
+    done = true;
+    for (auto &reader : readers)
+        reader.join();
+    assert(consistent);
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(398.0)));
+    // Growing sheet is resharded, earlier epochs keep their values
+    auto x5Before = x5.getSnapshot();
+    for (int i = 1; i <= 5000; i++) {
+        assert(x5.setCell(CPos(5, i), std::to_string(i)));
+        if (i % 500 == 0)
+            x5.publish();
+    }
+    auto x5Grown = x5.getSnapshot();
+    assert(x5.setCell(CPos(5, 1234), "=A1"));
+    assert(x5.setCell(CPos("A1"), "-1"));
+    x5.publish();
+    assert(valueMatch(x5Before->getValue(CPos(5, 1234)), CValue()));
+    assert(valueMatch(x5Grown->getValue(CPos(5, 1234)), CValue(1234.0)));
+    assert(valueMatch(x5Grown->getValue(CPos("B1")), CValue(398.0)));
+    assert(valueMatch(x5.getValue(CPos(5, 1234)), CValue(-1.0)));
+    assert(valueMatch(x5.getValue(CPos(5, 4321)), CValue(4321.0)));
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(-2.0)));
+    assert(x5.setCell(CPos("A1"), "199"));
+    x5.setConcurrentReads(false);
+    assert(x5.getSnapshot() == nullptr);
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue(796.0)));
+
+    CSpreadsheet x6;
+    assert(x6.setCell(CPos("A1"), "1"));
+    assert(x6.setCell(CPos("B1"), "=A1+1"));
+    x6.setAsyncRecalc(true);
+    assert(valueMatch(x6.getValue(CPos("B1")), CValue(2.0)));
+    std::vector<std::future<CValue>> futures;
+    for (int i = 0; i < 100; i++) {
+        assert(x6.setCell(CPos("A1"), std::to_string(i)));
+        futures.push_back(x6.getValueAsync(CPos("B1")));
+    }
+    double previous = 0;
+    for (size_t i = 0; i < futures.size(); i++) {
+        CValue value = futures[i].get();
+        assert(std::holds_alternative<double>(value));
+        assert(std::get<double>(value) >= i + 1 && std::get<double>(value) >= previous);
+        previous = std::get<double>(value);
+    }
+    assert(valueMatch(x6.getValue(CPos("B1")), CValue(100.0)));
+    assert(x6.setCell(CPos("C1"), "=C2"));
+    assert(x6.setCell(CPos("C2"), "=C1+1"));
+    assert(valueMatch(x6.getValueAsync(CPos("C2")).get(), CValue()));
+    x6.copyRect(CPos("B2"), CPos("B1"));
+    assert(x6.setCell(CPos("A2"), "10"));
+    assert(valueMatch(x6.getValue(CPos("B2")), CValue(11.0)));
+    // Readers switched to snapshots never see the empty one published before the worker catches up
+    std::atomic<bool> x6Done = false;
+    std::atomic<bool> x6Defined = true;
+    std::thread x6Reader([&x6, &x6Done, &x6Defined]() {
+        while (!x6Done) {
+            if (!valueMatch(x6.getValue(CPos("B2")), CValue(11.0)))
+                x6Defined = false;
+        }
+    });
+    x6.setConcurrentReads(true);
+    assert(valueMatch(x6.getValue(CPos("B2")), CValue(11.0)));
+    x6Done = true;
+    x6Reader.join();
+    assert(x6Defined);
+    x6.setConcurrentReads(false);
+    CSpreadsheet x7(x6);
+    assert(valueMatch(x7.getValue(CPos("B2")), CValue(11.0)));
+    x7 = x6;
+    assert(valueMatch(x7.getValue(CPos("B1")), CValue(100.0)));
+    assert(x6.setCell(CPos("A2"), "20"));
+    // Pending writes delay only cells depending on them, long chains are recalculated in one pass
+    assert(x6.setCell(CPos("D1"), "1"));
+    for (int row = 2; row <= 3000; row++)
+        assert(x6.setCell(CPos("D" + std::to_string(row)), "=D" + std::to_string(row - 1) + "+1"));
+    assert(valueMatch(x6.getValue(CPos("D3000")), CValue(3000.0)));
+    assert(x6.setCell(CPos("D1"), "2"));
+    assert(x6.getValueAsync(CPos("B1")).wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    assert(valueMatch(x6.getValue(CPos("D3000")), CValue(3001.0)));
+    x6.setAsyncRecalc(false);
+    assert(valueMatch(x6.getValue(CPos("B2")), CValue(21.0)));
+
+    CSpreadsheet x8;
+    assert(x8.setCell(CPos("A1"), "1"));
+    assert(x8.setCell(CPos("B1"), "=A1+1"));
+    assert(x8.setCell(CPos("C1"), "=A1+B1"));
+    assert(x8.setCell(CPos("A2"), "text"));
+    assert(x8.setCell(CPos("B2"), "=C2"));
+    assert(x8.setCell(CPos("C2"), "=B2"));
+    for (int i = 3; i < 40; i++)
+        assert(x8.setCell(CPos("A" + std::to_string(i)), "=A" + std::to_string(i - 1) + "+A" + std::to_string(i - 2)));
+    std::vector<CValue> values(9);
+    assert(!x8.getValues(CPos("A1"), 3, 4, values));
+    assert(x8.getValues(CPos("A1"), 3, 3, values));
+    assert(valueMatch(values[0], CValue(1.0)));
+    assert(valueMatch(values[1], CValue(2.0)));
+    assert(valueMatch(values[2], CValue(3.0)));
+    assert(valueMatch(values[3], CValue("text")));
+    assert(valueMatch(values[4], CValue()));
+    assert(valueMatch(values[5], CValue()));
+    assert(valueMatch(values[6], CValue("text1.000000")));
+    assert(valueMatch(values[8], CValue()));
+    assert(x8.setCell(CPos("A2"), "2"));
+    std::vector<double> numbers(3);
+    std::vector<uint8_t> valid(1);
+    assert(x8.getNumericValues(CPos("C1"), 1, 3, numbers, valid));
+    assert(numbers[0] == 3 && numbers[1] == 0 && numbers[2] == 0);
+    assert(valid[0] == 0x01);
+    assert(x8.getNumericValues(CPos("A37"), 1, 3, numbers, valid));
+    assert(valid[0] == 0x07 && numbers[2] == 102334155 && numbers[1] == 63245986);
+    assert(valueMatch(x8.getValue(CPos("A39")), CValue(102334155.0)));
+
+    CSpreadsheet x9;
+    assert(x9.setCell(CPos("A1"), "10 \t\n"));
+    assert(x9.setCell(CPos("A2"), "  10"));
+    assert(x9.setCell(CPos("A3"), "-1.5e+2"));
+    assert(x9.setCell(CPos("A4"), ".5"));
+    assert(x9.setCell(CPos("A5"), "+5"));
+    assert(x9.setCell(CPos("A6"), "1e400"));
+    assert(x9.setCell(CPos("A7"), "1e-400"));
+    assert(x9.setCell(CPos("A8"), "3e"));
+    assert(x9.setCell(CPos("A9"), "-"));
+    assert(x9.setCell(CPos("A10"), "5."));
+    assert(valueMatch(x9.getValue(CPos("A1")), CValue(10.0)));
+    assert(valueMatch(x9.getValue(CPos("A2")), CValue("  10")));
+    assert(valueMatch(x9.getValue(CPos("A3")), CValue(-150.0)));
+    assert(valueMatch(x9.getValue(CPos("A4")), CValue(".5")));
+    assert(valueMatch(x9.getValue(CPos("A5")), CValue("+5")));
+    assert(valueMatch(x9.getValue(CPos("A6")), CValue()));
+    assert(valueMatch(x9.getValue(CPos("A7")), CValue(0.0)));
+    assert(valueMatch(x9.getValue(CPos("A8")), CValue("3e")));
+    assert(valueMatch(x9.getValue(CPos("A9")), CValue("-")));
+    assert(valueMatch(x9.getValue(CPos("A10")), CValue(5.0)));
+    assert(!x9.setCell(CPos("B1"), "=1+"));
+    assert(x9.setCell(CPos("B1"), "=A1+A3"));
+    x9.copyRect(CPos("C1"), CPos("A1"), 2, 2);
+    assert(valueMatch(x9.getValue(CPos("C1")), CValue(10.0)));
+    assert(valueMatch(x9.getValue(CPos("C2")), CValue("  10")));
+    assert(valueMatch(x9.getValue(CPos("D1")), CValue()));
+    assert(x9.setCell(CPos("C3"), "=A3"));
+    assert(valueMatch(x9.getValue(CPos("D1")), CValue(-140.0)));
+    oss.clear();
+    oss.str("");
+    assert(x9.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue(10.0)));
+    assert(valueMatch(x1.getValue(CPos("A2")), CValue("  10")));
+    assert(valueMatch(x1.getValue(CPos("D1")), CValue(-140.0)));
+
+    static_assert("B12"_pos.getColumnNumber() == 2 && "B12"_pos.getRow() == 12);
+    static_assert("zz0"_pos.getIdView() == "ZZ0");
+    static_assert(CPos(18279, 7).getIdView() == "AAAA7");
+    assert("prog7250"_pos.getId() == "PROG7250");
+    assert(CPos("aAa12").getColumn() == "AAA" && CPos("aAa12").getColumnNumber() == 703);
+    assert(CPos::numberToColumn(702) == "ZZ");
+    assert(CPos("A1").columnToNumber("ZZ") == 702);
+    assert(CPos("A18446744073709551615").getRow() == SIZE_MAX);
+    for (const char *id : {"", "A", "12", "A01", "A1B", "$A1", "A 1", "A-1", "A18446744073709551616", "AAAAAAAAAAAAAAA1"}) {
+        try {
+            CPos pos(id);
+            assert(false);
+        } catch (std::invalid_argument &e) {
+        }
+    }
+    CSpreadsheet x10;
+    assert(x10.setCell(CPos("a1"), "4"));
+    assert(x10.setCell("B1"_pos, "=A1*2"));
+    assert(valueMatch(x10.getValue("A1"_pos), CValue(4.0)));
+    assert(valueMatch(x10.getValue(CPos("b1")), CValue(8.0)));
+
+    CSpreadsheet x11;
+    for (int i = 1; i <= 100; i++)
+        assert(x11.setCell(CPos(1, i), std::to_string(i)));
+    assert(x11.setCell(CPos("A50"), "text"));
+    assert(x11.setCell(CPos("B1"), "=sum(A1:A100)"));
+    assert(x11.setCell(CPos("B2"), "=count(A100:A1)"));
+    assert(x11.setCell(CPos("B3"), "=min(A1:A100)"));
+    assert(x11.setCell(CPos("B4"), "=max($A$1:A100)"));
+    assert(x11.setCell(CPos("B5"), "=countval(7, A1:A100)"));
+    assert(x11.setCell(CPos("B6"), "=if(B5, \"yes\", 1 / 0)"));
+    assert(x11.setCell(CPos("B7"), "=countval(A200, A99:A102)"));
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue(5000.0)));
+    assert(valueMatch(x11.getValue(CPos("B2")), CValue(100.0)));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue(1.0)));
+    assert(valueMatch(x11.getValue(CPos("B4")), CValue(100.0)));
+    assert(valueMatch(x11.getValue(CPos("B5")), CValue(1.0)));
+    assert(valueMatch(x11.getValue(CPos("B6")), CValue("yes")));
+    assert(valueMatch(x11.getValue(CPos("B7")), CValue(2.0)));
+    assert(valueMatch(x11.getValue(CPos("B8")), CValue()));
+    x11.copyRect(CPos("B11"), CPos("B1"), 1, 4);
+    assert(valueMatch(x11.getValue(CPos("B11")), CValue(4945.0)));
+    assert(valueMatch(x11.getValue(CPos("B12")), CValue(90.0)));
+    assert(valueMatch(x11.getValue(CPos("B13")), CValue(11.0)));
+    assert(valueMatch(x11.getValue(CPos("B14")), CValue(100.0)));
+    // Cycle closed through a range is detected without expanding the range
+    assert(x11.setCell(CPos("A60"), "=B1"));
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue()));
+    assert(valueMatch(x11.getValue(CPos("B7")), CValue(2.0)));
+    assert(x11.setCell(CPos("A60"), "60"));
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue(5000.0)));
+    // Range dependents are found by the index when publishing
+    x11.setConcurrentReads(true);
+    assert(x11.setCell(CPos("A70"), "-1000"));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue(1.0)));
+    x11.publish();
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue(5000.0 - 1070)));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue(-1000.0)));
+    assert(valueMatch(x11.getValue(CPos("B13")), CValue(-1000.0)));
+    x11.setConcurrentReads(false);
+
+    CSpreadsheet x12, x13;
+    std::ostringstream snapshot, journal;
+    assert(x12.setCell(CPos("A1"), "10"));
+    assert(x12.setCell(CPos("A2"), "=A1*2"));
+    assert(x12.compact(snapshot, journal));
+    std::string emptyJournal = journal.str();
+    assert(x12.setCell(CPos("A1"), "20"));
+    assert(x12.setCell(CPos("B1"), "multi\nline text"));
+    x12.copyRect(CPos("C1"), CPos("A1"), 1, 2);
+    assert(!x12.setCell(CPos("B1"), "=1+"));
+    assert(x12.setCell(CPos("D1"), "=C2+1"));
+    std::string fullJournal = journal.str();
+    std::istringstream snapshotIn(snapshot.str()), journalIn(fullJournal);
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("A2")), CValue(40.0)));
+    assert(valueMatch(x13.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x13.getValue(CPos("C2")), CValue(40.0)));
+    assert(valueMatch(x13.getValue(CPos("D1")), CValue(41.0)));
+    // Torn last record is dropped, the rest is replayed
+    snapshotIn = std::istringstream(snapshot.str());
+    journalIn = std::istringstream(fullJournal.substr(0, fullJournal.size() - 3));
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("C2")), CValue(40.0)));
+    assert(valueMatch(x13.getValue(CPos("D1")), CValue()));
+    // Corrupted record stops the replay
+    std::string corruptedJournal = fullJournal;
+    corruptedJournal[emptyJournal.size() + 25] ^= 1;
+    snapshotIn = std::istringstream(snapshot.str());
+    journalIn = std::istringstream(corruptedJournal);
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("A2")), CValue(20.0)));
+    assert(valueMatch(x13.getValue(CPos("C2")), CValue()));
+    // Compaction folds the journal into a new snapshot, old journal does not match it
+    std::ostringstream snapshot2, journal2;
+    assert(x12.compact(snapshot2, journal2));
+    snapshotIn = std::istringstream(snapshot2.str());
+    journalIn = std::istringstream(fullJournal);
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("D1")), CValue(41.0)));
+    assert(valueMatch(x13.getValue(CPos("A1")), CValue(20.0)));
+    x12.stopJournal();
+    assert(x12.setCell(CPos("A1"), "30"));
+    assert(journal2.str().find("S") == std::string::npos);
+    // Assignment stops the journal, later writes would be replayed against the wrong snapshot
+    std::ostringstream snapshot3, journal3;
+    assert(x12.compact(snapshot3, journal3));
+    std::string assignedJournal = journal3.str();
+    CSpreadsheet x12b;
+    assert(x12b.setCell(CPos("Z9"), "9"));
+    x12 = x12b;
+    assert(x12.setCell(CPos("B1"), "2"));
+    assert(journal3.str() == assignedJournal);
+    snapshotIn = std::istringstream(snapshot3.str());
+    journalIn = std::istringstream(journal3.str());
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("A1")), CValue(30.0)));
+    assert(valueMatch(x13.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x12.getValue(CPos("Z9")), CValue(9.0)));
+    assert(valueMatch(x12.getValue(CPos("A1")), CValue()));
+
+    CSpreadsheet x14;
+    std::string longText(200000, 'x');
+    assert(x14.setCell(CPos("A1"), longText));
+    assert(x14.setCell(CPos("A2"), "=A1+\"y\""));
+    oss.clear();
+    oss.str("");
+    assert(x14.save(oss));
+    data = oss.str();
+    assert(data.compare(data.size() - 7, 7, "</TAIL>") == 0);
+    iss.clear();
+    iss.str(data);
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A2")), CValue(longText + "y")));
+    data[100] ^= 1;
+    iss.clear();
+    iss.str(data);
+    assert(!x1.load(iss));
+    oss.clear();
+    oss.str("");
+    assert(CSpreadsheet().save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue()));
+    // Files with checksum in the header are still accepted
+    std::string legacyBody = "<ID>A1</ID><VAL>=2*3</VAL>";
+    iss.clear();
+    iss.str("<HEAD>" + std::to_string(std::hash<std::string>()(legacyBody)) + "</HEAD>" + legacyBody);
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue(6.0)));
+
+    CSpreadsheet x15;
+    const char *formulas[] = {"=A20+A29", "=-2^2", "=(-2)^2", "=2^3^2", "=2^(3^2)", "=1-(2-3)", "=-(1+2)*3",
+                              "=2*-A20", "=\"a\"\"b\"+A20", "=$A20+A$29+$A$20", "=sum($A20:A29)", "=countval(A20 > 1, A20:A29) <> 0",
+                              "=if(A20 < A29, 1 / 3, 1e22)", "=(1 < 2) < 3", "=1 < (2 < 3)"};
+    for (size_t i = 0; i < std::size(formulas); i++)
+        assert(x15.setCell(CPos(1, i + 1), formulas[i]));
+    for (int i = 20; i <= 39; i++) {
+        assert(x15.setCell(CPos(1, i), std::to_string(i)));
+        assert(x15.setCell(CPos(2, i), std::to_string(2 * i)));
+    }
+    x15.copyRect(CPos("B1"), CPos("A1"), 1, std::size(formulas));
+    oss.clear();
+    oss.str("");
+    assert(x15.save(oss));
+    data = oss.str();
+    // Copies are regenerated from AST, A2 inside A20 is no longer rewritten
+    assert(data.find("<ID>B1</ID><VAL>=B20+B29</VAL>") != std::string::npos);
+    assert(data.find("<VAL>=$A20+B$29+$A$20</VAL>") != std::string::npos);
+    assert(data.find("<VAL>=sum($A20:B29)</VAL>") != std::string::npos);
+    assert(data.find("<VAL>=(-2)^2</VAL>") != std::string::npos);
+    iss.clear();
+    iss.str(data);
+    assert(x1.load(iss));
+    for (size_t i = 1; i <= std::size(formulas); i++) {
+        assert(valueMatch(x1.getValue(CPos(1, i)), x15.getValue(CPos(1, i))));
+        assert(valueMatch(x1.getValue(CPos(2, i)), x15.getValue(CPos(2, i))));
+    }
+    assert(valueMatch(x15.getValue(CPos("B2")), CValue(-4.0)));
+    assert(valueMatch(x15.getValue(CPos("B3")), CValue(4.0)));
+    assert(valueMatch(x15.getValue(CPos("B4")), CValue(64.0)));
+    assert(valueMatch(x15.getValue(CPos("B9")), CValue("a\"b40.000000")));
+
+    CSpreadsheet x16;
+    x16.setAstBudget(16);
+    assert(x16.setCell(CPos("A1"), "1"));
+    for (int i = 2; i <= 100; i++)
+        assert(x16.setCell(CPos(1, i), "=A" + std::to_string(i - 1) + "+1"));
+    assert(x16.setCell(CPos("B1"), "=sum(A1:A100)"));
+    CAstStats astStats = x16.getAstStats();
+    assert(astStats.m_Resident <= 16 && astStats.m_Evictions >= 84 && astStats.m_Reparses == 0);
+    assert(valueMatch(x16.getValue(CPos("B1")), CValue(5050.0)));
+    astStats = x16.getAstStats();
+    assert(astStats.m_Resident <= 16 && astStats.m_Reparses >= 84);
+    // Evicted cells keep cycle detection, copying and saving working
+    assert(x16.setCell(CPos("A1"), "=A100"));
+    assert(valueMatch(x16.getValue(CPos("A50")), CValue()));
+    assert(x16.setCell(CPos("A1"), "1"));
+    x16.copyRect(CPos("C2"), CPos("A2"), 1, 99);
+    assert(valueMatch(x16.getValue(CPos("C100")), CValue()));
+    assert(x16.setCell(CPos("C1"), "10"));
+    assert(valueMatch(x16.getValue(CPos("C100")), CValue(109.0)));
+    oss.clear();
+    oss.str("");
+    assert(x16.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("C100")), CValue(109.0)));
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue(5050.0)));
+    x16.setAstBudget(0);
+    assert(valueMatch(x16.getValue(CPos("B1")), CValue(5050.0)));
+    assert(x16.getAstStats().m_Resident >= 100);
+    // Overwritten and removed ASTs are no longer counted, so staying within budget evicts nothing
+    CSpreadsheet x16b;
+    x16b.setAstBudget(16);
+    for (int i = 1; i <= 15; i++)
+        assert(x16b.setCell(CPos(1, i), "=" + std::to_string(i) + "+1"));
+    for (int i = 0; i < 100; i++) {
+        assert(x16b.setCell(CPos("A1"), "=" + std::to_string(i) + "*2"));
+        assert(x16b.setCell(CPos("B1"), "=A1"));
+        assert(x16b.setCell(CPos("B1"), "x"));
+    }
+    x16b.copyRect(CPos("A2"), CPos("A1"), 1, 1);
+    x16b.moveRect(CPos("A3"), CPos("A4"), 1, 1);
+    assert(x16b.deleteRows(5));
+    astStats = x16b.getAstStats();
+    assert(astStats.m_Resident == 13 && astStats.m_Evictions == 0);
+    assert(valueMatch(x16b.getValue(CPos("A2")), CValue(198.0)));
+
+    CSpreadsheet x17;
+    assert(x17.setCell(CPos("A1"), "1"));
+    assert(x17.setCell(CPos("A2"), "=A1*2"));
+    assert(x17.setCell(CPos("A3"), "=A1>0"));
+    assert(x17.setCell(CPos("B1"), "=A1+A2"));
+    size_t notifications = 0;
+    std::vector<std::pair<CPos, CValue>> changes;
+    size_t subscription = x17.subscribe(CPos("A2"), 1, 2, [&](const std::vector<std::pair<CPos, CValue>> &cells) {
+        notifications++;
+        changes = cells;
+    });
+    assert(subscription != 0);
+    // Only changed cells of the area are reported, once per write
+    assert(x17.setCell(CPos("A1"), "5"));
+    assert(notifications == 1 && changes.size() == 1);
+    assert(changes[0].first.getId() == "A2" && valueMatch(changes[0].second, CValue(10.0)));
+    assert(x17.setCell(CPos("A1"), "=10/2"));
+    assert(notifications == 1);
+    assert(x17.setCell(CPos("A1"), "-1"));
+    assert(notifications == 2 && changes.size() == 2);
+    assert(valueMatch(changes[1].second, CValue(0.0)));
+    assert(x17.setCell(CPos("A3"), "=A3"));
+    assert(notifications == 3 && changes.size() == 1 && valueMatch(changes[0].second, CValue()));
+    x17.copyRect(CPos("A3"), CPos("A2"));
+    assert(notifications == 4 && changes.size() == 1 && valueMatch(changes[0].second, CValue(-4.0)));
+    x17.unsubscribe(subscription);
+    assert(x17.setCell(CPos("A1"), "7"));
+    assert(notifications == 4);
+    // With concurrent reads changes are delivered by publish
+    x17.subscribe(CPos("B1"), 1, 1, [&](const std::vector<std::pair<CPos, CValue>> &cells) {
+        notifications++;
+        changes = cells;
+    });
+    x17.setConcurrentReads(true);
+    assert(x17.setCell(CPos("A1"), "1"));
+    assert(notifications == 4);
+    x17.publish();
+    assert(notifications == 5 && changes.size() == 1 && valueMatch(changes[0].second, CValue(3.0)));
+    x17.setConcurrentReads(false);
+
+    CSpreadsheet x18;
+    assert(x18.setCell(CPos("A1"), "0.1"));
+    assert(x18.setCell(CPos("B1"), "=A1*3"));
+    assert(x18.setCell(CPos("C1"), "say \"hi\", bye"));
+    assert(x18.setCell(CPos("A2"), "tab\there"));
+    assert(x18.setCell(CPos("C2"), "=C2"));
+    oss.clear();
+    oss.str("");
+    assert(x18.exportValues(oss, CPos("A1"), 3, 2));
+    assert(oss.str() == "0.1,0.30000000000000004,\"say \"\"hi\"\", bye\"\ntab\there,,\n");
+    oss.clear();
+    oss.str("");
+    assert(x18.exportValues(oss, CPos("A1"), 3, 2, EExportFormat::TSV));
+    assert(oss.str() == "0.1\t0.30000000000000004\tsay \"hi\", bye\ntab\\there\t\t\n");
+    // Large areas are split into chunks and slices without changing the output
+    for (int i = 1; i <= 30000; i++)
+        assert(x18.setCell(CPos(4, i), "=" + std::to_string(i) + "/4"));
+    oss.clear();
+    oss.str("");
+    assert(x18.exportValues(oss, CPos("D1"), 3, 30000));
+    std::string exported = oss.str();
+    assert(std::count(exported.begin(), exported.end(), '\n') == 30000);
+    assert(exported.compare(0, 12, "0.25,,\n0.5,,") == 0);
+    assert(exported.ends_with("\n7500,,\n"));
+    assert(!x18.exportValues(oss, CPos("A1"), -1, 2));
+
+    // Fields crossing chunk boundaries are assembled the same way
+    const std::string csv = "1,\"a,\"\"b\"\"\",=A1*2\r\n,x\r\n\"multi\nline\"\n=sum(A1:A2)+,3e2";
+    for (size_t capacity : {1, 2, 3, 1000}) {
+        iss.clear();
+        iss.str(csv);
+        CCsvReader reader(iss, capacity);
+        std::vector<std::pair<std::string, bool>> fields;
+        std::string_view field;
+        bool lastInRow;
+        while (reader.next(field, lastInRow))
+            fields.emplace_back(field, lastInRow);
+        assert(reader.isValid());
+        assert((fields == std::vector<std::pair<std::string, bool>>{{"1", false}, {"a,\"b\"", false}, {"=A1*2", true}, {"", false},
+                {"x", true}, {"multi\nline", true}, {"=sum(A1:A2)+", false}, {"3e2", true}}));
+    }
+
+    CSpreadsheet x19;
+    assert(x19.setCell(CPos("B4"), "=1/0"));
+    assert(x19.setCell(CPos("A2"), "keep"));
+    iss.clear();
+    iss.str(csv);
+    assert(x19.importCsv(iss, CPos("A1")));
+    assert(valueMatch(x19.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x19.getValue(CPos("B1")), CValue("a,\"b\"")));
+    assert(valueMatch(x19.getValue(CPos("C1")), CValue(2.0)));
+    assert(valueMatch(x19.getValue(CPos("A2")), CValue("keep")));
+    assert(valueMatch(x19.getValue(CPos("B2")), CValue("x")));
+    assert(valueMatch(x19.getValue(CPos("A3")), CValue("multi\nline")));
+    assert(valueMatch(x19.getValue(CPos("A4")), CValue()));
+    assert(valueMatch(x19.getValue(CPos("B4")), CValue(300.0)));
+    iss.clear();
+    iss.str("\"open");
+    assert(!x19.importCsv(iss, CPos("A10")));
+    assert(valueMatch(x19.getValue(CPos("A10")), CValue("open")));
+    // Enough formulas to be parsed by several threads
+    std::string rows;
+    for (int i = 1; i <= 5000; i++)
+        rows += std::to_string(i) + ",=A" + std::to_string(i) + "*2\n";
+    iss.clear();
+    iss.str(rows);
+    assert(x19.importCsv(iss, CPos("A1")));
+    assert(valueMatch(x19.getValue(CPos("B5000")), CValue(10000.0)));
+    assert(valueMatch(x19.getValue(CPos("C1")), CValue(2.0)));
+
+    CSpreadsheet x20;
+    assert(x20.setCell(CPos("A1"), "10"));
+    assert(x20.setCell(CPos("A2"), "20"));
+    assert(x20.setCell(CPos("A3"), "30"));
+    assert(x20.setCell(CPos("B1"), "=sum(A1:A3)"));
+    assert(x20.setCell(CPos("B2"), "=$A$3*2"));
+    assert(x20.setCell(CPos("B3"), "=A2"));
+    CSpreadsheet x20Copy(x20);
+    snapshot.str("");
+    journal.str("");
+    assert(x20.compact(snapshot, journal));
+    // Ranges spanning inserted rows grow, absolute references move with their cells
+    assert(x20.insertRows(2, 2));
+    assert(valueMatch(x20.getValue(CPos("A2")), CValue()));
+    assert(valueMatch(x20.getValue(CPos("A5")), CValue(30.0)));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue(60.0)));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue(60.0)));
+    assert(valueMatch(x20.getValue(CPos("B5")), CValue(20.0)));
+    assert(x20.setCell(CPos("A3"), "5"));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue(65.0)));
+    // Moved formulas are copied relative to their new position
+    x20.copyRect(CPos("C5"), CPos("B5"));
+    assert(valueMatch(x20.getValue(CPos("C5")), CValue(60.0)));
+    assert(valueMatch(x20Copy.getValue(CPos("B1")), CValue(60.0)));
+    assert(valueMatch(x20Copy.getValue(CPos("B3")), CValue(20.0)));
+    // References to deleted cells become undefined, also after save and load
+    assert(x20.deleteRows(4));
+    assert(valueMatch(x20.getValue(CPos("A4")), CValue(30.0)));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue(45.0)));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x20.getValue(CPos("C4")), CValue()));
+    assert(valueMatch(x20.getValue(CPos("B3")), CValue()));
+    assert(x20.setCell(CPos("A4"), "1"));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue()));
+    assert(x20.insertColumns(1));
+    assert(valueMatch(x20.getValue(CPos("C1")), CValue(16.0)));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue(1.0)));
+    assert(x20.deleteColumns(2));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue()));
+    assert(!x20.deleteColumns(0));
+    assert(!x20.deleteRows(0));
+    assert(!x20.insertRows(0));
+    oss.clear();
+    oss.str("");
+    assert(x20.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x1.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue()));
+    // Structural edits are journaled
+    snapshotIn.clear();
+    snapshotIn.str(snapshot.str());
+    journalIn.clear();
+    journalIn.str(journal.str());
+    assert(x13.load(snapshotIn, journalIn));
+    std::ostringstream replayed;
+    assert(x13.save(replayed));
+    assert(replayed.str() == oss.str());
+
+    CSpreadsheet x21;
+    snapshot.str("");
+    journal.str("");
+    assert(x21.compact(snapshot, journal));
+    for (int i = 1; i <= 5; i++)
+        assert(x21.setCell(CPos(1, i), std::to_string(i)));
+    // Overlapping copies read every cell before overwriting it
+    x21.copyRect(CPos("A2"), CPos("A1"), 1, 4);
+    assert(valueMatch(x21.getValue(CPos("A3")), CValue(2.0)));
+    assert(valueMatch(x21.getValue(CPos("A5")), CValue(4.0)));
+    x21.copyRect(CPos("A1"), CPos("A2"), 1, 4);
+    assert(valueMatch(x21.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x21.getValue(CPos("A4")), CValue(4.0)));
+    assert(x21.setCell(CPos("C1"), "=1"));
+    assert(x21.setCell(CPos("C2"), "=C1+1"));
+    assert(x21.setCell(CPos("C3"), "=C2+1"));
+    x21.copyRect(CPos("C2"), CPos("C1"), 1, 3);
+    assert(valueMatch(x21.getValue(CPos("C2")), CValue(1.0)));
+    assert(valueMatch(x21.getValue(CPos("C4")), CValue(3.0)));
+    // Moved cells are followed by references, ranges only when they lie inside the block
+    assert(x21.setCell(CPos("D1"), "5"));
+    assert(x21.setCell(CPos("D2"), "=D1*2"));
+    assert(x21.setCell(CPos("E1"), "=D1+D2"));
+    assert(x21.setCell(CPos("E2"), "=sum(D1:D2)"));
+    assert(x21.setCell(CPos("E3"), "=sum(D1:D5)"));
+    x21.moveRect(CPos("F10"), CPos("D1"), 1, 2);
+    assert(valueMatch(x21.getValue(CPos("D1")), CValue()));
+    assert(valueMatch(x21.getValue(CPos("F11")), CValue(10.0)));
+    assert(valueMatch(x21.getValue(CPos("E1")), CValue(15.0)));
+    assert(valueMatch(x21.getValue(CPos("E2")), CValue(15.0)));
+    assert(valueMatch(x21.getValue(CPos("E3")), CValue()));
+    assert(x21.setCell(CPos("G1"), "1"));
+    assert(x21.setCell(CPos("H1"), "=G1"));
+    x21.moveRect(CPos("G1"), CPos("F10"));
+    assert(valueMatch(x21.getValue(CPos("H1")), CValue(5.0)));
+    assert(valueMatch(x21.getValue(CPos("F11")), CValue(10.0)));
+    // Moved formula is copied relative to its new position
+    x21.moveRect(CPos("A20"), CPos("F11"));
+    x21.copyRect(CPos("A21"), CPos("A20"));
+    assert(valueMatch(x21.getValue(CPos("A20")), CValue(10.0)));
+    assert(valueMatch(x21.getValue(CPos("A21")), CValue()));
+    assert(x21.setCell(CPos("G2"), "7"));
+    assert(valueMatch(x21.getValue(CPos("A21")), CValue(14.0)));
+    assert(valueMatch(x21.getValue(CPos("E1")), CValue(15.0)));
+    oss.clear();
+    oss.str("");
+    assert(x21.save(oss));
+    snapshotIn.clear();
+    snapshotIn.str(snapshot.str());
+    journalIn.clear();
+    journalIn.str(journal.str());
+    assert(x13.load(snapshotIn, journalIn));
+    replayed.str("");
+    assert(x13.save(replayed));
+    assert(replayed.str() == oss.str());
+
+    // Large copies give the same sheet as copying column by column
+    CSpreadsheet x22, x22Serial;
+    for (CSpreadsheet *sheet : {&x22, &x22Serial}) {
+        assert(sheet->setCell(CPos("A1"), "1"));
+        assert(sheet->setCell(CPos("B1"), "=A1+$A$1"));
+        assert(sheet->setCell(CPos("A2"), "=sum(A$1:A1)"));
+        assert(sheet->setCell(CPos("B2"), "text"));
+        for (int i = 3; i <= 60; i++)
+            assert(sheet->setCell(CPos(1, i), "=A" + std::to_string(i - 1) + "*2"));
+    }
+    x22.copyRect(CPos("C1"), CPos("A1"), 2, 60);
+    x22.copyRect(CPos("B1"), CPos("A1"), 100, 60, 4);
+    for (int i = 0; i < 2; i++)
+        x22Serial.copyRect(CPos(3 + i, 1), CPos(1 + i, 1), 1, 60);
+    for (int i = 99; i >= 0; i--)
+        x22Serial.copyRect(CPos(2 + i, 1), CPos(1 + i, 1), 1, 60);
+    oss.clear();
+    oss.str("");
+    assert(x22.save(oss));
+    replayed.str("");
+    assert(x22Serial.save(replayed));
+    assert(replayed.str() == oss.str());
+    assert(valueMatch(x22.getValue(CPos("B2")), CValue(1.0)));
+
+    // Fused reference and number operations behave like the generic ones
+    CSpreadsheet x23;
+    assert(x23.setCell(CPos("A1"), "10"));
+    assert(x23.setCell(CPos("A2"), "4"));
+    assert(x23.setCell(CPos("A3"), "text"));
+    assert(x23.setCell(CPos("B1"), "=A1+A2"));
+    assert(x23.setCell(CPos("B2"), "=A1-2.5"));
+    assert(x23.setCell(CPos("B3"), "=3*$A$2"));
+    assert(x23.setCell(CPos("B4"), "=A1/A5"));
+    assert(x23.setCell(CPos("B5"), "=A3+A2"));
+    assert(x23.setCell(CPos("B6"), "=A$1/0"));
+    assert(x23.setCell(CPos("B7"), "=1-A2-A1"));
+    assert(valueMatch(x23.getValue(CPos("B1")), CValue(14.0)));
+    assert(valueMatch(x23.getValue(CPos("B2")), CValue(7.5)));
+    assert(valueMatch(x23.getValue(CPos("B3")), CValue(12.0)));
+    assert(valueMatch(x23.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B5")), CValue("text4.000000")));
+    assert(valueMatch(x23.getValue(CPos("B6")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B7")), CValue(-13.0)));
+    x23.copyRect(CPos("C2"), CPos("B1"), 1, 3);
+    assert(valueMatch(x23.getValue(CPos("C2")), CValue(19.5)));
+    assert(valueMatch(x23.getValue(CPos("C3")), CValue(5.0)));
+    assert(valueMatch(x23.getValue(CPos("C4")), CValue(12.0)));
+    assert(x23.setCell(CPos("B2"), "4"));
+    assert(valueMatch(x23.getValue(CPos("C2")), CValue(16.0)));
+    oss.clear();
+    oss.str("");
+    assert(x23.save(oss));
+    assert(oss.str().find("=B2+B3") != std::string::npos);
+    assert(oss.str().find("=3*$A$2") != std::string::npos);
+    assert(oss.str().find("=1-A2-A1") != std::string::npos);
+    assert(x23.setCell(CPos("D4"), "=A1*2"));
+    assert(x23.deleteRows(2));
+    assert(valueMatch(x23.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B2")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B6")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("D3")), CValue(20.0)));
+    assert(x23.setCell(CPos("A2"), "5"));
+    assert(valueMatch(x23.getValue(CPos("B1")), CValue()));
+
+    // Compacted dependency graph keeps answering like the map based one
+    CDependencyGraph graph;
+    graph.setDependencies(CPos("B1"), {"A1", "A2"});
+    graph.setDependencies(CPos("C1"), {"B1", "A1:B3"});
+    graph.setDependencies(CPos("B3"), {"A3"});
+    graph.setDependencies(CPos("A9"), {"A8"});
+    graph.compact();
+    graph.setDependencies(CPos("D1"), {"A1"});
+    graph.erase(CPos("B1"));
+    std::set<std::string> visited;
+    graph.forEachDependent(CPos("A1"), [&visited](const std::string &id) {
+        visited.insert(id);
+    });
+    assert(visited == std::set<std::string>({"C1", "D1"}));
+    visited.clear();
+    graph.forEachPrecedent("C1", [&visited](const std::string &id) {
+        visited.insert(id);
+        return true;
+    });
+    assert(visited == std::set<std::string>({"B1", "B3"}));
+    graph.compact();
+    visited.clear();
+    graph.forEachDependent(CPos("A3"), [&visited](const std::string &id) {
+        visited.insert(id);
+    });
+    assert(visited == std::set<std::string>({"B3", "C1"}));
+    visited.clear();
+    graph.forEachPrecedent("C1", [&visited](const std::string &id) {
+        visited.insert(id);
+        return true;
+    });
+    assert(visited == std::set<std::string>({"B1", "B3"}));
+    assert(graph.isShifted("C1", CShift{false, true, 2, 1}));
+    assert(!graph.isShifted("D1", CShift{false, true, 2, 1}));
+
+    CSpreadsheet x24;
+    assert(x24.setCell(CPos("A1"), "=B1+1"));
+    assert(x24.setCell(CPos("B1"), "=sum(C1:C5)"));
+    assert(x24.setCell(CPos("C2"), "2"));
+    oss.clear();
+    oss.str("");
+    assert(x24.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x24.load(iss));
+    assert(valueMatch(x24.getValue(CPos("A1")), CValue(3.0)));
+    assert(x24.setCell(CPos("C3"), "=A1"));
+    assert(valueMatch(x24.getValue(CPos("A1")), CValue()));
+    assert(x24.setCell(CPos("C3"), "5"));
+    assert(valueMatch(x24.getValue(CPos("A1")), CValue(8.0)));
+
+    // Sheets of a workbook reference each other by qualified references
+    CWorkbook x25;
+    assert(x25.addSheet("Data"));
+    assert(x25.addSheet("Q1 data"));
+    assert(x25.addSheet("Report"));
+    assert(!x25.addSheet("Data"));
+    assert(!x25.addSheet("a!b"));
+    assert(x25.setCell("Data", CPos("A1"), "10"));
+    assert(x25.setCell("Data", CPos("A2"), "=A1*2"));
+    assert(x25.setCell("Q1 data", CPos("B1"), "5"));
+    assert(x25.setCell("Report", CPos("A1"), "=Data!A2+'Q1 data'!B1"));
+    assert(x25.setCell("Report", CPos("A2"), "=sum(Data!A1:A2) + data!A1"));
+    assert(x25.setCell("Report", CPos("A3"), "=\"Data!A1\"+Missing!A1"));
+    assert(!x25.setCell("Report", CPos("A4"), "=$Data!A1"));
+    assert(!x25.setCell("Report", CPos("A5"), "=Data!sum(A1:A2)"));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue(25.0)));
+    assert(valueMatch(x25.getValue("Report", CPos("A2")), CValue()));
+    assert(valueMatch(x25.getValue("Report", CPos("A3")), CValue()));
+    assert(x25.setCell("Report", CPos("A2"), "=sum(Data!A1:A2) + Data!$A$1 + Data!A$1 + Data!$A1"));
+    assert(valueMatch(x25.getValue("Report", CPos("A2")), CValue(60.0)));
+    x25.getSheet("Report")->copyRect(CPos("B1"), CPos("A1"), 1, 2);
+    assert(x25.setCell("Data", CPos("B1"), "1"));
+    assert(x25.setCell("Data", CPos("B2"), "2"));
+    assert(x25.setCell("Q1 data", CPos("C1"), "4"));
+    assert(valueMatch(x25.getValue("Report", CPos("B1")), CValue(6.0)));
+    assert(valueMatch(x25.getValue("Report", CPos("B2")), CValue(24.0)));
+    // Cycle passing through two sheets
+    assert(x25.setCell("Data", CPos("A1"), "=Report!A1"));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue()));
+    assert(valueMatch(x25.getValue("Data", CPos("A2")), CValue()));
+    assert(x25.setCell("Data", CPos("A1"), "=sum(Report!C1:C2)"));
+    assert(x25.setCell("Report", CPos("C2"), "=Data!A2"));
+    assert(valueMatch(x25.getValue("Data", CPos("A1")), CValue()));
+    assert(x25.setCell("Report", CPos("C2"), "3"));
+    assert(valueMatch(x25.getValue("Data", CPos("A1")), CValue(3.0)));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue(11.0)));
+    oss.clear();
+    oss.str("");
+    assert(x25.save(oss));
+    assert(oss.str().find("=Data!A2+'Q1 data'!B1") != std::string::npos);
+    CWorkbook x25Loaded;
+    iss.clear();
+    iss.str(oss.str());
+    assert(x25Loaded.load(iss));
+    assert(x25Loaded.getSheetNames() == std::vector<std::string>({"Data", "Q1 data", "Report"}));
+    assert(valueMatch(x25Loaded.getValue("Report", CPos("A1")), CValue(11.0)));
+    assert(x25.addSheet("Alone"));
+    assert(x25.setCell("Alone", CPos("A1"), "=A2+1"));
+    assert(x25.setCell("Alone", CPos("A2"), "2"));
+    auto recalculated = x25.recalculate();
+    assert(recalculated.size() == 4);
+    assert(valueMatch(recalculated["Report"]->getValue(CPos("A1")), CValue(11.0)));
+    assert(valueMatch(recalculated["Alone"]->getValue(CPos("A1")), CValue(3.0)));
+    assert(x25.removeSheet("Q1 data"));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue()));
+    iss.clear();
+    iss.str("3 Bad 5\nxx");
+    assert(!x25Loaded.load(iss));
+    iss.clear();
+    iss.str("99999999999999 a 1\n");
+    assert(!x25Loaded.load(iss));
+    iss.clear();
+    iss.str("3 Bad 99999999999999\nxx");
+    assert(!x25Loaded.load(iss));
+    assert(x25Loaded.getSheetNames().size() == 3);
+    // Block compressed saves load the same cells and reject damaged blocks
+    CSpreadsheet x26;
+    for (int row = 1; row <= 3000; row++) {
+        std::string id = std::to_string(row);
+        assert(x26.setCell(CPos("A" + id), id));
+        assert(x26.setCell(CPos("B" + id), "=A" + id + "*2+$A$1"));
+    }
+    oss.clear();
+    oss.str("");
+    assert(x26.save(oss));
+    std::string x26Text = oss.str();
+    oss.clear();
+    oss.str("");
+    assert(x26.save(oss, ESaveFormat::BLOCKS));
+    std::string x26Blocks = oss.str();
+    assert(CBlockReader::isBlocked(x26Blocks) && x26Blocks.size() * 3 < x26Text.size());
+    std::string x26Decoded;
+    assert(CBlockReader::decode(x26Blocks, x26Decoded, 4) && x26Decoded == x26Text);
+    CSpreadsheet x26Loaded;
+    iss.clear();
+    iss.str(x26Blocks);
+    assert(x26Loaded.load(iss));
+    assert(valueMatch(x26Loaded.getValue(CPos("B3000")), CValue(6001.0)));
+    std::string x26Damaged = x26Blocks;
+    x26Damaged[x26Damaged.size() / 2] ^= 0x20;
+    iss.clear();
+    iss.str(x26Damaged);
+    assert(!x26Loaded.load(iss));
+    iss.clear();
+    iss.str(x26Blocks.substr(0, x26Blocks.size() - 10));
+    assert(!x26Loaded.load(iss));
+    // Sizes claimed by malformed headers are not allocated
+    assert(!CBlockReader::decode("<BLOCKS>\n99999999999999 1 0000000000000000\nx", x26Decoded));
+    assert(!CBlockReader::decode("<BLOCKS>\n1000000 2 0000000000000000\nab", x26Decoded));
+    iss.clear();
+    iss.str("<BLOCKS>\n99999999999999 1 0000000000000000\nx");
+    assert(!x26Loaded.load(iss));
+    std::string x26Repeated = "ab" + std::string(1000, 'x') + "abxxxx";
+    std::string x26Compressed = CLzCodec::compress(x26Repeated);
+    assert(x26Compressed.size() < 30);
+    std::string x26Restored(x26Repeated.size(), '\0');
+    assert(CLzCodec::decompress(x26Compressed, x26Restored) && x26Restored == x26Repeated);
+    assert(!CLzCodec::decompress(x26Compressed, std::span<char>(x26Restored.data(), x26Restored.size() - 1)));
+    std::ostringstream x26Snapshot;
+    std::ostringstream x26Journal;
+    assert(x26.compact(x26Snapshot, x26Journal, ESaveFormat::BLOCKS));
+    assert(x26.setCell(CPos("A1"), "10"));
+    std::istringstream x26SnapshotIn(x26Snapshot.str());
+    std::istringstream x26JournalIn(x26Journal.str());
+    assert(x26Loaded.load(x26SnapshotIn, x26JournalIn));
+    assert(valueMatch(x26Loaded.getValue(CPos("B3000")), CValue(6010.0)));
+    // Equality binds looser than ordering, copied formulas keep their parentheses
+    CSpreadsheet x27;
+    assert(x27.setCell(CPos("A1"), "=(0=0)<0"));
+    assert(x27.setCell(CPos("A2"), "=0=(0<0)"));
+    assert(x27.setCell(CPos("A3"), "=(1<>0)>=(2=2)"));
+    x27.copyRect(CPos("B1"), CPos("A1"), 1, 3);
+    assert(valueMatch(x27.getValue(CPos("B1")), CValue(0.0)));
+    assert(valueMatch(x27.getValue(CPos("B2")), CValue(1.0)));
+    oss.clear();
+    oss.str("");
+    assert(x27.save(oss));
+    assert(oss.str().find("<ID>B1</ID><VAL>=(0=0)<0</VAL><ID>B2</ID><VAL>=0=0<0</VAL><ID>B3</ID><VAL>=(1<>0)>=(2=2)</VAL>") != std::string::npos);
+    iss.clear();
+    iss.str(oss.str());
+    assert(x27.load(iss));
+    assert(valueMatch(x27.getValue(CPos("B1")), CValue(0.0)));
+    assert(valueMatch(x27.getValue(CPos("B3")), CValue(1.0)));
+    // Formulas with the same relative form are cloned from the parse cache
+    assert(CParseCache::relativeForm(CPos("B2"), "=A1*2+$C$1+sum(A1:b$3)") == "={c-1r-1}*2+{C3R1}+sum({c-1r-1}:{c0R3})");
+    assert(CParseCache::relativeForm(CPos("B2"), "=\"A1\"\"B2\"+1e5+log10(2)") == "=\"A1\"\"B2\"+1e5+log10(2)");
+    assert(CParseCache::relativeForm(CPos("B2"), "=Data!A1").empty());
+    CSpreadsheet x28;
+    assert(x28.setCell(CPos("C1"), "100"));
+    for (int row = 1; row <= 50; row++) {
+        assert(x28.setCell(CPos("A" + std::to_string(row)), std::to_string(row)));
+        assert(x28.setCell(CPos("B" + std::to_string(row)), "=A" + std::to_string(row) + "*2+$C$1+sum($A$1:A" + std::to_string(row) + ")"));
+    }
+    CAstStats x28Stats = x28.getAstStats();
+    assert(x28Stats.m_ParseHits == 49 && x28Stats.m_ParseMisses == 1);
+    assert(valueMatch(x28.getValue(CPos("B1")), CValue(103.0)));
+    assert(valueMatch(x28.getValue(CPos("B50")), CValue(1475.0)));
+    assert(x28.setCell(CPos("D7"), "=a7*2+$C$1+sum($A$1:a7)"));
+    assert(valueMatch(x28.getValue(CPos("D7")), CValue(142.0)));
+    assert(x28.setCell(CPos("E7"), "=\"B\"+C7"));
+    assert(x28.setCell(CPos("E8"), "=\"B\"+C8"));
+    assert(valueMatch(x28.getValue(CPos("E7")), CValue()));
+    assert(x28.setCell(CPos("C8"), "x"));
+    assert(valueMatch(x28.getValue(CPos("E8")), CValue("Bx")));
+    x28Stats = x28.getAstStats();
+    assert(x28Stats.m_ParseHits == 50 && x28Stats.m_ParseMisses == 3);
+    oss.clear();
+    oss.str("");
+    assert(x28.save(oss));
+    assert(oss.str().find("<ID>B9</ID><VAL>=A9*2+$C$1+sum($A$1:A9)</VAL>") != std::string::npos);
+    x28.setParseCacheCapacity(1);
+    assert(x28.setCell(CPos("F1"), "=A1"));
+    assert(x28.setCell(CPos("F2"), "=A1"));
+    assert(x28.setCell(CPos("F3"), "=A2"));
+    assert(x28.getAstStats().m_ParseMisses == 5);
+    iss.clear();
+    iss.str("=A1+1\n=A2+1\n=B1\n");
+    assert(x28.importCsv(iss, CPos("G1")));
+    assert(valueMatch(x28.getValue(CPos("G2")), CValue(3.0)));
+    assert(x28.getAstStats().m_ParseHits == 52);
+
+    // Large ranges are folded chunk by chunk and chunk results are added pairwise
+    CSpreadsheet x29;
+    CRangeNode::setWorkers(4);
+    std::string x29Csv;
+    for (int row = 0; row < 70000; row++)
+        x29Csv += "0.1\n";
+    iss.clear();
+    iss.str(x29Csv);
+    assert(x29.importCsv(iss, CPos("A1")));
+    assert(x29.setCell(CPos("A2"), "7"));
+    assert(x29.setCell(CPos("A3"), "text"));
+    assert(x29.setCell(CPos("A70000"), "-5"));
+    assert(x29.setCell(CPos("B1"), "=A2*3"));
+    assert(x29.setCell(CPos("C1"), "=sum(A1:A70000)"));
+    assert(x29.setCell(CPos("C2"), "=count(A1:B35000)"));
+    assert(x29.setCell(CPos("C3"), "=countval(0.1, A1:A70000)"));
+    assert(x29.setCell(CPos("C4"), "=max(A1:B35000)"));
+    assert(x29.setCell(CPos("C5"), "=min(A1:A70000)"));
+    double x29Chunks[5] = {};
+    for (size_t i = 0; i < 70000; i++) {
+        if (i != 2)
+            x29Chunks[i / CRangeNode::CHUNK_CELLS] += i == 1 ? 7 : i == 69999 ? -5 : 0.1;
+    }
+    double x29Sum = ((x29Chunks[0] + x29Chunks[1]) + (x29Chunks[2] + x29Chunks[3])) + x29Chunks[4];
+    assert(std::get<double>(x29.getValue(CPos("C1"))) == x29Sum);
+    assert(std::get<double>(x29.getValue(CPos("C1"))) == x29Sum);
+    assert(valueMatch(x29.getValue(CPos("C2")), CValue(35001.0)));
+    assert(valueMatch(x29.getValue(CPos("C3")), CValue(69997.0)));
+    assert(valueMatch(x29.getValue(CPos("C4")), CValue(21.0)));
+    assert(valueMatch(x29.getValue(CPos("C5")), CValue(-5.0)));
+    // Scenarios fold the same chunks on their own thread, unchanged inputs give the very same sum
+    auto x29Results = x29.evaluateScenarios({{}, {{CPos("A2"), CValue(7.0)}}}, {CPos("C1")});
+    assert(std::get<double>(x29Results[0][0]) == x29Sum && std::get<double>(x29Results[1][0]) == x29Sum);
+    // NaN is the minimum only as the first number of the range, like in a serial scan
+    assert(x29.setCell(CPos("A16385"), "=10^999-10^999"));
+    assert(valueMatch(x29.getValue(CPos("C5")), CValue(-5.0)));
+    assert(x29.setCell(CPos("A1"), "=10^999-10^999"));
+    assert(std::isnan(std::get<double>(x29.getValue(CPos("C5")))));
+    CRangeNode::setWorkers(0);
+    // Pool threads are reused by later jobs, every chunk runs exactly once
+    std::vector<std::atomic<int>> x29Runs(1000);
+    for (int job = 0; job < 50; job++)
+        CWorkerPool::instance().run(x29Runs.size(), 4, [&x29Runs](size_t chunk) { x29Runs[chunk]++; });
+    assert(std::all_of(x29Runs.begin(), x29Runs.end(), [](const std::atomic<int> &runs) { return runs == 50; }));
+
+    // Scenarios replace inputs in private overlays and leave the sheet untouched
+    CSpreadsheet x30;
+    assert(x30.setCell(CPos("A1"), "10"));
+    assert(x30.setCell(CPos("A2"), "20"));
+    assert(x30.setCell(CPos("A3"), "=A1+A2"));
+    assert(x30.setCell(CPos("A4"), "=sum(A1:A3)"));
+    assert(x30.setCell(CPos("A5"), "=A7*2"));
+    assert(x30.setCell(CPos("C1"), "=C2"));
+    assert(x30.setCell(CPos("C2"), "=C1"));
+    std::vector<CPos> x30Outputs = {CPos("A3"), CPos("A4"), CPos("A5"), CPos("C1"), CPos("A1")};
+    std::vector<std::map<CPos, CValue>> x30Inputs = {{}, {{CPos("A1"), CValue(1.0)}}, {{CPos("A7"), CValue(5.0)}},
+                                                     {{CPos("A3"), CValue("x")}}, {{CPos("C2"), CValue(1.0)}}};
+    auto x30Results = x30.evaluateScenarios(x30Inputs, x30Outputs);
+    assert(x30Results.size() == 5 && x30Results[0].size() == 5);
+    assert(valueMatch(x30Results[0][1], CValue(60.0)) && valueMatch(x30Results[0][2], CValue()));
+    assert(valueMatch(x30Results[1][0], CValue(21.0)) && valueMatch(x30Results[1][1], CValue(42.0)));
+    assert(valueMatch(x30Results[1][4], CValue(1.0)));
+    assert(valueMatch(x30Results[2][2], CValue(10.0)));
+    assert(valueMatch(x30Results[3][0], CValue("x")) && valueMatch(x30Results[3][1], CValue(30.0)));
+    assert(valueMatch(x30Results[4][3], CValue()));
+    assert(valueMatch(x30.getValue(CPos("A3")), CValue(30.0)));
+    assert(valueMatch(x30.getValue(CPos("A5")), CValue()));
+    x30Inputs.clear();
+    for (int i = 0; i < 100; i++)
+        x30Inputs.push_back({{CPos("A2"), CValue(double(i))}});
+    x30.setAstBudget(2);
+    assert(valueMatch(x30.getValue(CPos("A5")), CValue()));
+    assert(x30.getAstStats().m_Evictions > 0);
+    x30Results = x30.evaluateScenarios(x30Inputs, x30Outputs, 4);
+    for (int i = 0; i < 100; i++)
+        assert(valueMatch(x30Results[i][1], CValue(2.0 * (10 + i))));
+    assert(valueMatch(x30.getValue(CPos("A4")), CValue(60.0)));
     return EXIT_SUCCESS;
 }
 #endif /* __PROGTEST__ */
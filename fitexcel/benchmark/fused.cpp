@@ -0,0 +1,78 @@
+/******************************************************
+ * Filename: fused.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code measures evaluation of the hot binary formula shapes (reference with reference,
+ *              reference with number) built as generic operator trees and as fused nodes.
+ ******************************************************/
+
+#include "../spreadsheet.h"
+#include <iostream>
+
+/**
+ * Evaluates node repeatedly and returns average time of one evaluation
+ * @param node Evaluated node
+ * @param table Table data
+ * @param iterations Number of evaluations
+ * @return Nanoseconds per evaluation
+*/
+double measure(CNode &node, std::map<std::string, CCell> &table, size_t iterations) {
+    double sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        CValue value = node.evaluate(table);
+        if (std::holds_alternative<double>(value))
+            sink += std::get<double>(value);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    // Keeps the loop from being optimized away
+    if (sink == -1)
+        std::cout << sink;
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+void report(const std::string &shape, CNode &generic, CNode &fused, std::map<std::string, CCell> &table, size_t iterations) {
+    if (generic.evaluate(table) != fused.evaluate(table)) {
+        std::cout << shape << ": results differ" << std::endl;
+        return;
+    }
+
+    // Warm up caches and branch predictors before measuring
+    measure(generic, table, iterations / 10 + 1);
+    measure(fused, table, iterations / 10 + 1);
+    double genericTime = measure(generic, table, iterations);
+    double fusedTime = measure(fused, table, iterations);
+    std::cout << std::left << std::setw(10) << shape << std::right << std::fixed << std::setprecision(2)
+              << std::setw(12) << genericTime << std::setw(12) << fusedTime
+              << std::setw(10) << genericTime / fusedTime << 'x' << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t iterations = argc > 1 ? std::stoul(argv[1]) : 10000000;
+    CPos cell("C1"), a1("A1"), b1("B1");
+    std::map<std::string, CCell> table;
+    table.emplace(a1.getId(), CCell(a1, "1.5", CValue(1.5)));
+    table.emplace(b1.getId(), CCell(b1, "4", CValue(4.0)));
+
+    std::cout << std::left << std::setw(10) << "shape" << std::right << std::setw(12) << "generic ns"
+              << std::setw(12) << "fused ns" << std::setw(11) << "speedup" << std::endl;
+
+    CAddOperatorNode addGeneric(std::make_unique<CRelativeReferenceNode>(cell, a1, "A1"),
+                                std::make_unique<CRelativeReferenceNode>(cell, b1, "B1"));
+    CBinaryFused<COpAdd, CRefOperand, CRefOperand> addFused(cell, CRefOperand(a1, false, false), CRefOperand(b1, false, false));
+    report("A1+B1", addGeneric, addFused, table, iterations);
+
+    CMulOperatorNode mulGeneric(std::make_unique<CRelativeReferenceNode>(cell, a1, "A1"), std::make_unique<CNumberNode>(2));
+    CBinaryFused<COpMul, CRefOperand, CConstOperand> mulFused(cell, CRefOperand(a1, false, false), CConstOperand(2));
+    report("A1*2", mulGeneric, mulFused, table, iterations);
+
+    CSubOperatorNode subGeneric(std::make_unique<CNumberNode>(10), std::make_unique<CAbsoluteReferenceNode>(cell, b1, "B1"));
+    CBinaryFused<COpSub, CConstOperand, CRefOperand> subFused(cell, CConstOperand(10), CRefOperand(b1, true, true));
+    report("10-$B$1", subGeneric, subFused, table, iterations);
+
+    CDivOperatorNode divGeneric(std::make_unique<CRelativeReferenceNode>(cell, b1, "B1"), std::make_unique<CNumberNode>(3));
+    CBinaryFused<COpDiv, CRefOperand, CConstOperand> divFused(cell, CRefOperand(b1, false, false), CConstOperand(3));
+    report("B1/3", divGeneric, divFused, table, iterations);
+    return EXIT_SUCCESS;
+}
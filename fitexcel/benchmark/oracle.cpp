@@ -0,0 +1,624 @@
+/******************************************************
+ * Filename: oracle.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code generates random sheets with references, ranges, copies, cycles and strings and
+ *              evaluates them both by a deliberately simple reference evaluator and by CSpreadsheet.
+ *              Any difference is reported with the seed that reproduces it, matching scenarios report
+ *              the speedup of the spreadsheet over the reference evaluator.
+ ******************************************************/
+
+#include "../spreadsheet.h"
+#include <iostream>
+#include <random>
+
+/**
+ * Formula of the reference model. References keep the cell they point to, so no parsing is needed
+ * and copying only moves their relative parts
+*/
+struct CExpr {
+    enum EKind { NUMBER, STRING, REFERENCE, BINARY, NEGATION, RANGE_FUNCTION, COUNTVAL, IF };
+    EKind m_Kind = NUMBER;
+    double m_Number = 0;
+
+    // String literal, operator symbol or function name
+    std::string m_Text;
+
+    // Reference uses the first corner, range both of them
+    long m_Column[2] = {0, 0};
+    long m_Row[2] = {0, 0};
+    bool m_AbsoluteColumn[2] = {false, false};
+    bool m_AbsoluteRow[2] = {false, false};
+    std::vector<CExpr> m_Args;
+};
+
+struct CModelCell {
+    bool m_Formula = false;
+    CValue m_Literal;
+    CExpr m_Expr;
+};
+
+/****************************************************************************/
+
+std::string columnName(long column) {
+    std::string name;
+    for (column++; column > 0; column = (column - 1) / 26)
+        name.insert(name.begin(), static_cast<char>('A' + (column - 1) % 26));
+    return name;
+}
+
+std::string cellName(long column, long row) {
+    return columnName(column) + std::to_string(row);
+}
+
+std::string describe(const CValue &value) {
+    if (std::holds_alternative<double>(value)) {
+        std::ostringstream os;
+        os << std::setprecision(17) << std::get<double>(value);
+        return os.str();
+    }
+    if (std::holds_alternative<std::string>(value))
+        return '"' + std::get<std::string>(value) + '"';
+    return "undefined";
+}
+
+bool valueMatch(const CValue &r, const CValue &s) {
+    if (r.index() != s.index())
+        return false;
+    if (r.index() == 0)
+        return true;
+    if (r.index() == 2)
+        return std::get<std::string>(r) == std::get<std::string>(s);
+    if (std::isnan(std::get<double>(r)) && std::isnan(std::get<double>(s)))
+        return true;
+    if (std::isinf(std::get<double>(r)) && std::isinf(std::get<double>(s)))
+        return (std::get<double>(r) < 0 && std::get<double>(s) < 0) || (std::get<double>(r) > 0 && std::get<double>(s) > 0);
+    return fabs(std::get<double>(r) - std::get<double>(s)) <= 1e8 * DBL_EPSILON * fabs(std::get<double>(r));
+}
+
+/****************************************************************************/
+
+/**
+ * Straightforward evaluator following the specification: a cell from which a cycle can be reached is undefined,
+ * other cells are evaluated recursively. Values are kept only for one evaluation of the area
+*/
+class CReferenceSheet {
+public:
+    void setLiteral(long column, long row, const CValue &value) {
+        CModelCell &cell = m_Cells[{column, row}];
+        cell.m_Formula = false;
+        cell.m_Literal = value;
+    }
+
+    void setFormula(long column, long row, const CExpr &expr) {
+        CModelCell &cell = m_Cells[{column, row}];
+        cell.m_Formula = true;
+        cell.m_Expr = expr;
+    }
+
+    void copyRect(long dstColumn, long dstRow, long srcColumn, long srcRow, long w, long h) {
+        // Sources are read before anything is written
+        std::map<std::pair<long, long>, CModelCell> copies;
+        for (long column = 0; column < w; column++) {
+            for (long row = 0; row < h; row++) {
+                auto cell = m_Cells.find({srcColumn + column, srcRow + row});
+                if (cell == m_Cells.end())
+                    continue;
+                CModelCell copy = cell->second;
+                if (copy.m_Formula)
+                    copy.m_Expr = shifted(copy.m_Expr, dstColumn - srcColumn, dstRow - srcRow);
+                copies[{dstColumn + column, dstRow + row}] = copy;
+            }
+        }
+
+        for (long column = 0; column < w; column++)
+            for (long row = 0; row < h; row++)
+                m_Cells.erase({dstColumn + column, dstRow + row});
+        for (auto &[pos, cell] : copies)
+            m_Cells[pos] = cell;
+    }
+
+    /**
+     * Evaluates every cell of the area
+     * @return Values row by row
+    */
+    std::vector<CValue> evaluate(long columns, long rows) {
+        m_State.clear();
+        m_Values.clear();
+        std::vector<CValue> values;
+        for (long row = 1; row <= rows; row++)
+            for (long column = 0; column < columns; column++)
+                values.push_back(value(column, row));
+        return values;
+    }
+
+    const std::map<std::pair<long, long>, CModelCell> &cells() const {
+        return m_Cells;
+    }
+
+    /**
+     * Moves relative parts of all references like copying the formula does
+     * @return Moved formula
+    */
+    static CExpr shifted(CExpr expr, long columns, long rows) {
+        for (size_t i = 0; i < 2; i++) {
+            if (!expr.m_AbsoluteColumn[i])
+                expr.m_Column[i] += columns;
+            if (!expr.m_AbsoluteRow[i])
+                expr.m_Row[i] += rows;
+        }
+        for (CExpr &arg : expr.m_Args)
+            arg = shifted(std::move(arg), columns, rows);
+        return expr;
+    }
+
+private:
+    enum EState { VISITING, CLEAN, CYCLIC };
+
+    static void precedents(const CExpr &expr, const std::map<std::pair<long, long>, CModelCell> &cells, std::vector<std::pair<long, long>> &out) {
+        if (expr.m_Kind == CExpr::REFERENCE)
+            out.push_back({expr.m_Column[0], expr.m_Row[0]});
+        if (expr.m_Kind == CExpr::RANGE_FUNCTION || expr.m_Kind == CExpr::COUNTVAL) {
+            for (auto &[pos, cell] : cells)
+                if (inRange(expr, pos.first, pos.second))
+                    out.push_back(pos);
+        }
+        for (const CExpr &arg : expr.m_Args)
+            precedents(arg, cells, out);
+    }
+
+    static bool inRange(const CExpr &expr, long column, long row) {
+        return column >= std::min(expr.m_Column[0], expr.m_Column[1]) && column <= std::max(expr.m_Column[0], expr.m_Column[1])
+            && row >= std::min(expr.m_Row[0], expr.m_Row[1]) && row <= std::max(expr.m_Row[0], expr.m_Row[1]);
+    }
+
+    // Depth first search, every cell still on the stack when a cycle is found reaches that cycle
+    bool cyclic(const std::pair<long, long> &pos) {
+        auto cell = m_Cells.find(pos);
+        if (cell == m_Cells.end() || !cell->second.m_Formula)
+            return false;
+        auto state = m_State.find(pos);
+        if (state != m_State.end())
+            return state->second != CLEAN;
+
+        m_State[pos] = VISITING;
+        std::vector<std::pair<long, long>> next;
+        precedents(cell->second.m_Expr, m_Cells, next);
+        bool found = false;
+        for (const auto &precedent : next)
+            found = cyclic(precedent) || found;
+        m_State[pos] = found ? CYCLIC : CLEAN;
+        return found;
+    }
+
+    CValue value(long column, long row) {
+        auto cell = m_Cells.find({column, row});
+        if (cell == m_Cells.end())
+            return CValue();
+        if (!cell->second.m_Formula)
+            return cell->second.m_Literal;
+        if (cyclic({column, row}))
+            return CValue();
+
+        auto known = m_Values.find({column, row});
+        if (known != m_Values.end())
+            return known->second;
+        CValue result = evaluate(cell->second.m_Expr);
+        m_Values[{column, row}] = result;
+        return result;
+    }
+
+    CValue evaluate(const CExpr &expr) {
+        switch (expr.m_Kind) {
+            case CExpr::NUMBER:
+                return CValue(expr.m_Number);
+            case CExpr::STRING:
+                return CValue(expr.m_Text);
+            case CExpr::REFERENCE:
+                return value(expr.m_Column[0], expr.m_Row[0]);
+            case CExpr::NEGATION: {
+                CValue operand = evaluate(expr.m_Args[0]);
+                return std::holds_alternative<double>(operand) ? CValue(-std::get<double>(operand)) : CValue();
+            }
+            case CExpr::BINARY:
+                return binary(expr.m_Text, evaluate(expr.m_Args[0]), evaluate(expr.m_Args[1]));
+            case CExpr::IF: {
+                CValue condition = evaluate(expr.m_Args[0]);
+                if (!std::holds_alternative<double>(condition))
+                    return CValue();
+                return evaluate(expr.m_Args[std::get<double>(condition) != 0 ? 1 : 2]);
+            }
+            case CExpr::COUNTVAL:
+            case CExpr::RANGE_FUNCTION:
+                return function(expr);
+        }
+        return CValue();
+    }
+
+    CValue function(const CExpr &expr) {
+        std::vector<CValue> values;
+        for (long column = std::min(expr.m_Column[0], expr.m_Column[1]); column <= std::max(expr.m_Column[0], expr.m_Column[1]); column++)
+            for (long row = std::min(expr.m_Row[0], expr.m_Row[1]); row <= std::max(expr.m_Row[0], expr.m_Row[1]); row++)
+                values.push_back(value(column, row));
+
+        double count = 0;
+        std::vector<double> numbers;
+        if (expr.m_Kind == CExpr::COUNTVAL) {
+            CValue target = evaluate(expr.m_Args[0]);
+            for (const CValue &value : values)
+                count += value == target;
+            return CValue(count);
+        }
+        for (const CValue &value : values) {
+            count += !std::holds_alternative<std::monostate>(value);
+            if (std::holds_alternative<double>(value))
+                numbers.push_back(std::get<double>(value));
+        }
+
+        if (expr.m_Text == "count")
+            return CValue(count);
+        if (numbers.empty())
+            return CValue();
+        if (expr.m_Text == "min")
+            return CValue(*std::min_element(numbers.begin(), numbers.end()));
+        if (expr.m_Text == "max")
+            return CValue(*std::max_element(numbers.begin(), numbers.end()));
+        double sum = 0;
+        for (double number : numbers)
+            sum += number;
+        return CValue(sum);
+    }
+
+    static CValue binary(const std::string &op, const CValue &left, const CValue &right) {
+        bool numbers = std::holds_alternative<double>(left) && std::holds_alternative<double>(right);
+        bool strings = std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right);
+        if (op == "+") {
+            if (numbers)
+                return CValue(std::get<double>(left) + std::get<double>(right));
+            if (strings)
+                return CValue(std::get<std::string>(left) + std::get<std::string>(right));
+            if (std::holds_alternative<std::string>(left) && std::holds_alternative<double>(right))
+                return CValue(std::get<std::string>(left) + std::to_string(std::get<double>(right)));
+            if (std::holds_alternative<double>(left) && std::holds_alternative<std::string>(right))
+                return CValue(std::to_string(std::get<double>(left)) + std::get<std::string>(right));
+            return CValue();
+        }
+        if (op == "-" || op == "*" || op == "/" || op == "^") {
+            if (!numbers)
+                return CValue();
+            double l = std::get<double>(left);
+            double r = std::get<double>(right);
+            if (op == "-")
+                return CValue(l - r);
+            if (op == "*")
+                return CValue(l * r);
+            if (op == "^")
+                return CValue(std::pow(l, r));
+            return r == 0 ? CValue() : CValue(l / r);
+        }
+
+        // Relational operators compare two numbers or two strings, NaN is unordered
+        if (numbers)
+            return CValue(compare(op, std::get<double>(left), std::get<double>(right)) ? 1.0 : 0.0);
+        if (strings)
+            return CValue(compare(op, std::get<std::string>(left), std::get<std::string>(right)) ? 1.0 : 0.0);
+        return CValue();
+    }
+
+    template <typename T>
+    static bool compare(const std::string &op, const T &left, const T &right) {
+        if (op == "=")
+            return left == right;
+        if (op == "<>")
+            return left != right;
+        if (op == "<")
+            return left < right;
+        if (op == "<=")
+            return left <= right;
+        if (op == ">")
+            return left > right;
+        return left >= right;
+    }
+
+    std::map<std::pair<long, long>, CModelCell> m_Cells;
+    std::map<std::pair<long, long>, EState> m_State;
+    std::map<std::pair<long, long>, CValue> m_Values;
+};
+
+/****************************************************************************/
+
+struct CScenario {
+    std::string m_Name;
+    long m_Columns;
+    long m_Rows;
+    // Probability of a formula, a text literal or a number literal follows otherwise
+    double m_Formulas;
+    double m_Strings;
+    // References may point anywhere, not only to cells above
+    bool m_Cycles;
+    int m_Depth;
+    int m_Copies;
+    // Probability that a formula repeats the formula above it in relative form, as filled down columns do
+    double m_Repeats;
+};
+
+class CGenerator {
+public:
+    CGenerator(const CScenario &scenario, unsigned seed)
+        : m_Scenario(scenario)
+        , m_Random(seed) {}
+
+    /**
+     * Fills both sheets with the same random contents and applies the same random copies
+     * @param model Reference sheet
+     * @param sheet Spreadsheet
+    */
+    void fill(CReferenceSheet &model, CSpreadsheet &sheet) {
+        for (long row = 1; row <= m_Scenario.m_Rows; row++) {
+            for (long column = 0; column < m_Scenario.m_Columns; column++) {
+                double kind = uniform();
+                if (kind < 0.1)
+                    continue;
+                if (kind < 0.1 + m_Scenario.m_Formulas) {
+                    auto above = model.cells().find({column, row - 1});
+                    bool repeat = above != model.cells().end() && above->second.m_Formula && uniform() < m_Scenario.m_Repeats;
+                    CExpr expr = repeat ? CReferenceSheet::shifted(above->second.m_Expr, 0, 1) : randomExpr(column, row, m_Scenario.m_Depth);
+                    model.setFormula(column, row, expr);
+                    set(sheet, column, row, "=" + render(expr));
+                } else if (uniform() < m_Scenario.m_Strings) {
+                    std::string text = randomText();
+                    model.setLiteral(column, row, CValue(text));
+                    set(sheet, column, row, text);
+                } else {
+                    int number = pick(-20, 99);
+                    model.setLiteral(column, row, CValue(double(number)));
+                    set(sheet, column, row, std::to_string(number));
+                }
+            }
+        }
+
+        // Copies only move down and right, so relative references stay on the sheet
+        for (int i = 0; i < m_Scenario.m_Copies; i++) {
+            long w = pick(1, m_Scenario.m_Columns / 2);
+            long h = pick(1, m_Scenario.m_Rows / 2);
+            long srcColumn = pick(0, m_Scenario.m_Columns - w);
+            long srcRow = pick(1, m_Scenario.m_Rows - h + 1);
+            long dstColumn = pick(srcColumn, m_Scenario.m_Columns - w);
+            long dstRow = pick(srcRow, m_Scenario.m_Rows - h + 1);
+            model.copyRect(dstColumn, dstRow, srcColumn, srcRow, w, h);
+            sheet.copyRect(CPos(cellName(dstColumn, dstRow)), CPos(cellName(srcColumn, srcRow)), w, h);
+        }
+    }
+
+private:
+    double uniform() {
+        return std::uniform_real_distribution<double>(0, 1)(m_Random);
+    }
+
+    long pick(long from, long to) {
+        return std::uniform_int_distribution<long>(from, std::max(from, to))(m_Random);
+    }
+
+    static void set(CSpreadsheet &sheet, long column, long row, const std::string &contents) {
+        if (!sheet.setCell(CPos(cellName(column, row)), contents))
+            throw std::logic_error("rejected " + cellName(column, row) + ": " + contents);
+    }
+
+    std::string randomText() {
+        static const char *texts[] = {"a", "ab", "abc", "b", "text", "x y", "quote \"", "0a"};
+        return texts[pick(0, 7)];
+    }
+
+    // Acyclic scenarios reference only rows above the cell
+    bool randomTarget(long row, long &targetColumn, long &targetRow) {
+        long lastRow = m_Scenario.m_Cycles ? m_Scenario.m_Rows : row - 1;
+        if (lastRow < 1)
+            return false;
+        targetColumn = pick(0, m_Scenario.m_Columns - 1);
+        targetRow = m_Scenario.m_Cycles ? pick(1, lastRow) : pick(std::max(1L, row - 8), lastRow);
+        return true;
+    }
+
+    CExpr randomExpr(long column, long row, int depth) {
+        CExpr expr;
+        double kind = uniform();
+        if (depth == 0 || kind < 0.15) {
+            if (uniform() < m_Scenario.m_Strings) {
+                expr.m_Kind = CExpr::STRING;
+                expr.m_Text = randomText();
+            } else {
+                expr.m_Number = pick(0, 9);
+            }
+            return expr;
+        }
+
+        if (kind < 0.5) {
+            if (!randomTarget(row, expr.m_Column[0], expr.m_Row[0]))
+                return randomExpr(column, row, 0);
+            expr.m_Kind = CExpr::REFERENCE;
+            expr.m_AbsoluteColumn[0] = uniform() < 0.2;
+            expr.m_AbsoluteRow[0] = uniform() < 0.2;
+            return expr;
+        }
+
+        if (kind < 0.62) {
+            long top, left;
+            if (!randomTarget(row, left, top))
+                return randomExpr(column, row, 0);
+            static const char *functions[] = {"sum", "count", "min", "max", "countval"};
+            expr.m_Text = functions[pick(0, 4)];
+            expr.m_Kind = expr.m_Text == "countval" ? CExpr::COUNTVAL : CExpr::RANGE_FUNCTION;
+            long bottom = m_Scenario.m_Cycles ? top + pick(0, 6) : pick(top, row - 1);
+            expr.m_Column[0] = left;
+            expr.m_Row[0] = top;
+            expr.m_Column[1] = std::min(m_Scenario.m_Columns - 1, left + pick(0, 3));
+            expr.m_Row[1] = std::min(m_Scenario.m_Rows, bottom);
+            for (size_t i = 0; i < 2; i++) {
+                expr.m_AbsoluteColumn[i] = uniform() < 0.2;
+                expr.m_AbsoluteRow[i] = uniform() < 0.2;
+            }
+            if (expr.m_Kind == CExpr::COUNTVAL)
+                expr.m_Args.push_back(randomExpr(column, row, 0));
+            return expr;
+        }
+
+        if (kind < 0.68) {
+            expr.m_Kind = CExpr::NEGATION;
+            expr.m_Args.push_back(randomExpr(column, row, depth - 1));
+            return expr;
+        }
+
+        if (kind < 0.74) {
+            expr.m_Kind = CExpr::IF;
+            for (int i = 0; i < 3; i++)
+                expr.m_Args.push_back(randomExpr(column, row, depth - 1));
+            return expr;
+        }
+
+        static const char *operators[] = {"+", "+", "-", "*", "/", "^", "=", "<>", "<", "<=", ">", ">="};
+        expr.m_Kind = CExpr::BINARY;
+        expr.m_Text = operators[pick(0, 11)];
+        expr.m_Args.push_back(randomExpr(column, row, depth - 1));
+        expr.m_Args.push_back(randomExpr(column, row, depth - 1));
+        return expr;
+    }
+
+    static std::string render(const CExpr &expr) {
+        auto corner = [&expr](size_t i) {
+            return std::string(expr.m_AbsoluteColumn[i] ? "$" : "") + columnName(expr.m_Column[i])
+                 + (expr.m_AbsoluteRow[i] ? "$" : "") + std::to_string(expr.m_Row[i]);
+        };
+
+        switch (expr.m_Kind) {
+            case CExpr::NUMBER:
+                return std::to_string(static_cast<long>(expr.m_Number));
+            case CExpr::STRING: {
+                std::string out = "\"";
+                for (char c : expr.m_Text)
+                    out += c == '"' ? std::string("\"\"") : std::string(1, c);
+                return out + '"';
+            }
+            case CExpr::REFERENCE:
+                return corner(0);
+            case CExpr::NEGATION:
+                return "(-" + render(expr.m_Args[0]) + ")";
+            case CExpr::BINARY:
+                return "(" + render(expr.m_Args[0]) + expr.m_Text + render(expr.m_Args[1]) + ")";
+            case CExpr::IF:
+                return "if(" + render(expr.m_Args[0]) + ", " + render(expr.m_Args[1]) + ", " + render(expr.m_Args[2]) + ")";
+            case CExpr::COUNTVAL:
+                return "countval(" + render(expr.m_Args[0]) + ", " + corner(0) + ":" + corner(1) + ")";
+            case CExpr::RANGE_FUNCTION:
+                return expr.m_Text + "(" + corner(0) + ":" + corner(1) + ")";
+        }
+        return "";
+    }
+
+    const CScenario &m_Scenario;
+    std::mt19937 m_Random;
+};
+
+/****************************************************************************/
+
+template <typename TFunction>
+double measure(TFunction &&function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Compares values cell by cell and prints the first differences
+ * @return Number of differing cells
+*/
+size_t compare(const std::string &check, const CScenario &scenario, unsigned seed, const std::vector<CValue> &expected, const std::vector<CValue> &actual) {
+    size_t mismatches = 0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (valueMatch(expected[i], actual[i]))
+            continue;
+        if (mismatches++ < 5)
+            std::cout << scenario.m_Name << " seed " << seed << ' ' << check << ' '
+                      << cellName(i % scenario.m_Columns, i / scenario.m_Columns + 1)
+                      << ": expected " << describe(expected[i]) << ", got " << describe(actual[i]) << std::endl;
+    }
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned seeds = argc > 1 ? std::stoul(argv[1]) : 20;
+    const std::vector<CScenario> scenarios = {
+        {"references", 10, 120, 0.6, 0.0, false, 3, 0, 0.0},
+        {"ranges", 8, 150, 0.7, 0.0, false, 1, 0, 0.0},
+        {"copies", 12, 80, 0.5, 0.1, false, 3, 6, 0.0},
+        {"fills", 10, 120, 0.8, 0.1, false, 3, 0, 0.9},
+        {"cycles", 8, 60, 0.35, 0.1, true, 2, 2, 0.2},
+        {"strings", 8, 100, 0.5, 0.6, false, 3, 2, 0.0}
+    };
+
+    std::cout << std::left << std::setw(12) << "scenario" << std::right << std::setw(10) << "cells"
+              << std::setw(12) << "oracle ms" << std::setw(12) << "engine ms" << std::setw(11) << "speedup"
+              << std::setw(12) << "mismatches" << std::endl;
+
+    size_t failures = 0;
+    for (const CScenario &scenario : scenarios) {
+        size_t cells = 0, mismatches = 0;
+        double oracleTime = 0, engineTime = 0;
+        for (unsigned seed = 1; seed <= seeds; seed++) {
+            CReferenceSheet model;
+            CSpreadsheet sheet;
+            CGenerator(scenario, seed).fill(model, sheet);
+            cells += model.cells().size();
+
+            std::vector<CValue> expected, batch(scenario.m_Columns * scenario.m_Rows), single;
+            oracleTime += measure([&] { expected = model.evaluate(scenario.m_Columns, scenario.m_Rows); });
+            engineTime += measure([&] { sheet.getValues(CPos("A1"), scenario.m_Columns, scenario.m_Rows, batch); });
+            mismatches += compare("getValues", scenario, seed, expected, batch);
+
+            for (long row = 1; row <= scenario.m_Rows; row++)
+                for (long column = 0; column < scenario.m_Columns; column++)
+                    single.push_back(sheet.getValue(CPos(cellName(column, row))));
+            mismatches += compare("getValue", scenario, seed, expected, single);
+
+            // Inputs replace only literal and empty cells, so the model gets them as literals with the same cycles
+            std::mt19937 random(seed);
+            std::vector<std::map<CPos, CValue>> inputs(4);
+            std::vector<CPos> outputs;
+            for (long row = 1; row <= scenario.m_Rows; row++)
+                for (long column = 0; column < scenario.m_Columns; column++)
+                    outputs.push_back(CPos(cellName(column, row)));
+            for (auto &input : inputs) {
+                for (int i = 0; i < 6; i++) {
+                    long column = random() % scenario.m_Columns;
+                    long row = random() % scenario.m_Rows + 1;
+                    auto cell = model.cells().find({column, row});
+                    if (cell == model.cells().end() || !cell->second.m_Formula)
+                        input[CPos(cellName(column, row))] = random() % 4 ? CValue(double(random() % 100)) : CValue("what if");
+                }
+            }
+            auto results = sheet.evaluateScenarios(inputs, outputs);
+            for (size_t i = 0; i < inputs.size(); i++) {
+                CReferenceSheet changed = model;
+                for (const auto &[pos, value] : inputs[i])
+                    changed.setLiteral(pos.getColumnNumber() - 1, pos.getRow(), value);
+                mismatches += compare("scenarios", scenario, seed, changed.evaluate(scenario.m_Columns, scenario.m_Rows), results[i]);
+            }
+
+            // Saved formulas are parsed again, which checks unparsing of every node kind
+            std::stringstream file;
+            CSpreadsheet loaded;
+            if (!sheet.save(file) || !loaded.load(file)) {
+                std::cout << scenario.m_Name << " seed " << seed << ": save and load failed" << std::endl;
+                mismatches++;
+                continue;
+            }
+            loaded.getValues(CPos("A1"), scenario.m_Columns, scenario.m_Rows, batch);
+            mismatches += compare("load", scenario, seed, expected, batch);
+        }
+
+        failures += mismatches;
+        std::cout << std::left << std::setw(12) << scenario.m_Name << std::right << std::setw(10) << cells
+                  << std::fixed << std::setprecision(2) << std::setw(12) << oracleTime << std::setw(12) << engineTime
+                  << std::setw(10) << oracleTime / engineTime << 'x' << std::setw(12) << mismatches << std::endl;
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -15,28 +15,28 @@ void CBuilder::opAdd() {
     if (m_Nodes.empty() || m_Nodes.size() < 2) return;
     auto left = getTopNode();
     auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CAddOperatorNode>(std::move(right), std::move(left)));
+    pushBinary<COpAdd, CAddOperatorNode>(std::move(right), std::move(left));
 }
 
 void CBuilder::opSub() {
     if (m_Nodes.empty() || m_Nodes.size() < 2) return;
     auto left = getTopNode();
     auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CSubOperatorNode>(std::move(right), std::move(left)));
+    pushBinary<COpSub, CSubOperatorNode>(std::move(right), std::move(left));
 }
 
 void CBuilder::opMul() {
     if (m_Nodes.empty() || m_Nodes.size() < 2) return;
     auto left = getTopNode();
     auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CMulOperatorNode>(std::move(right), std::move(left)));
+    pushBinary<COpMul, CMulOperatorNode>(std::move(right), std::move(left));
 }
 
 void CBuilder::opDiv() {
     if (m_Nodes.empty() || m_Nodes.size() < 2) return;
     auto left = getTopNode();
     auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CDivOperatorNode>(std::move(right), std::move(left)));
+    pushBinary<COpDiv, CDivOperatorNode>(std::move(right), std::move(left));
 }
 
 void CBuilder::opPow() {
@@ -49,7 +49,7 @@ void CBuilder::opPow() {
 void CBuilder::opNeg() {
     if (m_Nodes.empty()) return;
     auto right = getTopNode();
-    m_Nodes.push(std::make_unique<CMulOperatorNode>(std::make_unique<CNumberNode>(-1.0), std::move(right)));
+    m_Nodes.push(std::make_unique<CNegOperatorNode>(std::move(right)));
 }
 
 void CBuilder::opEq() {
@@ -122,29 +122,252 @@ void CBuilder::valReference(std::string str) {
         return std::toupper(c);
     });
 
+    std::unique_ptr<CReferenceNode> reference;
     if (relative) {
         // Relative
-        m_Nodes.push(std::make_unique<CRelativeReferenceNode>(m_Pos, CPos(str), str));
+        reference = std::make_unique<CRelativeReferenceNode>(m_Pos, CPos(str), str);
     } else if (absoluteColumn && absoluteRow) {
         // Absolute
-        m_Nodes.push(std::make_unique<CAbsoluteReferenceNode>(m_Pos, CPos(str), str));
+        reference = std::make_unique<CAbsoluteReferenceNode>(m_Pos, CPos(str), str);
     } else if (absoluteColumn) {
         // Absolute column Relative row
-        m_Nodes.push(std::make_unique<CAbsRelReferenceNode>(m_Pos, CPos(str), str));
+        reference = std::make_unique<CAbsRelReferenceNode>(m_Pos, CPos(str), str);
     } else {
         // Relative column Absolute row
-        m_Nodes.push(std::make_unique<CRelAbsReferenceNode>(m_Pos, CPos(str), str));
+        reference = std::make_unique<CRelAbsReferenceNode>(m_Pos, CPos(str), str);
     }
 
-    m_Dependencies.push_back(str);
+    reference->setSheet(nextSheet());
+    m_Dependencies.push_back(reference->getDependency());
+    m_Nodes.push(std::move(reference));
 }
 
 void CBuilder::valRange(std::string str) {
-    // todo
+    auto range = std::make_unique<CRangeNode>(m_Pos, str);
+    range->setSheet(nextSheet());
+
+    // Range is kept as a single dependency instead of one per cell
+    m_Dependencies.push_back(range->getDependency());
+    m_Nodes.push(std::move(range));
 }
 
 void CBuilder::funcCall(std::string fnName, int paramCnt) {
-    // todo
+    if (paramCnt < 0 || m_Nodes.size() < static_cast<size_t>(paramCnt))
+        throw std::invalid_argument("Invalid function call!");
+
+    std::vector<std::unique_ptr<CNode>> params(paramCnt);
+    for (int i = paramCnt - 1; i >= 0; i--)
+        params[i] = getTopNode();
+
+    std::transform(fnName.begin(), fnName.end(), fnName.begin(), [](unsigned char c) {
+        return std::tolower(c);
+    });
+
+    if (fnName == "if" && paramCnt == 3) {
+        m_Nodes.push(std::make_unique<CIfFunctionNode>(std::move(params[0]), std::move(params[1]), std::move(params[2])));
+        return;
+    }
+
+    // Remaining functions take range as the last parameter
+    CRangeNode *rangeNode = paramCnt > 0 ? dynamic_cast<CRangeNode*>(params.back().get()) : nullptr;
+    if (rangeNode == nullptr)
+        throw std::invalid_argument("Invalid function call!");
+    params.back().release();
+    std::unique_ptr<CRangeNode> range(rangeNode);
+
+    if (fnName == "sum" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CSumFunctionNode>(std::move(range)));
+    } else if (fnName == "count" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CCountFunctionNode>(std::move(range)));
+    } else if (fnName == "min" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CMinFunctionNode>(std::move(range)));
+    } else if (fnName == "max" && paramCnt == 1) {
+        m_Nodes.push(std::make_unique<CMaxFunctionNode>(std::move(range)));
+    } else if (fnName == "countval" && paramCnt == 2) {
+        m_Nodes.push(std::make_unique<CCountvalFunctionNode>(std::move(params[0]), std::move(range)));
+    } else {
+        throw std::invalid_argument("Unknown function!");
+    }
+}
+
+std::optional<CRefOperand> CBuilder::refOperand(const CNode &node) {
+    // References to other sheets need the workbook, they keep the generic node
+    auto base = dynamic_cast<const CReferenceNode*>(&node);
+    if (base == nullptr || !base->getSheet().empty())
+        return std::nullopt;
+
+    if (auto reference = dynamic_cast<const CRelativeReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), false, false);
+    if (auto reference = dynamic_cast<const CAbsoluteReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), true, true);
+    if (auto reference = dynamic_cast<const CAbsRelReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), true, false);
+    if (auto reference = dynamic_cast<const CRelAbsReferenceNode*>(&node))
+        return CRefOperand(reference->getRefId(), false, true);
+    return std::nullopt;
+}
+
+std::optional<CConstOperand> CBuilder::constOperand(const CNode &node) {
+    if (auto number = dynamic_cast<const CNumberNode*>(&node))
+        return CConstOperand(number->getNumber());
+    return std::nullopt;
+}
+
+void CBuilder::parse(const std::string &expression) {
+    if (expression.find('!') == std::string::npos) {
+        parseExpression(expression, *this);
+        return;
+    }
+
+    m_Sheets.clear();
+    m_NextSheet = 0;
+    parseExpression(stripSheets(expression, m_Sheets), *this);
+}
+
+std::string CBuilder::nextSheet() {
+    return m_NextSheet < m_Sheets.size() ? m_Sheets[m_NextSheet++] : std::string();
+}
+
+bool CBuilder::isReference(std::string_view word) {
+    size_t i = word.size() > 0 && word[0] == '$';
+    size_t letters = i;
+    while (i < word.size() && std::isalpha(static_cast<unsigned char>(word[i])))
+        i++;
+    if (i == letters)
+        return false;
+    if (i < word.size() && word[i] == '$')
+        i++;
+    size_t digits = i;
+    while (i < word.size() && std::isdigit(static_cast<unsigned char>(word[i])))
+        i++;
+    return i > digits && i == word.size();
+}
+
+std::string CBuilder::stripSheets(std::string_view expression, std::vector<std::string> &sheets) {
+    auto isWord = [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+    };
+    auto wordEnd = [&expression, &isWord](size_t i) {
+        while (i < expression.size() && isWord(expression[i]))
+            i++;
+        return i;
+    };
+
+    std::string out;
+    out.reserve(expression.size());
+    std::string sheet;
+    bool qualified = false;
+    size_t i = 0;
+    while (i < expression.size()) {
+        char c = expression[i];
+        size_t end = i + 1;
+
+        if (std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$') {
+            end = wordEnd(i);
+            std::string_view word = expression.substr(i, end - i);
+            if (end < expression.size() && expression[end] == '!' && !qualified && word.find('$') == std::string_view::npos) {
+                sheet = word;
+                qualified = true;
+                i = end + 1;
+                continue;
+            }
+
+            // Every reference and range gets an entry, so that they can be matched with builder calls
+            if (isReference(word)) {
+                if (end + 1 < expression.size() && expression[end] == ':') {
+                    size_t second = wordEnd(end + 1);
+                    if (isReference(expression.substr(end + 1, second - end - 1)))
+                        end = second;
+                }
+                sheets.push_back(qualified ? sheet : std::string());
+                qualified = false;
+                out.append(expression.substr(i, end - i));
+                i = end;
+                continue;
+            }
+        } else if (c == '\'' && !qualified) {
+            // Quoted sheet name, quote inside is doubled
+            sheet.clear();
+            for (; end < expression.size(); end++) {
+                if (expression[end] == '\'' && (end + 1 >= expression.size() || expression[end + 1] != '\''))
+                    break;
+                if (expression[end] == '\'')
+                    end++;
+                sheet += expression[end];
+            }
+            if (end + 1 >= expression.size() || expression[end + 1] != '!')
+                throw std::invalid_argument("Invalid sheet name!");
+            qualified = true;
+            i = end + 2;
+            continue;
+        } else if (c == '"') {
+            // String literals are copied as they are, doubled quote does not end them
+            while (end < expression.size() && (expression[end] != '"' || (end + 1 < expression.size() && expression[end + 1] == '"')))
+                end += expression[end] == '"' ? 2 : 1;
+            end = std::min(end + 1, expression.size());
+        } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            // Exponent of a number is not a reference
+            end = wordEnd(i);
+            if (end < expression.size() && (expression[end] == '+' || expression[end] == '-') && std::tolower(expression[end - 1]) == 'e')
+                end = wordEnd(end + 1);
+            while (end < expression.size() && expression[end] == '.')
+                end = wordEnd(end + 1);
+        }
+
+        if (qualified)
+            throw std::invalid_argument("Sheet name must be followed by a reference!");
+        out.append(expression.substr(i, end - i));
+        i = end;
+    }
+
+    if (qualified)
+        throw std::invalid_argument("Sheet name must be followed by a reference!");
+    return out;
+}
+
+CValue CBuilder::parseLiteral(std::string_view contents) {
+    // Number literal: -?digits(.digits?)?([eE][+-]?digits)? followed by optional whitespace
+    size_t i = (!contents.empty() && contents[0] == '-') ? 1 : 0;
+    size_t digits = i;
+    while (i < contents.size() && std::isdigit(static_cast<unsigned char>(contents[i])))
+        i++;
+    if (i == digits)
+        return CValue(std::string(contents));
+
+    if (i < contents.size() && contents[i] == '.') {
+        i++;
+        while (i < contents.size() && std::isdigit(static_cast<unsigned char>(contents[i])))
+            i++;
+    }
+
+    if (i < contents.size() && (contents[i] == 'e' || contents[i] == 'E')) {
+        size_t exponent = i + 1;
+        if (exponent < contents.size() && (contents[exponent] == '+' || contents[exponent] == '-'))
+            exponent++;
+        size_t exponentDigits = exponent;
+        while (exponent < contents.size() && std::isdigit(static_cast<unsigned char>(contents[exponent])))
+            exponent++;
+        if (exponent == exponentDigits)
+            return CValue(std::string(contents));
+        i = exponent;
+    }
+
+    size_t end = i;
+    while (i < contents.size() && std::isspace(static_cast<unsigned char>(contents[i])))
+        i++;
+    if (i != contents.size())
+        return CValue(std::string(contents));
+
+    double number = 0;
+    auto [ptr, error] = std::from_chars(contents.data(), contents.data() + end, number);
+    if (error == std::errc::result_out_of_range) {
+        // Overflow and underflow behave like the parser (inf, 0)
+        number = std::strtod(std::string(contents.substr(0, end)).c_str(), nullptr);
+    }
+
+    if (std::isinf(number))
+        return CValue();
+    return CValue(number);
 }
 
 std::unique_ptr<CNode> CBuilder::getTopNode() {
@@ -24,8 +24,64 @@ public:
     std::vector<std::string> getDependencies() const;
     std::unique_ptr<CNode> buildAST();
 
+    /**
+     * Parses formula, references may be qualified by a sheet name (e.g. Sheet2!A1, 'Q1 data'!A1:B5).
+     * Qualifiers are stripped before the text reaches parseExpression and attached to the references afterwards
+     * @param expression Formula including the '=' prefix
+     * @throws std::invalid_argument when the formula is invalid
+    */
+    void parse(const std::string &expression);
+
+    /**
+     * Classifies cell contents without the '=' prefix the same way parseExpression does, but without building AST
+     * @param contents Cell contents
+     * @return Number for numeric literals (undefined on overflow), otherwise the contents as string
+    */
+    static CValue parseLiteral(std::string_view contents);
+
 private:
+    /**
+     * Pushes binary operation, operation of two references or of a reference and a number becomes one fused node
+     * @param left Left operand
+     * @param right Right operand
+    */
+    template <typename TOp, typename TNode>
+    void pushBinary(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
+
+    static std::optional<CRefOperand> refOperand(const CNode &node);
+    static std::optional<CConstOperand> constOperand(const CNode &node);
+
+    /**
+     * Removes sheet qualifiers from the formula
+     * @param expression Formula
+     * @param sheets Output qualifier of every reference and range in order of appearance, empty when unqualified
+     * @return Formula without qualifiers
+    */
+    static std::string stripSheets(std::string_view expression, std::vector<std::string> &sheets);
+    static bool isReference(std::string_view word);
+    std::string nextSheet();
+
     std::stack<std::unique_ptr<CNode>> m_Nodes;
     std::vector<std::string> m_Dependencies;
     CPos m_Pos;
-};
\ No newline at end of file
+    // Qualifiers of references in the parsed formula and index of the next one
+    std::vector<std::string> m_Sheets;
+    size_t m_NextSheet = 0;
+};
+
+template <typename TOp, typename TNode>
+void CBuilder::pushBinary(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) {
+    std::optional<CRefOperand> leftRef = refOperand(*left);
+    std::optional<CRefOperand> rightRef = refOperand(*right);
+    std::optional<CConstOperand> leftConst = leftRef ? std::nullopt : constOperand(*left);
+    std::optional<CConstOperand> rightConst = rightRef ? std::nullopt : constOperand(*right);
+
+    if (leftRef && rightRef)
+        m_Nodes.push(std::make_unique<CBinaryFused<TOp, CRefOperand, CRefOperand>>(m_Pos, *leftRef, *rightRef));
+    else if (leftRef && rightConst)
+        m_Nodes.push(std::make_unique<CBinaryFused<TOp, CRefOperand, CConstOperand>>(m_Pos, *leftRef, *rightConst));
+    else if (leftConst && rightRef)
+        m_Nodes.push(std::make_unique<CBinaryFused<TOp, CConstOperand, CRefOperand>>(m_Pos, *leftConst, *rightRef));
+    else
+        m_Nodes.push(std::make_unique<TNode>(std::move(left), std::move(right)));
+}
\ No newline at end of file
@@ -13,75 +13,144 @@
 ***********************************************/
 
 CPos::CPos(std::string_view str) {
-    if (str.empty())
+    size_t column = 0;
+    size_t row = 0;
+    if (!parse(str, column, row))
         throw std::invalid_argument("Invalid ID!");
-
-    size_t pos = str.find_first_of("0123456789");
-    if (pos == std::string::npos)
-        throw std::invalid_argument("Invalid ID!");
-
-    for (size_t i = 0; i < pos; i++) {
-        if (!std::isalpha(str[i]))
-            throw std::invalid_argument("Invalid ID!");
-        m_Column.push_back(std::toupper(str[i]));
-    }
-
-    std::string row(str.substr(pos));
-    if (!isValidRowNumber(row))
-        throw std::invalid_argument("Invalid ID!");
-
-    m_Row = std::stoi(row);
-    m_Id = str;
-    m_ColumnNumber = columnToNumber(m_Column);
-}
-
-CPos::CPos(const CPos &pos) 
-    : m_Id(pos.m_Id)
-    , m_Column(pos.m_Column)
-    , m_Row(pos.m_Row)
-    , m_ColumnNumber(pos.m_ColumnNumber) {}
-
-bool CPos::isValidRowNumber(const std::string &rowNumber) const {
-    for (size_t i = 0; i < rowNumber.length(); i++) {
-        if (!std::isdigit(rowNumber[i]))
-            return false;
-    }
-    return !(rowNumber.size() > 1 && rowNumber[0] == '0');
+    *this = CPos(column, row);
 }
 
 size_t CPos::columnToNumber(const std::string& column) {
     size_t result = 0;
-    size_t size = column.size();
-    for (size_t i = 0; i < size; ++i) {
-        result += (column[size - i - 1] - 'A' + 1) * std::pow(26, i);
+    for (char c : column) {
+        result = result * 26 + (std::toupper(c) - 'A' + 1);
     }
     return result;
 }
 
 std::string CPos::numberToColumn(size_t number) {
-    std::string result = "";
-    while (number > 0) {
-        int remainder = (number - 1) % 26; // Adjusted to 0-based index
-        result = char('A' + remainder) + result;
-        number = (number - 1) / 26;
-    }
-    return result;
+    char buffer[MAX_ID_LENGTH];
+    return std::string(buffer, formatColumn(number, buffer));
 }
 
 std::string CPos::getId() const {
-    return m_Id;
+    return std::string(m_Id.data(), m_Length);
 }
 
 std::string CPos::getColumn() const {
-    return m_Column;
+    return std::string(m_Id.data(), m_ColumnLength);
+}
+
+/***********************************************
+*        Cell Rectangle Section
+***********************************************/
+
+bool CRect::contains(size_t column, size_t row) const {
+    return column >= m_Left && column <= m_Right && row >= m_Top && row <= m_Bottom;
 }
 
-size_t CPos::getRow() const {
-    return m_Row;
+CRect CRect::parse(std::string_view range) {
+    size_t separator = range.find(':');
+    if (separator == std::string_view::npos)
+        throw std::invalid_argument("Invalid range!");
+
+    CPos from(range.substr(0, separator));
+    CPos to(range.substr(separator + 1));
+    return CRect{std::min(from.getColumnNumber(), to.getColumnNumber()), std::min(from.getRow(), to.getRow()),
+                 std::max(from.getColumnNumber(), to.getColumnNumber()), std::max(from.getRow(), to.getRow())};
 }
 
-size_t CPos::getColumnNumber() const {
-    return m_ColumnNumber;
+std::string CRect::toString() const {
+    return CPos(m_Left, m_Top).getId() + ":" + CPos(m_Right, m_Bottom).getId();
+}
+
+/***********************************************
+*        Structural Edit Section
+***********************************************/
+
+bool CShift::affects(const CPos &pos) const {
+    if (m_Move)
+        return m_Source.contains(pos.getColumnNumber(), pos.getRow());
+    return (m_Columns ? pos.getColumnNumber() : pos.getRow()) >= m_Index;
+}
+
+bool CShift::affects(const CRect &rect) const {
+    if (m_Move)
+        return m_Source.contains(rect.m_Left, rect.m_Top) && m_Source.contains(rect.m_Right, rect.m_Bottom);
+    return (m_Columns ? rect.m_Right : rect.m_Bottom) >= m_Index;
+}
+
+bool CShift::apply(CPos &pos) const {
+    if (m_Move) {
+        if (affects(pos)) {
+            pos = CPos(pos.getColumnNumber() - m_Source.m_Left + m_Destination.getColumnNumber(),
+                       pos.getRow() - m_Source.m_Top + m_Destination.getRow());
+        }
+        return true;
+    }
+
+    size_t column = pos.getColumnNumber();
+    size_t row = pos.getRow();
+    size_t &coordinate = m_Columns ? column : row;
+    size_t high = coordinate;
+    if (!apply(coordinate, high))
+        return false;
+    pos = CPos(column, row);
+    return true;
+}
+
+bool CShift::apply(CPos &first, CPos &second) const {
+    if (m_Move) {
+        CRect rect{std::min(first.getColumnNumber(), second.getColumnNumber()), std::min(first.getRow(), second.getRow()),
+                   std::max(first.getColumnNumber(), second.getColumnNumber()), std::max(first.getRow(), second.getRow())};
+        if (affects(rect)) {
+            apply(first);
+            apply(second);
+        }
+        return true;
+    }
+
+    size_t coordinates[2];
+    for (size_t i = 0; i < 2; i++)
+        coordinates[i] = m_Columns ? (i ? second : first).getColumnNumber() : (i ? second : first).getRow();
+
+    // The edit maps the span between the corners
+    size_t lower = coordinates[0] <= coordinates[1] ? 0 : 1;
+    size_t low = coordinates[lower];
+    size_t high = coordinates[1 - lower];
+    if (!apply(low, high))
+        return false;
+    coordinates[lower] = low;
+    coordinates[1 - lower] = high;
+
+    first = m_Columns ? CPos(coordinates[0], first.getRow()) : CPos(first.getColumnNumber(), coordinates[0]);
+    second = m_Columns ? CPos(coordinates[1], second.getRow()) : CPos(second.getColumnNumber(), coordinates[1]);
+    return true;
+}
+
+bool CShift::apply(size_t &low, size_t &high) const {
+    if (!m_Delete) {
+        if (low >= m_Index)
+            low += m_Count;
+        if (high >= m_Index)
+            high += m_Count;
+        return true;
+    }
+
+    size_t end = m_Index + m_Count;
+    if (low >= m_Index && high < end)
+        return false;
+
+    // Bounds inside the deleted part move to the nearest kept row or column
+    if (high >= end)
+        high -= m_Count;
+    else if (high >= m_Index)
+        high = m_Index - 1;
+    if (low >= end)
+        low -= m_Count;
+    else if (low >= m_Index)
+        low = m_Index;
+    return true;
 }
 
 /***********************************************
@@ -97,6 +166,12 @@ CCell::CCell(CPos id, const std::string &expr, std::unique_ptr<CNode> AST)
     , m_Root(std::move(AST))
     , m_IsEmpty(false) {}
 
+CCell::CCell(CPos id, const std::string &expr, CValue value)
+    : m_Pos(id)
+    , m_Expression(expr)
+    , m_Value(std::move(value))
+    , m_IsEmpty(false) {}
+
 CPos CCell::getPos() const {
     return m_Pos;
 }
@@ -109,34 +184,282 @@ CValue CCell::getValue() const {
     return m_Value;
 }
 
-std::string CCell::getExpression() const {
+const std::string &CCell::getExpression() const {
+    if (m_ExpressionStale) {
+        m_Expression = "=";
+        m_Root->unparse(m_Expression);
+        m_ExpressionStale = false;
+    }
     return m_Expression;
 }
 
 CValue CCell::evaluate(std::map<std::string, CCell> &table) {
-    if (m_Root == nullptr) {
-        m_Value = CValue();
+    if (CValueOverlay *overlay = CEvaluationPass::overlay())
+        return evaluate(*overlay, table);
+
+    // Already evaluated within the running pass
+    size_t pass = CEvaluationPass::current();
+    if (pass != 0 && m_Pass == pass)
         return m_Value;
+
+    CTraceSpan span("evaluate");
+    if (span.isActive())
+        span.setArgument(m_Pos.getId());
+
+    // Literal and empty cells keep their value
+    if (m_Root == nullptr) {
+        if (!m_Evicted || CEvaluationPass::loader() == nullptr)
+            return m_Value;
+        restoreAst(*CEvaluationPass::loader());
+        if (m_Root == nullptr)
+            return m_Value = CValue();
     }
+    m_Referenced = true;
 
     m_Value = m_Root->evaluate(table);
+    m_Pass = pass;
     return m_Value;
 }
 
+CValue CCell::evaluate(CValueOverlay &overlay, std::map<std::string, CCell> &table) const {
+    if (const CValue *input = overlay.input(table, m_Pos))
+        return *input;
+    if (m_Root == nullptr && !m_Evicted)
+        return m_Value;
+    if (const CValue *result = overlay.result(this))
+        return *result;
+
+    // Evicted AST is parsed privately, restoring it would write to the shared cell
+    std::shared_ptr<CNode> root = m_Root;
+    if (root == nullptr) {
+        if (CEvaluationPass::loader() == nullptr)
+            return m_Value;
+        root = overlay.load(*CEvaluationPass::loader(), m_Pos, m_Expression);
+    }
+
+    CValue value = root != nullptr ? root->evaluate(table) : CValue();
+    overlay.setResult(this, value);
+    return value;
+}
+
 bool CCell::isEmpty() const {
     return m_IsEmpty;
 }
 
+bool CCell::evictAst() {
+    if (m_Root == nullptr)
+        return false;
+
+    // Text must exist before the AST it could be regenerated from is gone
+    getExpression();
+    m_Root.reset();
+    m_Evicted = true;
+    m_Referenced = false;
+    return true;
+}
+
+void CCell::restoreAst(CAstLoader &loader) {
+    if (!m_Evicted)
+        return;
+    m_Root = loader.load(m_Pos, m_Expression);
+    m_Evicted = false;
+    if (m_Root != nullptr)
+        loader.noteResident();
+}
+
+bool CCell::hasAst() const {
+    return m_Root != nullptr;
+}
+
+bool CCell::isFormula() const {
+    return m_Root != nullptr || m_Evicted;
+}
+
+bool CCell::takeReferenced() {
+    bool referenced = m_Referenced;
+    m_Referenced = false;
+    return referenced;
+}
+
+void CCell::shift(const CShift &edit, CPos pos, std::vector<std::string> &dependencies) {
+    if (m_Root != nullptr) {
+        // AST shared with a copy of the sheet is rewritten privately
+        if (m_Root.use_count() > 1) {
+            std::vector<std::string> references;
+            m_Root = m_Root->clone(m_Pos, references);
+        }
+
+        if (!m_Root->shift(edit, pos, dependencies)) {
+            dependencies.clear();
+            m_Root = std::make_unique<CInvalidReferenceNode>();
+        }
+        m_ExpressionStale = true;
+    }
+    m_Pos = pos;
+}
+
 CCell CCell::copyCell(CPos dst, std::vector<std::string> &dependencies) {
-    std::string expression = m_Expression;
-    std::unique_ptr<CNode> root = m_Root->clone(dst, expression, dependencies);
-    return CCell(dst, expression, std::move(root));
+    if (m_Root == nullptr)
+        return CCell(dst, m_Expression, m_Value);
+
+    // Text of the copy is generated from its AST only when somebody asks for it
+    CCell cell(dst, "", m_Root->clone(dst, dependencies));
+    cell.m_ExpressionStale = true;
+    return cell;
 }   
 
+/***********************************************
+*        Evaluation Pass Section
+***********************************************/
+
+std::atomic<size_t> CEvaluationPass::s_Counter = 0;
+thread_local size_t CEvaluationPass::s_Current = 0;
+thread_local CAstLoader *CEvaluationPass::s_Loader = nullptr;
+thread_local CSheetResolver *CEvaluationPass::s_Sheets = nullptr;
+thread_local CValueOverlay *CEvaluationPass::s_Overlay = nullptr;
+
+CEvaluationPass::CEvaluationPass(CAstLoader *loader, CSheetResolver *sheets, CValueOverlay *overlay)
+    : CEvaluationPass(++s_Counter, loader, sheets, overlay) {}
+
+CEvaluationPass::CEvaluationPass(size_t id, CAstLoader *loader, CSheetResolver *sheets, CValueOverlay *overlay)
+    : m_Id(id)
+    , m_Previous(s_Current)
+    , m_PreviousLoader(s_Loader)
+    , m_PreviousSheets(s_Sheets)
+    , m_PreviousOverlay(s_Overlay) {
+    s_Current = m_Id;
+    s_Loader = loader;
+    s_Sheets = sheets;
+    s_Overlay = overlay;
+}
+
+CEvaluationPass::~CEvaluationPass() {
+    s_Current = m_Previous;
+    s_Loader = m_PreviousLoader;
+    s_Sheets = m_PreviousSheets;
+    s_Overlay = m_PreviousOverlay;
+}
+
+size_t CEvaluationPass::getId() const {
+    return m_Id;
+}
+
+size_t CEvaluationPass::current() {
+    return s_Current;
+}
+
+CAstLoader *CEvaluationPass::loader() {
+    return s_Loader;
+}
+
+std::map<std::string, CCell> *CEvaluationPass::sheet(const std::string &sheet) {
+    return s_Sheets != nullptr ? s_Sheets->table(sheet) : nullptr;
+}
+
+CValueOverlay *CEvaluationPass::overlay() {
+    return s_Overlay;
+}
+
+CValue CEvaluationPass::emptyCell(const std::map<std::string, CCell> &table, const CPos &pos) {
+    const CValue *input = s_Overlay != nullptr ? s_Overlay->input(table, pos) : nullptr;
+    return input != nullptr ? *input : CValue();
+}
+
+/***********************************************
+*        Value Overlay Section
+***********************************************/
+
+std::mutex CValueOverlay::s_LoadMutex;
+
+CValueOverlay::CValueOverlay(const std::map<std::string, CCell> &table, const std::map<CPos, CValue> &inputs)
+    : m_Table(&table)
+    , m_Inputs(&inputs) {}
+
+const CValue *CValueOverlay::input(const std::map<std::string, CCell> &table, const CPos &pos) const {
+    if (&table != m_Table)
+        return nullptr;
+    auto input = m_Inputs->find(pos);
+    return input != m_Inputs->end() ? &input->second : nullptr;
+}
+
+const CValue *CValueOverlay::result(const CCell *cell) const {
+    auto result = m_Results.find(cell);
+    return result != m_Results.end() ? &result->second : nullptr;
+}
+
+void CValueOverlay::setResult(const CCell *cell, const CValue &value) {
+    m_Results.insert_or_assign(cell, value);
+}
+
+std::shared_ptr<CNode> CValueOverlay::load(CAstLoader &loader, const CPos &pos, const std::string &expression) {
+    std::lock_guard<std::mutex> lock(s_LoadMutex);
+    return loader.load(pos, expression);
+}
+
 /***********************************************
 *        AST Node Types Section
 ***********************************************/
 
+int CNode::precedence() const {
+    return PRECEDENCE_PRIMARY;
+}
+
+bool CNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    return true;
+}
+
+void CNode::shiftOperand(std::unique_ptr<CNode> &node, const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    size_t count = dependencies.size();
+    if (node->shift(edit, cell, dependencies))
+        return;
+    dependencies.resize(count);
+    node = std::make_unique<CInvalidReferenceNode>();
+}
+
+void CNode::unparseOperand(const CNode &node, int minPrecedence, std::string &out) {
+    if (node.precedence() >= minPrecedence) {
+        node.unparse(out);
+        return;
+    }
+    out += '(';
+    node.unparse(out);
+    out += ')';
+}
+
+void CNode::unparseBinary(const CNode &left, const CNode &right, std::string_view op, int precedence, std::string &out) {
+    unparseOperand(left, precedence, out);
+    out += op;
+    unparseOperand(right, precedence + 1, out);
+}
+
+void CNode::unparseSheet(const std::string &sheet, std::string &out) {
+    if (sheet.empty())
+        return;
+
+    bool plain = !std::isdigit(static_cast<unsigned char>(sheet[0])) && std::all_of(sheet.begin(), sheet.end(), [](unsigned char c) {
+        return std::isalnum(c) || c == '_';
+    });
+    if (plain) {
+        out += sheet;
+    } else {
+        // Quotes inside quoted name are doubled
+        out += '\'';
+        for (char c : sheet) {
+            if (c == '\'')
+                out += '\'';
+            out += c;
+        }
+        out += '\'';
+    }
+    out += '!';
+}
+
+std::string CNode::qualify(const std::string &sheet, const std::string &reference) {
+    if (sheet.empty())
+        return reference;
+    return sheet + '!' + reference;
+}
+
 CNumberNode::CNumberNode(double num) 
     : m_Value(num) {}
 
@@ -145,10 +468,33 @@ CValue CNumberNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue(m_Value);
 }
 
-std::unique_ptr<CNode> CNumberNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
+std::unique_ptr<CNode> CNumberNode::clone(CPos dst, std::vector<std::string> &dependencies) {
     return std::make_unique<CNumberNode>(m_Value);
 }
 
+void CNumberNode::unparse(std::string &out) const {
+    unparseNumber(m_Value, out);
+}
+
+void CNumberNode::unparseNumber(double value, std::string &out) {
+    if (std::isinf(value)) {
+        out += value < 0 ? "-1e999" : "1e999";
+        return;
+    }
+
+    char buffer[32];
+    auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, end);
+}
+
+double CNumberNode::getNumber() const {
+    return m_Value;
+}
+
+int CNumberNode::precedence() const {
+    return std::signbit(m_Value) ? PRECEDENCE_NEGATION : PRECEDENCE_PRIMARY;
+}
+
 CStringNode::CStringNode(const std::string &str) 
     : m_Value(str) {}
 
@@ -156,10 +502,20 @@ CValue CStringNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue(m_Value);
 }
 
-std::unique_ptr<CNode> CStringNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
+std::unique_ptr<CNode> CStringNode::clone(CPos dst, std::vector<std::string> &dependencies) {
     return std::make_unique<CStringNode>(m_Value);
 }
 
+void CStringNode::unparse(std::string &out) const {
+    out += '"';
+    for (char c : m_Value) {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
 /***********************************************
 *        Arithmetics Operators Section
 ***********************************************/
@@ -168,13 +524,21 @@ CBinaryOperatorNode::CBinaryOperatorNode(std::unique_ptr<CNode> left, std::uniqu
     : m_Left(std::move(left))
     , m_Right(std::move(right)) {}
 
+bool CBinaryOperatorNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Left, edit, cell, dependencies);
+    shiftOperand(m_Right, edit, cell, dependencies);
+    return true;
+}
+
 CAddOperatorNode::CAddOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
     : CBinaryOperatorNode(std::move(left), std::move(right)) {}
 
 CValue CAddOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
 
+CValue CAddOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
     if (std::holds_alternative<std::string>(leftValue) && std::holds_alternative<double>(rightValue)) {
         return CValue(std::get<std::string>(leftValue) + std::to_string(std::get<double>(rightValue)));
 
@@ -192,8 +556,16 @@ CValue CAddOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CAddOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CAddOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CAddOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CAddOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CAddOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "+", PRECEDENCE_ADDITIVE, out);
+}
+
+int CAddOperatorNode::precedence() const {
+    return PRECEDENCE_ADDITIVE;
 }
 
 CSubOperatorNode::CSubOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -201,8 +573,10 @@ CSubOperatorNode::CSubOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<
 
 CValue CSubOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
 
+CValue CSubOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
     if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
         double result = std::get<double>(leftValue) - std::get<double>(rightValue);
         return CValue(result);
@@ -211,8 +585,16 @@ CValue CSubOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CSubOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CSubOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CSubOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CSubOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CSubOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "-", PRECEDENCE_ADDITIVE, out);
+}
+
+int CSubOperatorNode::precedence() const {
+    return PRECEDENCE_ADDITIVE;
 }
 
 CDivOperatorNode::CDivOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -220,8 +602,10 @@ CDivOperatorNode::CDivOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<
 
 CValue CDivOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
 
+CValue CDivOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
     if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
         if (std::get<double>(rightValue) == 0) return CValue();
         double result = std::get<double>(leftValue) / std::get<double>(rightValue);
@@ -231,8 +615,16 @@ CValue CDivOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CDivOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CDivOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CDivOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CDivOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CDivOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "/", PRECEDENCE_MULTIPLICATIVE, out);
+}
+
+int CDivOperatorNode::precedence() const {
+    return PRECEDENCE_MULTIPLICATIVE;
 }
 
 CMulOperatorNode::CMulOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -240,8 +632,10 @@ CMulOperatorNode::CMulOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<
 
 CValue CMulOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     auto leftValue = m_Left->evaluate(table);
-    auto rightValue = m_Right->evaluate(table);
+    return apply(leftValue, m_Right->evaluate(table));
+}
 
+CValue CMulOperatorNode::apply(const CValue &leftValue, const CValue &rightValue) {
     if (std::holds_alternative<double>(leftValue) && std::holds_alternative<double>(rightValue)) {
         double result = std::get<double>(leftValue) * std::get<double>(rightValue);
         return CValue(result);
@@ -250,8 +644,44 @@ CValue CMulOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CMulOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CMulOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CMulOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CMulOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CMulOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "*", PRECEDENCE_MULTIPLICATIVE, out);
+}
+
+int CMulOperatorNode::precedence() const {
+    return PRECEDENCE_MULTIPLICATIVE;
+}
+
+CNegOperatorNode::CNegOperatorNode(std::unique_ptr<CNode> operand)
+    : m_Operand(std::move(operand)) {}
+
+CValue CNegOperatorNode::evaluate(std::map<std::string, CCell> &table) {
+    auto value = m_Operand->evaluate(table);
+    if (std::holds_alternative<double>(value))
+        return CValue(-std::get<double>(value));
+    return CValue();
+}
+
+std::unique_ptr<CNode> CNegOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CNegOperatorNode>(m_Operand->clone(dst, dependencies));
+}
+
+void CNegOperatorNode::unparse(std::string &out) const {
+    out += '-';
+    unparseOperand(*m_Operand, PRECEDENCE_NEGATION, out);
+}
+
+int CNegOperatorNode::precedence() const {
+    return PRECEDENCE_NEGATION;
+}
+
+bool CNegOperatorNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Operand, edit, cell, dependencies);
+    return true;
 }
 
 CPowOperatorNode::CPowOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -269,8 +699,19 @@ CValue CPowOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CPowOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CPowOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CPowOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CPowOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CPowOperatorNode::unparse(std::string &out) const {
+    // Power is left associative and does not take negation as its right operand
+    unparseOperand(*m_Left, PRECEDENCE_POWER, out);
+    out += '^';
+    unparseOperand(*m_Right, PRECEDENCE_PRIMARY, out);
+}
+
+int CPowOperatorNode::precedence() const {
+    return PRECEDENCE_POWER;
 }
 
 /***********************************************
@@ -281,6 +722,12 @@ CRelationalOperatorNode::CRelationalOperatorNode(std::unique_ptr<CNode> left, st
     : m_Left(std::move(left))
     , m_Right(std::move(right)) {}
 
+bool CRelationalOperatorNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Left, edit, cell, dependencies);
+    shiftOperand(m_Right, edit, cell, dependencies);
+    return true;
+}
+
 CEqOperatorNode::CEqOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
     : CRelationalOperatorNode(std::move(left), std::move(right)) {}
 
@@ -297,8 +744,16 @@ CValue CEqOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CEqOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CEqOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CEqOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CEqOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CEqOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "=", PRECEDENCE_EQUALITY, out);
+}
+
+int CEqOperatorNode::precedence() const {
+    return PRECEDENCE_EQUALITY;
 }
 
 CNeOperatorNode::CNeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -317,8 +772,16 @@ CValue CNeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CNeOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CNeOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CNeOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CNeOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CNeOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "<>", PRECEDENCE_EQUALITY, out);
+}
+
+int CNeOperatorNode::precedence() const {
+    return PRECEDENCE_EQUALITY;
 }
 
 CLtOperatorNode::CLtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -337,8 +800,16 @@ CValue CLtOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CLtOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CLtOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CLtOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CLtOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CLtOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "<", PRECEDENCE_RELATIONAL, out);
+}
+
+int CLtOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
 }
 
 CLeOperatorNode::CLeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -357,8 +828,16 @@ CValue CLeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CLeOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CLeOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CLeOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CLeOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CLeOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, "<=", PRECEDENCE_RELATIONAL, out);
+}
+
+int CLeOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
 }
 
 CGtOperatorNode::CGtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -377,8 +856,16 @@ CValue CGtOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CGtOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CGtOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CGtOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CGtOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CGtOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, ">", PRECEDENCE_RELATIONAL, out);
+}
+
+int CGtOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
 }
 
 CGeOperatorNode::CGeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right) 
@@ -397,8 +884,16 @@ CValue CGeOperatorNode::evaluate(std::map<std::string, CCell> &table) {
     return CValue();
 }
 
-std::unique_ptr<CNode> CGeOperatorNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CGeOperatorNode>(m_Left->clone(dst, expr, dependencies), m_Right->clone(dst, expr, dependencies));
+std::unique_ptr<CNode> CGeOperatorNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CGeOperatorNode>(m_Left->clone(dst, dependencies), m_Right->clone(dst, dependencies));
+}
+
+void CGeOperatorNode::unparse(std::string &out) const {
+    unparseBinary(*m_Left, *m_Right, ">=", PRECEDENCE_RELATIONAL, out);
+}
+
+int CGeOperatorNode::precedence() const {
+    return PRECEDENCE_RELATIONAL;
 }
 
 /***********************************************
@@ -411,11 +906,49 @@ CReferenceNode::CReferenceNode(CPos cellId, CPos refId, const std::string &ref)
     , m_Reference(ref) {}
 
 CValue CReferenceNode::getValue(std::map<std::string, CCell> &table) {
-    auto cell = table.find(m_Reference);
-    if (cell != table.end()) {
-        return cell->second.evaluate(table);
+    // Cells of other sheets are evaluated within their own table
+    std::map<std::string, CCell> *source = m_Sheet.empty() ? &table : CEvaluationPass::sheet(m_Sheet);
+    if (source == nullptr)
+        return CValue();
+
+    auto cell = source->find(m_Reference);
+    if (cell != source->end()) {
+        return cell->second.evaluate(*source);
     }
-    return CValue();
+    return CEvaluationPass::emptyCell(*source, m_RefId);
+}
+
+const CPos &CReferenceNode::getRefId() const {
+    return m_RefId;
+}
+
+void CReferenceNode::setSheet(const std::string &sheet) {
+    m_Sheet = sheet;
+}
+
+const std::string &CReferenceNode::getSheet() const {
+    return m_Sheet;
+}
+
+std::string CReferenceNode::getDependency() const {
+    return qualify(m_Sheet, m_Reference);
+}
+
+bool CReferenceNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    m_CellId = cell;
+    if (m_Sheet.empty()) {
+        if (!edit.apply(m_RefId))
+            return false;
+        m_Reference = m_RefId.getId();
+    }
+    dependencies.push_back(getDependency());
+    return true;
+}
+
+std::unique_ptr<CNode> CReferenceNode::qualified(std::unique_ptr<CReferenceNode> node, std::vector<std::string> &dependencies) const {
+    node->m_Sheet = m_Sheet;
+    dependencies.push_back(node->getDependency());
+    return node;
 }
 
 CRelativeReferenceNode::CRelativeReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
@@ -425,28 +958,27 @@ CValue CRelativeReferenceNode::evaluate(std::map<std::string, CCell> &table) {
     return this->getValue(table);
 }
 
-std::unique_ptr<CNode> CRelativeReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
+std::unique_ptr<CNode> CRelativeReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
     size_t rowOffset = dst.getRow() - m_CellId.getRow();
     size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
 
-    std::string newReference = m_Reference;
     size_t refRow = m_RefId.getRow();
     size_t refCol = m_RefId.getColumnNumber();
 
     // Adjust row and column based on offsets
     refRow += rowOffset;
     refCol += colOffset;
-    newReference = CPos::numberToColumn(refCol) + std::to_string(refRow);
+    CPos newPos(refCol, refRow);
+    std::string newReference = newPos.getId();
 
-    size_t start_pos = 0;
-    std::string from = m_Reference;
-    std::string to =  newReference;
-    while ((start_pos = expr.find(from, start_pos)) != std::string::npos) {
-        expr.replace(start_pos, from.length(), to);
-        start_pos += to.length();
-    }
 
-    return std::make_unique<CRelativeReferenceNode>(dst, CPos(newReference), newReference);
+    return qualified(std::make_unique<CRelativeReferenceNode>(dst, newPos, newReference), dependencies);
+}
+
+void CRelativeReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += m_RefId.getColumn();
+    out += std::to_string(m_RefId.getRow());
 }
 
 CAbsoluteReferenceNode::CAbsoluteReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
@@ -456,8 +988,16 @@ CValue CAbsoluteReferenceNode::evaluate(std::map<std::string, CCell> &table) {
     return this->getValue(table);
 }
 
-std::unique_ptr<CNode> CAbsoluteReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
-    return std::make_unique<CAbsoluteReferenceNode>(dst, m_RefId, m_Reference);
+std::unique_ptr<CNode> CAbsoluteReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return qualified(std::make_unique<CAbsoluteReferenceNode>(dst, m_RefId, m_Reference), dependencies);
+}
+
+void CAbsoluteReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += "$";
+    out += m_RefId.getColumn();
+    out += "$";
+    out += std::to_string(m_RefId.getRow());
 }
 
 CAbsRelReferenceNode::CAbsRelReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
@@ -467,22 +1007,23 @@ CValue CAbsRelReferenceNode::evaluate(std::map<std::string, CCell> &table) {
     return this->getValue(table);
 }
 
-std::unique_ptr<CNode> CAbsRelReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
+std::unique_ptr<CNode> CAbsRelReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
     size_t rowOffset = dst.getRow() - m_CellId.getRow();
     size_t refRow = m_RefId.getRow();
 
     // Construct the adjusted reference
-    std::string newReference = m_RefId.getColumn() + std::to_string(refRow + rowOffset);
+    CPos newPos(m_RefId.getColumnNumber(), refRow + rowOffset);
+    std::string newReference = newPos.getId();
 
-    size_t start_pos = 0;
-    std::string from = "$" + m_RefId.getColumn() + std::to_string(m_RefId.getRow());
-    std::string to =  "$" + m_RefId.getColumn() + std::to_string(refRow + rowOffset);
-    while ((start_pos = expr.find(from, start_pos)) != std::string::npos) {
-        expr.replace(start_pos, from.length(), to);
-        start_pos += to.length();
-    }
 
-    return std::make_unique<CAbsRelReferenceNode>(dst, CPos(newReference), newReference);
+    return qualified(std::make_unique<CAbsRelReferenceNode>(dst, newPos, newReference), dependencies);
+}
+
+void CAbsRelReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += "$";
+    out += m_RefId.getColumn();
+    out += std::to_string(m_RefId.getRow());
 }
 
 CRelAbsReferenceNode::CRelAbsReferenceNode(CPos cellId, CPos refId, const std::string &ref) 
@@ -492,22 +1033,536 @@ CValue CRelAbsReferenceNode::evaluate(std::map<std::string, CCell> &table) {
     return this->getValue(table);
 }
 
-std::unique_ptr<CNode> CRelAbsReferenceNode::clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) {
+std::unique_ptr<CNode> CRelAbsReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
     size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
     size_t refRow = m_RefId.getRow();
     size_t refCol = m_RefId.getColumnNumber();
     refCol += colOffset;
 
     // Construct the adjusted reference
-    std::string newReference = CPos::numberToColumn(refCol) + std::to_string(refRow);
+    CPos newPos(refCol, refRow);
+    std::string newReference = newPos.getId();
+
+
+    return qualified(std::make_unique<CRelAbsReferenceNode>(dst, newPos, newReference), dependencies);
+}
+
+void CRelAbsReferenceNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    out += m_RefId.getColumn();
+    out += "$";
+    out += std::to_string(m_RefId.getRow());
+}
+
+CValue CInvalidReferenceNode::evaluate(std::map<std::string, CCell> &table) {
+    return CValue();
+}
 
-    size_t start_pos = 0;
-    std::string from = m_RefId.getColumn() + "$" + std::to_string(m_RefId.getRow());
-    std::string to = CPos::numberToColumn(refCol) + "$" + std::to_string(m_RefId.getRow());
-    while ((start_pos = expr.find(from, start_pos)) != std::string::npos) {
-        expr.replace(start_pos, from.length(), to);
-        start_pos += to.length();
+std::unique_ptr<CNode> CInvalidReferenceNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CInvalidReferenceNode>();
+}
+
+void CInvalidReferenceNode::unparse(std::string &out) const {
+    out += "1/0";
+}
+
+int CInvalidReferenceNode::precedence() const {
+    return PRECEDENCE_MULTIPLICATIVE;
+}
+
+/***********************************************
+*        Fused Operands Section
+***********************************************/
+
+CRefOperand::CRefOperand(CPos refId, bool absoluteColumn, bool absoluteRow)
+    : m_RefId(refId)
+    , m_Reference(refId.getId())
+    , m_AbsoluteColumn(absoluteColumn)
+    , m_AbsoluteRow(absoluteRow) {}
+
+CValue CRefOperand::value(std::map<std::string, CCell> &table) const {
+    auto cell = table.find(m_Reference);
+    if (cell != table.end())
+        return cell->second.evaluate(table);
+    return CEvaluationPass::emptyCell(table, m_RefId);
+}
+
+CRefOperand CRefOperand::clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const {
+    size_t column = m_RefId.getColumnNumber() + (m_AbsoluteColumn ? 0 : dst.getColumnNumber() - cell.getColumnNumber());
+    size_t row = m_RefId.getRow() + (m_AbsoluteRow ? 0 : dst.getRow() - cell.getRow());
+    CRefOperand operand(CPos(column, row), m_AbsoluteColumn, m_AbsoluteRow);
+    dependencies.push_back(operand.m_Reference);
+    return operand;
+}
+
+void CRefOperand::unparse(std::string &out) const {
+    if (m_AbsoluteColumn)
+        out += '$';
+    out += m_RefId.getColumn();
+    if (m_AbsoluteRow)
+        out += '$';
+    out += std::to_string(m_RefId.getRow());
+}
+
+bool CRefOperand::shift(const CShift &edit, std::vector<std::string> &dependencies) {
+    if (!edit.apply(m_RefId))
+        return false;
+    m_Reference = m_RefId.getId();
+    dependencies.push_back(m_Reference);
+    return true;
+}
+
+CConstOperand::CConstOperand(double number)
+    : m_Number(number)
+    , m_Value(std::isinf(number) ? CValue() : CValue(number)) {}
+
+CConstOperand CConstOperand::clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const {
+    return *this;
+}
+
+void CConstOperand::unparse(std::string &out) const {
+    CNumberNode::unparseNumber(m_Number, out);
+}
+
+bool CConstOperand::shift(const CShift &edit, std::vector<std::string> &dependencies) {
+    return true;
+}
+
+/***********************************************
+*        Worker Pool Section
+***********************************************/
+
+CWorkerPool &CWorkerPool::instance() {
+    static CWorkerPool pool;
+    return pool;
+}
+
+CWorkerPool::~CWorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_Wake.notify_all();
+    for (auto &thread : m_Threads)
+        thread.join();
+}
+
+void CWorkerPool::run(size_t chunks, size_t workers, const std::function<void(size_t)> &task) {
+    std::unique_lock<std::mutex> job(m_JobMutex, std::try_to_lock);
+    size_t helpers = job ? std::min(workers, chunks) : 0;
+    if (helpers <= 1) {
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+            task(chunk);
+        return;
     }
 
-    return std::make_unique<CRelAbsReferenceNode>(dst, CPos(newReference), newReference);
-}
\ No newline at end of file
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (m_Threads.size() < helpers - 1)
+        m_Threads.emplace_back(&CWorkerPool::work, this);
+    m_Task = &task;
+    m_Chunks = chunks;
+    m_Next = 0;
+    m_Openings = helpers - 1;
+    lock.unlock();
+    m_Wake.notify_all();
+
+    drain();
+
+    // Threads which have not woken up yet are not waited for
+    lock.lock();
+    m_Openings = 0;
+    m_Done.wait(lock, [this] { return m_Running == 0; });
+    m_Task = nullptr;
+}
+
+void CWorkerPool::work() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (true) {
+        m_Wake.wait(lock, [this] { return m_Stop || m_Openings > 0; });
+        if (m_Stop)
+            return;
+
+        m_Openings--;
+        m_Running++;
+        lock.unlock();
+        drain();
+        lock.lock();
+        if (--m_Running == 0)
+            m_Done.notify_one();
+    }
+}
+
+void CWorkerPool::drain() {
+    for (size_t chunk = m_Next++; chunk < m_Chunks; chunk = m_Next++)
+        (*m_Task)(chunk);
+}
+
+/***********************************************
+*        Ranges Section
+***********************************************/
+
+CRangeNode::CRangeNode(CPos cellId, const std::string &range)
+    : m_CellId(cellId) {
+    size_t separator = range.find(':');
+    if (separator == std::string::npos)
+        throw std::invalid_argument("Invalid range!");
+
+    std::string corners[2] = {range.substr(0, separator), range.substr(separator + 1)};
+    for (size_t i = 0; i < 2; i++) {
+        std::string &corner = corners[i];
+        m_AbsoluteColumn[i] = !corner.empty() && corner[0] == '$';
+        m_AbsoluteRow[i] = corner.find('$', 1) != std::string::npos;
+        corner.erase(std::remove(corner.begin(), corner.end(), '$'), corner.end());
+        m_Corners[i] = CPos(corner);
+    }
+}
+
+CValue CRangeNode::evaluate(std::map<std::string, CCell> &table) {
+    return CValue();
+}
+
+std::unique_ptr<CNode> CRangeNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return cloneRange(dst, dependencies);
+}
+
+void CRangeNode::unparse(std::string &out) const {
+    unparseSheet(m_Sheet, out);
+    for (size_t i = 0; i < 2; i++) {
+        if (i)
+            out += ':';
+        if (m_AbsoluteColumn[i])
+            out += '$';
+        out += m_Corners[i].getColumn();
+        if (m_AbsoluteRow[i])
+            out += '$';
+        out += std::to_string(m_Corners[i].getRow());
+    }
+}
+
+std::unique_ptr<CRangeNode> CRangeNode::cloneRange(CPos dst, std::vector<std::string> &dependencies) {
+    size_t rowOffset = dst.getRow() - m_CellId.getRow();
+    size_t colOffset = dst.getColumnNumber() - m_CellId.getColumnNumber();
+
+    // Shift relative parts of both corners
+    auto range = std::make_unique<CRangeNode>(*this);
+    range->m_CellId = dst;
+    for (size_t i = 0; i < 2; i++) {
+        size_t column = m_Corners[i].getColumnNumber() + (m_AbsoluteColumn[i] ? 0 : colOffset);
+        size_t row = m_Corners[i].getRow() + (m_AbsoluteRow[i] ? 0 : rowOffset);
+        range->m_Corners[i] = CPos(column, row);
+    }
+
+    dependencies.push_back(range->getDependency());
+    return range;
+}
+
+void CRangeNode::forEachValue(std::map<std::string, CCell> &table, const std::function<void(const CValue&)> &visitor) const {
+    CRect rect = getRect();
+    std::map<std::string, CCell> *source = m_Sheet.empty() ? &table : CEvaluationPass::sheet(m_Sheet);
+    for (size_t column = rect.m_Left; column <= rect.m_Right; column++) {
+        for (size_t row = rect.m_Top; row <= rect.m_Bottom; row++) {
+            if (source == nullptr) {
+                visitor(CValue());
+                continue;
+            }
+            CPos pos(column, row);
+            auto cell = source->find(pos.getId());
+            visitor(cell != source->end() ? cell->second.evaluate(*source) : CEvaluationPass::emptyCell(*source, pos));
+        }
+    }
+}
+
+bool CRangeNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    m_CellId = cell;
+    if (m_Sheet.empty() && !edit.apply(m_Corners[0], m_Corners[1]))
+        return false;
+    dependencies.push_back(getDependency());
+    return true;
+}
+
+void CRangeNode::setSheet(const std::string &sheet) {
+    m_Sheet = sheet;
+}
+
+std::string CRangeNode::getDependency() const {
+    return qualify(m_Sheet, getRect().toString());
+}
+
+CRect CRangeNode::getRect() const {
+    return CRect{std::min(m_Corners[0].getColumnNumber(), m_Corners[1].getColumnNumber()),
+                 std::min(m_Corners[0].getRow(), m_Corners[1].getRow()),
+                 std::max(m_Corners[0].getColumnNumber(), m_Corners[1].getColumnNumber()),
+                 std::max(m_Corners[0].getRow(), m_Corners[1].getRow())};
+}
+
+template<typename TPartial, typename TFold, typename TCombine>
+TPartial CRangeNode::reduce(std::map<std::string, CCell> &table, TFold fold, TCombine combine) const {
+    CRect rect = getRect();
+    size_t count = (rect.m_Right - rect.m_Left + 1) * (rect.m_Bottom - rect.m_Top + 1);
+    if (count < PARALLEL_CELLS) {
+        TPartial partial{};
+        forEachValue(table, [&partial, &fold](const CValue &value) {
+            fold(partial, value);
+        });
+        return partial;
+    }
+
+    CTraceSpan span("reduceRange");
+    size_t chunks = (count + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    std::vector<TPartial> partials(chunks);
+    if (CEvaluationPass::overlay() != nullptr) {
+        // Same chunks on the calling thread, so the result matches the parallel fold bit for bit
+        size_t index = 0;
+        forEachValue(table, [&partials, &fold, &index](const CValue &value) {
+            fold(partials[index++ / CHUNK_CELLS], value);
+        });
+    } else {
+        std::vector<const CCell*> cells = resolveCells(table);
+        forEachChunk(chunks, [&cells, &partials, &fold](size_t chunk) {
+            const CValue empty;
+            size_t end = std::min(cells.size(), (chunk + 1) * CHUNK_CELLS);
+            for (size_t i = chunk * CHUNK_CELLS; i < end; i++)
+                fold(partials[chunk], cells[i] != nullptr ? cells[i]->getValue() : empty);
+        });
+    }
+
+    // Neighbours are combined level by level, the tree depends only on the number of chunks
+    for (size_t step = 1; step < chunks; step *= 2) {
+        for (size_t i = 0; i + step < chunks; i += 2 * step)
+            combine(partials[i], partials[i + step]);
+    }
+    return partials[0];
+}
+
+std::vector<const CCell*> CRangeNode::resolveCells(std::map<std::string, CCell> &table) const {
+    CRect rect = getRect();
+    size_t rows = rect.m_Bottom - rect.m_Top + 1;
+    std::vector<const CCell*> cells((rect.m_Right - rect.m_Left + 1) * rows, nullptr);
+    std::map<std::string, CCell> *source = m_Sheet.empty() ? &table : CEvaluationPass::sheet(m_Sheet);
+    if (source == nullptr)
+        return cells;
+
+    size_t chunks = (cells.size() + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    std::vector<std::vector<CCell*>> formulas(chunks);
+    forEachChunk(chunks, [&](size_t chunk) {
+        size_t end = std::min(cells.size(), (chunk + 1) * CHUNK_CELLS);
+        for (size_t i = chunk * CHUNK_CELLS; i < end; i++) {
+            auto cell = source->find(CPos(rect.m_Left + i / rows, rect.m_Top + i % rows).getId());
+            if (cell == source->end())
+                continue;
+            cells[i] = &cell->second;
+            if (cell->second.isFormula())
+                formulas[chunk].push_back(&cell->second);
+        }
+    });
+
+    // Evaluated formulas keep their value in the cell, so the fold reads it without evaluating again
+    for (const auto &chunk : formulas) {
+        for (CCell *cell : chunk)
+            cell->evaluate(*source);
+    }
+    return cells;
+}
+
+std::atomic<size_t> CRangeNode::s_Workers = 0;
+
+void CRangeNode::setWorkers(size_t workers) {
+    s_Workers = workers;
+}
+
+void CRangeNode::forEachChunk(size_t chunks, const std::function<void(size_t)> &task) {
+    size_t workers = s_Workers ? s_Workers.load() : std::thread::hardware_concurrency();
+    CWorkerPool::instance().run(chunks, std::max<size_t>(workers, 1), task);
+}
+
+/***********************************************
+*        Functions Section
+***********************************************/
+
+CRangeFunctionNode::CRangeFunctionNode(std::unique_ptr<CRangeNode> range)
+    : m_Range(std::move(range)) {}
+
+bool CRangeFunctionNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    return m_Range->shift(edit, cell, dependencies);
+}
+
+template<typename TBetter>
+CValue CRangeFunctionNode::extremum(std::map<std::string, CCell> &table, TBetter better) const {
+    struct CExtremum {
+        std::optional<double> m_First;
+        std::optional<double> m_Best;
+    };
+
+    // First number is kept apart from the best one so that chunks combine exactly like a serial scan
+    CExtremum result = m_Range->reduce<CExtremum>(table, [&better](CExtremum &partial, const CValue &value) {
+        if (!std::holds_alternative<double>(value))
+            return;
+        double number = std::get<double>(value);
+        if (!partial.m_First)
+            partial.m_First = number;
+        if (!std::isnan(number) && (!partial.m_Best || better(number, *partial.m_Best)))
+            partial.m_Best = number;
+    }, [&better](CExtremum &left, const CExtremum &right) {
+        if (!left.m_First)
+            left.m_First = right.m_First;
+        if (right.m_Best && (!left.m_Best || better(*right.m_Best, *left.m_Best)))
+            left.m_Best = right.m_Best;
+    });
+
+    if (!result.m_First)
+        return CValue();
+    if (std::isnan(*result.m_First))
+        return CValue(*result.m_First);
+    return CValue(*result.m_Best);
+}
+
+CSumFunctionNode::CSumFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CSumFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    // Sum stays empty until the first number is found
+    auto sum = m_Range->reduce<std::optional<double>>(table, [](std::optional<double> &partial, const CValue &value) {
+        if (std::holds_alternative<double>(value))
+            partial = partial.value_or(0) + std::get<double>(value);
+    }, [](std::optional<double> &left, const std::optional<double> &right) {
+        if (right)
+            left = left.value_or(0) + *right;
+    });
+
+    if (!sum)
+        return CValue();
+    return CValue(*sum);
+}
+
+std::unique_ptr<CNode> CSumFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CSumFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CSumFunctionNode::unparse(std::string &out) const {
+    out += "sum(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CCountFunctionNode::CCountFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CCountFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    return CValue(m_Range->reduce<double>(table, [](double &count, const CValue &value) {
+        if (!std::holds_alternative<std::monostate>(value))
+            count++;
+    }, [](double &left, double right) {
+        left += right;
+    }));
+}
+
+std::unique_ptr<CNode> CCountFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CCountFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CCountFunctionNode::unparse(std::string &out) const {
+    out += "count(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CMinFunctionNode::CMinFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CMinFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    return extremum(table, std::less<double>());
+}
+
+std::unique_ptr<CNode> CMinFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CMinFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CMinFunctionNode::unparse(std::string &out) const {
+    out += "min(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CMaxFunctionNode::CMaxFunctionNode(std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range)) {}
+
+CValue CMaxFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    return extremum(table, std::greater<double>());
+}
+
+std::unique_ptr<CNode> CMaxFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    return std::make_unique<CMaxFunctionNode>(m_Range->cloneRange(dst, dependencies));
+}
+
+void CMaxFunctionNode::unparse(std::string &out) const {
+    out += "max(";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CCountvalFunctionNode::CCountvalFunctionNode(std::unique_ptr<CNode> value, std::unique_ptr<CRangeNode> range)
+    : CRangeFunctionNode(std::move(range))
+    , m_Value(std::move(value)) {}
+
+CValue CCountvalFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    CValue target = m_Value->evaluate(table);
+    return CValue(m_Range->reduce<double>(table, [&target](double &count, const CValue &value) {
+        if (value == target)
+            count++;
+    }, [](double &left, double right) {
+        left += right;
+    }));
+}
+
+std::unique_ptr<CNode> CCountvalFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    auto value = m_Value->clone(dst, dependencies);
+    return std::make_unique<CCountvalFunctionNode>(std::move(value), m_Range->cloneRange(dst, dependencies));
+}
+
+bool CCountvalFunctionNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Value, edit, cell, dependencies);
+    return m_Range->shift(edit, cell, dependencies);
+}
+
+void CCountvalFunctionNode::unparse(std::string &out) const {
+    out += "countval(";
+    m_Value->unparse(out);
+    out += ", ";
+    m_Range->unparse(out);
+    out += ')';
+}
+
+CIfFunctionNode::CIfFunctionNode(std::unique_ptr<CNode> condition, std::unique_ptr<CNode> ifTrue, std::unique_ptr<CNode> ifFalse)
+    : m_Condition(std::move(condition))
+    , m_IfTrue(std::move(ifTrue))
+    , m_IfFalse(std::move(ifFalse)) {}
+
+CValue CIfFunctionNode::evaluate(std::map<std::string, CCell> &table) {
+    CValue condition = m_Condition->evaluate(table);
+    if (!std::holds_alternative<double>(condition))
+        return CValue();
+    return std::get<double>(condition) != 0 ? m_IfTrue->evaluate(table) : m_IfFalse->evaluate(table);
+}
+
+std::unique_ptr<CNode> CIfFunctionNode::clone(CPos dst, std::vector<std::string> &dependencies) {
+    auto condition = m_Condition->clone(dst, dependencies);
+    auto ifTrue = m_IfTrue->clone(dst, dependencies);
+    return std::make_unique<CIfFunctionNode>(std::move(condition), std::move(ifTrue), m_IfFalse->clone(dst, dependencies));
+}
+
+bool CIfFunctionNode::shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) {
+    shiftOperand(m_Condition, edit, cell, dependencies);
+    shiftOperand(m_IfTrue, edit, cell, dependencies);
+    shiftOperand(m_IfFalse, edit, cell, dependencies);
+    return true;
+}
+
+void CIfFunctionNode::unparse(std::string &out) const {
+    out += "if(";
+    m_Condition->unparse(out);
+    out += ", ";
+    m_IfTrue->unparse(out);
+    out += ", ";
+    m_IfFalse->unparse(out);
+    out += ')';
+}
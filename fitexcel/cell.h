@@ -25,6 +25,7 @@
 #include <memory>
 #include <algorithm>
 #include <functional>
+#include <condition_variable>
 #include <iterator>
 #include <stdexcept>
 #include <variant>
@@ -43,17 +44,66 @@ constexpr unsigned SPREADSHEET_SPEED = 0x08;
 constexpr unsigned SPREADSHEET_PARSER = 0x10;
 #endif /* __PROGTEST__ */
 
+#include "tracer.h"
+
 class CCell;
+class CDependencyGraph;
+class CValueOverlay;
 
 class CPos {
 public:
-    CPos() = default;
+    // Longest id that fits size_t: 14 column letters followed by 20 row digits
+    static constexpr size_t MAX_ID_LENGTH = 34;
+
+    constexpr CPos() = default;
     CPos(std::string_view str);
-    CPos(const CPos &pos);
+
+    /**
+     * Creates position from numeric column and row without parsing, id is normalized to upper case
+     * @param column Column position (1 = A)
+     * @param row Row number
+    */
+    constexpr CPos(size_t column, size_t row)
+        : m_Row(row)
+        , m_ColumnNumber(column) {
+        m_ColumnLength = formatColumn(column, m_Id.data());
+        m_Length = m_ColumnLength + formatRow(row, m_Id.data() + m_ColumnLength);
+    }
+
     std::string getId() const;
+
+    /**
+     * Returns id without copying, valid as long as the position exists
+     * @return Cell id
+    */
+    constexpr std::string_view getIdView() const {
+        return std::string_view(m_Id.data(), m_Length);
+    }
+
     std::string getColumn() const;
-    size_t getRow() const;
-    size_t getColumnNumber() const;
+
+    constexpr size_t getRow() const {
+        return m_Row;
+    }
+
+    constexpr size_t getColumnNumber() const {
+        return m_ColumnNumber;
+    }
+
+    /**
+     * Orders positions column by column, so positions can be keys of ordered containers
+     * @param pos Compared position
+     * @return Order of the positions
+    */
+    constexpr std::strong_ordering operator<=>(const CPos &pos) const {
+        if (auto order = m_ColumnNumber <=> pos.m_ColumnNumber; order != 0)
+            return order;
+        return m_Row <=> pos.m_Row;
+    }
+
+    constexpr bool operator==(const CPos &pos) const {
+        return m_ColumnNumber == pos.m_ColumnNumber && m_Row == pos.m_Row;
+    }
 
     /**
      * Converts numeric representation of column to coresponding string id (e.g. 1 -> A, 27 -> AA)
@@ -69,12 +119,186 @@ public:
     */
     size_t columnToNumber(const std::string& column);
 
+    /**
+     * Parses case insensitive cell id without allocating, usable in constant expressions
+     * @param str Cell id (e.g. B12)
+     * @param column Parsed column position
+     * @param row Parsed row number
+     * @return False if the id is invalid or does not fit size_t
+    */
+    static constexpr bool parse(std::string_view str, size_t &column, size_t &row) {
+        size_t i = 0;
+        column = 0;
+        row = 0;
+
+        for (; i < str.size() && isLetter(str[i]); i++) {
+            size_t letter = (str[i] | 0x20) - 'a' + 1;
+            if (column > (SIZE_MAX - letter) / 26)
+                return false;
+            column = column * 26 + letter;
+        }
+
+        // Non-empty column followed by row number without leading zeros
+        if (i == 0 || i == str.size() || (str[i] == '0' && i + 1 != str.size()))
+            return false;
+
+        for (; i < str.size(); i++) {
+            if (str[i] < '0' || str[i] > '9')
+                return false;
+            size_t digit = str[i] - '0';
+            if (row > (SIZE_MAX - digit) / 10)
+                return false;
+            row = row * 10 + digit;
+        }
+        return true;
+    }
+
+    /**
+     * Writes column id into buffer without allocating (e.g. 1 -> A, 27 -> AA)
+     * @param number Column position
+     * @param buffer Output with room for at least 14 characters
+     * @return Number of written characters
+    */
+    static constexpr size_t formatColumn(size_t number, char *buffer) {
+        size_t length = 0;
+        for (size_t rest = number; rest > 0; rest = (rest - 1) / 26)
+            length++;
+
+        for (size_t i = length; i > 0; i--) {
+            buffer[i - 1] = 'A' + (number - 1) % 26;
+            number = (number - 1) / 26;
+        }
+        return length;
+    }
+
+private:
+    static constexpr bool isLetter(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static constexpr size_t formatRow(size_t row, char *buffer) {
+        size_t length = 1;
+        for (size_t rest = row; rest >= 10; rest /= 10)
+            length++;
+
+        for (size_t i = length; i > 0; i--) {
+            buffer[i - 1] = '0' + row % 10;
+            row /= 10;
+        }
+        return length;
+    }
+
+    std::array<char, MAX_ID_LENGTH> m_Id = {};
+    uint8_t m_Length = 0;
+    uint8_t m_ColumnLength = 0;
+    size_t m_Row = 0;
+    size_t m_ColumnNumber = 0;
+};
+
+/**
+ * Fixed size string used as template argument of the _pos literal
+*/
+template <size_t N>
+struct CPosLiteral {
+    constexpr CPosLiteral(const char (&str)[N]) {
+        std::copy_n(str, N, m_Str);
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(m_Str, N - 1);
+    }
+
+    char m_Str[N] = {};
+};
+
+/**
+ * Cell position literal checked at compile time, e.g. "B12"_pos
+ * @return Cell position
+*/
+template <CPosLiteral Id>
+constexpr CPos operator""_pos() {
+    constexpr std::array<size_t, 3> parsed = [] {
+        size_t column = 0;
+        size_t row = 0;
+        bool valid = CPos::parse(Id.view(), column, row);
+        return std::array<size_t, 3>{valid, column, row};
+    }();
+    static_assert(parsed[0], "Invalid cell id");
+    return CPos(parsed[1], parsed[2]);
+}
+
+/****************************************************************************/
+
+/**
+ * Rectangular area of cells with inclusive bounds, used for range references
+*/
+struct CRect {
+    size_t m_Left;
+    size_t m_Top;
+    size_t m_Right;
+    size_t m_Bottom;
+
+    bool contains(size_t column, size_t row) const;
+
+    /**
+     * Parses range in the "A1:B5" form, corners may be given in any order
+     * @param range Range without '$' signs
+     * @return Normalized rectangle
+    */
+    static CRect parse(std::string_view range);
+    std::string toString() const;
+};
+
+/****************************************************************************/
+
+/**
+ * Insertion or deletion of whole rows or columns, or move of a block of cells. Maps positions from before
+ * the edit to positions after it
+*/
+struct CShift {
+    // Columns are edited instead of rows
+    bool m_Columns;
+    bool m_Delete;
+    // First inserted or deleted row or column
+    size_t m_Index;
+    size_t m_Count;
+
+    // Cells of the source area move to the destination instead of the row or column edit
+    bool m_Move = false;
+    CRect m_Source = {};
+    CPos m_Destination = {};
+
+    /**
+     * Checks whether the edit moves or deletes the position
+     * @param pos Position before the edit
+     * @return True if the row or column lies at or after the edited one, or the position lies in the moved block
+    */
+    bool affects(const CPos &pos) const;
+
+    /**
+     * Checks whether the edit changes the range
+     * @param rect Range before the edit
+     * @return True if the range reaches the edited rows or columns, or lies entirely in the moved block
+    */
+    bool affects(const CRect &rect) const;
+
+    /**
+     * @param pos Position before the edit, replaced by the position after it
+     * @return False if the position was deleted
+    */
+    bool apply(CPos &pos) const;
+
+    /**
+     * Maps corners of a range given in any order. Insertion inside the range grows it, deletion shrinks it
+     * and a moved block takes only ranges lying entirely inside it along
+     * @param first First corner
+     * @param second Second corner
+     * @return False if the whole range was deleted
+    */
+    bool apply(CPos &first, CPos &second) const;
+
 private:
-    bool isValidRowNumber(const std::string &rowNumber) const;
-    std::string m_Id;
-    std::string m_Column;
-    size_t m_Row;
-    size_t m_ColumnNumber;
+    bool apply(size_t &low, size_t &high) const;
 };
 
 /****************************************************************************/
@@ -93,8 +317,112 @@ public:
      * @param dst Target cell position
      * @return Pointer to copied node
     */
-    virtual std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) = 0;
+    virtual std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) = 0;
+
+    /**
+     * Method to recursively write AST back to formula text (without the leading '=')
+     * @param out Output text
+    */
+    virtual void unparse(std::string &out) const = 0;
+
+    /**
+     * Binding strength of the node, used to place parentheses when unparsing
+     * @return Precedence level
+    */
+    virtual int precedence() const;
+
+    /**
+     * Method to recursively move references after rows or columns were inserted or deleted, the AST is changed in place
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references of the node
+     * @return False if the node references deleted cells and has to be replaced
+    */
+    virtual bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies);
     virtual ~CNode() = default;
+
+    // Precedence levels of the formula grammar from the loosest binding
+    static constexpr int PRECEDENCE_EQUALITY = 1;
+    static constexpr int PRECEDENCE_RELATIONAL = 2;
+    static constexpr int PRECEDENCE_ADDITIVE = 3;
+    static constexpr int PRECEDENCE_MULTIPLICATIVE = 4;
+    static constexpr int PRECEDENCE_NEGATION = 5;
+    static constexpr int PRECEDENCE_POWER = 6;
+    static constexpr int PRECEDENCE_PRIMARY = 7;
+
+protected:
+    /**
+     * Writes operand, in parentheses when it binds looser than required
+     * @param node Operand
+     * @param minPrecedence Lowest precedence written without parentheses
+     * @param out Output text
+    */
+    static void unparseOperand(const CNode &node, int minPrecedence, std::string &out);
+
+    /**
+     * Writes left associative binary operation
+     * @param out Output text
+    */
+    static void unparseBinary(const CNode &left, const CNode &right, std::string_view op, int precedence, std::string &out);
+
+    /**
+     * Shifts operand and replaces it by an invalid reference when it references deleted cells
+     * @param node Operand
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references, those of a replaced operand are dropped
+    */
+    static void shiftOperand(std::unique_ptr<CNode> &node, const CShift &edit, CPos cell, std::vector<std::string> &dependencies);
+
+    /**
+     * Writes sheet qualifier followed by '!', names which are not plain identifiers are quoted
+     * @param sheet Sheet name, nothing is written for an empty one
+     * @param out Output text
+    */
+    static void unparseSheet(const std::string &sheet, std::string &out);
+
+    /**
+     * Builds dependency of a qualified reference, e.g. "Sheet2!A1"
+     * @param sheet Sheet name, empty for the own sheet
+     * @param reference Cell id or range
+     * @return Dependency text
+    */
+    static std::string qualify(const std::string &sheet, const std::string &reference);
+};
+
+/****************************************************************************/
+
+/**
+ * Rebuilds ASTs of evicted cells from their expression text, implemented by the owner of the parser
+*/
+class CAstLoader {
+public:
+    /**
+     * @param pos Cell position
+     * @param expression Cell formula
+     * @return Rebuilt AST or nullptr when the formula can not be parsed
+    */
+    virtual std::shared_ptr<CNode> load(const CPos &pos, const std::string &expression) = 0;
+
+    /**
+     * Called when a loaded AST is kept by its cell, private ASTs of a value overlay are not reported
+    */
+    virtual void noteResident() {}
+    virtual ~CAstLoader() = default;
+};
+
+/**
+ * Gives access to other sheets of a workbook for references qualified by a sheet name, implemented by the workbook
+*/
+class CSheetResolver {
+public:
+    /**
+     * @param sheet Sheet name
+     * @return Table of the sheet or nullptr when there is no such sheet
+    */
+    virtual std::map<std::string, CCell> *table(const std::string &sheet) = 0;
+    virtual const CDependencyGraph *graph(const std::string &sheet) const = 0;
+    virtual ~CSheetResolver() = default;
 };
 
 /****************************************************************************/
@@ -103,10 +431,18 @@ class CCell {
 public:
     CCell();
     CCell(CPos id, const std::string &expr, std::unique_ptr<CNode> AST);
+
+    /**
+     * Creates literal cell (number or text) which has value but no AST
+     * @param id Cell position
+     * @param expr Original cell contents
+     * @param value Literal value
+    */
+    CCell(CPos id, const std::string &expr, CValue value);
     CPos getPos() const;
     void setValue(CValue val);
     CValue getValue() const;
-    std::string getExpression() const;
+    const std::string &getExpression() const;
 
     /**
      * Evaluates cell and returns its value
@@ -123,13 +459,222 @@ public:
     */
     CCell copyCell(CPos dst, std::vector<std::string> &dependencies);
 
+    /**
+     * Drops AST of a formula cell and keeps only its text, the AST is rebuilt on the next evaluation
+     * @return True if AST was evicted
+    */
+    bool evictAst();
+
+    /**
+     * Rebuilds evicted AST
+     * @param loader Parser of the expression text
+    */
+    void restoreAst(CAstLoader &loader);
+    bool hasAst() const;
+    bool isFormula() const;
+
+    /**
+     * Returns and clears the reference bit set by evaluation, used by CLOCK eviction
+     * @return True if the cell was evaluated since the last call
+    */
+    bool takeReferenced();
+
+    /**
+     * Moves cell after rows or columns were inserted or deleted and updates its references, evicted AST
+     * has to be restored first
+     * @param edit Structural edit
+     * @param pos Cell position after the edit
+     * @param dependencies Output references of the formula
+    */
+    void shift(const CShift &edit, CPos pos, std::vector<std::string> &dependencies);
+
 private:
+    /**
+     * Evaluates cell without writing to it, the overlay replaces inputs and keeps values of formulas
+     * @param overlay Overlay of the running evaluation
+     * @param table Table data
+     * @return Evaluated cell value
+    */
+    CValue evaluate(CValueOverlay &overlay, std::map<std::string, CCell> &table) const;
     CPos m_Pos;
-    std::string m_Expression;
+    // Copied cells get their text from AST on first request
+    mutable std::string m_Expression;
+    mutable bool m_ExpressionStale = false;
     CValue m_Value;
     // Root of AST
     std::shared_ptr<CNode> m_Root;
     bool m_IsEmpty;
+    // Evaluation pass in which m_Value was computed
+    size_t m_Pass = 0;
+    // Formula whose AST was evicted to save memory
+    bool m_Evicted = false;
+    bool m_Referenced = false;
+};
+
+/****************************************************************************/
+
+/**
+ * Values of one evaluation with replaced input cells. Values of formulas are kept here instead of in the cells,
+ * so the table is only read and several overlays may evaluate it at once
+*/
+class CValueOverlay {
+public:
+    /**
+     * @param table Table whose cells are replaced, cells of other sheets keep their values
+     * @param inputs Values of replaced cells, which need not exist in the table
+    */
+    CValueOverlay(const std::map<std::string, CCell> &table, const std::map<CPos, CValue> &inputs);
+    CValueOverlay(const CValueOverlay &overlay) = delete;
+    CValueOverlay& operator=(const CValueOverlay &overlay) = delete;
+
+    /**
+     * @param table Table of the cell
+     * @param pos Cell position
+     * @return Input value or nullptr when the cell is not replaced
+    */
+    const CValue *input(const std::map<std::string, CCell> &table, const CPos &pos) const;
+
+    /**
+     * @param cell Formula cell
+     * @return Value computed by this evaluation or nullptr
+    */
+    const CValue *result(const CCell *cell) const;
+    void setResult(const CCell *cell, const CValue &value);
+
+    /**
+     * Parses evicted AST for this evaluation only, the loader is shared by all overlays so loads are serialized
+     * @param loader AST loader of the running pass
+     * @param pos Cell position
+     * @param expression Cell formula
+     * @return AST or nullptr when the formula can not be parsed
+    */
+    std::shared_ptr<CNode> load(CAstLoader &loader, const CPos &pos, const std::string &expression);
+
+private:
+    const std::map<std::string, CCell> *m_Table;
+    const std::map<CPos, CValue> *m_Inputs;
+    std::unordered_map<const CCell*, CValue> m_Results;
+    static std::mutex s_LoadMutex;
+};
+
+/****************************************************************************/
+
+/**
+ * Evaluation pass of the calling thread. While the pass is alive every cell is evaluated
+ * at most once and further references reuse its value, so the table must not change meanwhile
+*/
+class CEvaluationPass {
+public:
+    /**
+     * Starts new pass
+     * @param loader Rebuilds evicted ASTs reached during the pass
+     * @param sheets Resolves references to other sheets
+     * @param overlay Keeps values of the pass instead of cells, nullptr evaluates into cells
+    */
+    CEvaluationPass(CAstLoader *loader = nullptr, CSheetResolver *sheets = nullptr, CValueOverlay *overlay = nullptr);
+
+    /**
+     * Joins already running pass, used by worker threads evaluating for another thread
+     * @param id Pass id
+     * @param loader Rebuilds evicted ASTs reached during the pass
+     * @param sheets Resolves references to other sheets
+     * @param overlay Keeps values of the pass instead of cells, nullptr evaluates into cells
+    */
+    explicit CEvaluationPass(size_t id, CAstLoader *loader = nullptr, CSheetResolver *sheets = nullptr, CValueOverlay *overlay = nullptr);
+    CEvaluationPass(const CEvaluationPass &pass) = delete;
+    CEvaluationPass& operator=(const CEvaluationPass &pass) = delete;
+    ~CEvaluationPass();
+    size_t getId() const;
+
+    /**
+     * Returns pass of the calling thread
+     * @return Pass id or 0 when no pass is running
+    */
+    static size_t current();
+
+    /**
+     * Returns AST loader of the running pass
+     * @return Loader or nullptr
+    */
+    static CAstLoader *loader();
+
+    /**
+     * Returns table of another sheet of the workbook evaluated by the running pass
+     * @param sheet Sheet name
+     * @return Table or nullptr when the sheet does not exist or no workbook is attached
+    */
+    static std::map<std::string, CCell> *sheet(const std::string &sheet);
+
+    /**
+     * Returns overlay of the running pass
+     * @return Overlay or nullptr
+    */
+    static CValueOverlay *overlay();
+
+    /**
+     * Returns value of a cell missing in the table, which is empty unless the overlay replaces it
+     * @param table Table data
+     * @param pos Cell position
+     * @return Cell value
+    */
+    static CValue emptyCell(const std::map<std::string, CCell> &table, const CPos &pos);
+
+private:
+    size_t m_Id;
+    size_t m_Previous;
+    CAstLoader *m_PreviousLoader;
+    CSheetResolver *m_PreviousSheets;
+    CValueOverlay *m_PreviousOverlay;
+    static std::atomic<size_t> s_Counter;
+    static thread_local size_t s_Current;
+    static thread_local CAstLoader *s_Loader;
+    static thread_local CSheetResolver *s_Sheets;
+    static thread_local CValueOverlay *s_Overlay;
+};
+
+/****************************************************************************/
+
+/**
+ * Persistent threads sharing chunked work with the calling thread, so large aggregates do not start
+ * threads on every evaluation. One job runs at a time, callers finding the pool busy run their chunks alone
+*/
+class CWorkerPool {
+public:
+    /**
+     * Returns process wide pool, its threads are started on first demand
+     * @return Pool
+    */
+    static CWorkerPool &instance();
+    CWorkerPool(const CWorkerPool &pool) = delete;
+    CWorkerPool& operator=(const CWorkerPool &pool) = delete;
+    ~CWorkerPool();
+
+    /**
+     * Runs task for every chunk on the calling thread and at most workers - 1 pool threads
+     * @param chunks Number of chunks
+     * @param workers Number of threads including the calling one
+     * @param task Callback receiving chunk index, must not use the pool itself
+    */
+    void run(size_t chunks, size_t workers, const std::function<void(size_t)> &task);
+
+private:
+    CWorkerPool() = default;
+    void work();
+    void drain();
+
+    // Serializes jobs, held by the caller for the whole job
+    std::mutex m_JobMutex;
+    std::mutex m_Mutex;
+    std::condition_variable m_Wake;
+    std::condition_variable m_Done;
+    std::vector<std::thread> m_Threads;
+    const std::function<void(size_t)> *m_Task = nullptr;
+    size_t m_Chunks = 0;
+    std::atomic<size_t> m_Next = 0;
+    // Pool threads still allowed to join the job and those working on it
+    size_t m_Openings = 0;
+    size_t m_Running = 0;
+    bool m_Stop = false;
 };
 
 /****************************************************************************/
@@ -138,7 +683,17 @@ class CNumberNode : public CNode {
 public:
     CNumberNode(double num);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+    double getNumber() const;
+
+    /**
+     * Writes number the way the parser reads it back, infinity as 1e999
+     * @param value Number
+     * @param out Output text
+    */
+    static void unparseNumber(double value, std::string &out);
 
 private:
     double m_Value;
@@ -148,7 +703,8 @@ class CStringNode : public CNode {
 public:
     CStringNode(const std::string &str);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 
 private:
     std::string m_Value;
@@ -159,6 +715,7 @@ private:
 class CBinaryOperatorNode : public CNode {
 public:
     CBinaryOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
     
 protected:
     // Left operand
@@ -172,35 +729,90 @@ class CAddOperatorNode : public CBinaryOperatorNode {
 public:
     CAddOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Adds numbers or concatenates strings, numbers are written with std::to_string
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CSubOperatorNode : public CBinaryOperatorNode {
 public:
     CSubOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Subtracts numbers
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CDivOperatorNode : public CBinaryOperatorNode {
 public:
     CDivOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Divides numbers, division by zero is undefined
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CMulOperatorNode : public CBinaryOperatorNode {
 public:
     CMulOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+
+    /**
+     * Multiplies numbers
+     * @param left Left operand value
+     * @param right Right operand value
+     * @return Result, undefined for unsupported operand types
+    */
+    static CValue apply(const CValue &left, const CValue &right);
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+};
+
+class CNegOperatorNode : public CNode {
+public:
+    CNegOperatorNode(std::unique_ptr<CNode> operand);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+private:
+    std::unique_ptr<CNode> m_Operand;
 };
 
 class CPowOperatorNode : public CBinaryOperatorNode {
 public:
     CPowOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 /****************************************************************************/
@@ -208,6 +820,7 @@ public:
 class CRelationalOperatorNode : public CNode {
 public:
     CRelationalOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
     
 protected:
     std::unique_ptr<CNode> m_Left;
@@ -218,42 +831,54 @@ class CEqOperatorNode : public CRelationalOperatorNode {
 public:
     CEqOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CNeOperatorNode : public CRelationalOperatorNode {
 public:
     CNeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CLtOperatorNode : public CRelationalOperatorNode {
 public:
     CLtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CLeOperatorNode : public CRelationalOperatorNode {
 public:
     CLeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CGtOperatorNode : public CRelationalOperatorNode {
 public:
     CGtOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 class CGeOperatorNode : public CRelationalOperatorNode {
 public:
     CGeOperatorNode(std::unique_ptr<CNode> left, std::unique_ptr<CNode> right);
     CValue evaluate(std::map<std::string, CCell> &table) override;
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
 };
 
 /****************************************************************************/
@@ -268,8 +893,40 @@ public:
      * @return Reference value
     */
     CValue getValue(std::map<std::string, CCell> &table);
+    const CPos &getRefId() const;
+
+    /**
+     * Makes the reference point to a cell of another sheet
+     * @param sheet Sheet name
+    */
+    void setSheet(const std::string &sheet);
+    const std::string &getSheet() const;
+
+    /**
+     * Returns dependency of the reference, e.g. "A1" or "Sheet2!A1"
+     * @return Dependency text
+    */
+    std::string getDependency() const;
+
+    /**
+     * Moves referenced cell regardless of '$' signs, structural edits move the cells themselves.
+     * References to other sheets are kept, the edit belongs to the own sheet only
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references
+     * @return False if the referenced cell was deleted
+    */
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
 
 protected:
+    /**
+     * Finishes cloned reference, it keeps the sheet and reports its dependency
+     * @param node Cloned reference
+     * @param dependencies Output references
+     * @return Cloned reference
+    */
+    std::unique_ptr<CNode> qualified(std::unique_ptr<CReferenceNode> node, std::vector<std::string> &dependencies) const;
+
     // The position of the cell in which the reference is located
     CPos m_CellId;
 
@@ -278,6 +935,9 @@ protected:
 
     // String representation of reference
     std::string m_Reference;
+
+    // Sheet of the referenced cell, empty for the own sheet
+    std::string m_Sheet;
 };
 
 class CRelativeReferenceNode : public CReferenceNode {
@@ -290,7 +950,8 @@ public:
      * @param CPos Copy destination
      * @return Pointer to recalculated reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 };
 
 class CAbsoluteReferenceNode : public CReferenceNode {
@@ -303,7 +964,8 @@ public:
      * @param CPos Copy destination
      * @return Pointer to reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 };
 
 class CAbsRelReferenceNode : public CReferenceNode {
@@ -316,7 +978,8 @@ public:
      * @param CPos Copy destination
      * @return Pointer to recalculated reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
 };
 
 class CRelAbsReferenceNode : public CReferenceNode {
@@ -329,5 +992,348 @@ public:
      * @param CPos Copy destination
      * @return Pointer to recalculated reference
     */
-    std::unique_ptr<CNode> clone(CPos dst, std::string &expr, std::vector<std::string> &dependencies) override;
-};
\ No newline at end of file
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+/**
+ * Reference whose cells were deleted, it has undefined value and is written as 1/0 which evaluates the same way
+*/
+class CInvalidReferenceNode : public CNode {
+public:
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    int precedence() const override;
+};
+
+/****************************************************************************/
+
+/**
+ * Cell reference operand stored by value inside a fused node
+*/
+class CRefOperand {
+public:
+    CRefOperand(CPos refId, bool absoluteColumn, bool absoluteRow);
+    CValue value(std::map<std::string, CCell> &table) const;
+
+    /**
+     * Moves relative parts of the reference like copying a reference node does
+     * @param cell Position of the owning cell
+     * @param dst Copy destination
+     * @param dependencies Output references
+     * @return Copied operand
+    */
+    CRefOperand clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const;
+    void unparse(std::string &out) const;
+    bool shift(const CShift &edit, std::vector<std::string> &dependencies);
+
+private:
+    CPos m_RefId;
+    // Table key of the referenced cell
+    std::string m_Reference;
+    bool m_AbsoluteColumn;
+    bool m_AbsoluteRow;
+};
+
+/**
+ * Number operand stored by value inside a fused node
+*/
+class CConstOperand {
+public:
+    CConstOperand(double number);
+
+    const CValue &value(std::map<std::string, CCell> &table) const {
+        return m_Value;
+    }
+
+    CConstOperand clone(CPos cell, CPos dst, std::vector<std::string> &dependencies) const;
+    void unparse(std::string &out) const;
+    bool shift(const CShift &edit, std::vector<std::string> &dependencies);
+
+private:
+    double m_Number;
+    // Value computed once, infinite numbers are undefined
+    CValue m_Value;
+};
+
+/**
+ * Operations available to fused nodes, they share semantics with the generic operator nodes
+*/
+struct COpAdd {
+    static constexpr std::string_view SYMBOL = "+";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_ADDITIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+            return CValue(std::get<double>(left) + std::get<double>(right));
+        return CAddOperatorNode::apply(left, right);
+    }
+};
+
+struct COpSub {
+    static constexpr std::string_view SYMBOL = "-";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_ADDITIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+            return CValue(std::get<double>(left) - std::get<double>(right));
+        return CSubOperatorNode::apply(left, right);
+    }
+};
+
+struct COpMul {
+    static constexpr std::string_view SYMBOL = "*";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_MULTIPLICATIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+            return CValue(std::get<double>(left) * std::get<double>(right));
+        return CMulOperatorNode::apply(left, right);
+    }
+};
+
+struct COpDiv {
+    static constexpr std::string_view SYMBOL = "/";
+    static constexpr int PRECEDENCE = CNode::PRECEDENCE_MULTIPLICATIVE;
+
+    static CValue apply(const CValue &left, const CValue &right) {
+        if (std::holds_alternative<double>(left) && std::holds_alternative<double>(right) && std::get<double>(right) != 0)
+            return CValue(std::get<double>(left) / std::get<double>(right));
+        return CDivOperatorNode::apply(left, right);
+    }
+};
+
+/**
+ * Superinstruction for the most common formula shapes (e.g. A1+B1, A1*2), both operands are stored inline
+ * and the operation is evaluated by a single virtual call
+*/
+template <typename TOp, typename TLeft, typename TRight>
+class CBinaryFused : public CNode {
+public:
+    CBinaryFused(CPos cellId, TLeft left, TRight right)
+        : m_CellId(cellId)
+        , m_Left(std::move(left))
+        , m_Right(std::move(right)) {}
+
+    CValue evaluate(std::map<std::string, CCell> &table) override {
+        // Operands are evaluated left to right like in the generic tree
+        CValue left = m_Left.value(table);
+        return TOp::apply(left, m_Right.value(table));
+    }
+
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override {
+        TLeft left = m_Left.clone(m_CellId, dst, dependencies);
+        return std::make_unique<CBinaryFused>(dst, std::move(left), m_Right.clone(m_CellId, dst, dependencies));
+    }
+
+    void unparse(std::string &out) const override {
+        m_Left.unparse(out);
+        out += TOp::SYMBOL;
+        m_Right.unparse(out);
+    }
+
+    int precedence() const override {
+        return TOp::PRECEDENCE;
+    }
+
+    /**
+     * Operation with a deleted operand is undefined whatever the other one is, so the whole node is replaced
+     * @param edit Structural edit
+     * @param cell Position of the owning cell after the edit
+     * @param dependencies Output references
+     * @return False if an operand references deleted cell
+    */
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override {
+        m_CellId = cell;
+        return m_Left.shift(edit, dependencies) && m_Right.shift(edit, dependencies);
+    }
+
+private:
+    // The position of the cell in which the operation is located
+    CPos m_CellId;
+    TLeft m_Left;
+    TRight m_Right;
+};
+
+/****************************************************************************/
+
+class CRangeNode : public CNode {
+public:
+    /**
+     * @param cellId Position of the cell in which the range is located
+     * @param range Range as written in the formula (e.g. A$7:$X29)
+    */
+    CRangeNode(CPos cellId, const std::string &range);
+
+    /**
+     * Range alone is not a value, it is consumed by functions
+     * @param table Table data
+     * @return Undefined value
+    */
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+
+    /**
+     * Clones range and shifts its relative corners
+     * @param dst Copy destination
+     * @return Pointer to recalculated range
+    */
+    std::unique_ptr<CRangeNode> cloneRange(CPos dst, std::vector<std::string> &dependencies);
+
+    /**
+     * Evaluates every cell of the range including empty ones, column by column
+     * @param table Table data
+     * @param visitor Callback receiving cell values
+    */
+    void forEachValue(std::map<std::string, CCell> &table, const std::function<void(const CValue&)> &visitor) const;
+
+    /**
+     * Folds values of the range in column-major order. Ranges of at least PARALLEL_CELLS cells are split into
+     * chunks of CHUNK_CELLS consecutive cells folded on several threads and partial results are combined pairwise
+     * in a fixed order, so the result does not depend on the number of threads. Overlay evaluations fold the same
+     * chunks serially, they are already spread over threads by scenarios
+     * @param table Table data
+     * @param fold Adds cell value to partial result
+     * @param combine Adds right partial result to the left one
+     * @return Result of the whole range
+    */
+    template<typename TPartial, typename TFold, typename TCombine>
+    TPartial reduce(std::map<std::string, CCell> &table, TFold fold, TCombine combine) const;
+    CRect getRect() const;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+    void setSheet(const std::string &sheet);
+
+    /**
+     * Returns dependency of the range, e.g. "A1:B5" or "Sheet2!A1:B5"
+     * @return Dependency text
+    */
+    std::string getDependency() const;
+    static const size_t PARALLEL_CELLS = 1 << 16;
+    static const size_t CHUNK_CELLS = 1 << 14;
+
+    /**
+     * Sets number of threads folding chunks of large ranges, results do not depend on it
+     * @param workers Number of threads, 0 uses hardware concurrency
+    */
+    static void setWorkers(size_t workers);
+
+private:
+    /**
+     * Finds cells of the range chunk by chunk on several threads, formulas are then evaluated on the calling
+     * thread because evaluation writes to cells and may reach other cells of the range
+     * @param table Table data
+     * @return Cells in column-major order, nullptr for missing ones
+    */
+    std::vector<const CCell*> resolveCells(std::map<std::string, CCell> &table) const;
+
+    /**
+     * Runs task for every chunk, chunks are taken by the calling thread and threads of the shared worker pool
+     * @param chunks Number of chunks
+     * @param task Callback receiving chunk index
+    */
+    static void forEachChunk(size_t chunks, const std::function<void(size_t)> &task);
+    static std::atomic<size_t> s_Workers;
+
+    // The position of the cell in which the range is located
+    CPos m_CellId;
+
+    // Sheet of the range, empty for the own sheet
+    std::string m_Sheet;
+
+    // Corners as written, only the rectangle is normalized
+    CPos m_Corners[2];
+    bool m_AbsoluteColumn[2];
+    bool m_AbsoluteRow[2];
+};
+
+/****************************************************************************/
+
+class CRangeFunctionNode : public CNode {
+public:
+    CRangeFunctionNode(std::unique_ptr<CRangeNode> range);
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+protected:
+    /**
+     * Finds number selected by a strict comparison. Like a serial scan keeping the first number unless a better one
+     * follows, NaN is the result only when it is the first number of the range and is skipped otherwise
+     * @param table Table data
+     * @param better Comparison of a candidate with the best number so far
+     * @return Selected number, undefined for a range without numbers
+    */
+    template<typename TBetter>
+    CValue extremum(std::map<std::string, CCell> &table, TBetter better) const;
+    std::unique_ptr<CRangeNode> m_Range;
+};
+
+class CSumFunctionNode : public CRangeFunctionNode {
+public:
+    CSumFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CCountFunctionNode : public CRangeFunctionNode {
+public:
+    CCountFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CMinFunctionNode : public CRangeFunctionNode {
+public:
+    CMinFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CMaxFunctionNode : public CRangeFunctionNode {
+public:
+    CMaxFunctionNode(std::unique_ptr<CRangeNode> range);
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+};
+
+class CCountvalFunctionNode : public CRangeFunctionNode {
+public:
+    CCountvalFunctionNode(std::unique_ptr<CNode> value, std::unique_ptr<CRangeNode> range);
+
+    /**
+     * Counts cells of the range whose value equals the evaluated value (empty cells match undefined)
+     * @param table Table data
+     * @return Number of matching cells
+    */
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+private:
+    std::unique_ptr<CNode> m_Value;
+};
+
+class CIfFunctionNode : public CNode {
+public:
+    CIfFunctionNode(std::unique_ptr<CNode> condition, std::unique_ptr<CNode> ifTrue, std::unique_ptr<CNode> ifFalse);
+
+    /**
+     * Evaluates only the selected branch, non-numeric condition gives undefined value
+     * @param table Table data
+     * @return Value of the selected branch
+    */
+    CValue evaluate(std::map<std::string, CCell> &table) override;
+    std::unique_ptr<CNode> clone(CPos dst, std::vector<std::string> &dependencies) override;
+    void unparse(std::string &out) const override;
+    bool shift(const CShift &edit, CPos cell, std::vector<std::string> &dependencies) override;
+
+private:
+    std::unique_ptr<CNode> m_Condition;
+    std::unique_ptr<CNode> m_IfTrue;
+    std::unique_ptr<CNode> m_IfFalse;
+};
@@ -0,0 +1,289 @@
+/******************************************************
+ * Filename: codec.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements LZ family codec without external dependencies and block container
+ *              built on top of it, which is used for compressed saves. Blocks carry their own checksums
+ *              and are decompressed in parallel on load.
+ ******************************************************/
+
+#include "codec.h"
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+/***********************************************
+*        LZ Codec Section
+***********************************************/
+
+uint32_t CLzCodec::read32(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint32_t CLzCodec::hash32(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+void CLzCodec::writeLength(std::string &out, size_t length) {
+    for (; length >= 255; length -= 255)
+        out.push_back(static_cast<char>(255));
+    out.push_back(static_cast<char>(length));
+}
+
+bool CLzCodec::readLength(const unsigned char *&in, const unsigned char *end, size_t &length) {
+    unsigned char byte;
+    do {
+        if (in == end)
+            return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+std::string CLzCodec::compress(std::string_view input) {
+    std::string out;
+    out.reserve(input.size() / 2 + 16);
+    // Positions are stored shifted by one, 0 marks an empty slot
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    auto emit = [&](size_t literals, size_t offset, size_t match) {
+        size_t matchCode = match ? match - MIN_MATCH : 0;
+        out.push_back(static_cast<char>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(matchCode, 15)));
+        if (literals >= 15)
+            writeLength(out, literals - 15);
+        out.append(input.data() + anchor, literals);
+        if (!match)
+            return;
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15)
+            writeLength(out, matchCode - 15);
+    };
+
+    while (pos + MIN_MATCH <= input.size()) {
+        uint32_t sequence = read32(input.data() + pos);
+        uint32_t &slot = table[hash32(sequence)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(pos + 1);
+
+        if (!candidate || pos - (candidate - 1) > MAX_OFFSET || read32(input.data() + candidate - 1) != sequence) {
+            pos++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t length = MIN_MATCH;
+        while (pos + length < input.size() && input[match + length] == input[pos + length])
+            length++;
+
+        emit(pos - anchor, pos - match, length);
+        pos += length;
+        anchor = pos;
+    }
+
+    // Final sequence holds the remaining literals, possibly none
+    emit(input.size() - anchor, 0, 0);
+    return out;
+}
+
+bool CLzCodec::decompress(std::string_view input, std::span<char> output) {
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(input.data());
+    const unsigned char *end = in + input.size();
+    size_t written = 0;
+
+    while (in != end) {
+        unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(in, end, literals))
+            return false;
+        if (literals > size_t(end - in) || literals > output.size() - written)
+            return false;
+        std::memcpy(output.data() + written, in, literals);
+        in += literals;
+        written += literals;
+
+        // Only the last sequence ends after its literals
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return false;
+        size_t offset = in[0] | (size_t(in[1]) << 8);
+        in += 2;
+        size_t length = token & 0xf;
+        if (length == 15 && !readLength(in, end, length))
+            return false;
+        length += MIN_MATCH;
+        if (offset == 0 || offset > written || length > output.size() - written)
+            return false;
+
+        // Source and destination may overlap, repeating the last offset bytes
+        char *dst = output.data() + written;
+        const char *src = dst - offset;
+        if (offset >= length) {
+            std::memcpy(dst, src, length);
+        } else {
+            for (size_t i = 0; i < length; i++)
+                dst[i] = src[i];
+        }
+        written += length;
+    }
+    return written == output.size();
+}
+
+/***********************************************
+*        Block Writer Section
+***********************************************/
+
+CBlockWriter::CBlockWriter(std::ostream &os, size_t blockSize)
+    : m_Os(os)
+    , m_BlockSize(std::clamp<size_t>(blockSize, 1, MAX_BLOCK_SIZE)) {
+    m_Buffer.reserve(m_BlockSize);
+    m_Os.write(MAGIC.data(), MAGIC.size());
+}
+
+void CBlockWriter::write(std::string_view data) {
+    m_Checksum.update(data);
+    while (!data.empty()) {
+        // Whole blocks of large pieces are compressed without copying them into the buffer
+        if (m_Buffer.empty() && data.size() >= m_BlockSize) {
+            writeBlock(data.substr(0, m_BlockSize));
+            data.remove_prefix(m_BlockSize);
+            continue;
+        }
+
+        size_t take = std::min(m_BlockSize - m_Buffer.size(), data.size());
+        m_Buffer.append(data.substr(0, take));
+        data.remove_prefix(take);
+        if (m_Buffer.size() == m_BlockSize) {
+            writeBlock(m_Buffer);
+            m_Buffer.clear();
+        }
+    }
+}
+
+bool CBlockWriter::finish() {
+    if (!m_Buffer.empty()) {
+        writeBlock(m_Buffer);
+        m_Buffer.clear();
+    }
+    writeBlock("");
+    m_Os.flush();
+    return !m_Os.fail();
+}
+
+const CChecksum &CBlockWriter::getChecksum() const {
+    return m_Checksum;
+}
+
+void CBlockWriter::writeBlock(std::string_view data) {
+    CChecksum checksum;
+    checksum.update(data);
+
+    std::string compressed = CLzCodec::compress(data);
+    std::string_view stored = compressed.size() < data.size() ? std::string_view(compressed) : data;
+    m_Os << data.size() << ' ' << stored.size() << ' ' << checksum.toString() << '\n';
+    m_Os.write(stored.data(), stored.size());
+}
+
+/***********************************************
+*        Block Reader Section
+***********************************************/
+
+bool CBlockReader::isBlocked(std::string_view input) {
+    return input.substr(0, CBlockWriter::MAGIC.size()) == CBlockWriter::MAGIC;
+}
+
+bool CBlockReader::decode(std::string_view input, std::string &output, size_t workers) {
+    struct CBlock {
+        std::string_view m_Stored;
+        size_t m_Offset;
+        size_t m_Size;
+        std::string_view m_Checksum;
+    };
+
+    if (!isBlocked(input))
+        return false;
+    input.remove_prefix(CBlockWriter::MAGIC.size());
+
+    // Headers are read serially to find where every block starts in the input and in the output
+    std::vector<CBlock> blocks;
+    size_t total = 0;
+    while (true) {
+        size_t lineEnd = input.find('\n');
+        if (lineEnd == std::string_view::npos)
+            return false;
+        std::string_view line = input.substr(0, lineEnd);
+        input.remove_prefix(lineEnd + 1);
+
+        size_t rawSize = 0;
+        size_t storedSize = 0;
+        const char *end = line.data() + line.size();
+        auto raw = std::from_chars(line.data(), end, rawSize);
+        if (raw.ec != std::errc() || raw.ptr == end || *raw.ptr != ' ')
+            return false;
+        auto stored = std::from_chars(raw.ptr + 1, end, storedSize);
+        if (stored.ec != std::errc() || stored.ptr == end || *stored.ptr != ' ' || end - stored.ptr != 17)
+            return false;
+        if (storedSize > rawSize || storedSize > input.size())
+            return false;
+        if (rawSize > CBlockWriter::MAX_BLOCK_SIZE || rawSize > storedSize * CLzCodec::MAX_RATIO || rawSize > SIZE_MAX - total)
+            return false;
+
+        std::string_view checksum(stored.ptr + 1, 16);
+        if (rawSize == 0) {
+            // End marker closes the stream, nothing may follow it
+            CChecksum empty;
+            if (checksum != empty.toString() || !input.empty())
+                return false;
+            break;
+        }
+
+        blocks.push_back({input.substr(0, storedSize), total, rawSize, checksum});
+        input.remove_prefix(storedSize);
+        total += rawSize;
+    }
+
+    output.assign(total, '\0');
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::clamp<size_t>(workers, 1, std::max<size_t>(blocks.size(), 1));
+
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> valid = true;
+    auto work = [&]() {
+        for (size_t i = next++; i < blocks.size() && valid.load(std::memory_order_relaxed); i = next++) {
+            const CBlock &block = blocks[i];
+            std::span<char> target(output.data() + block.m_Offset, block.m_Size);
+            if (block.m_Stored.size() == block.m_Size)
+                std::memcpy(target.data(), block.m_Stored.data(), block.m_Size);
+            else if (!CLzCodec::decompress(block.m_Stored, target)) {
+                valid = false;
+                break;
+            }
+
+            CChecksum checksum;
+            checksum.update(std::string_view(target.data(), target.size()));
+            if (checksum.toString() != block.m_Checksum)
+                valid = false;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+        threads.emplace_back(work);
+    work();
+    for (auto &thread : threads)
+        thread.join();
+
+    if (!valid)
+        output.clear();
+    return valid;
+}
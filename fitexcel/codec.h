@@ -0,0 +1,99 @@
+#include "journal.h"
+#include <span>
+
+/**
+ * Byte oriented LZ77 codec in the LZ4 style. Compressed data is a series of sequences, each made of a token
+ * (literal length in the high nibble, match length - 4 in the low nibble), extra length bytes for nibbles equal
+ * to 15, literals and 2-byte little endian match offset. The last sequence carries literals only
+*/
+class CLzCodec {
+public:
+    static const size_t MIN_MATCH = 4;
+    static const size_t MAX_OFFSET = 65535;
+
+    // Every compressed byte stands for at most this many uncompressed bytes
+    static const size_t MAX_RATIO = 255;
+
+    /**
+     * @param input Uncompressed data
+     * @return Compressed data
+    */
+    static std::string compress(std::string_view input);
+
+    /**
+     * Decompresses data into a buffer of known size, malformed input never writes outside of the buffer
+     * @param input Compressed data
+     * @param output Buffer of exactly the uncompressed size
+     * @return False if the input is malformed or does not fill the buffer exactly
+    */
+    static bool decompress(std::string_view input, std::span<char> output);
+
+private:
+    static const unsigned HASH_BITS = 14;
+    static uint32_t read32(const char *data);
+    static uint32_t hash32(uint32_t sequence);
+    static void writeLength(std::string &out, size_t length);
+    static bool readLength(const unsigned char *&in, const unsigned char *end, size_t &length);
+};
+
+/****************************************************************************/
+
+/**
+ * Writes data as independently compressed blocks. The stream starts with "<BLOCKS>\n", every block is written
+ * as "<raw size> <stored size> <checksum>\n<stored bytes>" and a block of raw size 0 ends the stream.
+ * Blocks that do not shrink are stored uncompressed, which is signalled by equal sizes
+*/
+class CBlockWriter {
+public:
+    static constexpr std::string_view MAGIC = "<BLOCKS>\n";
+    static const size_t MAX_BLOCK_SIZE = 1 << 24;
+
+    /**
+     * @param os Output stream
+     * @param blockSize Uncompressed size of blocks, at most MAX_BLOCK_SIZE
+    */
+    CBlockWriter(std::ostream &os, size_t blockSize = 1 << 16);
+    CBlockWriter(const CBlockWriter &writer) = delete;
+    CBlockWriter& operator=(const CBlockWriter &writer) = delete;
+    void write(std::string_view data);
+
+    /**
+     * Writes the last partial block and the end marker, nothing can be written afterwards
+     * @return True if the stream is still valid
+    */
+    bool finish();
+
+    /**
+     * @return Checksum of the uncompressed data, the same as CStreamWriter computes for it
+    */
+    const CChecksum &getChecksum() const;
+
+private:
+    void writeBlock(std::string_view data);
+    std::ostream &m_Os;
+    std::string m_Buffer;
+    size_t m_BlockSize;
+    CChecksum m_Checksum;
+};
+
+/****************************************************************************/
+
+class CBlockReader {
+public:
+    /**
+     * @param input Stream contents
+     * @return True if the contents were written by CBlockWriter
+    */
+    static bool isBlocked(std::string_view input);
+
+    /**
+     * Checks block headers and decompresses blocks in parallel, every block is verified against its checksum.
+     * Sizes in headers are checked before anything is allocated, so the output is at most MAX_RATIO times
+     * larger than the input
+     * @param input Stream contents
+     * @param output Uncompressed data
+     * @param workers Number of decompressing threads, 0 uses hardware concurrency
+     * @return False if any block is truncated, malformed or corrupted
+    */
+    static bool decode(std::string_view input, std::string &output, size_t workers = 0);
+};
@@ -0,0 +1,102 @@
+/******************************************************
+ * Filename: csv.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements buffered RFC 4180 tokenizer used by CSV import.
+ ******************************************************/
+
+#include "csv.h"
+
+/***********************************************
+*        CSV Reader Section
+***********************************************/
+
+CCsvReader::CCsvReader(std::istream &is, size_t capacity)
+    : m_Is(is)
+    , m_Capacity(std::max<size_t>(capacity, 1)) {
+    m_Buffer.resize(m_Capacity);
+}
+
+bool CCsvReader::fill() {
+    m_Pos = 0;
+    m_Size = 0;
+    if (!m_Is.read(m_Buffer.data(), m_Capacity) && !m_Is.eof())
+        return false;
+    m_Size = m_Is.gcount();
+    return m_Size > 0;
+}
+
+bool CCsvReader::next(std::string_view &field, bool &lastInRow) {
+    if (m_Pos == m_Size && !fill())
+        return false;
+    if (m_SkipNewline) {
+        m_SkipNewline = false;
+        if (m_Buffer[m_Pos] == '\n' && ++m_Pos == m_Size && !fill())
+            return false;
+    }
+
+    m_Field.clear();
+    bool assembled = false;
+    if (m_Buffer[m_Pos] == '"') {
+        // Quoted field, doubled quote stands for a quote character
+        assembled = true;
+        m_Pos++;
+        while (true) {
+            if (m_Pos == m_Size && !fill()) {
+                m_Unterminated = true;
+                break;
+            }
+            size_t quote = m_Buffer.find('"', m_Pos);
+            if (quote == std::string::npos || quote >= m_Size) {
+                m_Field.append(m_Buffer, m_Pos, m_Size - m_Pos);
+                m_Pos = m_Size;
+                continue;
+            }
+            m_Field.append(m_Buffer, m_Pos, quote - m_Pos);
+            m_Pos = quote + 1;
+            if ((m_Pos < m_Size || fill()) && m_Buffer[m_Pos] == '"') {
+                m_Field.push_back('"');
+                m_Pos++;
+                continue;
+            }
+            break;
+        }
+    }
+
+    // Unquoted field or text following the closing quote runs to the next separator
+    lastInRow = true;
+    while (true) {
+        if (m_Pos == m_Size) {
+            if (!fill())
+                break;
+            assembled = true;
+        }
+        size_t end = m_Pos;
+        while (end < m_Size && m_Buffer[end] != ',' && m_Buffer[end] != '\n' && m_Buffer[end] != '\r')
+            end++;
+
+        if (end == m_Size) {
+            m_Field.append(m_Buffer, m_Pos, end - m_Pos);
+            m_Pos = m_Size;
+            assembled = true;
+            continue;
+        }
+
+        if (assembled)
+            m_Field.append(m_Buffer, m_Pos, end - m_Pos);
+        else
+            field = std::string_view(m_Buffer.data() + m_Pos, end - m_Pos);
+        lastInRow = m_Buffer[end] != ',';
+        m_SkipNewline = m_Buffer[end] == '\r';
+        m_Pos = end + 1;
+        break;
+    }
+
+    if (assembled)
+        field = m_Field;
+    return true;
+}
+
+bool CCsvReader::isValid() const {
+    return !m_Unterminated && !m_Is.bad();
+}
@@ -0,0 +1,42 @@
+#include <algorithm>
+#include <istream>
+#include <string>
+#include <string_view>
+
+/**
+ * RFC 4180 tokenizer reading the stream in large chunks. Fields without quotes are returned as views
+ * into the chunk, quoted fields and fields crossing a chunk boundary are assembled separately
+*/
+class CCsvReader {
+public:
+    CCsvReader(std::istream &is, size_t capacity = 1 << 20);
+    CCsvReader(const CCsvReader &reader) = delete;
+    CCsvReader& operator=(const CCsvReader &reader) = delete;
+
+    /**
+     * Reads next field, both '\n' and "\r\n" end a row
+     * @param field Field contents, valid until the next call
+     * @param lastInRow Set if the field ends a row
+     * @return False at the end of input
+    */
+    bool next(std::string_view &field, bool &lastInRow);
+
+    /**
+     * Checks that the input was read completely and no quoted field was left open
+     * @return True if the input was valid
+    */
+    bool isValid() const;
+
+private:
+    bool fill();
+    std::istream &m_Is;
+    std::string m_Buffer;
+    size_t m_Capacity;
+    size_t m_Pos = 0;
+    size_t m_Size = 0;
+    // Field assembled from several pieces
+    std::string m_Field;
+    // Previous row ended with '\r', a following '\n' belongs to it
+    bool m_SkipNewline = false;
+    bool m_Unterminated = false;
+};
@@ -0,0 +1,181 @@
+/******************************************************
+ * Filename: journal.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements append-only journal of sheet modifications used for incremental saves
+ *              and crash recovery, together with the running checksum and buffered stream writer used by file IO.
+ ******************************************************/
+
+#include "journal.h"
+#include <sstream>
+
+/***********************************************
+*        Checksum Section
+***********************************************/
+
+void CChecksum::update(std::string_view data) {
+    for (char c : data)
+        update(c);
+}
+
+void CChecksum::update(char c) {
+    m_Hash ^= static_cast<unsigned char>(c);
+    m_Hash *= 0x100000001b3ULL;
+}
+
+uint64_t CChecksum::get() const {
+    return m_Hash;
+}
+
+std::string CChecksum::toString() const {
+    static const char *hex = "0123456789abcdef";
+    std::string result(16, '0');
+    for (size_t i = 0; i < 16; i++)
+        result[15 - i] = hex[(m_Hash >> (i * 4)) & 0xf];
+    return result;
+}
+
+/***********************************************
+*        Stream Writer Section
+***********************************************/
+
+CStreamWriter::CStreamWriter(std::ostream &os, size_t capacity)
+    : m_Os(os)
+    , m_Capacity(capacity) {
+    m_Buffer.reserve(capacity);
+}
+
+CStreamWriter::~CStreamWriter() {
+    flush();
+}
+
+void CStreamWriter::write(std::string_view data) {
+    m_Checksum.update(data);
+    if (m_Buffer.size() + data.size() > m_Capacity)
+        flush();
+
+    // Data larger than the buffer goes straight to the stream
+    if (data.size() >= m_Capacity)
+        m_Os.write(data.data(), data.size());
+    else
+        m_Buffer.append(data);
+}
+
+bool CStreamWriter::flush() {
+    if (!m_Buffer.empty()) {
+        m_Os.write(m_Buffer.data(), m_Buffer.size());
+        m_Buffer.clear();
+    }
+    return !m_Os.fail();
+}
+
+const CChecksum &CStreamWriter::getChecksum() const {
+    return m_Checksum;
+}
+
+/***********************************************
+*        Journal Section
+***********************************************/
+
+CJournal::CJournal(std::ostream &os, std::string_view base)
+    : m_Os(os) {
+    append('B', base);
+}
+
+bool CJournal::appendSetCell(std::string_view id, std::string_view contents) {
+    std::string payload;
+    payload.reserve(id.size() + contents.size() + 1);
+    payload.append(id).append(1, ' ').append(contents);
+    return append('S', payload);
+}
+
+bool CJournal::appendCopyRect(std::string_view dst, std::string_view src, int w, int h) {
+    return appendRect('C', dst, src, w, h);
+}
+
+bool CJournal::appendMoveRect(std::string_view dst, std::string_view src, int w, int h) {
+    return appendRect('M', dst, src, w, h);
+}
+
+bool CJournal::appendShift(std::string_view operation, size_t index, size_t count) {
+    std::string payload(operation);
+    payload.append(1, ' ').append(std::to_string(index)).append(1, ' ').append(std::to_string(count));
+    return append('T', payload);
+}
+
+bool CJournal::isValid() const {
+    return !m_Os.fail();
+}
+
+bool CJournal::appendRect(char type, std::string_view dst, std::string_view src, int w, int h) {
+    std::string payload;
+    payload.append(dst).append(1, ' ').append(src).append(1, ' ')
+           .append(std::to_string(w)).append(1, ' ').append(std::to_string(h));
+    return append(type, payload);
+}
+
+bool CJournal::append(char type, std::string_view payload) {
+    if (m_Os.fail())
+        return false;
+
+    CChecksum checksum;
+    checksum.update(type);
+    checksum.update(payload);
+
+    // Record reaches the stream as a whole, so a crash can only tear the last one
+    m_Os << type << payload.size() << ' ' << checksum.toString() << '\n';
+    m_Os.write(payload.data(), payload.size());
+    m_Os << '\n';
+    m_Os.flush();
+    return !m_Os.fail();
+}
+
+bool CJournal::readRecord(std::istream &is, char &type, std::string &payload) {
+    size_t length = 0;
+    std::string expected;
+    if (!is.get(type) || !(is >> length) || is.get() != ' ' || !(is >> expected) || is.get() != '\n')
+        return false;
+
+    payload.resize(length);
+    if (!is.read(payload.data(), length) || is.get() != '\n')
+        return false;
+
+    CChecksum checksum;
+    checksum.update(type);
+    checksum.update(payload);
+    return checksum.toString() == expected;
+}
+
+size_t CJournal::replay(std::istream &is, std::string_view base, const std::function<void(const CJournalRecord&)> &apply) {
+    char type;
+    std::string payload;
+    if (!readRecord(is, type, payload) || type != 'B' || payload != base)
+        return 0;
+
+    size_t applied = 0;
+    while (readRecord(is, type, payload)) {
+        CJournalRecord record{type, "", "", 1, 1, 0, 0};
+        size_t separator = payload.find(' ');
+        if (separator == std::string::npos)
+            break;
+        record.m_Target = payload.substr(0, separator);
+
+        if (type == 'S') {
+            record.m_Argument = payload.substr(separator + 1);
+        } else if (type == 'C' || type == 'M') {
+            std::istringstream arguments(payload.substr(separator + 1));
+            if (!(arguments >> record.m_Argument >> record.m_Width >> record.m_Height))
+                break;
+        } else if (type == 'T') {
+            std::istringstream arguments(payload.substr(separator + 1));
+            if (!(arguments >> record.m_Index >> record.m_Count))
+                break;
+        } else {
+            break;
+        }
+
+        apply(record);
+        applied++;
+    }
+    return applied;
+}
@@ -0,0 +1,115 @@
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+/**
+ * Running 64-bit FNV-1a checksum, data can be added in any number of pieces
+*/
+class CChecksum {
+public:
+    void update(std::string_view data);
+    void update(char c);
+    uint64_t get() const;
+
+    /**
+     * Formats checksum as 16 lower case hex digits
+     * @return Checksum text
+    */
+    std::string toString() const;
+
+private:
+    uint64_t m_Hash = 0xcbf29ce484222325ULL;
+};
+
+/****************************************************************************/
+
+/**
+ * Buffered output keeping running checksum of everything written through it, so large payloads
+ * can be streamed without building them in memory first
+*/
+class CStreamWriter {
+public:
+    CStreamWriter(std::ostream &os, size_t capacity = 65536);
+    CStreamWriter(const CStreamWriter &writer) = delete;
+    CStreamWriter& operator=(const CStreamWriter &writer) = delete;
+    ~CStreamWriter();
+    void write(std::string_view data);
+
+    /**
+     * Passes buffered data to the stream
+     * @return True if the stream is still valid
+    */
+    bool flush();
+    const CChecksum &getChecksum() const;
+
+private:
+    std::ostream &m_Os;
+    std::string m_Buffer;
+    size_t m_Capacity;
+    CChecksum m_Checksum;
+};
+
+/****************************************************************************/
+
+/**
+ * One journaled sheet modification
+*/
+struct CJournalRecord {
+    // 'S' for setCell, 'C' for copyRect, 'M' for moveRect, 'T' for row and column insertion or deletion
+    char m_Type;
+
+    // Modified cell (setCell), copy or move destination or edit name, e.g. "insertRows" (structural edit)
+    std::string m_Target;
+
+    // Cell contents (setCell) or copy or move source
+    std::string m_Argument;
+
+    // Size of copied or moved area
+    int m_Width;
+    int m_Height;
+
+    // First edited row or column and number of edited rows or columns (structural edit)
+    size_t m_Index;
+    size_t m_Count;
+};
+
+/****************************************************************************/
+
+/**
+ * Append-only log of sheet modifications stored next to a full snapshot. Every record is written as
+ * "<type><payload length> <checksum>\n<payload>\n", the first record names the snapshot the journal extends
+*/
+class CJournal {
+public:
+    /**
+     * Starts new journal in an empty stream
+     * @param os Journal stream
+     * @param base Checksum of the snapshot the journal extends
+    */
+    CJournal(std::ostream &os, std::string_view base);
+
+    bool appendSetCell(std::string_view id, std::string_view contents);
+    bool appendCopyRect(std::string_view dst, std::string_view src, int w, int h);
+    bool appendMoveRect(std::string_view dst, std::string_view src, int w, int h);
+    bool appendShift(std::string_view operation, size_t index, size_t count);
+    bool isValid() const;
+
+    /**
+     * Reads records in order and stops at the end of stream or at the first torn or corrupted record,
+     * which is how an interrupted append looks like after a crash
+     * @param is Journal stream
+     * @param base Checksum of the loaded snapshot, journals of other snapshots are ignored
+     * @param apply Callback applying one record
+     * @return Number of applied records
+    */
+    static size_t replay(std::istream &is, std::string_view base, const std::function<void(const CJournalRecord&)> &apply);
+
+private:
+    bool append(char type, std::string_view payload);
+    bool appendRect(char type, std::string_view dst, std::string_view src, int w, int h);
+    static bool readRecord(std::istream &is, char &type, std::string &payload);
+    std::ostream &m_Os;
+};
@@ -8,10 +8,13 @@ echo "#include <cfloat>" >> all_in_one.cpp
 echo "#include <cassert>" >> all_in_one.cpp
 echo "#include <cmath>" >> all_in_one.cpp
 echo "#include <iostream>" >> all_in_one.cpp
+echo "#include <istream>" >> all_in_one.cpp
+echo "#include <ostream>" >> all_in_one.cpp
 echo "#include <sstream>" >> all_in_one.cpp
 echo "#include <fstream>" >> all_in_one.cpp
 echo "#include <iomanip>" >> all_in_one.cpp
 echo "#include <string>" >> all_in_one.cpp
+echo "#include <string_view>" >> all_in_one.cpp
 echo "#include <array>" >> all_in_one.cpp
 echo "#include <vector>" >> all_in_one.cpp
 echo "#include <list>" >> all_in_one.cpp
@@ -32,6 +35,14 @@ echo "#include <compare>" >> all_in_one.cpp
 echo "#include <charconv>" >> all_in_one.cpp
 echo "#include <span>" >> all_in_one.cpp
 echo "#include <utility>" >> all_in_one.cpp
+echo "#include <atomic>" >> all_in_one.cpp
+echo "#include <bit>" >> all_in_one.cpp
+echo "#include <chrono>" >> all_in_one.cpp
+echo "#include <condition_variable>" >> all_in_one.cpp
+echo "#include <cstdint>" >> all_in_one.cpp
+echo "#include <future>" >> all_in_one.cpp
+echo "#include <mutex>" >> all_in_one.cpp
+echo "#include <thread>" >> all_in_one.cpp
 echo "#include \"expression.h\"" >> all_in_one.cpp
 grep -vhE '^(#include|#ifndef)' cell.h >> all_in_one.cpp
-grep -vh '^#include' builder.h spreadsheet.h cell.cpp builder.cpp spreadsheet.cpp test.cpp >> all_in_one.cpp
+grep -vh '^#include' tracer.h builder.h journal.h codec.h csv.h spreadsheet.h workbook.h cell.cpp tracer.cpp builder.cpp journal.cpp codec.cpp csv.cpp spreadsheet.cpp workbook.cpp test.cpp >> all_in_one.cpp
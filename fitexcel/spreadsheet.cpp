@@ -3,24 +3,165 @@
  * Author: David Kopelent
  * Date: 24.04.2024
  * Description: This file implements methods for representing and manipulating spreadsheets.
- *              It contains the definitions of the member functions of the CSpreadsheet and CDependencyChecker class.
+ *              It contains the definitions of the member functions of the CSpreadsheet, CDependencyGraph
+ *              and CDependencyChecker class.
  ******************************************************/
 
 #include "spreadsheet.h"
 
-CSpreadsheet::CSpreadsheet(const CSpreadsheet &sheet) 
-    : m_Table(sheet.m_Table)
-    , m_Dependencies(sheet.m_Dependencies) {}
+CValueSnapshot::CValueSnapshot(size_t epoch)
+    : m_Epoch(epoch), m_Shards{std::make_shared<CShard>()} {}
 
-CSpreadsheet& CSpreadsheet::operator=(const CSpreadsheet &sheet) {
-    if (&sheet == this) return *this;
+CValue CValueSnapshot::getValue(const CPos &pos) const {
+    const CValue *value = find(pos.getId());
+    return value != nullptr ? *value : CValue();
+}
+
+size_t CValueSnapshot::getEpoch() const {
+    return m_Epoch;
+}
+
+const CValue *CValueSnapshot::find(const std::string &id) const {
+    const CShard &shard = *m_Shards[shardOf(id)];
+    auto value = shard.find(id);
+    return value != shard.end() ? &value->second : nullptr;
+}
+
+void CValueSnapshot::assign(const std::string &id, CValue value, std::vector<bool> &copied) {
+    size_t index = shardOf(id);
+    if (!copied[index]) {
+        m_Shards[index] = std::make_shared<CShard>(*m_Shards[index]);
+        copied[index] = true;
+    }
+
+    CShard &shard = *m_Shards[index];
+    m_Size -= shard.erase(id);
+    if (!std::holds_alternative<std::monostate>(value)) {
+        shard.emplace(id, std::move(value));
+        m_Size++;
+    }
+}
+
+void CValueSnapshot::reshard(size_t cells, std::vector<bool> &copied) {
+    size_t count = std::bit_ceil(std::max<size_t>(cells / SHARD_CELLS, 1));
+    std::vector<std::shared_ptr<CShard>> shards(count);
+    for (auto &shard : shards)
+        shard = std::make_shared<CShard>();
+
+    std::swap(m_Shards, shards);
+    for (const auto &shard : shards) {
+        for (const auto &[id, value] : *shard)
+            m_Shards[shardOf(id)]->emplace(id, value);
+    }
+    copied.assign(count, true);
+}
+
+size_t CValueSnapshot::shardOf(const std::string &id) const {
+    return std::hash<std::string>{}(id) & (m_Shards.size() - 1);
+}
+
+// Copies never take over a running background worker
+CSpreadsheet::CSpreadsheet(const CSpreadsheet &sheet) {
+    auto lock = sheet.lockTable();
     m_Table = sheet.m_Table;
     m_Dependencies = sheet.m_Dependencies;
+    m_AstCache = sheet.m_AstCache;
+    m_ConcurrentReads = sheet.m_ConcurrentReads.load();
+    m_PublishSnapshots = m_ConcurrentReads;
+    m_Snapshot = sheet.m_Snapshot.load();
+    m_Changed = sheet.m_Changed;
+    m_PublishAll = sheet.m_PublishAll || sheet.m_AsyncRecalc;
+}
+
+CSpreadsheet& CSpreadsheet::operator=(const CSpreadsheet &sheet) {
+    if (&sheet == this) return *this;
+    std::map<std::string, CCell> table;
+    CDependencyGraph dependencies;
+    CAstCache astCache;
+    bool concurrentReads;
+    std::shared_ptr<const CValueSnapshot> snapshot;
+    {
+        auto lock = sheet.lockTable();
+        table = sheet.m_Table;
+        dependencies = sheet.m_Dependencies;
+        astCache = sheet.m_AstCache;
+        concurrentReads = sheet.m_ConcurrentReads;
+        snapshot = sheet.m_Snapshot.load();
+    }
+
+    // Assigned table is not a delta of the last compaction, the journal no longer matches the sheet
+    auto lock = lockTable();
+    m_Journal.reset();
+    m_Table = std::move(table);
+    m_Dependencies = std::move(dependencies);
+    m_AstCache = std::move(astCache);
+    m_ConcurrentReads = concurrentReads;
+    m_PublishSnapshots = concurrentReads;
+    m_Snapshot = snapshot;
+    m_Changed.clear();
+    m_PublishAll = true;
+    m_WorkAvailable.notify_one();
     return *this;
 }
 
+CSpreadsheet::~CSpreadsheet() {
+    setAsyncRecalc(false);
+}
+
 // Load spreadsheet data from an input stream
 bool CSpreadsheet::load(std::istream &is) {
+    std::string checksum;
+    m_DeferNotifications = true;
+    bool loaded = loadSnapshot(is, checksum);
+    compactDependencies();
+    m_DeferNotifications = false;
+    notifySubscribers();
+    return loaded;
+}
+
+bool CSpreadsheet::load(std::istream &snapshot, std::istream &journal) {
+    std::string checksum;
+    m_DeferNotifications = true;
+    bool loaded = loadSnapshot(snapshot, checksum);
+    if (loaded)
+        replayJournal(journal, checksum);
+    compactDependencies();
+    m_DeferNotifications = false;
+    notifySubscribers();
+    return loaded;
+}
+
+void CSpreadsheet::replayJournal(std::istream &journal, const std::string &checksum) {
+    CTraceSpan span("replay");
+    try {
+        CJournal::replay(journal, checksum, [this](const CJournalRecord &record) {
+            if (record.m_Type == 'S')
+                setCell(CPos(record.m_Target), record.m_Argument);
+            else if (record.m_Type == 'C')
+                copyRect(CPos(record.m_Target), CPos(record.m_Argument), record.m_Width, record.m_Height);
+            else if (record.m_Type == 'M')
+                moveRect(CPos(record.m_Target), CPos(record.m_Argument), record.m_Width, record.m_Height);
+            else if (record.m_Target == "insertRows")
+                insertRows(record.m_Index, record.m_Count);
+            else if (record.m_Target == "deleteRows")
+                deleteRows(record.m_Index, record.m_Count);
+            else if (record.m_Target == "insertColumns")
+                insertColumns(record.m_Index, record.m_Count);
+            else if (record.m_Target == "deleteColumns")
+                deleteColumns(record.m_Index, record.m_Count);
+        });
+    } catch(std::invalid_argument &e) {
+        // Keep the records applied before the damaged one
+    }
+}
+
+void CSpreadsheet::compactDependencies() {
+    auto lock = lockTable();
+    m_Dependencies.compact();
+}
+
+bool CSpreadsheet::loadSnapshot(std::istream &is, std::string &checksum) {
+    CTraceSpan span("load");
     if (is.fail()) {
         return false;
     }
@@ -30,22 +171,54 @@ bool CSpreadsheet::load(std::istream &is) {
     buffer << is.rdbuf();
     std::string content = buffer.str();
 
-    size_t headStart = content.find("<HEAD>");
-    size_t headEnd = content.find("</HEAD>");
+    // Block files hold the same data compressed, corrupted block fails the whole load
+    if (CBlockReader::isBlocked(content)) {
+        std::string decoded;
+        if (!CBlockReader::decode(content, decoded))
+            return false;
+        content = std::move(decoded);
+    }
+
+    // Streamed files carry checksum of the body in a trailer, older files in a header
+    if (content.compare(0, 6, "<BODY>") == 0) {
+        size_t tailStart = content.rfind("<TAIL>");
+        if (tailStart == std::string::npos || content.size() < tailStart + 13 || content.compare(content.size() - 7, 7, "</TAIL>") != 0)
+            return false;
 
-    if (headStart == std::string::npos || headEnd == std::string::npos)
-        return false;
+        CChecksum body;
+        body.update(std::string_view(content).substr(0, tailStart));
+        if (content.compare(tailStart + 6, content.size() - tailStart - 13, body.toString()) != 0)
+            return false;
 
-    // Check headers for file corruption
-    std::string head = content.substr(headStart + 6, headEnd - headStart - 6);
-    if (head != std::to_string(hashTableContent(content.substr(headEnd + 7))))
-        return false;
+        checksum = body.toString();
+        content.resize(tailStart);
+        content.erase(0, 6);
+    } else {
+        size_t headStart = content.find("<HEAD>");
+        size_t headEnd = content.find("</HEAD>");
+
+        if (headStart == std::string::npos || headEnd == std::string::npos)
+            return false;
 
-    // Clear existing data
-    m_Table.clear();
-    m_Dependencies.clear();
+        // Check headers for file corruption
+        std::string head = content.substr(headStart + 6, headEnd - headStart - 6);
+        content.erase(0, headEnd + 7);
+        if (head != std::to_string(hashTableContent(content)))
+            return false;
+        checksum = head;
+    }
+
+    // Clear existing data, the journal no longer matches the sheet
+    {
+        auto lock = lockTable();
+        m_Journal.reset();
+        m_Table.clear();
+        m_AstCache.noteCleared();
+        m_Dependencies.clear();
+        m_PublishAll = true;
+    }
 
-    if (content.substr(headEnd + 7) == "<EMPTY>")
+    if (content == "<EMPTY>")
         return true;
 
     size_t idStart = content.find("<ID>");
@@ -73,8 +246,11 @@ bool CSpreadsheet::load(std::istream &is) {
         try {
             setCell(CPos(cell), value);
         } catch(std::invalid_argument &e) {
+            auto lock = lockTable();
             m_Table.clear();
+            m_AstCache.noteCleared();
             m_Dependencies.clear();
+            m_PublishAll = true;
             return false;
         }
     }
@@ -88,167 +264,1809 @@ size_t CSpreadsheet::hashTableContent(const std::string& str) const {
 }
 
 // Save spreadsheet data to an output stream
-bool CSpreadsheet::save(std::ostream &os) const {
+bool CSpreadsheet::save(std::ostream &os, ESaveFormat format) const {
+    std::string checksum;
+    return saveSnapshot(os, checksum, format);
+}
+
+bool CSpreadsheet::compact(std::ostream &snapshot, std::ostream &journal, ESaveFormat format) {
+    std::string checksum;
+    if (!saveSnapshot(snapshot, checksum, format))
+        return false;
+
+    auto lock = lockTable();
+    m_Journal = std::make_unique<CJournal>(journal, checksum);
+    return m_Journal->isValid();
+}
+
+void CSpreadsheet::stopJournal() {
+    auto lock = lockTable();
+    m_Journal.reset();
+}
+
+bool CSpreadsheet::saveSnapshot(std::ostream &os, std::string &checksum, ESaveFormat format) const {
+    CTraceSpan span("save");
     if (os.fail())
         return false;
 
+    auto lock = lockTable();
     os.clear();
-    std::string head;
-    std::string content = "";
-
-    if (m_Table.empty()) {
-        content = "<EMPTY>";
-        head = "<HEAD>" + std::to_string(hashTableContent(content)) + "</HEAD>";
-        os << head << content;
-        return !os.fail();
+    if (format == ESaveFormat::BLOCKS) {
+        CBlockWriter writer(os);
+        writeSnapshot(writer, checksum);
+        return writer.finish();
     }
 
+    CStreamWriter writer(os);
+    writeSnapshot(writer, checksum);
+    return writer.flush();
+}
+
+template <typename TWriter>
+void CSpreadsheet::writeSnapshot(TWriter &writer, std::string &checksum) const {
+    // Cells are streamed as they are visited, checksum of the body follows in the trailer
+    writer.write("<BODY>");
     for (const auto &d: m_Table) {
-        content += "<ID>" + d.second.getPos().getId() + "</ID><VAL>" + d.second.getExpression() + "</VAL>";
+        writer.write("<ID>");
+        writer.write(d.first);
+        writer.write("</ID><VAL>");
+        writer.write(d.second.getExpression());
+        writer.write("</VAL>");
     }
 
-    head = "<HEAD>" + std::to_string(hashTableContent(content)) + "</HEAD>";
-    os << head << content;
-    return !os.fail();
+    checksum = writer.getChecksum().toString();
+    writer.write("<TAIL>");
+    writer.write(checksum);
+    writer.write("</TAIL>");
 }
 
 // Set the contents of a cell
 bool CSpreadsheet::setCell(CPos pos, std::string contents) {
     if (contents.empty())
         return false;
-        
-    CBuilder builder(pos);
+
+    CTraceSpan span("setCell");
+    if (span.isActive())
+        span.setArgument(pos.getId());
+
     std::string expression = contents;
+    std::optional<CValue> literal;
+    CParsedFormula formula;
+    bool parsed = true;
 
-    try {
-        parseExpression(contents, builder); 
-    } catch(std::invalid_argument &e) {
-        auto cell = m_Table.find(pos.getId());
-        if (cell != m_Table.end()) {
-            m_Table.erase(cell);
+    // Only formulas need the parser, literals are stored directly as values
+    if (contents[0] != '=') {
+        CTraceSpan literalSpan("literal");
+        literal = CBuilder::parseLiteral(contents);
+    } else {
+        try {
+            CTraceSpan parseSpan("parse");
+            formula = m_ParseCache.parse(pos, contents);
+        } catch(std::invalid_argument &e) {
+            parsed = false;
         }
+    }
 
-        auto dependencyIterator = m_Dependencies.find(pos.getId());
-        if (dependencyIterator != m_Dependencies.end()) {
-            m_Dependencies.erase(dependencyIterator->first);
-        }
+    // Parsing does not touch the table, lock only for the update
+    auto lock = lockTable();
+    if (!parsed) {
+        if (eraseCell(pos.getId()))
+            markChanged(pos.getId());
+        m_Dependencies.erase(pos);
+        if (m_Journal)
+            m_Journal->appendSetCell(pos.getIdView(), contents);
+        notifySubscribers();
         return false;
     }
 
-    // Create a new cell object
-    CCell newCell(pos, expression, builder.buildAST());
+    {
+        CTraceSpan buildSpan("build");
 
-    // Check if the cell already exists in the table
-    auto cell = m_Table.find(pos.getId());
-    if (cell != m_Table.end()) {
-        cell->second = newCell;
-    } else {
-        // Insert the new cell into the table
-        m_Table.insert({pos.getId(), newCell});
+        // Create a new cell object, replacing the existing one
+        storeCell(pos.getId(), literal ? CCell(pos, expression, std::move(*literal)) : CCell(pos, expression, std::move(formula.m_Root)));
+        markChanged(pos.getId());
     }
 
-    auto dependencyIterator = m_Dependencies.find(pos.getId());
-    if (dependencyIterator != m_Dependencies.end()) {
-        dependencyIterator->second = builder.getDependencies();
-    } else {
-        m_Dependencies.insert({pos.getId(), builder.getDependencies()});
-    }
+    CTraceSpan dependencySpan("dependencies");
+    m_Dependencies.setDependencies(pos, formula.m_Dependencies);
+    if (m_Journal)
+        m_Journal->appendSetCell(pos.getIdView(), contents);
 
+    if (!literal)
+        m_AstCache.enforce(m_Table);
+    notifySubscribers();
     return true;
 }
 
 // Get the value of a cell
 CValue CSpreadsheet::getValue(CPos pos) {
+    CTraceSpan span("getValue");
+    if (span.isActive())
+        span.setArgument(pos.getId());
+
+    // Readers never touch the table while the writer may be modifying it
+    // Snapshot is loaded once, switching concurrent reads off may clear it right after the flag
+    if (m_ConcurrentReads.load(std::memory_order_acquire)) {
+        if (std::shared_ptr<const CValueSnapshot> snapshot = m_Snapshot.load())
+            return snapshot->getValue(pos);
+    }
+
+    if (m_AsyncRecalc.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_CellClean.wait(lock, [this, &pos] { return isClean(pos.getId()); });
+        return cachedValue(pos.getId());
+    }
+
     auto cell = m_Table.find(pos.getId());
     if (cell != m_Table.end()) {
-        CDependencyChecker checker(m_Dependencies);
-        if (checker.containsCycle(pos.getId())) {
-            return CValue();
+        {
+            CTraceSpan cycleSpan("cycleCheck");
+            CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+            if (checker.containsCycle(pos.getId())) {
+                return CValue();
+            }
         }
-        return cell->second.evaluate(m_Table);
+        CValue value;
+        {
+            CEvaluationPass pass(&m_AstCache, m_Sheets);
+            value = cell->second.evaluate(m_Table);
+        }
+        m_AstCache.enforce(m_Table);
+        return value;
     }
     return CValue();
 }
 
-// Copy a rectangular range of cells within the spreadsheet
-void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h) {
-    // Determine start and destination positions
-    size_t startCol = src.getColumnNumber();
-    size_t startRow = src.getRow();
-    size_t dstCol = dst.getColumnNumber();
-    size_t dstRow = dst.getRow();
-    std::vector<std::pair<CPos, CCell>> from;
-    std::vector<CPos> to;
-
-    // Get list of cells for copying
-    for (size_t i = startCol; i < startCol + w; i++) {
-        std::string col = CPos::numberToColumn(i);
-    
-        for (size_t j = startRow; j < startRow + h; j++) {
-            auto cell = m_Table.find(col + std::to_string(j));
-            if (cell != m_Table.end()) {
-                from.push_back({CPos(col + std::to_string(j)), cell->second});
+bool CSpreadsheet::getValues(CPos topLeft, int w, int h, std::span<CValue> values) {
+    if (w < 0 || h < 0 || values.size() < static_cast<size_t>(w) * h)
+        return false;
+
+    evaluateRegion(topLeft, w, h, [&values](size_t i, const CValue &value) {
+        values[i] = value;
+    });
+    return true;
+}
+
+bool CSpreadsheet::getNumericValues(CPos topLeft, int w, int h, std::span<double> values, std::span<uint8_t> valid) {
+    size_t count = static_cast<size_t>(std::max(w, 0)) * std::max(h, 0);
+    if (w < 0 || h < 0 || values.size() < count || valid.size() < (count + 7) / 8)
+        return false;
+
+    std::fill(valid.begin(), valid.begin() + (count + 7) / 8, 0);
+    evaluateRegion(topLeft, w, h, [&values, &valid](size_t i, const CValue &value) {
+        if (std::holds_alternative<double>(value)) {
+            values[i] = std::get<double>(value);
+            valid[i / 8] |= 1 << (i % 8);
+        } else {
+            values[i] = 0;
+        }
+    });
+    return true;
+}
+
+void CSpreadsheet::evaluateRegion(const CPos &topLeft, int w, int h, const std::function<void(size_t, const CValue&)> &store) {
+    CTraceSpan span("getValues");
+
+    std::vector<std::string> ids;
+    ids.reserve(static_cast<size_t>(w) * h);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++)
+            ids.push_back(CPos(topLeft.getColumnNumber() + i, topLeft.getRow() + j).getId());
+    }
+
+    std::shared_ptr<const CValueSnapshot> snapshot = m_ConcurrentReads.load(std::memory_order_acquire) ? m_Snapshot.load() : nullptr;
+    if (snapshot != nullptr) {
+        for (size_t i = 0; i < ids.size(); i++) {
+            const CValue *value = snapshot->find(ids[i]);
+            store(i, value != nullptr ? *value : CValue());
+        }
+        return;
+    }
+
+    if (m_AsyncRecalc.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_CellClean.wait(lock, [this, &ids] {
+            return std::all_of(ids.begin(), ids.end(), [this](const std::string &id) { return isClean(id); });
+        });
+        for (size_t i = 0; i < ids.size(); i++)
+            store(i, cachedValue(ids[i]));
+        return;
+    }
+
+    // Shared precedents are evaluated once thanks to the common pass
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (size_t i = 0; i < ids.size(); i++) {
+            auto cell = m_Table.find(ids[i]);
+            if (cell == m_Table.end() || checker.containsCycle(ids[i]))
+                store(i, CValue());
+            else
+                store(i, cell->second.evaluate(m_Table));
+        }
+    }
+    m_AstCache.enforce(m_Table);
+}
+
+std::vector<std::vector<CValue>> CSpreadsheet::evaluateScenarios(const std::vector<std::map<CPos, CValue>> &inputs, const std::vector<CPos> &outputs, size_t workers) {
+    CTraceSpan span("evaluateScenarios");
+    std::vector<std::vector<CValue>> results(inputs.size(), std::vector<CValue>(outputs.size()));
+    auto lock = lockTable();
+
+    // Cycles and output cells are found once, scenarios only read them
+    std::vector<CCell*> cells(outputs.size(), nullptr);
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    for (size_t i = 0; i < outputs.size(); i++) {
+        std::string id = outputs[i].getId();
+        auto cell = m_Table.find(id);
+        if (cell != m_Table.end() && !checker.containsCycle(id))
+            cells[i] = &cell->second;
+    }
+
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::clamp<size_t>(workers, 1, std::max<size_t>(inputs.size(), 1));
+
+    std::atomic<size_t> next = 0;
+    auto work = [&]() {
+        for (size_t scenario = next++; scenario < inputs.size(); scenario = next++) {
+            CValueOverlay overlay(m_Table, inputs[scenario]);
+            CEvaluationPass pass(&m_AstCache, m_Sheets, &overlay);
+            for (size_t i = 0; i < outputs.size(); i++) {
+                const CValue *input = overlay.input(m_Table, outputs[i]);
+                if (input != nullptr)
+                    results[scenario][i] = *input;
+                else if (cells[i] != nullptr)
+                    results[scenario][i] = cells[i]->evaluate(m_Table);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+        threads.emplace_back(work);
+    work();
+    for (auto &thread : threads)
+        thread.join();
+    return results;
+}
+
+bool CSpreadsheet::exportValues(std::ostream &os, CPos topLeft, int w, int h, EExportFormat format) {
+    if (w < 0 || h < 0 || os.fail())
+        return false;
+
+    CTraceSpan span("export");
+    // Bounds memory held by values of one chunk, slices below the minimum are not worth a thread
+    static constexpr size_t CHUNK_CELLS = 1 << 16;
+    static constexpr size_t MIN_SLICE_CELLS = 4096;
+    size_t columns = w;
+    size_t chunkRows = std::max<size_t>(1, CHUNK_CELLS / std::max<size_t>(columns, 1));
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+
+    CStreamWriter writer(os, 1 << 20);
+    std::vector<CValue> values;
+    std::vector<std::string> slices(workers);
+    for (size_t row = 0; row < static_cast<size_t>(h); row += chunkRows) {
+        size_t rows = std::min(chunkRows, h - row);
+        values.assign(columns * rows, CValue());
+        evaluateRegion(CPos(topLeft.getColumnNumber(), topLeft.getRow() + row), w, rows, [&values](size_t i, const CValue &value) {
+            values[i] = value;
+        });
+
+        // Evaluation shares cell caches, so only formatting runs in parallel
+        size_t count = std::clamp<size_t>(columns * rows / MIN_SLICE_CELLS, 1, std::min(workers, rows));
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < count; i++) {
+            threads.emplace_back(formatRows, std::cref(values), columns, rows * i / count, rows * (i + 1) / count,
+                                 format, std::ref(slices[i]));
+        }
+        formatRows(values, columns, 0, rows / count, format, slices[0]);
+        for (auto &thread : threads)
+            thread.join();
+
+        for (size_t i = 0; i < count; i++) {
+            writer.write(slices[i]);
+            slices[i].clear();
+        }
+    }
+    return writer.flush();
+}
+
+void CSpreadsheet::formatRows(const std::vector<CValue> &values, size_t w, size_t fromRow, size_t toRow, EExportFormat format, std::string &out) {
+    for (size_t row = fromRow; row < toRow; row++) {
+        for (size_t column = 0; column < w; column++) {
+            if (column)
+                out.push_back(format == EExportFormat::CSV ? ',' : '\t');
+            formatField(values[row * w + column], format, out);
+        }
+        out.push_back('\n');
+    }
+}
+
+void CSpreadsheet::formatField(const CValue &value, EExportFormat format, std::string &out) {
+    if (std::holds_alternative<double>(value)) {
+        // Shortest representation which reads back as the same double
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), std::get<double>(value));
+        out.append(buffer, result.ptr);
+        return;
+    }
+    if (!std::holds_alternative<std::string>(value))
+        return;
+
+    const std::string &str = std::get<std::string>(value);
+    if (format == EExportFormat::TSV) {
+        for (char c : str) {
+            if (c == '\t')
+                out.append("\\t");
+            else if (c == '\n')
+                out.append("\\n");
+            else if (c == '\r')
+                out.append("\\r");
+            else if (c == '\\')
+                out.append("\\\\");
+            else
+                out.push_back(c);
+        }
+        return;
+    }
+
+    if (str.find_first_of(",\"\r\n") == std::string::npos) {
+        out.append(str);
+        return;
+    }
+    out.push_back('"');
+    for (char c : str) {
+        if (c == '"')
+            out.push_back('"');
+        out.push_back(c);
+    }
+    out.push_back('"');
+}
+
+bool CSpreadsheet::importCsv(std::istream &is, CPos origin) {
+    CTraceSpan span("importCsv");
+    CCsvReader reader(is);
+    std::vector<std::pair<CPos, std::string>> formulas;
+
+    auto lock = lockTable();
+    size_t column = 0;
+    size_t row = 0;
+    std::string_view field;
+    bool lastInRow;
+    {
+        CTraceSpan literalSpan("literal");
+        while (reader.next(field, lastInRow)) {
+            CPos pos(origin.getColumnNumber() + column, origin.getRow() + row);
+            column++;
+            if (lastInRow) {
+                column = 0;
+                row++;
+            }
+            if (field.empty())
+                continue;
+
+            if (field[0] == '=') {
+                formulas.emplace_back(pos, field);
+                continue;
+            }
+
+            std::string id = pos.getId();
+            storeCell(id, CCell(pos, std::string(field), CBuilder::parseLiteral(field)));
+            m_Dependencies.erase(pos);
+            markChanged(id);
+            if (m_Journal)
+                m_Journal->appendSetCell(pos.getIdView(), field);
+        }
+    }
+
+    // Parsing is independent for every formula, the table is only updated afterwards
+    std::vector<std::optional<CParsedFormula>> parsed(formulas.size());
+    auto parseSlice = [this, &formulas, &parsed](size_t from, size_t to) {
+        for (size_t i = from; i < to; i++) {
+            try {
+                parsed[i] = m_ParseCache.parse(formulas[i].first, formulas[i].second);
+            } catch(std::invalid_argument &e) {
+                // Invalid formula clears the cell like setCell does
+            }
+        }
+    };
+    {
+        CTraceSpan parseSpan("parse");
+        static constexpr size_t MIN_SLICE_FORMULAS = 1024;
+        size_t count = std::clamp<size_t>(formulas.size() / MIN_SLICE_FORMULAS, 1, std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < count; i++)
+            threads.emplace_back(parseSlice, formulas.size() * i / count, formulas.size() * (i + 1) / count);
+        parseSlice(0, formulas.size() / count);
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    {
+        CTraceSpan buildSpan("build");
+        for (size_t i = 0; i < formulas.size(); i++) {
+            const auto &[pos, contents] = formulas[i];
+            std::string id = pos.getId();
+            if (parsed[i]) {
+                storeCell(id, CCell(pos, contents, std::move(parsed[i]->m_Root)));
+                m_Dependencies.setDependencies(pos, parsed[i]->m_Dependencies);
             } else {
-                from.push_back({CPos(col + std::to_string(j)), CCell()});
+                eraseCell(id);
+                m_Dependencies.erase(pos);
             }
+            markChanged(id);
+            if (m_Journal)
+                m_Journal->appendSetCell(pos.getIdView(), contents);
         }
     }
 
-    // Get list of target cell positions
-    for (size_t i = dstCol; i < dstCol + w; i++) {
-        std::string col = CPos::numberToColumn(i);
+    m_Dependencies.compact();
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
+    return reader.isValid();
+}
+
+bool CSpreadsheet::insertRows(size_t row, size_t count) {
+    return shiftCells(CShift{false, false, row, count}, "insertRows");
+}
+
+bool CSpreadsheet::deleteRows(size_t row, size_t count) {
+    return shiftCells(CShift{false, true, row, count}, "deleteRows");
+}
+
+bool CSpreadsheet::insertColumns(size_t column, size_t count) {
+    return shiftCells(CShift{true, false, column, count}, "insertColumns");
+}
+
+bool CSpreadsheet::deleteColumns(size_t column, size_t count) {
+    return shiftCells(CShift{true, true, column, count}, "deleteColumns");
+}
+
+bool CSpreadsheet::shiftCells(const CShift &edit, std::string_view operation) {
+    // Rows and columns are numbered from 1
+    if (edit.m_Index == 0)
+        return false;
+    if (edit.m_Count == 0)
+        return true;
+
+    CTraceSpan span("shift");
+    auto lock = lockTable();
 
-        for (size_t j = dstRow; j < dstRow + h; j++) {
-            to.push_back(CPos(col + std::to_string(j)));
+    // Moved cells leave the table so that their new ids can not collide with cells not moved yet
+    std::vector<std::map<std::string, CCell>::node_type> moved;
+    std::vector<std::map<std::string, CCell>::iterator> rewritten;
+    for (auto cell = m_Table.begin(); cell != m_Table.end();) {
+        CPos pos = cell->second.getPos();
+        if (edit.affects(pos)) {
+            markChanged(cell->first);
+            m_Dependencies.erase(pos);
+            moved.push_back(m_Table.extract(cell++));
+            continue;
         }
+        if (cell->second.isFormula() && m_Dependencies.isShifted(cell->first, edit))
+            rewritten.push_back(cell);
+        ++cell;
     }
-    
-    // Copy cells
-    for (size_t i = 0; i < from.size(); i++) {
-        auto dependencyIterator = m_Dependencies.find(to[i].getId());
-
-        if (from[i].second.isEmpty()) {
-            m_Table.erase(to[i].getId());
-            
-            // Remove cell dependencies
-            if (dependencyIterator != m_Dependencies.end())
-                m_Dependencies.erase(to[i].getId());
+
+    for (auto cell : rewritten) {
+        rewriteCell(cell->second, edit, cell->second.getPos());
+        markChanged(cell->first);
+    }
+
+    for (auto &node : moved) {
+        CPos pos = node.mapped().getPos();
+        if (!edit.apply(pos)) {
+            m_AstCache.noteReleased(node.mapped());
             continue;
-        } 
+        }
+        rewriteCell(node.mapped(), edit, pos);
+        node.key() = pos.getId();
+        markChanged(node.key());
+        m_Table.insert(std::move(node));
+    }
+
+    if (m_Journal)
+        m_Journal->appendShift(operation, edit.m_Index, edit.m_Count);
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
+    return true;
+}
+
+// Copy a rectangular range of cells within the spreadsheet
+void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h, size_t workers) {
+    auto lock = lockTable();
+    static constexpr size_t PARALLEL_COPY_CELLS = 4096;
+    if (!workers)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    if (w > 0 && h > 0 && static_cast<size_t>(w) * h >= PARALLEL_COPY_CELLS && workers > 1) {
+        copyRectParallel(dst, src, w, h, workers);
+        if (m_Journal)
+            m_Journal->appendCopyRect(dst.getIdView(), src.getIdView(), w, h);
+        m_AstCache.enforce(m_Table);
+        notifySubscribers();
+        return;
+    }
 
-        std::vector<std::string> dependencies;
-        CCell newCell = from[i].second.copyCell(to[i], dependencies);
-        auto cell = m_Table.find(to[i].getId());
+    // Traversal against the copy direction reads every source cell before the copy can overwrite it
+    bool columnsBackward = dst.getColumnNumber() > src.getColumnNumber();
+    bool rowsBackward = dst.getRow() > src.getRow();
+    std::vector<std::string> dependencies;
+    for (int i = 0; i < w; i++) {
+        size_t column = columnsBackward ? w - 1 - i : i;
+        for (int j = 0; j < h; j++) {
+            size_t row = rowsBackward ? h - 1 - j : j;
+            CPos from(src.getColumnNumber() + column, src.getRow() + row);
+            CPos to(dst.getColumnNumber() + column, dst.getRow() + row);
+            std::string id = to.getId();
+            markChanged(id);
 
-        if (cell != m_Table.end()) {
-            m_Table.at(cell->first) = newCell;
-        } else {
-            m_Table.insert({to[i].getId(), newCell});
+            auto cell = m_Table.find(from.getId());
+            if (cell == m_Table.end()) {
+                eraseCell(id);
+
+                // Remove cell dependencies
+                m_Dependencies.erase(to);
+                continue;
+            }
+
+            cell->second.restoreAst(m_AstCache);
+            dependencies.clear();
+            storeCell(std::move(id), cell->second.copyCell(to, dependencies));
+            m_Dependencies.setDependencies(to, dependencies);
+        }
+    }
+
+    if (m_Journal)
+        m_Journal->appendCopyRect(dst.getIdView(), src.getIdView(), w, h);
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
+}
+
+void CSpreadsheet::copyRectParallel(const CPos &dst, const CPos &src, int w, int h, size_t workers) {
+    CTraceSpan span("copyRectParallel");
+    size_t count = static_cast<size_t>(w) * h;
+
+    // Restoring evicted ASTs changes the cells, so it is done before the table is shared by the workers
+    for (int column = 0; column < w; column++) {
+        for (int row = 0; row < h; row++) {
+            auto cell = m_Table.find(CPos(src.getColumnNumber() + column, src.getRow() + row).getId());
+            if (cell != m_Table.end())
+                cell->second.restoreAst(m_AstCache);
+        }
+    }
+
+    // Every source is read before anything is written, so overlapping areas need no traversal order
+    std::vector<std::optional<CCell>> copies(count);
+    std::vector<std::vector<std::string>> dependencies(count);
+    auto cloneSlice = [this, &dst, &src, h, &copies, &dependencies](size_t from, size_t to) {
+        for (size_t i = from; i < to; i++) {
+            size_t column = i / h;
+            size_t row = i % h;
+            auto cell = m_Table.find(CPos(src.getColumnNumber() + column, src.getRow() + row).getId());
+            if (cell != m_Table.end())
+                copies[i] = cell->second.copyCell(CPos(dst.getColumnNumber() + column, dst.getRow() + row), dependencies[i]);
         }
+    };
 
-        if (dependencyIterator != m_Dependencies.end()) {
-            m_Dependencies.at(dependencyIterator->first) = dependencies;
+    workers = std::min(workers, count);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+        threads.emplace_back(cloneSlice, count * i / workers, count * (i + 1) / workers);
+    cloneSlice(0, count / workers);
+    for (auto &thread : threads)
+        thread.join();
+
+    for (size_t i = 0; i < count; i++) {
+        CPos to(dst.getColumnNumber() + i / h, dst.getRow() + i % h);
+        std::string id = to.getId();
+        markChanged(id);
+        if (!copies[i]) {
+            eraseCell(id);
+            m_Dependencies.erase(to);
+            continue;
         }
+
+        storeCell(std::move(id), std::move(*copies[i]));
+        m_Dependencies.setDependencies(to, dependencies[i]);
     }
 }
 
-CDependencyChecker::CDependencyChecker(const std::map<std::string, std::vector<std::string>>& dependencies) 
-    : m_Dependencies(dependencies) {}
+void CSpreadsheet::moveRect(CPos dst, CPos src, int w, int h) {
+    if (w <= 0 || h <= 0)
+        return;
 
-bool CDependencyChecker::isCyclicUtil(const std::string& vertex) {
-    if (!visited.count(vertex)) {
-        visited.insert(vertex);
-        recursionStack.insert(vertex);
+    CTraceSpan span("moveRect");
+    CShift edit{false, false, 0, 0, true,
+                CRect{src.getColumnNumber(), src.getRow(), src.getColumnNumber() + w - 1, src.getRow() + h - 1}, dst};
+    auto lock = lockTable();
 
-        for (const auto& dependent : m_Dependencies[vertex]) {
-            if (!visited.count(dependent) && isCyclicUtil(dependent))
-                return true;
-            else if (recursionStack.count(dependent))
-                return true;
+    // Moved cells leave the table first, the destination may overlap the source
+    std::vector<std::map<std::string, CCell>::node_type> moved;
+    for (size_t column = edit.m_Source.m_Left; column <= edit.m_Source.m_Right; column++) {
+        for (size_t row = edit.m_Source.m_Top; row <= edit.m_Source.m_Bottom; row++) {
+            CPos pos(column, row);
+            std::string id = pos.getId();
+            markChanged(id);
+            auto node = m_Table.extract(id);
+            if (node.empty())
+                continue;
+            m_Dependencies.erase(pos);
+            moved.push_back(std::move(node));
         }
     }
-    recursionStack.erase(vertex);
-    return false;
+
+    // Cells overwritten by the block are dropped, references to them see the moved cells
+    for (size_t column = dst.getColumnNumber(); column < dst.getColumnNumber() + w; column++) {
+        for (size_t row = dst.getRow(); row < dst.getRow() + h; row++) {
+            CPos pos(column, row);
+            std::string id = pos.getId();
+            if (eraseCell(id)) {
+                m_Dependencies.erase(pos);
+                markChanged(id);
+            }
+        }
+    }
+
+    // Only cells referencing the block are rewritten
+    std::set<std::string> dependents;
+    for (size_t column = edit.m_Source.m_Left; column <= edit.m_Source.m_Right; column++) {
+        for (size_t row = edit.m_Source.m_Top; row <= edit.m_Source.m_Bottom; row++) {
+            m_Dependencies.forEachDependent(CPos(column, row), [&dependents](const std::string &id) {
+                dependents.insert(id);
+            });
+        }
+    }
+    for (const auto &id : dependents) {
+        auto cell = m_Table.find(id);
+        if (cell == m_Table.end() || !m_Dependencies.isShifted(id, edit))
+            continue;
+        rewriteCell(cell->second, edit, cell->second.getPos());
+        markChanged(id);
+    }
+
+    // Moved ASTs keep their references, only those pointing into the block follow it
+    for (auto &node : moved) {
+        CPos pos = node.mapped().getPos();
+        edit.apply(pos);
+        rewriteCell(node.mapped(), edit, pos);
+        node.key() = pos.getId();
+        markChanged(node.key());
+        m_Table.insert(std::move(node));
+    }
+
+    if (m_Journal)
+        m_Journal->appendMoveRect(dst.getIdView(), src.getIdView(), w, h);
+    m_AstCache.enforce(m_Table);
+    notifySubscribers();
+}
+
+void CSpreadsheet::rewriteCell(CCell &cell, const CShift &edit, CPos pos) {
+    cell.restoreAst(m_AstCache);
+
+    std::vector<std::string> dependencies;
+    cell.shift(edit, pos, dependencies);
+    m_Dependencies.setDependencies(pos, dependencies);
+}
+
+void CSpreadsheet::storeCell(std::string id, CCell &&cell) {
+    if (cell.hasAst())
+        m_AstCache.noteResident();
+
+    auto existing = m_Table.lower_bound(id);
+    if (existing != m_Table.end() && existing->first == id) {
+        m_AstCache.noteReleased(existing->second);
+        existing->second = std::move(cell);
+    } else {
+        m_Table.emplace_hint(existing, std::move(id), std::move(cell));
+    }
+}
+
+bool CSpreadsheet::eraseCell(const std::string &id) {
+    auto cell = m_Table.find(id);
+    if (cell == m_Table.end())
+        return false;
+    m_AstCache.noteReleased(cell->second);
+    m_Table.erase(cell);
+    return true;
+}
+
+size_t CSpreadsheet::subscribe(CPos topLeft, int w, int h, CChangeCallback callback) {
+    if (w <= 0 || h <= 0)
+        return 0;
+
+    // Changes are reported against the values visible right now
+    CSubscription subscription{CRect{topLeft.getColumnNumber(), topLeft.getRow(), topLeft.getColumnNumber() + w - 1, topLeft.getRow() + h - 1},
+                               std::move(callback), {}};
+    evaluateRegion(topLeft, w, h, [&subscription, &topLeft, w](size_t i, const CValue &value) {
+        if (!std::holds_alternative<std::monostate>(value))
+            subscription.m_Values.emplace(CPos(topLeft.getColumnNumber() + i % w, topLeft.getRow() + i / w).getId(), value);
+    });
+
+    auto lock = lockTable();
+    size_t id = m_NextSubscription++;
+    m_Subscriptions.emplace(id, std::move(subscription));
+    return id;
+}
+
+void CSpreadsheet::unsubscribe(size_t id) {
+    auto lock = lockTable();
+    m_Subscriptions.erase(id);
+}
+
+CSpreadsheet::CNotifications CSpreadsheet::collectChanges(const std::vector<std::string> &ids) {
+    CNotifications notifications;
+    for (auto &[id, subscription] : m_Subscriptions) {
+        std::vector<std::pair<CPos, CValue>> changes;
+        for (const auto &cellId : ids) {
+            CPos pos(cellId);
+            if (!subscription.m_Rect.contains(pos.getColumnNumber(), pos.getRow()))
+                continue;
+
+            // Values equal to the last delivered one are not reported
+            CValue value = cachedValue(cellId);
+            auto previous = subscription.m_Values.find(cellId);
+            if (previous == subscription.m_Values.end() ? std::holds_alternative<std::monostate>(value) : previous->second == value)
+                continue;
+
+            if (std::holds_alternative<std::monostate>(value))
+                subscription.m_Values.erase(previous);
+            else
+                subscription.m_Values.insert_or_assign(cellId, value);
+            changes.emplace_back(pos, std::move(value));
+        }
+
+        if (!changes.empty())
+            notifications.emplace_back(subscription.m_Callback, std::move(changes));
+    }
+    return notifications;
+}
+
+void CSpreadsheet::deliverChanges(const CNotifications &notifications) {
+    for (const auto &[callback, changes] : notifications)
+        callback(changes);
+}
+
+void CSpreadsheet::notifySubscribers() {
+    // Snapshot and background modes notify after publish or batch
+    if (m_Subscriptions.empty() || m_DeferNotifications || m_ConcurrentReads || m_AsyncRecalc)
+        return;
+
+    // Only subscribed cells are evaluated, everything else stays lazy
+    std::vector<std::string> watched;
+    for (auto &id : collectAffected()) {
+        CPos pos(id);
+        for (const auto &subscription : m_Subscriptions) {
+            if (subscription.second.m_Rect.contains(pos.getColumnNumber(), pos.getRow())) {
+                watched.push_back(std::move(id));
+                break;
+            }
+        }
+    }
+
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (const auto &id : watched) {
+            auto cell = m_Table.find(id);
+            if (cell == m_Table.end())
+                continue;
+            if (checker.containsCycle(id))
+                cell->second.setValue(CValue());
+            else
+                cell->second.evaluate(m_Table);
+        }
+    }
+    m_AstCache.enforce(m_Table);
+    deliverChanges(collectChanges(watched));
+}
+
+void CSpreadsheet::setAstBudget(size_t maxAsts) {
+    auto lock = lockTable();
+    m_AstCache.setBudget(maxAsts);
+    m_AstCache.enforce(m_Table);
+}
+
+CAstStats CSpreadsheet::getAstStats() const {
+    auto lock = lockTable();
+    CAstStats stats = m_AstCache.getStats(m_Table);
+    stats.m_ParseHits = m_ParseCache.getHits();
+    stats.m_ParseMisses = m_ParseCache.getMisses();
+    return stats;
+}
+
+void CSpreadsheet::setParseCacheCapacity(size_t entries) {
+    m_ParseCache.setCapacity(entries);
+}
+
+void CSpreadsheet::markChanged(const std::string &id) {
+    if (!m_ConcurrentReads.load(std::memory_order_relaxed) && !m_AsyncRecalc.load(std::memory_order_relaxed) && m_Subscriptions.empty())
+        return;
+    m_Changed.insert(id);
+    if (m_AsyncRecalc.load(std::memory_order_relaxed))
+        markDirty(id);
+    m_WorkAvailable.notify_one();
+}
+
+void CSpreadsheet::markDirty(const std::string &id) {
+    // Dependents already dirty are walked too, their own dependents may have been recalculated meanwhile
+    std::unordered_set<std::string> seen = {id};
+    std::queue<std::string> queue;
+    queue.push(id);
+    while (!queue.empty()) {
+        std::string next = std::move(queue.front());
+        queue.pop();
+        m_Dependencies.forEachDependent(CPos(next), [&seen, &queue](const std::string &dependent) {
+            if (seen.insert(dependent).second)
+                queue.push(dependent);
+        });
+        if (m_Dirty.insert(next).second)
+            m_Queue.push_back(std::move(next));
+    }
+}
+
+std::unique_lock<std::mutex> CSpreadsheet::lockTable() const {
+    if (!m_AsyncRecalc.load(std::memory_order_acquire))
+        return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(m_Mutex);
+}
+
+std::vector<std::string> CSpreadsheet::collectAffected() {
+    std::vector<std::string> affected;
+
+    if (m_PublishAll) {
+        for (const auto &cell : m_Table)
+            affected.push_back(cell.first);
+    } else {
+        // Collect changed cells and everything that transitively depends on them
+        std::set<std::string> seen(m_Changed);
+        std::queue<std::string> queue;
+        for (const auto &id : m_Changed)
+            queue.push(id);
+
+        while (!queue.empty()) {
+            std::string id = queue.front();
+            queue.pop();
+            m_Dependencies.forEachDependent(CPos(id), [&seen, &queue](const std::string &next) {
+                if (seen.insert(next).second)
+                    queue.push(next);
+            });
+            affected.push_back(std::move(id));
+        }
+    }
+
+    m_Changed.clear();
+    m_PublishAll = false;
+    return affected;
+}
+
+void CSpreadsheet::storeSnapshot(const std::vector<std::string> &ids, bool full) {
+    std::shared_ptr<const CValueSnapshot> previous = m_Snapshot.load();
+    if (previous == nullptr)
+        return;
+
+    auto snapshot = std::make_shared<CValueSnapshot>(previous->m_Epoch + 1);
+    std::vector<bool> copied;
+    if (full) {
+        snapshot->reshard(ids.size(), copied);
+    } else {
+        // Shards without changes stay shared with the previous epoch
+        snapshot->m_Shards = previous->m_Shards;
+        snapshot->m_Size = previous->m_Size;
+        copied.assign(snapshot->m_Shards.size(), false);
+    }
+
+    for (const auto &id : ids)
+        snapshot->assign(id, cachedValue(id), copied);
+
+    // Growing sheet gets more shards, so that a publish keeps copying only a small part of it
+    if (snapshot->m_Size > 2 * CValueSnapshot::SHARD_CELLS * snapshot->m_Shards.size())
+        snapshot->reshard(snapshot->m_Size, copied);
+    m_Snapshot.store(std::move(snapshot), std::memory_order_release);
+}
+
+void CSpreadsheet::setConcurrentReads(bool enabled) {
+    if (enabled == m_ConcurrentReads.load())
+        return;
+
+    auto lock = lockTable();
+    if (!enabled) {
+        m_ConcurrentReads = false;
+        m_PublishSnapshots = false;
+        m_Snapshot.store(nullptr);
+        if (!m_AsyncRecalc)
+            m_Changed.clear();
+        return;
+    }
+
+    // Readers must see a complete snapshot before they are allowed in
+    m_PublishAll = true;
+    m_Snapshot.store(std::make_shared<const CValueSnapshot>());
+    m_PublishSnapshots = true;
+    if (m_AsyncRecalc) {
+        m_WorkAvailable.notify_one();
+        m_CellClean.wait(lock, [this] { return m_Snapshot.load()->getEpoch() > 0; });
+        m_ConcurrentReads.store(true, std::memory_order_release);
+        return;
+    }
+
+    publish();
+    m_ConcurrentReads.store(true, std::memory_order_release);
+}
+
+void CSpreadsheet::publish() {
+    // Background worker publishes on its own after every batch
+    if (m_AsyncRecalc || m_Snapshot.load() == nullptr)
+        return;
+
+    CTraceSpan span("publish");
+    bool full = m_PublishAll;
+    std::vector<std::string> affected = collectAffected();
+
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (const auto &id : affected) {
+            auto cell = m_Table.find(id);
+            if (cell == m_Table.end())
+                continue;
+            if (checker.containsCycle(id))
+                cell->second.setValue(CValue());
+            else
+                cell->second.evaluate(m_Table);
+        }
+    }
+    m_AstCache.enforce(m_Table);
+
+    storeSnapshot(affected, full);
+    deliverChanges(collectChanges(affected));
+}
+
+std::shared_ptr<const CValueSnapshot> CSpreadsheet::evaluateAll() {
+    CTraceSpan span("evaluateAll");
+    auto lock = lockTable();
+    auto snapshot = std::make_shared<CValueSnapshot>();
+    std::vector<bool> copied;
+    snapshot->reshard(m_Table.size(), copied);
+    CDependencyChecker checker(m_Dependencies, m_Sheets, m_SheetName);
+    {
+        CEvaluationPass pass(&m_AstCache, m_Sheets);
+        for (auto &[id, cell] : m_Table) {
+            if (!checker.containsCycle(id))
+                snapshot->assign(id, cell.evaluate(m_Table), copied);
+        }
+    }
+    m_AstCache.enforce(m_Table);
+    return snapshot;
+}
+
+std::shared_ptr<const CValueSnapshot> CSpreadsheet::getSnapshot() const {
+    return m_Snapshot.load();
+}
+
+void CSpreadsheet::setAsyncRecalc(bool enabled) {
+    if (enabled == m_AsyncRecalc.load())
+        return;
+
+    if (enabled) {
+        // Cached values of all cells are refreshed by the first batch
+        m_StopWorker = false;
+        m_PublishAll = true;
+        m_AsyncRecalc = true;
+        m_Worker = std::thread(&CSpreadsheet::recalcWorker, this);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_StopWorker = true;
+    }
+    m_WorkAvailable.notify_all();
+    m_Worker.join();
+    m_AsyncRecalc = false;
+}
+
+std::future<CValue> CSpreadsheet::getValueAsync(CPos pos) {
+    std::promise<CValue> promise;
+    std::future<CValue> future = promise.get_future();
+
+    if (!m_AsyncRecalc.load(std::memory_order_acquire)) {
+        promise.set_value(getValue(pos));
+        return future;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (isClean(pos.getId()))
+        promise.set_value(cachedValue(pos.getId()));
+    else
+        m_Waiters.emplace(pos.getId(), std::move(promise));
+    return future;
+}
+
+bool CSpreadsheet::isClean(const std::string &id) const {
+    return !m_PublishAll && !m_Dirty.count(id);
+}
+
+CValue CSpreadsheet::cachedValue(const std::string &id) const {
+    auto cell = m_Table.find(id);
+    if (cell != m_Table.end())
+        return cell->second.getValue();
+    return CValue();
+}
+
+void CSpreadsheet::resolveWaiters() {
+    for (auto waiter = m_Waiters.begin(); waiter != m_Waiters.end();) {
+        if (!isClean(waiter->first)) {
+            ++waiter;
+            continue;
+        }
+        waiter->second.set_value(cachedValue(waiter->first));
+        waiter = m_Waiters.erase(waiter);
+    }
+}
+
+void CSpreadsheet::recalcWorker() {
+    // Bounds time for which writers and readers wait for the worker
+    static const size_t RECALC_SLICE = 256;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    std::vector<std::string> recalculated;
+    bool full = false;
+
+    // Cycle analysis and evaluation pass are shared by all cells recalculated until the next write
+    std::optional<CDependencyChecker> checker;
+    size_t passId = 0;
+
+    while (true) {
+        bool pending = !m_Changed.empty() || m_PublishAll;
+        if (m_Queue.empty() && !pending) {
+            // Batch finished, hand the values over to snapshot readers
+            if (m_PublishSnapshots && (full || !recalculated.empty())) {
+                storeSnapshot(recalculated, full);
+                m_CellClean.notify_all();
+            }
+
+            // Subscribers may read the sheet from their callbacks
+            CNotifications notifications = collectChanges(recalculated);
+            recalculated.clear();
+            full = false;
+            if (!notifications.empty()) {
+                lock.unlock();
+                deliverChanges(notifications);
+                lock.lock();
+                continue;
+            }
+
+            if (m_StopWorker)
+                break;
+            m_WorkAvailable.wait(lock, [this] { return m_StopWorker || !m_Changed.empty() || m_PublishAll; });
+            continue;
+        }
+
+        // Writes already marked their dependents dirty, only a full refresh is expanded here
+        if (pending) {
+            if (m_PublishAll) {
+                full = true;
+                for (const auto &cell : m_Table) {
+                    if (m_Dirty.insert(cell.first).second)
+                        m_Queue.push_back(cell.first);
+                }
+            }
+            m_Changed.clear();
+            m_PublishAll = false;
+            checker.reset();
+            passId = 0;
+            resolveWaiters();
+            m_CellClean.notify_all();
+            continue;
+        }
+
+        if (!checker)
+            checker.emplace(m_Dependencies, m_Sheets, m_SheetName);
+        {
+            std::optional<CEvaluationPass> pass;
+            if (passId)
+                pass.emplace(passId, &m_AstCache, m_Sheets);
+            else
+                passId = pass.emplace(&m_AstCache, m_Sheets).getId();
+
+            for (size_t i = 0; i < RECALC_SLICE && !m_Queue.empty(); i++) {
+                std::string id = std::move(m_Queue.front());
+                m_Queue.pop_front();
+                auto cell = m_Table.find(id);
+                if (cell != m_Table.end()) {
+                    if (checker->containsCycle(id))
+                        cell->second.setValue(CValue());
+                    else
+                        cell->second.evaluate(m_Table);
+                }
+                m_Dirty.erase(id);
+                recalculated.push_back(std::move(id));
+            }
+        }
+        m_AstCache.enforce(m_Table);
+        resolveWaiters();
+        m_CellClean.notify_all();
+
+        // Let writers and readers in between slices
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
+std::shared_ptr<CNode> CAstCache::load(const CPos &pos, const std::string &expression) {
+    CTraceSpan span("reparse");
+    if (span.isActive())
+        span.setArgument(pos.getId());
+
+    CBuilder builder(pos);
+    try {
+        builder.parse(expression);
+    } catch(std::invalid_argument &e) {
+        return nullptr;
+    }
+
+    m_Reparses++;
+    return builder.buildAST();
+}
+
+void CAstCache::setBudget(size_t budget) {
+    m_Budget = budget;
+}
+
+void CAstCache::noteResident() {
+    m_Resident++;
+}
+
+void CAstCache::noteReleased(const CCell &cell) {
+    // Cell restored by a pass of another workbook sheet was never counted here
+    if (cell.hasAst() && m_Resident > 0)
+        m_Resident--;
+}
+
+void CAstCache::noteCleared() {
+    m_Resident = 0;
+}
+
+void CAstCache::enforce(std::map<std::string, CCell> &table) {
+    if (m_Budget == 0 || m_Resident <= m_Budget)
+        return;
+
+    // Passes of other workbook sheets may restore ASTs in this table, recount before sweeping
+    m_Resident = 0;
+    for (const auto &cell : table) {
+        if (cell.second.hasAst())
+            m_Resident++;
+    }
+
+    // Sweep down below the budget, so the next sweep comes only after more new ASTs
+    size_t target = m_Budget - m_Budget / 8;
+    auto cell = table.lower_bound(m_Hand);
+    for (size_t visited = 0; m_Resident > target && visited < 2 * table.size(); visited++) {
+        if (cell == table.end())
+            cell = table.begin();
+
+        // Recently evaluated cells get a second chance
+        if (cell->second.hasAst() && !cell->second.takeReferenced() && cell->second.evictAst()) {
+            m_Resident--;
+            m_Evictions++;
+        }
+        ++cell;
+    }
+
+    m_Hand = cell == table.end() ? "" : cell->first;
+}
+
+CAstStats CAstCache::getStats(const std::map<std::string, CCell> &table) const {
+    CAstStats stats{0, m_Evictions, m_Reparses, 0, 0};
+    for (const auto &cell : table) {
+        if (cell.second.hasAst())
+            stats.m_Resident++;
+    }
+    return stats;
+}
+
+CParseCache::CParseCache(size_t capacity)
+    : m_Capacity(capacity) {}
+
+CParsedFormula CParseCache::parse(const CPos &pos, const std::string &expression) {
+    std::string key = m_Capacity ? relativeForm(pos, expression) : std::string();
+    CParsedFormula formula;
+    if (!key.empty()) {
+        std::shared_ptr<CNode> cached;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            auto entry = m_Index.find(key);
+            if (entry != m_Index.end()) {
+                m_Entries.splice(m_Entries.begin(), m_Entries, entry->second);
+                cached = entry->second->m_Template;
+                m_Hits++;
+            }
+        }
+
+        // Template is never modified, so it can be cloned outside of the lock, its nodes know the cell they were parsed for
+        if (cached) {
+            CTraceSpan span("parseCacheHit");
+            formula.m_Root = cached->clone(pos, formula.m_Dependencies);
+            return formula;
+        }
+    }
+
+    CBuilder builder(pos);
+    builder.parse(expression);
+    formula.m_Root = builder.buildAST();
+    formula.m_Dependencies = builder.getDependencies();
+    if (key.empty() || formula.m_Root == nullptr)
+        return formula;
+
+    // Cells own their ASTs, the cache keeps a private copy
+    std::vector<std::string> dependencies;
+    std::shared_ptr<CNode> cached = formula.m_Root->clone(pos, dependencies);
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Misses++;
+    if (m_Index.count(key) || m_Capacity == 0)
+        return formula;
+    m_Entries.push_front(CEntry{key, std::move(cached)});
+    m_Index.emplace(std::move(key), m_Entries.begin());
+    while (m_Entries.size() > m_Capacity) {
+        m_Index.erase(m_Entries.back().m_Key);
+        m_Entries.pop_back();
+    }
+    return formula;
+}
+
+void CParseCache::setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Capacity = capacity;
+    while (m_Entries.size() > m_Capacity) {
+        m_Index.erase(m_Entries.back().m_Key);
+        m_Entries.pop_back();
+    }
+}
+
+size_t CParseCache::getHits() const {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Hits;
+}
+
+size_t CParseCache::getMisses() const {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Misses;
+}
+
+std::string CParseCache::relativeForm(const CPos &pos, std::string_view expression) {
+    // Sheet names could look like references, qualified formulas are always parsed
+    if (expression.find('!') != std::string_view::npos)
+        return "";
+
+    std::string key;
+    key.reserve(expression.size() + 16);
+    size_t i = 0;
+    while (i < expression.size()) {
+        char c = expression[i];
+        if (c == '"') {
+            // String literal is copied as is, doubled quote stays inside it
+            size_t end = i + 1;
+            while (end < expression.size() && (expression[end] != '"' || (end + 1 < expression.size() && expression[end + 1] == '"')))
+                end += expression[end] == '"' ? 2 : 1;
+            end = std::min(end + 1, expression.size());
+            key.append(expression.substr(i, end - i));
+            i = end;
+            continue;
+        }
+
+        // Exponent of a number (e.g. 1e5) is not a reference
+        bool number = i > 0 && (std::isalnum(static_cast<unsigned char>(expression[i - 1])) || expression[i - 1] == '.');
+        if ((!std::isalpha(static_cast<unsigned char>(c)) && c != '$') || number) {
+            key.push_back(c);
+            i++;
+            continue;
+        }
+
+        // Reference is [$]letters[$]digits not followed by a letter, digit or '(' (function call)
+        size_t end = i;
+        bool absoluteColumn = expression[end] == '$';
+        end += absoluteColumn;
+        size_t letters = end;
+        while (end < expression.size() && std::isalpha(static_cast<unsigned char>(expression[end])))
+            end++;
+        bool hasLetters = end > letters;
+        bool absoluteRow = end < expression.size() && expression[end] == '$';
+        end += absoluteRow;
+        size_t digits = end;
+        while (end < expression.size() && std::isdigit(static_cast<unsigned char>(expression[end])))
+            end++;
+        bool word = end < expression.size() && (std::isalnum(static_cast<unsigned char>(expression[end])) || expression[end] == '_' || expression[end] == '(');
+
+        if (!hasLetters || end == digits || word) {
+            // Function name or other word, copied up to its end so its digits are not read as a reference
+            size_t wordEnd = std::max(end, i + 1);
+            while (wordEnd < expression.size() && (std::isalnum(static_cast<unsigned char>(expression[wordEnd])) || expression[wordEnd] == '_'))
+                wordEnd++;
+            key.append(expression.substr(i, wordEnd - i));
+            i = wordEnd;
+            continue;
+        }
+
+        std::string id(expression.substr(i, end - i));
+        id.erase(std::remove(id.begin(), id.end(), '$'), id.end());
+        size_t column, row;
+        if (!CPos::parse(id, column, row))
+            return "";
+
+        key.push_back('{');
+        key.append(absoluteColumn ? "C" + std::to_string(column) : "c" + std::to_string(static_cast<long long>(column - pos.getColumnNumber())));
+        key.append(absoluteRow ? "R" + std::to_string(row) : "r" + std::to_string(static_cast<long long>(row - pos.getRow())));
+        key.push_back('}');
+        i = end;
+    }
+    return key;
+}
+
+void CIntervalTree::insert(size_t low, size_t high, const std::string &owner) {
+    m_Pending.push_back({low, high, owner, false});
+}
+
+void CIntervalTree::erase(size_t low, size_t high, const std::string &owner) {
+    for (auto interval = m_Pending.begin(); interval != m_Pending.end(); ++interval) {
+        if (interval->m_Low == low && interval->m_High == high && interval->m_Owner == owner) {
+            m_Pending.erase(interval);
+            return;
+        }
+    }
+
+    // Merged intervals are only marked, the tree is compacted once too many of them are gone
+    auto interval = std::lower_bound(m_Sorted.begin(), m_Sorted.end(), low, [](const CInterval &interval, size_t low) {
+        return interval.m_Low < low;
+    });
+    for (; interval != m_Sorted.end() && interval->m_Low == low; ++interval) {
+        if (!interval->m_Erased && interval->m_High == high && interval->m_Owner == owner) {
+            interval->m_Erased = true;
+            m_Erased++;
+            break;
+        }
+    }
+
+    if (m_Erased * 2 > m_Sorted.size())
+        rebuild();
+}
+
+bool CIntervalTree::empty() const {
+    return m_Pending.empty() && m_Erased == m_Sorted.size();
+}
+
+void CIntervalTree::stab(size_t point, const std::function<void(const std::string&)> &visitor) const {
+    if (m_Pending.size() > 16 + m_Sorted.size() / 4)
+        rebuild();
+
+    stabTree(0, m_Sorted.size(), point, visitor);
+    for (const auto &interval : m_Pending) {
+        if (interval.m_Low <= point && point <= interval.m_High)
+            visitor(interval.m_Owner);
+    }
+}
+
+void CIntervalTree::rebuild() const {
+    std::vector<CInterval> intervals;
+    intervals.reserve(m_Sorted.size() - m_Erased + m_Pending.size());
+    for (auto &interval : m_Sorted) {
+        if (!interval.m_Erased)
+            intervals.push_back(std::move(interval));
+    }
+    std::move(m_Pending.begin(), m_Pending.end(), std::back_inserter(intervals));
+    std::sort(intervals.begin(), intervals.end(), [](const CInterval &a, const CInterval &b) {
+        return a.m_Low < b.m_Low;
+    });
+
+    m_Sorted = std::move(intervals);
+    m_Pending.clear();
+    m_Erased = 0;
+    m_MaxHigh.assign(m_Sorted.size(), 0);
+    buildMaxHigh(0, m_Sorted.size());
+}
+
+size_t CIntervalTree::buildMaxHigh(size_t from, size_t to) const {
+    if (from >= to)
+        return 0;
+
+    // Middle of the slice is the root of its subtree
+    size_t middle = from + (to - from) / 2;
+    m_MaxHigh[middle] = std::max({m_Sorted[middle].m_High, buildMaxHigh(from, middle), buildMaxHigh(middle + 1, to)});
+    return m_MaxHigh[middle];
+}
+
+void CIntervalTree::stabTree(size_t from, size_t to, size_t point, const std::function<void(const std::string&)> &visitor) const {
+    if (from >= to)
+        return;
+
+    size_t middle = from + (to - from) / 2;
+    if (m_MaxHigh[middle] < point)
+        return;
+
+    stabTree(from, middle, point, visitor);
+    const CInterval &interval = m_Sorted[middle];
+    if (interval.m_Low > point)
+        return;
+
+    if (!interval.m_Erased && point <= interval.m_High)
+        visitor(interval.m_Owner);
+    stabTree(middle + 1, to, point, visitor);
+}
+
+void CRangeIndex::insert(const CRect &rect, const std::string &owner) {
+    for (size_t column = rect.m_Left; column <= rect.m_Right; column++)
+        m_Columns[column].insert(rect.m_Top, rect.m_Bottom, owner);
+}
+
+void CRangeIndex::erase(const CRect &rect, const std::string &owner) {
+    for (size_t column = rect.m_Left; column <= rect.m_Right; column++) {
+        auto tree = m_Columns.find(column);
+        if (tree == m_Columns.end())
+            continue;
+        tree->second.erase(rect.m_Top, rect.m_Bottom, owner);
+        if (tree->second.empty())
+            m_Columns.erase(tree);
+    }
+}
+
+void CRangeIndex::clear() {
+    m_Columns.clear();
+}
+
+void CRangeIndex::stab(size_t column, size_t row, const std::function<void(const std::string&)> &visitor) const {
+    auto tree = m_Columns.find(column);
+    if (tree != m_Columns.end())
+        tree->second.stab(row, visitor);
+}
+
+void CDependencyGraph::setDependencies(const CPos &pos, const std::vector<std::string> &references) {
+    erase(pos);
+    if (references.empty())
+        return;
+
+    std::string id = pos.getId();
+    std::vector<std::string> cells;
+    std::vector<CRect> ranges;
+    for (const auto &reference : references) {
+        if (reference.find(':') != std::string::npos && reference.find('!') == std::string::npos) {
+            CRect rect = CRect::parse(reference);
+            m_RangeIndex.insert(rect, id);
+            ranges.push_back(rect);
+        } else {
+            m_Dependents[reference].insert(id);
+            cells.push_back(reference);
+        }
+    }
+
+    if (!cells.empty())
+        m_References.emplace(id, std::move(cells));
+    if (!ranges.empty())
+        m_Ranges.emplace(id, std::move(ranges));
+    m_Formulas[pos.getColumnNumber()].insert(pos.getRow());
+}
+
+bool CDependencyGraph::isShifted(const std::string &id, const CShift &edit) const {
+    auto references = m_References.find(id);
+    if (references != m_References.end()) {
+        for (const auto &reference : references->second) {
+            if (reference.find('!') == std::string::npos && edit.affects(CPos(reference)))
+                return true;
+        }
+    }
+
+    auto ranges = m_Ranges.find(id);
+    if (ranges != m_Ranges.end()) {
+        for (const auto &rect : ranges->second) {
+            if (edit.affects(rect))
+                return true;
+        }
+    }
+
+    uint32_t node = findNode(id);
+    if (!isFrozen(node))
+        return false;
+    for (uint32_t i = m_ReferenceOffsets[node]; i < m_ReferenceOffsets[node + 1]; i++) {
+        const std::string &reference = m_Names[m_FrozenReferences[i]];
+        if (reference.find('!') == std::string::npos && edit.affects(CPos(reference)))
+            return true;
+    }
+    for (uint32_t i = m_RangeOffsets[node]; i < m_RangeOffsets[node + 1]; i++) {
+        if (edit.affects(m_FrozenRanges[i]))
+            return true;
+    }
+    return false;
+}
+
+void CDependencyGraph::erase(const CPos &pos) {
+    auto column = m_Formulas.find(pos.getColumnNumber());
+    if (column == m_Formulas.end() || !column->second.erase(pos.getRow())) {
+        // Cell is not in the overlay, but it may still have frozen references
+        if (!m_Names.empty())
+            drop(pos.getId());
+        return;
+    }
+    if (column->second.empty())
+        m_Formulas.erase(column);
+
+    std::string id = pos.getId();
+    auto references = m_References.find(id);
+    if (references != m_References.end()) {
+        for (const auto &reference : references->second) {
+            auto dependents = m_Dependents.find(reference);
+            if (dependents == m_Dependents.end())
+                continue;
+            dependents->second.erase(id);
+            if (dependents->second.empty())
+                m_Dependents.erase(dependents);
+        }
+        m_References.erase(references);
+    }
+
+    auto ranges = m_Ranges.find(id);
+    if (ranges != m_Ranges.end()) {
+        for (const auto &rect : ranges->second)
+            m_RangeIndex.erase(rect, id);
+        m_Ranges.erase(ranges);
+    }
+}
+
+void CDependencyGraph::clear() {
+    m_Names.clear();
+    m_Nodes.clear();
+    m_ReferenceOffsets.clear();
+    m_FrozenReferences.clear();
+    m_RangeOffsets.clear();
+    m_FrozenRanges.clear();
+    m_DependentOffsets.clear();
+    m_FrozenDependents.clear();
+    m_FrozenFormulas.clear();
+    m_Dropped.clear();
+    m_References.clear();
+    m_Ranges.clear();
+    m_Dependents.clear();
+    m_RangeIndex.clear();
+    m_Formulas.clear();
+}
+
+bool CDependencyGraph::forEachPrecedent(const std::string &id, const std::function<bool(const std::string&)> &visitor) const {
+    auto references = m_References.find(id);
+    if (references != m_References.end()) {
+        for (const auto &reference : references->second) {
+            if (!visitor(reference))
+                return false;
+        }
+    }
+
+    // Cell has references either in the overlay or in the frozen arrays
+    auto ranges = m_Ranges.find(id);
+    const CRect *first = nullptr;
+    const CRect *last = nullptr;
+    if (ranges != m_Ranges.end()) {
+        first = ranges->second.data();
+        last = first + ranges->second.size();
+    } else if (references == m_References.end()) {
+        uint32_t node = findNode(id);
+        if (!isFrozen(node))
+            return true;
+        for (uint32_t i = m_ReferenceOffsets[node]; i < m_ReferenceOffsets[node + 1]; i++) {
+            if (!visitor(m_Names[m_FrozenReferences[i]]))
+                return false;
+        }
+        first = m_FrozenRanges.data() + m_RangeOffsets[node];
+        last = m_FrozenRanges.data() + m_RangeOffsets[node + 1];
+    }
+
+    // Only cells with references inside the range are visited, not the whole area
+    for (const CRect *rect = first; rect != last; ++rect) {
+        if (!forEachFormula(*rect, visitor))
+            return false;
+    }
+    return true;
+}
+
+bool CDependencyGraph::forEachFormula(const CRect &rect, const std::function<bool(const std::string&)> &visitor) const {
+    for (auto column = m_Formulas.lower_bound(rect.m_Left); column != m_Formulas.end() && column->first <= rect.m_Right; ++column) {
+        for (auto row = column->second.lower_bound(rect.m_Top); row != column->second.end() && *row <= rect.m_Bottom; ++row) {
+            if (!visitor(CPos(column->first, *row).getId()))
+                return false;
+        }
+    }
+
+    auto before = [](const CFrozenFormula &formula, const std::pair<size_t, size_t> &pos) {
+        return std::make_pair(formula.m_Column, formula.m_Row) < pos;
+    };
+    auto formula = std::lower_bound(m_FrozenFormulas.begin(), m_FrozenFormulas.end(), std::make_pair(rect.m_Left, rect.m_Top), before);
+    while (formula != m_FrozenFormulas.end() && formula->m_Column <= rect.m_Right) {
+        // Jump over rows of the column outside of the range
+        if (formula->m_Row < rect.m_Top || formula->m_Row > rect.m_Bottom) {
+            size_t column = formula->m_Column + (formula->m_Row > rect.m_Bottom);
+            formula = std::lower_bound(formula, m_FrozenFormulas.end(), std::make_pair(column, rect.m_Top), before);
+            continue;
+        }
+        if (!m_Dropped[formula->m_Node] && !visitor(m_Names[formula->m_Node]))
+            return false;
+        ++formula;
+    }
+    return true;
+}
+
+std::set<std::string> CDependencyGraph::getReferencedSheets() const {
+    std::set<std::string> sheets;
+    auto add = [&sheets](const std::string &reference) {
+        size_t separator = reference.find('!');
+        if (separator != std::string::npos)
+            sheets.insert(reference.substr(0, separator));
+    };
+    for (const auto &[id, references] : m_References) {
+        for (const auto &reference : references)
+            add(reference);
+    }
+    for (size_t node = 0; node < m_Names.size(); node++) {
+        if (m_DependentOffsets[node] != m_DependentOffsets[node + 1])
+            add(m_Names[node]);
+    }
+    return sheets;
+}
+
+void CDependencyGraph::forEachDependent(const CPos &pos, const std::function<void(const std::string&)> &visitor) const {
+    std::string id = pos.getId();
+    auto dependents = m_Dependents.find(id);
+    if (dependents != m_Dependents.end()) {
+        for (const auto &dependent : dependents->second)
+            visitor(dependent);
+    }
+
+    // Frozen dependents whose references changed since are in the overlay already
+    uint32_t node = findNode(id);
+    if (node != NO_NODE) {
+        for (uint32_t i = m_DependentOffsets[node]; i < m_DependentOffsets[node + 1]; i++) {
+            if (!m_Dropped[m_FrozenDependents[i]])
+                visitor(m_Names[m_FrozenDependents[i]]);
+        }
+    }
+    m_RangeIndex.stab(pos.getColumnNumber(), pos.getRow(), visitor);
+}
+
+void CDependencyGraph::compact() {
+    std::vector<std::string> names;
+    std::unordered_map<std::string, uint32_t> nodes;
+    auto intern = [&names, &nodes](const std::string &id) {
+        auto [node, inserted] = nodes.emplace(id, names.size());
+        if (inserted)
+            names.push_back(id);
+        return node->second;
+    };
+
+    // Edges are collected as pairs first and then bucketed by their source node
+    std::vector<std::pair<uint32_t, uint32_t>> references;
+    std::vector<std::pair<uint32_t, CRect>> ranges;
+    std::vector<CFrozenFormula> formulas;
+    for (const auto &formula : m_FrozenFormulas) {
+        if (m_Dropped[formula.m_Node])
+            continue;
+        uint32_t node = intern(m_Names[formula.m_Node]);
+        formulas.push_back(CFrozenFormula{formula.m_Column, formula.m_Row, node});
+        for (uint32_t i = m_ReferenceOffsets[formula.m_Node]; i < m_ReferenceOffsets[formula.m_Node + 1]; i++)
+            references.emplace_back(node, intern(m_Names[m_FrozenReferences[i]]));
+        for (uint32_t i = m_RangeOffsets[formula.m_Node]; i < m_RangeOffsets[formula.m_Node + 1]; i++)
+            ranges.emplace_back(node, m_FrozenRanges[i]);
+    }
+    for (const auto &[column, rows] : m_Formulas) {
+        for (size_t row : rows) {
+            std::string id = CPos(column, row).getId();
+            uint32_t node = intern(id);
+            formulas.push_back(CFrozenFormula{column, row, node});
+            auto cells = m_References.find(id);
+            if (cells != m_References.end()) {
+                for (const auto &reference : cells->second)
+                    references.emplace_back(node, intern(reference));
+            }
+            auto rects = m_Ranges.find(id);
+            if (rects != m_Ranges.end()) {
+                for (const auto &rect : rects->second)
+                    ranges.emplace_back(node, rect);
+            }
+        }
+    }
+    std::sort(formulas.begin(), formulas.end(), [](const CFrozenFormula &a, const CFrozenFormula &b) {
+        return std::make_pair(a.m_Column, a.m_Row) < std::make_pair(b.m_Column, b.m_Row);
+    });
+
+    // Counting sort of edges into compressed sparse rows
+    auto bucket = [count = names.size()](const auto &edges, auto source, auto target, std::vector<uint32_t> &offsets, auto &values) {
+        offsets.assign(count + 1, 0);
+        for (const auto &edge : edges)
+            offsets[source(edge) + 1]++;
+        for (size_t i = 0; i < count; i++)
+            offsets[i + 1] += offsets[i];
+        std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+        values.resize(edges.size());
+        for (const auto &edge : edges)
+            values[next[source(edge)]++] = target(edge);
+    };
+    auto first = [](const auto &edge) { return edge.first; };
+    auto second = [](const auto &edge) { return edge.second; };
+    bucket(references, first, second, m_ReferenceOffsets, m_FrozenReferences);
+    bucket(references, second, first, m_DependentOffsets, m_FrozenDependents);
+    bucket(ranges, first, second, m_RangeOffsets, m_FrozenRanges);
+
+    m_Names = std::move(names);
+    m_Nodes = std::move(nodes);
+    m_FrozenFormulas = std::move(formulas);
+    m_Dropped.assign(m_Names.size(), false);
+    m_References.clear();
+    m_Ranges.clear();
+    m_Dependents.clear();
+    m_Formulas.clear();
+}
+
+uint32_t CDependencyGraph::findNode(const std::string &id) const {
+    auto node = m_Nodes.find(id);
+    return node != m_Nodes.end() ? node->second : NO_NODE;
+}
+
+bool CDependencyGraph::isFrozen(uint32_t node) const {
+    return node != NO_NODE && !m_Dropped[node]
+        && (m_ReferenceOffsets[node] != m_ReferenceOffsets[node + 1] || m_RangeOffsets[node] != m_RangeOffsets[node + 1]);
+}
+
+void CDependencyGraph::drop(const std::string &id) {
+    uint32_t node = findNode(id);
+    if (!isFrozen(node))
+        return;
+
+    // Range index is shared by both layers, it has to forget the frozen ranges now
+    m_Dropped[node] = true;
+    for (uint32_t i = m_RangeOffsets[node]; i < m_RangeOffsets[node + 1]; i++)
+        m_RangeIndex.erase(m_FrozenRanges[i], id);
+}
+
+CDependencyChecker::CDependencyChecker(const CDependencyGraph& dependencies, const CSheetResolver *sheets, const std::string &sheet)
+    : m_Dependencies(dependencies)
+    , m_Sheets(sheets)
+    , m_Sheet(sheet) {}
+
+bool CDependencyChecker::isCyclicUtil(const std::string& vertex) {
+    auto result = results.find(vertex);
+    if (result != results.end())
+        return result->second;
+
+    // Back edge to a vertex on the current path closes a cycle
+    if (recursionStack.count(vertex))
+        return true;
+
+    bool cyclic = false;
+    recursionStack.insert(vertex);
+    cyclic = !forEachPrecedent(vertex, [this](const std::string& precedent) {
+        return !isCyclicUtil(precedent);
+    });
+    recursionStack.erase(vertex);
+    results[vertex] = cyclic;
+    return cyclic;
+}
+
+bool CDependencyChecker::forEachPrecedent(const std::string &vertex, const std::function<bool(const std::string&)> &visitor) const {
+    size_t separator = vertex.find('!');
+    std::string sheet = separator != std::string::npos ? vertex.substr(0, separator) : "";
+    std::string id = separator != std::string::npos ? vertex.substr(separator + 1) : vertex;
+    const CDependencyGraph *graph = sheet.empty() ? &m_Dependencies : m_Sheets != nullptr ? m_Sheets->graph(sheet) : nullptr;
+    if (graph == nullptr)
+        return true;
+
+    // References to the checked sheet become local vertices, local cells of other sheets get qualified
+    auto qualified = [this, &sheet, &visitor](const std::string &precedent) {
+        size_t separator = precedent.find('!');
+        if (separator == std::string::npos)
+            return visitor(sheet.empty() ? precedent : sheet + '!' + precedent);
+        if (precedent.compare(0, separator, m_Sheet) == 0 && separator == m_Sheet.size())
+            return visitor(precedent.substr(separator + 1));
+        return visitor(precedent);
+    };
+
+    // Range of another sheet is a vertex of its own, its precedents are the formulas inside
+    if (id.find(':') != std::string::npos)
+        return graph->forEachFormula(CRect::parse(id), qualified);
+    return graph->forEachPrecedent(id, qualified);
 }
 
 bool CDependencyChecker::containsCycle(const std::string &vertex) {
@@ -1,34 +1,740 @@
 #include "builder.h"
+#include "codec.h"
+#include "csv.h"
+#include <bit>
+#include <condition_variable>
+#include <future>
+
+/**
+ * Immutable set of evaluated cell values published for concurrent readers. Values are split into shards
+ * by id hash, a new epoch copies only the shards its changes touch and shares the rest with the previous one
+*/
+class CValueSnapshot {
+public:
+    CValueSnapshot(size_t epoch = 0);
+    CValue getValue(const CPos &pos) const;
+    size_t getEpoch() const;
+
+private:
+    friend class CSpreadsheet;
+    using CShard = std::unordered_map<std::string, CValue>;
+    static constexpr size_t SHARD_CELLS = 1024;
+
+    /**
+     * @param id Cell id
+     * @return Stored value or nullptr for undefined cells
+    */
+    const CValue *find(const std::string &id) const;
+
+    /**
+     * Replaces value of the cell, the shard is copied on its first change within the epoch
+     * @param id Cell id
+     * @param value New value, undefined values are not stored
+     * @param copied Shards already copied within the epoch
+    */
+    void assign(const std::string &id, CValue value, std::vector<bool> &copied);
+
+    /**
+     * Redistributes values into enough shards for the given number of cells
+     * @param cells Expected number of cells
+     * @param copied Shards already copied within the epoch, all shards are new afterwards
+    */
+    void reshard(size_t cells, std::vector<bool> &copied);
+    size_t shardOf(const std::string &id) const;
+
+    size_t m_Epoch;
+    size_t m_Size = 0;
+    // Power of two shards, those not copied within the epoch are shared with earlier snapshots
+    std::vector<std::shared_ptr<CShard>> m_Shards;
+};
+
+/**
+ * Row intervals of one column. Intervals sorted by lower bound form an implicit balanced tree
+ * where every node keeps the highest upper bound of its subtree, recent changes are merged lazily
+*/
+class CIntervalTree {
+public:
+    void insert(size_t low, size_t high, const std::string &owner);
+    void erase(size_t low, size_t high, const std::string &owner);
+    bool empty() const;
+
+    /**
+     * Reports owners of all intervals containing the point
+     * @param point Row number
+     * @param visitor Callback receiving owners
+    */
+    void stab(size_t point, const std::function<void(const std::string&)> &visitor) const;
+
+private:
+    struct CInterval {
+        size_t m_Low;
+        size_t m_High;
+        std::string m_Owner;
+        bool m_Erased;
+    };
+
+    void rebuild() const;
+    size_t buildMaxHigh(size_t from, size_t to) const;
+    void stabTree(size_t from, size_t to, size_t point, const std::function<void(const std::string&)> &visitor) const;
+
+    mutable std::vector<CInterval> m_Sorted;
+    mutable std::vector<size_t> m_MaxHigh;
+    mutable size_t m_Erased = 0;
+    // Inserted intervals not merged into the tree yet, scanned linearly
+    mutable std::vector<CInterval> m_Pending;
+};
+
+/**
+ * Spatial index of range references answering which ranges contain a cell. Every column has its own
+ * interval tree, so a range is stored once per column it spans instead of once per cell
+*/
+class CRangeIndex {
+public:
+    void insert(const CRect &rect, const std::string &owner);
+    void erase(const CRect &rect, const std::string &owner);
+    void clear();
+
+    /**
+     * Point-stabbing query
+     * @param column Cell column
+     * @param row Cell row
+     * @param visitor Callback receiving owners of ranges containing the cell
+    */
+    void stab(size_t column, size_t row, const std::function<void(const std::string&)> &visitor) const;
+
+private:
+    std::map<size_t, CIntervalTree> m_Columns;
+};
+
+/**
+ * Dependencies between cells. Plain references are kept as edges in both directions,
+ * range references as rectangles which are never expanded to single cells. References to other
+ * sheets (e.g. "Sheet2!A1", "Sheet2!A1:B5") are kept as plain references. Compaction freezes
+ * edges into compressed sparse row arrays over interned cell ids, later changes are kept in
+ * a small map based overlay until the next compaction
+*/
+class CDependencyGraph {
+public:
+    /**
+     * Replaces references of the cell
+     * @param pos Cell position
+     * @param references Referenced cells, ranges are given as "A1:B5"
+    */
+    void setDependencies(const CPos &pos, const std::vector<std::string> &references);
+    void erase(const CPos &pos);
+    void clear();
+
+    /**
+     * Visits cells the cell depends on. Ranges yield only cells which have references themselves,
+     * other cells can not lie on a cycle
+     * @param id Cell id
+     * @param visitor Callback receiving cell ids, returning false stops the traversal
+     * @return False if the traversal was stopped
+    */
+    bool forEachPrecedent(const std::string &id, const std::function<bool(const std::string&)> &visitor) const;
+
+    /**
+     * Visits cells which reference the cell directly or through a range
+     * @param pos Cell position
+     * @param visitor Callback receiving cell ids
+    */
+    void forEachDependent(const CPos &pos, const std::function<void(const std::string&)> &visitor) const;
+
+    /**
+     * Visits cells with references lying in the area
+     * @param rect Area
+     * @param visitor Callback receiving cell ids, returning false stops the traversal
+     * @return False if the traversal was stopped
+    */
+    bool forEachFormula(const CRect &rect, const std::function<bool(const std::string&)> &visitor) const;
+
+    /**
+     * Returns names of other sheets referenced by cells of this sheet, may include sheets
+     * no longer referenced until the next compaction
+     * @return Sheet names
+    */
+    std::set<std::string> getReferencedSheets() const;
+
+    /**
+     * Checks whether the cell references cells moved or deleted by a structural edit
+     * @param id Cell id
+     * @param edit Structural edit
+     * @return True if some reference or range reaches the edited rows or columns
+    */
+    bool isShifted(const std::string &id, const CShift &edit) const;
+
+    /**
+     * Moves the overlay and frozen edges which are still valid into new frozen arrays,
+     * meant to run after bulk changes (load, import)
+    */
+    void compact();
+
+private:
+    /**
+     * Frozen cell with references, kept sorted by position for range lookups
+    */
+    struct CFrozenFormula {
+        size_t m_Column;
+        size_t m_Row;
+        uint32_t m_Node;
+    };
+
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+    uint32_t findNode(const std::string &id) const;
+    bool isFrozen(uint32_t node) const;
+    void drop(const std::string &id);
+
+    // Interned cell ids of the frozen graph, node number is the index
+    std::vector<std::string> m_Names;
+    std::unordered_map<std::string, uint32_t> m_Nodes;
+    // Frozen edges of node i are [offsets[i], offsets[i + 1]) of the edge arrays
+    std::vector<uint32_t> m_ReferenceOffsets;
+    std::vector<uint32_t> m_FrozenReferences;
+    std::vector<uint32_t> m_RangeOffsets;
+    std::vector<CRect> m_FrozenRanges;
+    std::vector<uint32_t> m_DependentOffsets;
+    std::vector<uint32_t> m_FrozenDependents;
+    std::vector<CFrozenFormula> m_FrozenFormulas;
+    // Frozen nodes whose references were replaced or erased after the compaction
+    std::vector<bool> m_Dropped;
+
+    // Overlay of changes made after the compaction
+    std::map<std::string, std::vector<std::string>> m_References;
+    std::map<std::string, std::vector<CRect>> m_Ranges;
+    std::map<std::string, std::set<std::string>> m_Dependents;
+    CRangeIndex m_RangeIndex;
+    // Positions of cells with references, column -> rows
+    std::map<size_t, std::set<size_t>> m_Formulas;
+};
+
+/**
+ * AST eviction counters
+*/
+struct CAstStats {
+    // Formula cells whose AST is in memory
+    size_t m_Resident;
+    size_t m_Evictions;
+    size_t m_Reparses;
+
+    // Formulas instantiated from the parse cache and formulas that had to be parsed
+    size_t m_ParseHits;
+    size_t m_ParseMisses;
+};
+
+/**
+ * Keeps number of resident formula ASTs within budget. Cold ASTs are evicted by a CLOCK sweep
+ * over the table and rebuilt from the expression text once the cell is evaluated again
+*/
+class CAstCache : public CAstLoader {
+public:
+    std::shared_ptr<CNode> load(const CPos &pos, const std::string &expression) override;
+
+    /**
+     * @param budget Maximum number of resident ASTs, 0 disables eviction
+    */
+    void setBudget(size_t budget);
+    void noteResident() override;
+
+    /**
+     * Must be called before a cell leaves the table or is overwritten
+     * @param cell Released cell
+    */
+    void noteReleased(const CCell &cell);
+
+    /**
+     * Called when the whole table is cleared
+    */
+    void noteCleared();
+
+    /**
+     * Evicts cold ASTs when the budget is exceeded, must not run while the table is being evaluated
+     * @param table Table data
+    */
+    void enforce(std::map<std::string, CCell> &table);
+    CAstStats getStats(const std::map<std::string, CCell> &table) const;
+
+private:
+    size_t m_Budget = 0;
+    // Resident ASTs kept up to date by every change of the table, the table is scanned only when over budget
+    size_t m_Resident = 0;
+    size_t m_Evictions = 0;
+    size_t m_Reparses = 0;
+    // Cell the CLOCK hand points to
+    std::string m_Hand;
+};
+
+/**
+ * Formula ready to be stored in a cell
+*/
+struct CParsedFormula {
+    std::unique_ptr<CNode> m_Root;
+    std::vector<std::string> m_Dependencies;
+};
+
+/**
+ * LRU cache of parsed formulas keyed by their relative form, in which every reference is replaced by its offset
+ * from the cell (absolute parts are kept). Formulas filled down or across a column share the form, so all but
+ * the first one are cloned from the cached AST like copyRect does instead of being parsed
+*/
+class CParseCache {
+public:
+    CParseCache(size_t capacity = 4096);
+    CParseCache(const CParseCache &cache) = delete;
+    CParseCache& operator=(const CParseCache &cache) = delete;
+
+    /**
+     * Builds AST of the formula, safe to call from several threads
+     * @param pos Cell position
+     * @param expression Formula including the '=' prefix
+     * @return Formula AST and its references
+     * @throws std::invalid_argument when the formula is invalid
+    */
+    CParsedFormula parse(const CPos &pos, const std::string &expression);
+
+    /**
+     * @param capacity Maximum number of cached formulas, 0 disables the cache
+    */
+    void setCapacity(size_t capacity);
+    size_t getHits() const;
+    size_t getMisses() const;
+
+    /**
+     * Replaces every reference outside of string literals by "{c<column offset>r<row offset>}", absolute
+     * parts by "{C<column>R<row>}"
+     * @param pos Cell position
+     * @param expression Formula
+     * @return Relative form, empty for formulas that are not cached (qualified references, oversized ids)
+    */
+    static std::string relativeForm(const CPos &pos, std::string_view expression);
+
+private:
+    struct CEntry {
+        std::string m_Key;
+        // AST of the first formula with the key, cloned for the others
+        std::shared_ptr<CNode> m_Template;
+    };
+
+    mutable std::mutex m_Mutex;
+    size_t m_Capacity;
+    // Most recently used first
+    std::list<CEntry> m_Entries;
+    std::unordered_map<std::string, std::list<CEntry>::iterator> m_Index;
+    size_t m_Hits = 0;
+    size_t m_Misses = 0;
+};
+
+/**
+ * Text format of exported values
+*/
+enum class EExportFormat {
+    // Comma separated, fields with separators, quotes or line breaks are quoted
+    CSV,
+    // Tab separated, tabs, line breaks and backslashes are escaped with a backslash
+    TSV
+};
+
+/**
+ * Layout of saved sheets, load recognizes both
+*/
+enum class ESaveFormat {
+    // Tagged cells followed by checksum trailer
+    TEXT,
+    // Tagged cells split into LZ compressed blocks with their own checksums
+    BLOCKS
+};
+
+/****************************************************************************/
 
 class CSpreadsheet {
 public:
     static unsigned capabilities() {
-        return SPREADSHEET_SPEED | SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FILE_IO;
+        return SPREADSHEET_SPEED | SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FILE_IO | SPREADSHEET_FUNCTIONS;
     }
     
     CSpreadsheet() = default;
     CSpreadsheet(const CSpreadsheet &sheet);
     CSpreadsheet& operator=(const CSpreadsheet &sheet);
+    ~CSpreadsheet();
     bool load(std::istream &is);
-    bool save(std::ostream &os) const;
+
+    /**
+     * Saves all cells, block format is smaller and loads faster as blocks are decompressed in parallel
+     * @param os Output stream
+     * @param format Layout of the saved data
+     * @return True if write was successful
+    */
+    bool save(std::ostream &os, ESaveFormat format = ESaveFormat::TEXT) const;
+
+    /**
+     * Loads snapshot and replays journal records written after it, torn tail of the journal is ignored
+     * @param snapshot Snapshot input
+     * @param journal Journal input, ignored when it belongs to another snapshot
+     * @return False if the snapshot is invalid
+    */
+    bool load(std::istream &snapshot, std::istream &journal);
+
+    /**
+     * Writes full snapshot and starts a new journal, every following setCell and copyRect is appended
+     * to the journal, so a checkpoint costs only the changes made since the last compaction.
+     * Loading or assigning another sheet stops the journal
+     * @param snapshot Snapshot output
+     * @param journal Empty journal output, must stay alive while journaling
+     * @param format Layout of the snapshot
+     * @return True if both streams were written
+    */
+    bool compact(std::ostream &snapshot, std::ostream &journal, ESaveFormat format = ESaveFormat::TEXT);
+    void stopJournal();
     bool setCell(CPos pos, std::string contents);
     CValue getValue(CPos pos);
-    void copyRect(CPos dst, CPos src, int w = 1, int h = 1);
+
+    /**
+     * Evaluates rectangular area at once with shared cycle analysis, every cell is evaluated only once
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param values Output buffer of at least w * h items, filled row by row
+     * @return False if the area or buffer size is invalid
+    */
+    bool getValues(CPos topLeft, int w, int h, std::span<CValue> values);
+
+    /**
+     * Numeric variant of getValues, non-numeric cells are stored as 0 with cleared validity bit
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param values Output buffer of at least w * h numbers, filled row by row
+     * @param valid Validity bitmap of at least (w * h + 7) / 8 bytes, bit i % 8 of byte i / 8 belongs to values[i]
+     * @return False if the area or buffer size is invalid
+    */
+    bool getNumericValues(CPos topLeft, int w, int h, std::span<double> values, std::span<uint8_t> valid);
+
+    /**
+     * Evaluates outputs under several sets of input values without changing the sheet. Scenarios are evaluated
+     * in parallel, each one keeps its values in its own overlay. Inputs only replace cell values, so outputs
+     * depending on a cycle of the sheet stay undefined even if an input replaces a cell of the cycle
+     * @param inputs Replaced cell values of every scenario, cells need not exist
+     * @param outputs Evaluated cells
+     * @param workers Number of evaluating threads, 0 uses hardware concurrency
+     * @return Output values of every scenario in the order of outputs
+    */
+    std::vector<std::vector<CValue>> evaluateScenarios(const std::vector<std::map<CPos, CValue>> &inputs, const std::vector<CPos> &outputs, size_t workers = 0);
+
+    /**
+     * Copies rectangular area, relative references of copied formulas are shifted. Areas of at least 4096 cells
+     * are cloned on several threads
+     * @param dst Top left cell of the destination
+     * @param src Top left cell of the source
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param workers Number of cloning threads, 0 uses hardware concurrency
+    */
+    void copyRect(CPos dst, CPos src, int w = 1, int h = 1, size_t workers = 0);
+
+    /**
+     * Moves rectangular area like cut and paste. Moved formulas keep referencing the same cells and references
+     * to moved cells (or ranges lying entirely in the area) follow them, cells overwritten at the destination are dropped
+     * @param dst Top left cell of the destination
+     * @param src Top left cell of the moved area
+     * @param w Number of columns
+     * @param h Number of rows
+    */
+    void moveRect(CPos dst, CPos src, int w = 1, int h = 1);
+
+    /**
+     * Streams computed values of rectangular area as one text line per row, undefined cells are empty fields.
+     * The area is evaluated chunk by chunk and every chunk is formatted by several threads
+     * @param os Output stream
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param format Output format
+     * @return True if the area is valid and write was successful
+    */
+    bool exportValues(std::ostream &os, CPos topLeft, int w, int h, EExportFormat format = EExportFormat::CSV);
+
+    /**
+     * Reads CSV rows into cells starting at origin, every field behaves like setCell of its text and empty
+     * fields keep the cell unchanged. Literals are stored directly, formulas are parsed afterwards by several threads
+     * @param is CSV input
+     * @param origin Cell receiving the first field of the first row
+     * @return False if the input could not be read completely or ends inside a quoted field
+    */
+    bool importCsv(std::istream &is, CPos origin);
+
+    /**
+     * Inserts empty rows before the row, cells below move down and references to them follow,
+     * ranges spanning the row grow
+     * @param row First inserted row
+     * @param count Number of inserted rows
+     * @return True if the rows were inserted
+    */
+    bool insertRows(size_t row, size_t count = 1);
+
+    /**
+     * Deletes rows, cells below move up. Ranges spanning deleted rows shrink and references to deleted
+     * cells become invalid with undefined value
+     * @param row First deleted row
+     * @param count Number of deleted rows
+     * @return True if the rows were deleted
+    */
+    bool deleteRows(size_t row, size_t count = 1);
+    bool insertColumns(size_t column, size_t count = 1);
+    bool deleteColumns(size_t column, size_t count = 1);
+
+    /**
+     * Switches getValue to read published snapshots, so it can be called from many threads
+     * while a single writer thread modifies the sheet. Readers caught by switching it off fall back
+     * to the table, which is safe only while nobody writes
+     * @param enabled Enable/disable concurrent reads
+    */
+    void setConcurrentReads(bool enabled);
+
+    /**
+     * Recalculates cells changed since the last publish together with their dependents
+     * and atomically replaces the snapshot seen by readers (writer thread only)
+    */
+    void publish();
+
+    /**
+     * Returns the last published snapshot, useful for consistent reads of several cells
+     * @return Snapshot or nullptr when concurrent reads are disabled
+    */
+    std::shared_ptr<const CValueSnapshot> getSnapshot() const;
+
+    /**
+     * Moves recalculation to a background worker, writes then only update the table
+     * and getValue waits just for cells that are still dirty
+     * @param enabled Enable/disable background recalculation
+    */
+    void setAsyncRecalc(bool enabled);
+
+    /**
+     * Returns cell value once the background worker has recalculated the cell
+     * @param pos Cell position
+     * @return Future resolved with the cell value
+    */
+    std::future<CValue> getValueAsync(CPos pos);
+
+    /**
+     * Bounds memory taken by formula ASTs, ASTs of cells not evaluated recently are dropped
+     * and re-parsed from the expression text on demand
+     * @param maxAsts Maximum number of resident ASTs, 0 keeps all of them
+    */
+    void setAstBudget(size_t maxAsts);
+    CAstStats getAstStats() const;
+
+    /**
+     * Bounds number of formulas kept by the parse cache, repeated formulas in relative form (e.g. =A1*2 in B1
+     * and =A2*2 in B2) are cloned from the cache instead of being parsed again
+     * @param entries Maximum number of cached formulas, 0 disables the cache
+    */
+    void setParseCacheCapacity(size_t entries);
+
+    using CChangeCallback = std::function<void(const std::vector<std::pair<CPos, CValue>>&)>;
+
+    /**
+     * Registers callback which receives cells of the area whose value changed. It is called once after
+     * every write, after publish with concurrent reads, or after every batch of the background worker
+     * (from the worker thread)
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param callback Receives changed cells and their new values
+     * @return Subscription id, 0 for an empty area
+    */
+    size_t subscribe(CPos topLeft, int w, int h, CChangeCallback callback);
+    void unsubscribe(size_t id);
 
 private:
+    friend class CWorkbook;
     std::map<std::string, CCell> m_Table;
-    std::map<std::string, std::vector<std::string>> m_Dependencies;
+    CDependencyGraph m_Dependencies;
+    // Workbook owning the sheet and the name of the sheet in it, copies are detached
+    CSheetResolver *m_Sheets = nullptr;
+    std::string m_SheetName;
+    std::atomic<bool> m_ConcurrentReads = false;
+    // Worker publishes snapshots already before readers are switched to them
+    bool m_PublishSnapshots = false;
+    std::atomic<std::shared_ptr<const CValueSnapshot>> m_Snapshot;
+    // Cells modified since the last publish
+    std::set<std::string> m_Changed;
+    bool m_PublishAll = false;
+    std::atomic<bool> m_AsyncRecalc = false;
+    bool m_StopWorker = false;
+    std::thread m_Worker;
+    // Guards the table while background recalculation is enabled
+    mutable std::mutex m_Mutex;
+    std::condition_variable m_WorkAvailable;
+    std::condition_variable m_CellClean;
+    // Cells waiting for background recalculation and their order
+    std::unordered_set<std::string> m_Dirty;
+    std::deque<std::string> m_Queue;
+    std::multimap<std::string, std::promise<CValue>> m_Waiters;
+    // Journal of changes made since the last compaction
+    std::unique_ptr<CJournal> m_Journal;
+    CAstCache m_AstCache;
+    CParseCache m_ParseCache;
+
+    struct CSubscription {
+        CRect m_Rect;
+        CChangeCallback m_Callback;
+        // Last delivered value of every defined cell of the area
+        std::unordered_map<std::string, CValue> m_Values;
+    };
+    using CNotifications = std::vector<std::pair<CChangeCallback, std::vector<std::pair<CPos, CValue>>>>;
+    std::map<size_t, CSubscription> m_Subscriptions;
+    size_t m_NextSubscription = 1;
+    bool m_DeferNotifications = false;
+
+    /**
+     * Compares recalculated cells with values last delivered to subscribers
+     * @param ids Recalculated cells
+     * @return Notifications to deliver, outside of the table lock
+    */
+    CNotifications collectChanges(const std::vector<std::string> &ids);
+    void deliverChanges(const CNotifications &notifications);
+    void notifySubscribers();
+    void replayJournal(std::istream &journal, const std::string &checksum);
+    void compactDependencies();
+
+    /**
+     * Evaluates every cell with one shared cycle analysis
+     * @return Values of all defined cells
+    */
+    std::shared_ptr<const CValueSnapshot> evaluateAll();
+
+    /**
+     * Moves cells by a structural edit. Moved cells and cells with references crossing the edit get their
+     * references rewritten in place, other formulas are not touched
+     * @param edit Structural edit
+     * @param operation Edit name stored in the journal
+     * @return False for column 0
+    */
+    bool shiftCells(const CShift &edit, std::string_view operation);
+
+    /**
+     * Restores AST if needed, applies the edit to the cell and registers its new references
+     * @param cell Rewritten cell
+     * @param edit Structural edit
+     * @param pos Cell position after the edit
+    */
+    void rewriteCell(CCell &cell, const CShift &edit, CPos pos);
+
+    /**
+     * Inserts the cell or overwrites the existing one, keeping the resident AST count up to date
+     * @param id Cell id
+     * @param cell New cell
+    */
+    void storeCell(std::string id, CCell &&cell);
+
+    /**
+     * Removes the cell, keeping the resident AST count up to date
+     * @param id Cell id
+     * @return True if the cell existed
+    */
+    bool eraseCell(const std::string &id);
+
+    /**
+     * Copies large area by cloning cells on several threads, storage and dependency graph are updated
+     * afterwards in one pass, the result is the same as with the serial copy
+     * @param dst Top left cell of the destination
+     * @param src Top left cell of the source
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param workers Number of cloning threads
+    */
+    void copyRectParallel(const CPos &dst, const CPos &src, int w, int h, size_t workers);
     size_t hashTableContent(const std::string& str) const;
+    bool loadSnapshot(std::istream &is, std::string &checksum);
+    bool saveSnapshot(std::ostream &os, std::string &checksum, ESaveFormat format) const;
+
+    /**
+     * Writes tagged cells and checksum trailer, the checksum does not depend on the save format
+     * @param writer Stream or block writer
+     * @param checksum Checksum of the body
+    */
+    template <typename TWriter>
+    void writeSnapshot(TWriter &writer, std::string &checksum) const;
+    void markChanged(const std::string &id);
+    std::unique_lock<std::mutex> lockTable() const;
+
+    /**
+     * Takes cells changed since the last recalculation and adds all their transitive dependents
+     * @return Ids of cells that need to be recalculated
+    */
+    std::vector<std::string> collectAffected();
+    void storeSnapshot(const std::vector<std::string> &ids, bool full);
+
+    /**
+     * Marks cell and everything that transitively depends on it for background recalculation
+     * @param id Changed cell
+    */
+    void markDirty(const std::string &id);
+    bool isClean(const std::string &id) const;
+    CValue cachedValue(const std::string &id) const;
+    void resolveWaiters();
+    void recalcWorker();
+
+    /**
+     * Appends rows [fromRow, toRow) of evaluated chunk to output text
+     * @param values Chunk values, row by row
+     * @param w Number of columns
+     * @param fromRow First formatted row
+     * @param toRow Row after the last formatted one
+     * @param format Output format
+     * @param out Output text
+    */
+    static void formatRows(const std::vector<CValue> &values, size_t w, size_t fromRow, size_t toRow, EExportFormat format, std::string &out);
+
+    /**
+     * Appends one value, numbers in the shortest form that reads back exactly, undefined values as empty fields.
+     * CSV quotes texts containing separators, quotes or line breaks, TSV escapes tabs, line breaks and backslashes
+     * @param value Cell value
+     * @param format Output format
+     * @param out Output text
+    */
+    static void formatField(const CValue &value, EExportFormat format, std::string &out);
+
+    /**
+     * Evaluates area row by row and passes every value to the callback
+     * @param topLeft Top left cell of the area
+     * @param w Number of columns
+     * @param h Number of rows
+     * @param store Callback receiving index of the cell within the area and its value
+    */
+    void evaluateRegion(const CPos &topLeft, int w, int h, const std::function<void(size_t, const CValue&)> &store);
 };
 
 class CDependencyChecker {
 public:
-    CDependencyChecker(const std::map<std::string, std::vector<std::string>>& dependencies);
+    /**
+     * @param dependencies Graph of the checked sheet
+     * @param sheets Graphs of other sheets of the workbook, cycles may pass through them
+     * @param sheet Name of the checked sheet in the workbook
+    */
+    CDependencyChecker(const CDependencyGraph& dependencies, const CSheetResolver *sheets = nullptr, const std::string &sheet = "");
+
+    /**
+     * Checks whether the cell lies on a cycle or depends on one. Results are cached,
+     * so one checker can answer queries for many cells of an unchanged sheet
+     * @param vertex Cell id
+     * @return True if the cell value can not be evaluated
+    */
     bool containsCycle(const std::string& vertex);
 
 private:
-    std::map<std::string, std::vector<std::string>> m_Dependencies;
-    std::unordered_set<std::string> visited;
+    const CDependencyGraph& m_Dependencies;
+    const CSheetResolver *m_Sheets;
+    std::string m_Sheet;
+    std::unordered_map<std::string, bool> results;
     std::unordered_set<std::string> recursionStack;
     bool isCyclicUtil(const std::string& vertex);
+
+    /**
+     * Visits precedents of a vertex, vertices of other sheets are qualified by the sheet name
+     * @param vertex Cell id, qualified for cells of other sheets
+     * @param visitor Callback receiving precedents, returning false stops the traversal
+     * @return False if the traversal was stopped
+    */
+    bool forEachPrecedent(const std::string &vertex, const std::function<bool(const std::string&)> &visitor) const;
 };
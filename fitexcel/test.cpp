@@ -1,4 +1,4 @@
-#include "spreadsheet.h"
+#include "workbook.h"
 #ifndef __PROGTEST__
 
 bool valueMatch(const CValue &r, const CValue &s) {
@@ -282,6 +282,1051 @@ int main() {
     assert(valueMatch(x3.getValue(CPos("B2")), CValue(1.0)));
     assert(valueMatch(x3.getValue(CPos("B3")), CValue(2.0)));
     assert(valueMatch(x3.getValue(CPos("C0")), CValue(1.0)));
+
+    CTracer::instance().enable(1024);
+    CSpreadsheet x4;
+    assert(x4.setCell(CPos("A1"), "5"));
+    assert(x4.setCell(CPos("A2"), "=A1*2"));
+    assert(valueMatch(x4.getValue(CPos("A2")), CValue(10.0)));
+    oss.clear();
+    oss.str("");
+    assert(x4.save(oss));
+    CTracer::instance().disable();
+    assert(x4.setCell(CPos("A3"), "=A2"));
+    assert(CTracer::instance().size() > 0);
+    oss.clear();
+    oss.str("");
+    assert(CTracer::instance().dump(oss));
+    data = oss.str();
+    assert(oss.fill() == ' ');
+    assert(data.find("{\"traceEvents\":[") == 0);
+    assert(data.find("\"name\":\"parse\"") != std::string::npos);
+    assert(data.find("\"name\":\"cycleCheck\"") != std::string::npos);
+    assert(data.find("\"name\":\"evaluate\",\"cat\":\"fitexcel\",\"ph\":\"X\"") != std::string::npos);
+    assert(data.find("\"args\":{\"cell\":\"A1\"}") != std::string::npos);
+    assert(data.find("\"args\":{\"cell\":\"A3\"}") == std::string::npos);
+    CTracer::instance().enable(4);
+    assert(valueMatch(x4.getValue(CPos("A3")), CValue(10.0)));
+    assert(valueMatch(x4.getValue(CPos("A3")), CValue(10.0)));
+    CTracer::instance().disable();
+    assert(CTracer::instance().size() == 4);
+    CTracer::instance().clear();
+    assert(CTracer::instance().size() == 0);
+
+    CSpreadsheet x5;
+    assert(x5.setCell(CPos("A1"), "1"));
+    assert(x5.setCell(CPos("B1"), "=A1*2"));
+    assert(x5.setCell(CPos("C1"), "=D1"));
+    assert(x5.setCell(CPos("D1"), "=C1"));
+    x5.setConcurrentReads(true);
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(2.0)));
+    assert(valueMatch(x5.getValue(CPos("C1")), CValue()));
+    assert(x5.setCell(CPos("A1"), "5"));
+    x5.copyRect(CPos("B2"), CPos("B1"));
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(2.0)));
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue()));
+    x5.publish();
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(10.0)));
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue()));
+    assert(x5.setCell(CPos("A2"), "=B1"));
+    assert(x5.setCell(CPos("D1"), "7"));
+    x5.publish();
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue(20.0)));
+    assert(valueMatch(x5.getValue(CPos("C1")), CValue(7.0)));
+
+    std::atomic<bool> done = false;
+    std::atomic<bool> consistent = true;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&x5, &done, &consistent]() {
+            while (!done) {
+                auto snapshot = x5.getSnapshot();
+                CValue a = snapshot->getValue(CPos("A1"));
+                if (!valueMatch(snapshot->getValue(CPos("B1")), CValue(std::get<double>(a) * 2)))
+                    consistent = false;
+                if (!std::holds_alternative<double>(x5.getValue(CPos("B1"))))
+                    consistent = false;
+            }
+        });
+    }
+    for (int i = 0; i < 200; i++) {
+        assert(x5.setCell(CPos("A1"), std::to_string(i)));
+        x5.publish();
+    }
+    done = true;
+    for (auto &reader : readers)
+        reader.join();
+    assert(consistent);
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(398.0)));
+    // Growing sheet is resharded, earlier epochs keep their values
+    auto x5Before = x5.getSnapshot();
+    for (int i = 1; i <= 5000; i++) {
+        assert(x5.setCell(CPos(5, i), std::to_string(i)));
+        if (i % 500 == 0)
+            x5.publish();
+    }
+    auto x5Grown = x5.getSnapshot();
+    assert(x5.setCell(CPos(5, 1234), "=A1"));
+    assert(x5.setCell(CPos("A1"), "-1"));
+    x5.publish();
+    assert(valueMatch(x5Before->getValue(CPos(5, 1234)), CValue()));
+    assert(valueMatch(x5Grown->getValue(CPos(5, 1234)), CValue(1234.0)));
+    assert(valueMatch(x5Grown->getValue(CPos("B1")), CValue(398.0)));
+    assert(valueMatch(x5.getValue(CPos(5, 1234)), CValue(-1.0)));
+    assert(valueMatch(x5.getValue(CPos(5, 4321)), CValue(4321.0)));
+    assert(valueMatch(x5.getValue(CPos("B1")), CValue(-2.0)));
+    assert(x5.setCell(CPos("A1"), "199"));
+    x5.setConcurrentReads(false);
+    assert(x5.getSnapshot() == nullptr);
+    assert(valueMatch(x5.getValue(CPos("B2")), CValue(796.0)));
+
+    CSpreadsheet x6;
+    assert(x6.setCell(CPos("A1"), "1"));
+    assert(x6.setCell(CPos("B1"), "=A1+1"));
+    x6.setAsyncRecalc(true);
+    assert(valueMatch(x6.getValue(CPos("B1")), CValue(2.0)));
+    std::vector<std::future<CValue>> futures;
+    for (int i = 0; i < 100; i++) {
+        assert(x6.setCell(CPos("A1"), std::to_string(i)));
+        futures.push_back(x6.getValueAsync(CPos("B1")));
+    }
+    double previous = 0;
+    for (size_t i = 0; i < futures.size(); i++) {
+        CValue value = futures[i].get();
+        assert(std::holds_alternative<double>(value));
+        assert(std::get<double>(value) >= i + 1 && std::get<double>(value) >= previous);
+        previous = std::get<double>(value);
+    }
+    assert(valueMatch(x6.getValue(CPos("B1")), CValue(100.0)));
+    assert(x6.setCell(CPos("C1"), "=C2"));
+    assert(x6.setCell(CPos("C2"), "=C1+1"));
+    assert(valueMatch(x6.getValueAsync(CPos("C2")).get(), CValue()));
+    x6.copyRect(CPos("B2"), CPos("B1"));
+    assert(x6.setCell(CPos("A2"), "10"));
+    assert(valueMatch(x6.getValue(CPos("B2")), CValue(11.0)));
+    // Readers switched to snapshots never see the empty one published before the worker catches up
+    std::atomic<bool> x6Done = false;
+    std::atomic<bool> x6Defined = true;
+    std::thread x6Reader([&x6, &x6Done, &x6Defined]() {
+        while (!x6Done) {
+            if (!valueMatch(x6.getValue(CPos("B2")), CValue(11.0)))
+                x6Defined = false;
+        }
+    });
+    x6.setConcurrentReads(true);
+    assert(valueMatch(x6.getValue(CPos("B2")), CValue(11.0)));
+    x6Done = true;
+    x6Reader.join();
+    assert(x6Defined);
+    x6.setConcurrentReads(false);
+    CSpreadsheet x7(x6);
+    assert(valueMatch(x7.getValue(CPos("B2")), CValue(11.0)));
+    x7 = x6;
+    assert(valueMatch(x7.getValue(CPos("B1")), CValue(100.0)));
+    assert(x6.setCell(CPos("A2"), "20"));
+    // Pending writes delay only cells depending on them, long chains are recalculated in one pass
+    assert(x6.setCell(CPos("D1"), "1"));
+    for (int row = 2; row <= 3000; row++)
+        assert(x6.setCell(CPos("D" + std::to_string(row)), "=D" + std::to_string(row - 1) + "+1"));
+    assert(valueMatch(x6.getValue(CPos("D3000")), CValue(3000.0)));
+    assert(x6.setCell(CPos("D1"), "2"));
+    assert(x6.getValueAsync(CPos("B1")).wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    assert(valueMatch(x6.getValue(CPos("D3000")), CValue(3001.0)));
+    x6.setAsyncRecalc(false);
+    assert(valueMatch(x6.getValue(CPos("B2")), CValue(21.0)));
+
+    CSpreadsheet x8;
+    assert(x8.setCell(CPos("A1"), "1"));
+    assert(x8.setCell(CPos("B1"), "=A1+1"));
+    assert(x8.setCell(CPos("C1"), "=A1+B1"));
+    assert(x8.setCell(CPos("A2"), "text"));
+    assert(x8.setCell(CPos("B2"), "=C2"));
+    assert(x8.setCell(CPos("C2"), "=B2"));
+    for (int i = 3; i < 40; i++)
+        assert(x8.setCell(CPos("A" + std::to_string(i)), "=A" + std::to_string(i - 1) + "+A" + std::to_string(i - 2)));
+    std::vector<CValue> values(9);
+    assert(!x8.getValues(CPos("A1"), 3, 4, values));
+    assert(x8.getValues(CPos("A1"), 3, 3, values));
+    assert(valueMatch(values[0], CValue(1.0)));
+    assert(valueMatch(values[1], CValue(2.0)));
+    assert(valueMatch(values[2], CValue(3.0)));
+    assert(valueMatch(values[3], CValue("text")));
+    assert(valueMatch(values[4], CValue()));
+    assert(valueMatch(values[5], CValue()));
+    assert(valueMatch(values[6], CValue("text1.000000")));
+    assert(valueMatch(values[8], CValue()));
+    assert(x8.setCell(CPos("A2"), "2"));
+    std::vector<double> numbers(3);
+    std::vector<uint8_t> valid(1);
+    assert(x8.getNumericValues(CPos("C1"), 1, 3, numbers, valid));
+    assert(numbers[0] == 3 && numbers[1] == 0 && numbers[2] == 0);
+    assert(valid[0] == 0x01);
+    assert(x8.getNumericValues(CPos("A37"), 1, 3, numbers, valid));
+    assert(valid[0] == 0x07 && numbers[2] == 102334155 && numbers[1] == 63245986);
+    assert(valueMatch(x8.getValue(CPos("A39")), CValue(102334155.0)));
+
+    CSpreadsheet x9;
+    assert(x9.setCell(CPos("A1"), "10 \t\n"));
+    assert(x9.setCell(CPos("A2"), "  10"));
+    assert(x9.setCell(CPos("A3"), "-1.5e+2"));
+    assert(x9.setCell(CPos("A4"), ".5"));
+    assert(x9.setCell(CPos("A5"), "+5"));
+    assert(x9.setCell(CPos("A6"), "1e400"));
+    assert(x9.setCell(CPos("A7"), "1e-400"));
+    assert(x9.setCell(CPos("A8"), "3e"));
+    assert(x9.setCell(CPos("A9"), "-"));
+    assert(x9.setCell(CPos("A10"), "5."));
+    assert(valueMatch(x9.getValue(CPos("A1")), CValue(10.0)));
+    assert(valueMatch(x9.getValue(CPos("A2")), CValue("  10")));
+    assert(valueMatch(x9.getValue(CPos("A3")), CValue(-150.0)));
+    assert(valueMatch(x9.getValue(CPos("A4")), CValue(".5")));
+    assert(valueMatch(x9.getValue(CPos("A5")), CValue("+5")));
+    assert(valueMatch(x9.getValue(CPos("A6")), CValue()));
+    assert(valueMatch(x9.getValue(CPos("A7")), CValue(0.0)));
+    assert(valueMatch(x9.getValue(CPos("A8")), CValue("3e")));
+    assert(valueMatch(x9.getValue(CPos("A9")), CValue("-")));
+    assert(valueMatch(x9.getValue(CPos("A10")), CValue(5.0)));
+    assert(!x9.setCell(CPos("B1"), "=1+"));
+    assert(x9.setCell(CPos("B1"), "=A1+A3"));
+    x9.copyRect(CPos("C1"), CPos("A1"), 2, 2);
+    assert(valueMatch(x9.getValue(CPos("C1")), CValue(10.0)));
+    assert(valueMatch(x9.getValue(CPos("C2")), CValue("  10")));
+    assert(valueMatch(x9.getValue(CPos("D1")), CValue()));
+    assert(x9.setCell(CPos("C3"), "=A3"));
+    assert(valueMatch(x9.getValue(CPos("D1")), CValue(-140.0)));
+    oss.clear();
+    oss.str("");
+    assert(x9.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue(10.0)));
+    assert(valueMatch(x1.getValue(CPos("A2")), CValue("  10")));
+    assert(valueMatch(x1.getValue(CPos("D1")), CValue(-140.0)));
+
+    static_assert("B12"_pos.getColumnNumber() == 2 && "B12"_pos.getRow() == 12);
+    static_assert("zz0"_pos.getIdView() == "ZZ0");
+    static_assert(CPos(18279, 7).getIdView() == "AAAA7");
+    assert("prog7250"_pos.getId() == "PROG7250");
+    assert(CPos("aAa12").getColumn() == "AAA" && CPos("aAa12").getColumnNumber() == 703);
+    assert(CPos::numberToColumn(702) == "ZZ");
+    assert(CPos("A1").columnToNumber("ZZ") == 702);
+    assert(CPos("A18446744073709551615").getRow() == SIZE_MAX);
+    for (const char *id : {"", "A", "12", "A01", "A1B", "$A1", "A 1", "A-1", "A18446744073709551616", "AAAAAAAAAAAAAAA1"}) {
+        try {
+            CPos pos(id);
+            assert(false);
+        } catch (std::invalid_argument &e) {
+        }
+    }
+    CSpreadsheet x10;
+    assert(x10.setCell(CPos("a1"), "4"));
+    assert(x10.setCell("B1"_pos, "=A1*2"));
+    assert(valueMatch(x10.getValue("A1"_pos), CValue(4.0)));
+    assert(valueMatch(x10.getValue(CPos("b1")), CValue(8.0)));
+
+    CSpreadsheet x11;
+    for (int i = 1; i <= 100; i++)
+        assert(x11.setCell(CPos(1, i), std::to_string(i)));
+    assert(x11.setCell(CPos("A50"), "text"));
+    assert(x11.setCell(CPos("B1"), "=sum(A1:A100)"));
+    assert(x11.setCell(CPos("B2"), "=count(A100:A1)"));
+    assert(x11.setCell(CPos("B3"), "=min(A1:A100)"));
+    assert(x11.setCell(CPos("B4"), "=max($A$1:A100)"));
+    assert(x11.setCell(CPos("B5"), "=countval(7, A1:A100)"));
+    assert(x11.setCell(CPos("B6"), "=if(B5, \"yes\", 1 / 0)"));
+    assert(x11.setCell(CPos("B7"), "=countval(A200, A99:A102)"));
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue(5000.0)));
+    assert(valueMatch(x11.getValue(CPos("B2")), CValue(100.0)));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue(1.0)));
+    assert(valueMatch(x11.getValue(CPos("B4")), CValue(100.0)));
+    assert(valueMatch(x11.getValue(CPos("B5")), CValue(1.0)));
+    assert(valueMatch(x11.getValue(CPos("B6")), CValue("yes")));
+    assert(valueMatch(x11.getValue(CPos("B7")), CValue(2.0)));
+    assert(valueMatch(x11.getValue(CPos("B8")), CValue()));
+    x11.copyRect(CPos("B11"), CPos("B1"), 1, 4);
+    assert(valueMatch(x11.getValue(CPos("B11")), CValue(4945.0)));
+    assert(valueMatch(x11.getValue(CPos("B12")), CValue(90.0)));
+    assert(valueMatch(x11.getValue(CPos("B13")), CValue(11.0)));
+    assert(valueMatch(x11.getValue(CPos("B14")), CValue(100.0)));
+    // Cycle closed through a range is detected without expanding the range
+    assert(x11.setCell(CPos("A60"), "=B1"));
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue()));
+    assert(valueMatch(x11.getValue(CPos("B7")), CValue(2.0)));
+    assert(x11.setCell(CPos("A60"), "60"));
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue(5000.0)));
+    // Range dependents are found by the index when publishing
+    x11.setConcurrentReads(true);
+    assert(x11.setCell(CPos("A70"), "-1000"));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue(1.0)));
+    x11.publish();
+    assert(valueMatch(x11.getValue(CPos("B1")), CValue(5000.0 - 1070)));
+    assert(valueMatch(x11.getValue(CPos("B3")), CValue(-1000.0)));
+    assert(valueMatch(x11.getValue(CPos("B13")), CValue(-1000.0)));
+    x11.setConcurrentReads(false);
+
+    CSpreadsheet x12, x13;
+    std::ostringstream snapshot, journal;
+    assert(x12.setCell(CPos("A1"), "10"));
+    assert(x12.setCell(CPos("A2"), "=A1*2"));
+    assert(x12.compact(snapshot, journal));
+    std::string emptyJournal = journal.str();
+    assert(x12.setCell(CPos("A1"), "20"));
+    assert(x12.setCell(CPos("B1"), "multi\nline text"));
+    x12.copyRect(CPos("C1"), CPos("A1"), 1, 2);
+    assert(!x12.setCell(CPos("B1"), "=1+"));
+    assert(x12.setCell(CPos("D1"), "=C2+1"));
+    std::string fullJournal = journal.str();
+    std::istringstream snapshotIn(snapshot.str()), journalIn(fullJournal);
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("A2")), CValue(40.0)));
+    assert(valueMatch(x13.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x13.getValue(CPos("C2")), CValue(40.0)));
+    assert(valueMatch(x13.getValue(CPos("D1")), CValue(41.0)));
+    // Torn last record is dropped, the rest is replayed
+    snapshotIn = std::istringstream(snapshot.str());
+    journalIn = std::istringstream(fullJournal.substr(0, fullJournal.size() - 3));
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("C2")), CValue(40.0)));
+    assert(valueMatch(x13.getValue(CPos("D1")), CValue()));
+    // Corrupted record stops the replay
+    std::string corruptedJournal = fullJournal;
+    corruptedJournal[emptyJournal.size() + 25] ^= 1;
+    snapshotIn = std::istringstream(snapshot.str());
+    journalIn = std::istringstream(corruptedJournal);
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("A2")), CValue(20.0)));
+    assert(valueMatch(x13.getValue(CPos("C2")), CValue()));
+    // Compaction folds the journal into a new snapshot, old journal does not match it
+    std::ostringstream snapshot2, journal2;
+    assert(x12.compact(snapshot2, journal2));
+    snapshotIn = std::istringstream(snapshot2.str());
+    journalIn = std::istringstream(fullJournal);
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("D1")), CValue(41.0)));
+    assert(valueMatch(x13.getValue(CPos("A1")), CValue(20.0)));
+    x12.stopJournal();
+    assert(x12.setCell(CPos("A1"), "30"));
+    assert(journal2.str().find("S") == std::string::npos);
+    // Assignment stops the journal, later writes would be replayed against the wrong snapshot
+    std::ostringstream snapshot3, journal3;
+    assert(x12.compact(snapshot3, journal3));
+    std::string assignedJournal = journal3.str();
+    CSpreadsheet x12b;
+    assert(x12b.setCell(CPos("Z9"), "9"));
+    x12 = x12b;
+    assert(x12.setCell(CPos("B1"), "2"));
+    assert(journal3.str() == assignedJournal);
+    snapshotIn = std::istringstream(snapshot3.str());
+    journalIn = std::istringstream(journal3.str());
+    assert(x13.load(snapshotIn, journalIn));
+    assert(valueMatch(x13.getValue(CPos("A1")), CValue(30.0)));
+    assert(valueMatch(x13.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x12.getValue(CPos("Z9")), CValue(9.0)));
+    assert(valueMatch(x12.getValue(CPos("A1")), CValue()));
+
+    CSpreadsheet x14;
+    std::string longText(200000, 'x');
+    assert(x14.setCell(CPos("A1"), longText));
+    assert(x14.setCell(CPos("A2"), "=A1+\"y\""));
+    oss.clear();
+    oss.str("");
+    assert(x14.save(oss));
+    data = oss.str();
+    assert(data.compare(data.size() - 7, 7, "</TAIL>") == 0);
+    iss.clear();
+    iss.str(data);
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A2")), CValue(longText + "y")));
+    data[100] ^= 1;
+    iss.clear();
+    iss.str(data);
+    assert(!x1.load(iss));
+    oss.clear();
+    oss.str("");
+    assert(CSpreadsheet().save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue()));
+    // Files with checksum in the header are still accepted
+    std::string legacyBody = "<ID>A1</ID><VAL>=2*3</VAL>";
+    iss.clear();
+    iss.str("<HEAD>" + std::to_string(std::hash<std::string>()(legacyBody)) + "</HEAD>" + legacyBody);
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue(6.0)));
+
+    CSpreadsheet x15;
+    const char *formulas[] = {"=A20+A29", "=-2^2", "=(-2)^2", "=2^3^2", "=2^(3^2)", "=1-(2-3)", "=-(1+2)*3",
+                              "=2*-A20", "=\"a\"\"b\"+A20", "=$A20+A$29+$A$20", "=sum($A20:A29)", "=countval(A20 > 1, A20:A29) <> 0",
+                              "=if(A20 < A29, 1 / 3, 1e22)", "=(1 < 2) < 3", "=1 < (2 < 3)"};
+    for (size_t i = 0; i < std::size(formulas); i++)
+        assert(x15.setCell(CPos(1, i + 1), formulas[i]));
+    for (int i = 20; i <= 39; i++) {
+        assert(x15.setCell(CPos(1, i), std::to_string(i)));
+        assert(x15.setCell(CPos(2, i), std::to_string(2 * i)));
+    }
+    x15.copyRect(CPos("B1"), CPos("A1"), 1, std::size(formulas));
+    oss.clear();
+    oss.str("");
+    assert(x15.save(oss));
+    data = oss.str();
+    // Copies are regenerated from AST, A2 inside A20 is no longer rewritten
+    assert(data.find("<ID>B1</ID><VAL>=B20+B29</VAL>") != std::string::npos);
+    assert(data.find("<VAL>=$A20+B$29+$A$20</VAL>") != std::string::npos);
+    assert(data.find("<VAL>=sum($A20:B29)</VAL>") != std::string::npos);
+    assert(data.find("<VAL>=(-2)^2</VAL>") != std::string::npos);
+    iss.clear();
+    iss.str(data);
+    assert(x1.load(iss));
+    for (size_t i = 1; i <= std::size(formulas); i++) {
+        assert(valueMatch(x1.getValue(CPos(1, i)), x15.getValue(CPos(1, i))));
+        assert(valueMatch(x1.getValue(CPos(2, i)), x15.getValue(CPos(2, i))));
+    }
+    assert(valueMatch(x15.getValue(CPos("B2")), CValue(-4.0)));
+    assert(valueMatch(x15.getValue(CPos("B3")), CValue(4.0)));
+    assert(valueMatch(x15.getValue(CPos("B4")), CValue(64.0)));
+    assert(valueMatch(x15.getValue(CPos("B9")), CValue("a\"b40.000000")));
+
+    CSpreadsheet x16;
+    x16.setAstBudget(16);
+    assert(x16.setCell(CPos("A1"), "1"));
+    for (int i = 2; i <= 100; i++)
+        assert(x16.setCell(CPos(1, i), "=A" + std::to_string(i - 1) + "+1"));
+    assert(x16.setCell(CPos("B1"), "=sum(A1:A100)"));
+    CAstStats astStats = x16.getAstStats();
+    assert(astStats.m_Resident <= 16 && astStats.m_Evictions >= 84 && astStats.m_Reparses == 0);
+    assert(valueMatch(x16.getValue(CPos("B1")), CValue(5050.0)));
+    astStats = x16.getAstStats();
+    assert(astStats.m_Resident <= 16 && astStats.m_Reparses >= 84);
+    // Evicted cells keep cycle detection, copying and saving working
+    assert(x16.setCell(CPos("A1"), "=A100"));
+    assert(valueMatch(x16.getValue(CPos("A50")), CValue()));
+    assert(x16.setCell(CPos("A1"), "1"));
+    x16.copyRect(CPos("C2"), CPos("A2"), 1, 99);
+    assert(valueMatch(x16.getValue(CPos("C100")), CValue()));
+    assert(x16.setCell(CPos("C1"), "10"));
+    assert(valueMatch(x16.getValue(CPos("C100")), CValue(109.0)));
+    oss.clear();
+    oss.str("");
+    assert(x16.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("C100")), CValue(109.0)));
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue(5050.0)));
+    x16.setAstBudget(0);
+    assert(valueMatch(x16.getValue(CPos("B1")), CValue(5050.0)));
+    assert(x16.getAstStats().m_Resident >= 100);
+    // Overwritten and removed ASTs are no longer counted, so staying within budget evicts nothing
+    CSpreadsheet x16b;
+    x16b.setAstBudget(16);
+    for (int i = 1; i <= 15; i++)
+        assert(x16b.setCell(CPos(1, i), "=" + std::to_string(i) + "+1"));
+    for (int i = 0; i < 100; i++) {
+        assert(x16b.setCell(CPos("A1"), "=" + std::to_string(i) + "*2"));
+        assert(x16b.setCell(CPos("B1"), "=A1"));
+        assert(x16b.setCell(CPos("B1"), "x"));
+    }
+    x16b.copyRect(CPos("A2"), CPos("A1"), 1, 1);
+    x16b.moveRect(CPos("A3"), CPos("A4"), 1, 1);
+    assert(x16b.deleteRows(5));
+    astStats = x16b.getAstStats();
+    assert(astStats.m_Resident == 13 && astStats.m_Evictions == 0);
+    assert(valueMatch(x16b.getValue(CPos("A2")), CValue(198.0)));
+
+    CSpreadsheet x17;
+    assert(x17.setCell(CPos("A1"), "1"));
+    assert(x17.setCell(CPos("A2"), "=A1*2"));
+    assert(x17.setCell(CPos("A3"), "=A1>0"));
+    assert(x17.setCell(CPos("B1"), "=A1+A2"));
+    size_t notifications = 0;
+    std::vector<std::pair<CPos, CValue>> changes;
+    size_t subscription = x17.subscribe(CPos("A2"), 1, 2, [&](const std::vector<std::pair<CPos, CValue>> &cells) {
+        notifications++;
+        changes = cells;
+    });
+    assert(subscription != 0);
+    // Only changed cells of the area are reported, once per write
+    assert(x17.setCell(CPos("A1"), "5"));
+    assert(notifications == 1 && changes.size() == 1);
+    assert(changes[0].first.getId() == "A2" && valueMatch(changes[0].second, CValue(10.0)));
+    assert(x17.setCell(CPos("A1"), "=10/2"));
+    assert(notifications == 1);
+    assert(x17.setCell(CPos("A1"), "-1"));
+    assert(notifications == 2 && changes.size() == 2);
+    assert(valueMatch(changes[1].second, CValue(0.0)));
+    assert(x17.setCell(CPos("A3"), "=A3"));
+    assert(notifications == 3 && changes.size() == 1 && valueMatch(changes[0].second, CValue()));
+    x17.copyRect(CPos("A3"), CPos("A2"));
+    assert(notifications == 4 && changes.size() == 1 && valueMatch(changes[0].second, CValue(-4.0)));
+    x17.unsubscribe(subscription);
+    assert(x17.setCell(CPos("A1"), "7"));
+    assert(notifications == 4);
+    // With concurrent reads changes are delivered by publish
+    x17.subscribe(CPos("B1"), 1, 1, [&](const std::vector<std::pair<CPos, CValue>> &cells) {
+        notifications++;
+        changes = cells;
+    });
+    x17.setConcurrentReads(true);
+    assert(x17.setCell(CPos("A1"), "1"));
+    assert(notifications == 4);
+    x17.publish();
+    assert(notifications == 5 && changes.size() == 1 && valueMatch(changes[0].second, CValue(3.0)));
+    x17.setConcurrentReads(false);
+
+    CSpreadsheet x18;
+    assert(x18.setCell(CPos("A1"), "0.1"));
+    assert(x18.setCell(CPos("B1"), "=A1*3"));
+    assert(x18.setCell(CPos("C1"), "say \"hi\", bye"));
+    assert(x18.setCell(CPos("A2"), "tab\there"));
+    assert(x18.setCell(CPos("C2"), "=C2"));
+    oss.clear();
+    oss.str("");
+    assert(x18.exportValues(oss, CPos("A1"), 3, 2));
+    assert(oss.str() == "0.1,0.30000000000000004,\"say \"\"hi\"\", bye\"\ntab\there,,\n");
+    oss.clear();
+    oss.str("");
+    assert(x18.exportValues(oss, CPos("A1"), 3, 2, EExportFormat::TSV));
+    assert(oss.str() == "0.1\t0.30000000000000004\tsay \"hi\", bye\ntab\\there\t\t\n");
+    // Large areas are split into chunks and slices without changing the output
+    for (int i = 1; i <= 30000; i++)
+        assert(x18.setCell(CPos(4, i), "=" + std::to_string(i) + "/4"));
+    oss.clear();
+    oss.str("");
+    assert(x18.exportValues(oss, CPos("D1"), 3, 30000));
+    std::string exported = oss.str();
+    assert(std::count(exported.begin(), exported.end(), '\n') == 30000);
+    assert(exported.compare(0, 12, "0.25,,\n0.5,,") == 0);
+    assert(exported.ends_with("\n7500,,\n"));
+    assert(!x18.exportValues(oss, CPos("A1"), -1, 2));
+
+    // Fields crossing chunk boundaries are assembled the same way
+    const std::string csv = "1,\"a,\"\"b\"\"\",=A1*2\r\n,x\r\n\"multi\nline\"\n=sum(A1:A2)+,3e2";
+    for (size_t capacity : {1, 2, 3, 1000}) {
+        iss.clear();
+        iss.str(csv);
+        CCsvReader reader(iss, capacity);
+        std::vector<std::pair<std::string, bool>> fields;
+        std::string_view field;
+        bool lastInRow;
+        while (reader.next(field, lastInRow))
+            fields.emplace_back(field, lastInRow);
+        assert(reader.isValid());
+        assert((fields == std::vector<std::pair<std::string, bool>>{{"1", false}, {"a,\"b\"", false}, {"=A1*2", true}, {"", false},
+                {"x", true}, {"multi\nline", true}, {"=sum(A1:A2)+", false}, {"3e2", true}}));
+    }
+
+    CSpreadsheet x19;
+    assert(x19.setCell(CPos("B4"), "=1/0"));
+    assert(x19.setCell(CPos("A2"), "keep"));
+    iss.clear();
+    iss.str(csv);
+    assert(x19.importCsv(iss, CPos("A1")));
+    assert(valueMatch(x19.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x19.getValue(CPos("B1")), CValue("a,\"b\"")));
+    assert(valueMatch(x19.getValue(CPos("C1")), CValue(2.0)));
+    assert(valueMatch(x19.getValue(CPos("A2")), CValue("keep")));
+    assert(valueMatch(x19.getValue(CPos("B2")), CValue("x")));
+    assert(valueMatch(x19.getValue(CPos("A3")), CValue("multi\nline")));
+    assert(valueMatch(x19.getValue(CPos("A4")), CValue()));
+    assert(valueMatch(x19.getValue(CPos("B4")), CValue(300.0)));
+    iss.clear();
+    iss.str("\"open");
+    assert(!x19.importCsv(iss, CPos("A10")));
+    assert(valueMatch(x19.getValue(CPos("A10")), CValue("open")));
+    // Enough formulas to be parsed by several threads
+    std::string rows;
+    for (int i = 1; i <= 5000; i++)
+        rows += std::to_string(i) + ",=A" + std::to_string(i) + "*2\n";
+    iss.clear();
+    iss.str(rows);
+    assert(x19.importCsv(iss, CPos("A1")));
+    assert(valueMatch(x19.getValue(CPos("B5000")), CValue(10000.0)));
+    assert(valueMatch(x19.getValue(CPos("C1")), CValue(2.0)));
+
+    CSpreadsheet x20;
+    assert(x20.setCell(CPos("A1"), "10"));
+    assert(x20.setCell(CPos("A2"), "20"));
+    assert(x20.setCell(CPos("A3"), "30"));
+    assert(x20.setCell(CPos("B1"), "=sum(A1:A3)"));
+    assert(x20.setCell(CPos("B2"), "=$A$3*2"));
+    assert(x20.setCell(CPos("B3"), "=A2"));
+    CSpreadsheet x20Copy(x20);
+    snapshot.str("");
+    journal.str("");
+    assert(x20.compact(snapshot, journal));
+    // Ranges spanning inserted rows grow, absolute references move with their cells
+    assert(x20.insertRows(2, 2));
+    assert(valueMatch(x20.getValue(CPos("A2")), CValue()));
+    assert(valueMatch(x20.getValue(CPos("A5")), CValue(30.0)));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue(60.0)));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue(60.0)));
+    assert(valueMatch(x20.getValue(CPos("B5")), CValue(20.0)));
+    assert(x20.setCell(CPos("A3"), "5"));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue(65.0)));
+    // Moved formulas are copied relative to their new position
+    x20.copyRect(CPos("C5"), CPos("B5"));
+    assert(valueMatch(x20.getValue(CPos("C5")), CValue(60.0)));
+    assert(valueMatch(x20Copy.getValue(CPos("B1")), CValue(60.0)));
+    assert(valueMatch(x20Copy.getValue(CPos("B3")), CValue(20.0)));
+    // References to deleted cells become undefined, also after save and load
+    assert(x20.deleteRows(4));
+    assert(valueMatch(x20.getValue(CPos("A4")), CValue(30.0)));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue(45.0)));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x20.getValue(CPos("C4")), CValue()));
+    assert(valueMatch(x20.getValue(CPos("B3")), CValue()));
+    assert(x20.setCell(CPos("A4"), "1"));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue()));
+    assert(x20.insertColumns(1));
+    assert(valueMatch(x20.getValue(CPos("C1")), CValue(16.0)));
+    assert(valueMatch(x20.getValue(CPos("B4")), CValue(1.0)));
+    assert(x20.deleteColumns(2));
+    assert(valueMatch(x20.getValue(CPos("B1")), CValue()));
+    assert(!x20.deleteColumns(0));
+    assert(!x20.deleteRows(0));
+    assert(!x20.insertRows(0));
+    oss.clear();
+    oss.str("");
+    assert(x20.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x1.load(iss));
+    assert(valueMatch(x1.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x1.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x1.getValue(CPos("A1")), CValue()));
+    // Structural edits are journaled
+    snapshotIn.clear();
+    snapshotIn.str(snapshot.str());
+    journalIn.clear();
+    journalIn.str(journal.str());
+    assert(x13.load(snapshotIn, journalIn));
+    std::ostringstream replayed;
+    assert(x13.save(replayed));
+    assert(replayed.str() == oss.str());
+
+    CSpreadsheet x21;
+    snapshot.str("");
+    journal.str("");
+    assert(x21.compact(snapshot, journal));
+    for (int i = 1; i <= 5; i++)
+        assert(x21.setCell(CPos(1, i), std::to_string(i)));
+    // Overlapping copies read every cell before overwriting it
+    x21.copyRect(CPos("A2"), CPos("A1"), 1, 4);
+    assert(valueMatch(x21.getValue(CPos("A3")), CValue(2.0)));
+    assert(valueMatch(x21.getValue(CPos("A5")), CValue(4.0)));
+    x21.copyRect(CPos("A1"), CPos("A2"), 1, 4);
+    assert(valueMatch(x21.getValue(CPos("A1")), CValue(1.0)));
+    assert(valueMatch(x21.getValue(CPos("A4")), CValue(4.0)));
+    assert(x21.setCell(CPos("C1"), "=1"));
+    assert(x21.setCell(CPos("C2"), "=C1+1"));
+    assert(x21.setCell(CPos("C3"), "=C2+1"));
+    x21.copyRect(CPos("C2"), CPos("C1"), 1, 3);
+    assert(valueMatch(x21.getValue(CPos("C2")), CValue(1.0)));
+    assert(valueMatch(x21.getValue(CPos("C4")), CValue(3.0)));
+    // Moved cells are followed by references, ranges only when they lie inside the block
+    assert(x21.setCell(CPos("D1"), "5"));
+    assert(x21.setCell(CPos("D2"), "=D1*2"));
+    assert(x21.setCell(CPos("E1"), "=D1+D2"));
+    assert(x21.setCell(CPos("E2"), "=sum(D1:D2)"));
+    assert(x21.setCell(CPos("E3"), "=sum(D1:D5)"));
+    x21.moveRect(CPos("F10"), CPos("D1"), 1, 2);
+    assert(valueMatch(x21.getValue(CPos("D1")), CValue()));
+    assert(valueMatch(x21.getValue(CPos("F11")), CValue(10.0)));
+    assert(valueMatch(x21.getValue(CPos("E1")), CValue(15.0)));
+    assert(valueMatch(x21.getValue(CPos("E2")), CValue(15.0)));
+    assert(valueMatch(x21.getValue(CPos("E3")), CValue()));
+    assert(x21.setCell(CPos("G1"), "1"));
+    assert(x21.setCell(CPos("H1"), "=G1"));
+    x21.moveRect(CPos("G1"), CPos("F10"));
+    assert(valueMatch(x21.getValue(CPos("H1")), CValue(5.0)));
+    assert(valueMatch(x21.getValue(CPos("F11")), CValue(10.0)));
+    // Moved formula is copied relative to its new position
+    x21.moveRect(CPos("A20"), CPos("F11"));
+    x21.copyRect(CPos("A21"), CPos("A20"));
+    assert(valueMatch(x21.getValue(CPos("A20")), CValue(10.0)));
+    assert(valueMatch(x21.getValue(CPos("A21")), CValue()));
+    assert(x21.setCell(CPos("G2"), "7"));
+    assert(valueMatch(x21.getValue(CPos("A21")), CValue(14.0)));
+    assert(valueMatch(x21.getValue(CPos("E1")), CValue(15.0)));
+    oss.clear();
+    oss.str("");
+    assert(x21.save(oss));
+    snapshotIn.clear();
+    snapshotIn.str(snapshot.str());
+    journalIn.clear();
+    journalIn.str(journal.str());
+    assert(x13.load(snapshotIn, journalIn));
+    replayed.str("");
+    assert(x13.save(replayed));
+    assert(replayed.str() == oss.str());
+
+    // Large copies give the same sheet as copying column by column
+    CSpreadsheet x22, x22Serial;
+    for (CSpreadsheet *sheet : {&x22, &x22Serial}) {
+        assert(sheet->setCell(CPos("A1"), "1"));
+        assert(sheet->setCell(CPos("B1"), "=A1+$A$1"));
+        assert(sheet->setCell(CPos("A2"), "=sum(A$1:A1)"));
+        assert(sheet->setCell(CPos("B2"), "text"));
+        for (int i = 3; i <= 60; i++)
+            assert(sheet->setCell(CPos(1, i), "=A" + std::to_string(i - 1) + "*2"));
+    }
+    x22.copyRect(CPos("C1"), CPos("A1"), 2, 60);
+    x22.copyRect(CPos("B1"), CPos("A1"), 100, 60, 4);
+    for (int i = 0; i < 2; i++)
+        x22Serial.copyRect(CPos(3 + i, 1), CPos(1 + i, 1), 1, 60);
+    for (int i = 99; i >= 0; i--)
+        x22Serial.copyRect(CPos(2 + i, 1), CPos(1 + i, 1), 1, 60);
+    oss.clear();
+    oss.str("");
+    assert(x22.save(oss));
+    replayed.str("");
+    assert(x22Serial.save(replayed));
+    assert(replayed.str() == oss.str());
+    assert(valueMatch(x22.getValue(CPos("B2")), CValue(1.0)));
+
+    // Fused reference and number operations behave like the generic ones
+    CSpreadsheet x23;
+    assert(x23.setCell(CPos("A1"), "10"));
+    assert(x23.setCell(CPos("A2"), "4"));
+    assert(x23.setCell(CPos("A3"), "text"));
+    assert(x23.setCell(CPos("B1"), "=A1+A2"));
+    assert(x23.setCell(CPos("B2"), "=A1-2.5"));
+    assert(x23.setCell(CPos("B3"), "=3*$A$2"));
+    assert(x23.setCell(CPos("B4"), "=A1/A5"));
+    assert(x23.setCell(CPos("B5"), "=A3+A2"));
+    assert(x23.setCell(CPos("B6"), "=A$1/0"));
+    assert(x23.setCell(CPos("B7"), "=1-A2-A1"));
+    assert(valueMatch(x23.getValue(CPos("B1")), CValue(14.0)));
+    assert(valueMatch(x23.getValue(CPos("B2")), CValue(7.5)));
+    assert(valueMatch(x23.getValue(CPos("B3")), CValue(12.0)));
+    assert(valueMatch(x23.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B5")), CValue("text4.000000")));
+    assert(valueMatch(x23.getValue(CPos("B6")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B7")), CValue(-13.0)));
+    x23.copyRect(CPos("C2"), CPos("B1"), 1, 3);
+    assert(valueMatch(x23.getValue(CPos("C2")), CValue(19.5)));
+    assert(valueMatch(x23.getValue(CPos("C3")), CValue(5.0)));
+    assert(valueMatch(x23.getValue(CPos("C4")), CValue(12.0)));
+    assert(x23.setCell(CPos("B2"), "4"));
+    assert(valueMatch(x23.getValue(CPos("C2")), CValue(16.0)));
+    oss.clear();
+    oss.str("");
+    assert(x23.save(oss));
+    assert(oss.str().find("=B2+B3") != std::string::npos);
+    assert(oss.str().find("=3*$A$2") != std::string::npos);
+    assert(oss.str().find("=1-A2-A1") != std::string::npos);
+    assert(x23.setCell(CPos("D4"), "=A1*2"));
+    assert(x23.deleteRows(2));
+    assert(valueMatch(x23.getValue(CPos("B1")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B2")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B4")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("B6")), CValue()));
+    assert(valueMatch(x23.getValue(CPos("D3")), CValue(20.0)));
+    assert(x23.setCell(CPos("A2"), "5"));
+    assert(valueMatch(x23.getValue(CPos("B1")), CValue()));
+
+    // Compacted dependency graph keeps answering like the map based one
+    CDependencyGraph graph;
+    graph.setDependencies(CPos("B1"), {"A1", "A2"});
+    graph.setDependencies(CPos("C1"), {"B1", "A1:B3"});
+    graph.setDependencies(CPos("B3"), {"A3"});
+    graph.setDependencies(CPos("A9"), {"A8"});
+    graph.compact();
+    graph.setDependencies(CPos("D1"), {"A1"});
+    graph.erase(CPos("B1"));
+    std::set<std::string> visited;
+    graph.forEachDependent(CPos("A1"), [&visited](const std::string &id) {
+        visited.insert(id);
+    });
+    assert(visited == std::set<std::string>({"C1", "D1"}));
+    visited.clear();
+    graph.forEachPrecedent("C1", [&visited](const std::string &id) {
+        visited.insert(id);
+        return true;
+    });
+    assert(visited == std::set<std::string>({"B1", "B3"}));
+    graph.compact();
+    visited.clear();
+    graph.forEachDependent(CPos("A3"), [&visited](const std::string &id) {
+        visited.insert(id);
+    });
+    assert(visited == std::set<std::string>({"B3", "C1"}));
+    visited.clear();
+    graph.forEachPrecedent("C1", [&visited](const std::string &id) {
+        visited.insert(id);
+        return true;
+    });
+    assert(visited == std::set<std::string>({"B1", "B3"}));
+    assert(graph.isShifted("C1", CShift{false, true, 2, 1}));
+    assert(!graph.isShifted("D1", CShift{false, true, 2, 1}));
+
+    CSpreadsheet x24;
+    assert(x24.setCell(CPos("A1"), "=B1+1"));
+    assert(x24.setCell(CPos("B1"), "=sum(C1:C5)"));
+    assert(x24.setCell(CPos("C2"), "2"));
+    oss.clear();
+    oss.str("");
+    assert(x24.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert(x24.load(iss));
+    assert(valueMatch(x24.getValue(CPos("A1")), CValue(3.0)));
+    assert(x24.setCell(CPos("C3"), "=A1"));
+    assert(valueMatch(x24.getValue(CPos("A1")), CValue()));
+    assert(x24.setCell(CPos("C3"), "5"));
+    assert(valueMatch(x24.getValue(CPos("A1")), CValue(8.0)));
+
+    // Sheets of a workbook reference each other by qualified references
+    CWorkbook x25;
+    assert(x25.addSheet("Data"));
+    assert(x25.addSheet("Q1 data"));
+    assert(x25.addSheet("Report"));
+    assert(!x25.addSheet("Data"));
+    assert(!x25.addSheet("a!b"));
+    assert(x25.setCell("Data", CPos("A1"), "10"));
+    assert(x25.setCell("Data", CPos("A2"), "=A1*2"));
+    assert(x25.setCell("Q1 data", CPos("B1"), "5"));
+    assert(x25.setCell("Report", CPos("A1"), "=Data!A2+'Q1 data'!B1"));
+    assert(x25.setCell("Report", CPos("A2"), "=sum(Data!A1:A2) + data!A1"));
+    assert(x25.setCell("Report", CPos("A3"), "=\"Data!A1\"+Missing!A1"));
+    assert(!x25.setCell("Report", CPos("A4"), "=$Data!A1"));
+    assert(!x25.setCell("Report", CPos("A5"), "=Data!sum(A1:A2)"));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue(25.0)));
+    assert(valueMatch(x25.getValue("Report", CPos("A2")), CValue()));
+    assert(valueMatch(x25.getValue("Report", CPos("A3")), CValue()));
+    assert(x25.setCell("Report", CPos("A2"), "=sum(Data!A1:A2) + Data!$A$1 + Data!A$1 + Data!$A1"));
+    assert(valueMatch(x25.getValue("Report", CPos("A2")), CValue(60.0)));
+    x25.getSheet("Report")->copyRect(CPos("B1"), CPos("A1"), 1, 2);
+    assert(x25.setCell("Data", CPos("B1"), "1"));
+    assert(x25.setCell("Data", CPos("B2"), "2"));
+    assert(x25.setCell("Q1 data", CPos("C1"), "4"));
+    assert(valueMatch(x25.getValue("Report", CPos("B1")), CValue(6.0)));
+    assert(valueMatch(x25.getValue("Report", CPos("B2")), CValue(24.0)));
+    // Cycle passing through two sheets
+    assert(x25.setCell("Data", CPos("A1"), "=Report!A1"));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue()));
+    assert(valueMatch(x25.getValue("Data", CPos("A2")), CValue()));
+    assert(x25.setCell("Data", CPos("A1"), "=sum(Report!C1:C2)"));
+    assert(x25.setCell("Report", CPos("C2"), "=Data!A2"));
+    assert(valueMatch(x25.getValue("Data", CPos("A1")), CValue()));
+    assert(x25.setCell("Report", CPos("C2"), "3"));
+    assert(valueMatch(x25.getValue("Data", CPos("A1")), CValue(3.0)));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue(11.0)));
+    oss.clear();
+    oss.str("");
+    assert(x25.save(oss));
+    assert(oss.str().find("=Data!A2+'Q1 data'!B1") != std::string::npos);
+    CWorkbook x25Loaded;
+    iss.clear();
+    iss.str(oss.str());
+    assert(x25Loaded.load(iss));
+    assert(x25Loaded.getSheetNames() == std::vector<std::string>({"Data", "Q1 data", "Report"}));
+    assert(valueMatch(x25Loaded.getValue("Report", CPos("A1")), CValue(11.0)));
+    assert(x25.addSheet("Alone"));
+    assert(x25.setCell("Alone", CPos("A1"), "=A2+1"));
+    assert(x25.setCell("Alone", CPos("A2"), "2"));
+    auto recalculated = x25.recalculate();
+    assert(recalculated.size() == 4);
+    assert(valueMatch(recalculated["Report"]->getValue(CPos("A1")), CValue(11.0)));
+    assert(valueMatch(recalculated["Alone"]->getValue(CPos("A1")), CValue(3.0)));
+    assert(x25.removeSheet("Q1 data"));
+    assert(valueMatch(x25.getValue("Report", CPos("A1")), CValue()));
+    iss.clear();
+    iss.str("3 Bad 5\nxx");
+    assert(!x25Loaded.load(iss));
+    iss.clear();
+    iss.str("99999999999999 a 1\n");
+    assert(!x25Loaded.load(iss));
+    iss.clear();
+    iss.str("3 Bad 99999999999999\nxx");
+    assert(!x25Loaded.load(iss));
+    assert(x25Loaded.getSheetNames().size() == 3);
+    // Block compressed saves load the same cells and reject damaged blocks
+    CSpreadsheet x26;
+    for (int row = 1; row <= 3000; row++) {
+        std::string id = std::to_string(row);
+        assert(x26.setCell(CPos("A" + id), id));
+        assert(x26.setCell(CPos("B" + id), "=A" + id + "*2+$A$1"));
+    }
+    oss.clear();
+    oss.str("");
+    assert(x26.save(oss));
+    std::string x26Text = oss.str();
+    oss.clear();
+    oss.str("");
+    assert(x26.save(oss, ESaveFormat::BLOCKS));
+    std::string x26Blocks = oss.str();
+    assert(CBlockReader::isBlocked(x26Blocks) && x26Blocks.size() * 3 < x26Text.size());
+    std::string x26Decoded;
+    assert(CBlockReader::decode(x26Blocks, x26Decoded, 4) && x26Decoded == x26Text);
+    CSpreadsheet x26Loaded;
+    iss.clear();
+    iss.str(x26Blocks);
+    assert(x26Loaded.load(iss));
+    assert(valueMatch(x26Loaded.getValue(CPos("B3000")), CValue(6001.0)));
+    std::string x26Damaged = x26Blocks;
+    x26Damaged[x26Damaged.size() / 2] ^= 0x20;
+    iss.clear();
+    iss.str(x26Damaged);
+    assert(!x26Loaded.load(iss));
+    iss.clear();
+    iss.str(x26Blocks.substr(0, x26Blocks.size() - 10));
+    assert(!x26Loaded.load(iss));
+    // Sizes claimed by malformed headers are not allocated
+    assert(!CBlockReader::decode("<BLOCKS>\n99999999999999 1 0000000000000000\nx", x26Decoded));
+    assert(!CBlockReader::decode("<BLOCKS>\n1000000 2 0000000000000000\nab", x26Decoded));
+    iss.clear();
+    iss.str("<BLOCKS>\n99999999999999 1 0000000000000000\nx");
+    assert(!x26Loaded.load(iss));
+    std::string x26Repeated = "ab" + std::string(1000, 'x') + "abxxxx";
+    std::string x26Compressed = CLzCodec::compress(x26Repeated);
+    assert(x26Compressed.size() < 30);
+    std::string x26Restored(x26Repeated.size(), '\0');
+    assert(CLzCodec::decompress(x26Compressed, x26Restored) && x26Restored == x26Repeated);
+    assert(!CLzCodec::decompress(x26Compressed, std::span<char>(x26Restored.data(), x26Restored.size() - 1)));
+    std::ostringstream x26Snapshot;
+    std::ostringstream x26Journal;
+    assert(x26.compact(x26Snapshot, x26Journal, ESaveFormat::BLOCKS));
+    assert(x26.setCell(CPos("A1"), "10"));
+    std::istringstream x26SnapshotIn(x26Snapshot.str());
+    std::istringstream x26JournalIn(x26Journal.str());
+    assert(x26Loaded.load(x26SnapshotIn, x26JournalIn));
+    assert(valueMatch(x26Loaded.getValue(CPos("B3000")), CValue(6010.0)));
+    // Equality binds looser than ordering, copied formulas keep their parentheses
+    CSpreadsheet x27;
+    assert(x27.setCell(CPos("A1"), "=(0=0)<0"));
+    assert(x27.setCell(CPos("A2"), "=0=(0<0)"));
+    assert(x27.setCell(CPos("A3"), "=(1<>0)>=(2=2)"));
+    x27.copyRect(CPos("B1"), CPos("A1"), 1, 3);
+    assert(valueMatch(x27.getValue(CPos("B1")), CValue(0.0)));
+    assert(valueMatch(x27.getValue(CPos("B2")), CValue(1.0)));
+    oss.clear();
+    oss.str("");
+    assert(x27.save(oss));
+    assert(oss.str().find("<ID>B1</ID><VAL>=(0=0)<0</VAL><ID>B2</ID><VAL>=0=0<0</VAL><ID>B3</ID><VAL>=(1<>0)>=(2=2)</VAL>") != std::string::npos);
+    iss.clear();
+    iss.str(oss.str());
+    assert(x27.load(iss));
+    assert(valueMatch(x27.getValue(CPos("B1")), CValue(0.0)));
+    assert(valueMatch(x27.getValue(CPos("B3")), CValue(1.0)));
+    // Formulas with the same relative form are cloned from the parse cache
+    assert(CParseCache::relativeForm(CPos("B2"), "=A1*2+$C$1+sum(A1:b$3)") == "={c-1r-1}*2+{C3R1}+sum({c-1r-1}:{c0R3})");
+    assert(CParseCache::relativeForm(CPos("B2"), "=\"A1\"\"B2\"+1e5+log10(2)") == "=\"A1\"\"B2\"+1e5+log10(2)");
+    assert(CParseCache::relativeForm(CPos("B2"), "=Data!A1").empty());
+    CSpreadsheet x28;
+    assert(x28.setCell(CPos("C1"), "100"));
+    for (int row = 1; row <= 50; row++) {
+        assert(x28.setCell(CPos("A" + std::to_string(row)), std::to_string(row)));
+        assert(x28.setCell(CPos("B" + std::to_string(row)), "=A" + std::to_string(row) + "*2+$C$1+sum($A$1:A" + std::to_string(row) + ")"));
+    }
+    CAstStats x28Stats = x28.getAstStats();
+    assert(x28Stats.m_ParseHits == 49 && x28Stats.m_ParseMisses == 1);
+    assert(valueMatch(x28.getValue(CPos("B1")), CValue(103.0)));
+    assert(valueMatch(x28.getValue(CPos("B50")), CValue(1475.0)));
+    assert(x28.setCell(CPos("D7"), "=a7*2+$C$1+sum($A$1:a7)"));
+    assert(valueMatch(x28.getValue(CPos("D7")), CValue(142.0)));
+    assert(x28.setCell(CPos("E7"), "=\"B\"+C7"));
+    assert(x28.setCell(CPos("E8"), "=\"B\"+C8"));
+    assert(valueMatch(x28.getValue(CPos("E7")), CValue()));
+    assert(x28.setCell(CPos("C8"), "x"));
+    assert(valueMatch(x28.getValue(CPos("E8")), CValue("Bx")));
+    x28Stats = x28.getAstStats();
+    assert(x28Stats.m_ParseHits == 50 && x28Stats.m_ParseMisses == 3);
+    oss.clear();
+    oss.str("");
+    assert(x28.save(oss));
+    assert(oss.str().find("<ID>B9</ID><VAL>=A9*2+$C$1+sum($A$1:A9)</VAL>") != std::string::npos);
+    x28.setParseCacheCapacity(1);
+    assert(x28.setCell(CPos("F1"), "=A1"));
+    assert(x28.setCell(CPos("F2"), "=A1"));
+    assert(x28.setCell(CPos("F3"), "=A2"));
+    assert(x28.getAstStats().m_ParseMisses == 5);
+    iss.clear();
+    iss.str("=A1+1\n=A2+1\n=B1\n");
+    assert(x28.importCsv(iss, CPos("G1")));
+    assert(valueMatch(x28.getValue(CPos("G2")), CValue(3.0)));
+    assert(x28.getAstStats().m_ParseHits == 52);
+
+    // Large ranges are folded chunk by chunk and chunk results are added pairwise
+    CSpreadsheet x29;
+    CRangeNode::setWorkers(4);
+    std::string x29Csv;
+    for (int row = 0; row < 70000; row++)
+        x29Csv += "0.1\n";
+    iss.clear();
+    iss.str(x29Csv);
+    assert(x29.importCsv(iss, CPos("A1")));
+    assert(x29.setCell(CPos("A2"), "7"));
+    assert(x29.setCell(CPos("A3"), "text"));
+    assert(x29.setCell(CPos("A70000"), "-5"));
+    assert(x29.setCell(CPos("B1"), "=A2*3"));
+    assert(x29.setCell(CPos("C1"), "=sum(A1:A70000)"));
+    assert(x29.setCell(CPos("C2"), "=count(A1:B35000)"));
+    assert(x29.setCell(CPos("C3"), "=countval(0.1, A1:A70000)"));
+    assert(x29.setCell(CPos("C4"), "=max(A1:B35000)"));
+    assert(x29.setCell(CPos("C5"), "=min(A1:A70000)"));
+    double x29Chunks[5] = {};
+    for (size_t i = 0; i < 70000; i++) {
+        if (i != 2)
+            x29Chunks[i / CRangeNode::CHUNK_CELLS] += i == 1 ? 7 : i == 69999 ? -5 : 0.1;
+    }
+    double x29Sum = ((x29Chunks[0] + x29Chunks[1]) + (x29Chunks[2] + x29Chunks[3])) + x29Chunks[4];
+    assert(std::get<double>(x29.getValue(CPos("C1"))) == x29Sum);
+    assert(std::get<double>(x29.getValue(CPos("C1"))) == x29Sum);
+    assert(valueMatch(x29.getValue(CPos("C2")), CValue(35001.0)));
+    assert(valueMatch(x29.getValue(CPos("C3")), CValue(69997.0)));
+    assert(valueMatch(x29.getValue(CPos("C4")), CValue(21.0)));
+    assert(valueMatch(x29.getValue(CPos("C5")), CValue(-5.0)));
+    // Scenarios fold the same chunks on their own thread, unchanged inputs give the very same sum
+    auto x29Results = x29.evaluateScenarios({{}, {{CPos("A2"), CValue(7.0)}}}, {CPos("C1")});
+    assert(std::get<double>(x29Results[0][0]) == x29Sum && std::get<double>(x29Results[1][0]) == x29Sum);
+    // NaN is the minimum only as the first number of the range, like in a serial scan
+    assert(x29.setCell(CPos("A16385"), "=10^999-10^999"));
+    assert(valueMatch(x29.getValue(CPos("C5")), CValue(-5.0)));
+    assert(x29.setCell(CPos("A1"), "=10^999-10^999"));
+    assert(std::isnan(std::get<double>(x29.getValue(CPos("C5")))));
+    CRangeNode::setWorkers(0);
+    // Pool threads are reused by later jobs, every chunk runs exactly once
+    std::vector<std::atomic<int>> x29Runs(1000);
+    for (int job = 0; job < 50; job++)
+        CWorkerPool::instance().run(x29Runs.size(), 4, [&x29Runs](size_t chunk) { x29Runs[chunk]++; });
+    assert(std::all_of(x29Runs.begin(), x29Runs.end(), [](const std::atomic<int> &runs) { return runs == 50; }));
+
+    // Scenarios replace inputs in private overlays and leave the sheet untouched
+    CSpreadsheet x30;
+    assert(x30.setCell(CPos("A1"), "10"));
+    assert(x30.setCell(CPos("A2"), "20"));
+    assert(x30.setCell(CPos("A3"), "=A1+A2"));
+    assert(x30.setCell(CPos("A4"), "=sum(A1:A3)"));
+    assert(x30.setCell(CPos("A5"), "=A7*2"));
+    assert(x30.setCell(CPos("C1"), "=C2"));
+    assert(x30.setCell(CPos("C2"), "=C1"));
+    std::vector<CPos> x30Outputs = {CPos("A3"), CPos("A4"), CPos("A5"), CPos("C1"), CPos("A1")};
+    std::vector<std::map<CPos, CValue>> x30Inputs = {{}, {{CPos("A1"), CValue(1.0)}}, {{CPos("A7"), CValue(5.0)}},
+                                                     {{CPos("A3"), CValue("x")}}, {{CPos("C2"), CValue(1.0)}}};
+    auto x30Results = x30.evaluateScenarios(x30Inputs, x30Outputs);
+    assert(x30Results.size() == 5 && x30Results[0].size() == 5);
+    assert(valueMatch(x30Results[0][1], CValue(60.0)) && valueMatch(x30Results[0][2], CValue()));
+    assert(valueMatch(x30Results[1][0], CValue(21.0)) && valueMatch(x30Results[1][1], CValue(42.0)));
+    assert(valueMatch(x30Results[1][4], CValue(1.0)));
+    assert(valueMatch(x30Results[2][2], CValue(10.0)));
+    assert(valueMatch(x30Results[3][0], CValue("x")) && valueMatch(x30Results[3][1], CValue(30.0)));
+    assert(valueMatch(x30Results[4][3], CValue()));
+    assert(valueMatch(x30.getValue(CPos("A3")), CValue(30.0)));
+    assert(valueMatch(x30.getValue(CPos("A5")), CValue()));
+    x30Inputs.clear();
+    for (int i = 0; i < 100; i++)
+        x30Inputs.push_back({{CPos("A2"), CValue(double(i))}});
+    x30.setAstBudget(2);
+    assert(valueMatch(x30.getValue(CPos("A5")), CValue()));
+    assert(x30.getAstStats().m_Evictions > 0);
+    x30Results = x30.evaluateScenarios(x30Inputs, x30Outputs, 4);
+    for (int i = 0; i < 100; i++)
+        assert(valueMatch(x30Results[i][1], CValue(2.0 * (10 + i))));
+    assert(valueMatch(x30.getValue(CPos("A4")), CValue(60.0)));
     return EXIT_SUCCESS;
 }
 #endif /* __PROGTEST__ */
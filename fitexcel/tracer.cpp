@@ -0,0 +1,141 @@
+/******************************************************
+ * Filename: tracer.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements opt-in span tracer used for profiling of cell parsing, evaluation and file IO.
+ *              Recorded spans can be exported as Chrome trace-event JSON.
+ ******************************************************/
+
+#include "tracer.h"
+
+/***********************************************
+*        Tracer Section
+***********************************************/
+
+CTracer::CTracer()
+    : m_Enabled(false)
+    , m_Next(0)
+    , m_Count(0)
+    , m_Epoch(std::chrono::steady_clock::now()) {}
+
+CTracer &CTracer::instance() {
+    static CTracer tracer;
+    return tracer;
+}
+
+void CTracer::enable(size_t capacity) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Events.assign(capacity == 0 ? 1 : capacity, CTraceEvent());
+    m_Next = 0;
+    m_Count = 0;
+    m_Epoch = std::chrono::steady_clock::now();
+    m_Enabled = true;
+}
+
+void CTracer::disable() {
+    m_Enabled = false;
+}
+
+bool CTracer::isEnabled() const {
+    return m_Enabled.load(std::memory_order_relaxed);
+}
+
+void CTracer::clear() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Next = 0;
+    m_Count = 0;
+}
+
+size_t CTracer::size() const {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Count;
+}
+
+void CTracer::record(const char *name, std::string argument, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_Events.empty() || start < m_Epoch)
+        return;
+
+    CTraceEvent &event = m_Events[m_Next];
+    event.m_Name = name;
+    event.m_Argument = std::move(argument);
+    event.m_Start = std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_Epoch).count();
+    event.m_Duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    event.m_Thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+    // Overwrite the oldest span once the buffer is full
+    m_Next = (m_Next + 1) % m_Events.size();
+    if (m_Count < m_Events.size())
+        m_Count++;
+}
+
+void CTracer::writeEscaped(std::ostream &os, std::string_view str) {
+    static const char *hex = "0123456789abcdef";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            os << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        } else {
+            os << c;
+        }
+    }
+}
+
+bool CTracer::dump(std::ostream &os) const {
+    if (os.fail())
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    size_t first = (m_Next + m_Events.size() - m_Count) % std::max<size_t>(m_Events.size(), 1);
+
+    // Fractions are zero padded, the caller gets its own fill character back
+    char fill = os.fill('0');
+
+    os << "{\"traceEvents\":[";
+    for (size_t i = 0; i < m_Count; i++) {
+        const CTraceEvent &event = m_Events[(first + i) % m_Events.size()];
+
+        // Chrome expects timestamps in microseconds, keep nanosecond precision as fraction
+        os << (i ? ",\n" : "\n") << "{\"name\":\"";
+        writeEscaped(os, event.m_Name);
+        os << "\",\"cat\":\"fitexcel\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (event.m_Thread % 1000000)
+           << ",\"ts\":" << event.m_Start / 1000 << '.' << std::setw(3) << event.m_Start % 1000
+           << ",\"dur\":" << event.m_Duration / 1000 << '.' << std::setw(3) << event.m_Duration % 1000;
+
+        if (!event.m_Argument.empty()) {
+            os << ",\"args\":{\"cell\":\"";
+            writeEscaped(os, event.m_Argument);
+            os << "\"}";
+        }
+        os << '}';
+    }
+    os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    os.fill(fill);
+    return !os.fail();
+}
+
+/***********************************************
+*        Trace Span Section
+***********************************************/
+
+CTraceSpan::CTraceSpan(const char *name)
+    : m_Name(name)
+    , m_Active(CTracer::instance().isEnabled()) {
+    if (m_Active)
+        m_Start = std::chrono::steady_clock::now();
+}
+
+CTraceSpan::~CTraceSpan() {
+    if (m_Active)
+        CTracer::instance().record(m_Name, std::move(m_Argument), m_Start, std::chrono::steady_clock::now());
+}
+
+bool CTraceSpan::isActive() const {
+    return m_Active;
+}
+
+void CTraceSpan::setArgument(std::string_view argument) {
+    if (m_Active)
+        m_Argument = argument;
+}
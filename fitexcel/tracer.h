@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * One finished span recorded by the tracer
+*/
+struct CTraceEvent {
+    // Static span name (e.g. "parse", "evaluate")
+    const char *m_Name;
+
+    // Optional span detail, usually the cell id
+    std::string m_Argument;
+
+    // Start of the span in nanoseconds since the tracer was enabled
+    uint64_t m_Start;
+
+    // Span length in nanoseconds
+    uint64_t m_Duration;
+
+    // Hashed id of the recording thread
+    size_t m_Thread;
+};
+
+/****************************************************************************/
+
+class CTracer {
+public:
+    /**
+     * Returns process wide tracer instance
+     * @return Tracer
+    */
+    static CTracer &instance();
+
+    /**
+     * Starts recording spans into a ring buffer, the oldest spans are overwritten once it is full
+     * @param capacity Maximum number of kept spans
+    */
+    void enable(size_t capacity = 65536);
+    void disable();
+    bool isEnabled() const;
+    void clear();
+    size_t size() const;
+
+    /**
+     * Stores finished span, called by CTraceSpan
+     * @param name Span name
+     * @param argument Span detail
+     * @param start Span start
+     * @param end Span end
+    */
+    void record(const char *name, std::string argument, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+    /**
+     * Writes recorded spans as Chrome trace-event JSON (chrome://tracing, Perfetto, speedscope)
+     * @param os Output stream
+     * @return True if write was successful
+    */
+    bool dump(std::ostream &os) const;
+
+private:
+    CTracer();
+    static void writeEscaped(std::ostream &os, std::string_view str);
+    std::atomic<bool> m_Enabled;
+    mutable std::mutex m_Mutex;
+    std::vector<CTraceEvent> m_Events;
+    // Ring buffer write position and number of valid events
+    size_t m_Next;
+    size_t m_Count;
+    std::chrono::steady_clock::time_point m_Epoch;
+};
+
+/****************************************************************************/
+
+/**
+ * RAII span, measures time between construction and destruction when tracing is enabled
+*/
+class CTraceSpan {
+public:
+    CTraceSpan(const char *name);
+    CTraceSpan(const CTraceSpan &span) = delete;
+    CTraceSpan& operator=(const CTraceSpan &span) = delete;
+    ~CTraceSpan();
+    bool isActive() const;
+
+    /**
+     * Attaches detail shown in trace viewer, ignored for inactive spans
+     * @param argument Span detail
+    */
+    void setArgument(std::string_view argument);
+
+private:
+    const char *m_Name;
+    std::string m_Argument;
+    bool m_Active;
+    std::chrono::steady_clock::time_point m_Start;
+};
@@ -0,0 +1,193 @@
+/******************************************************
+ * Filename: workbook.cpp
+ * Author: David Kopelent
+ * Date: 19.10.2026
+ * Description: This code implements workbook of named sheets with references between sheets,
+ *              cycle detection across sheets and concurrent recalculation of independent sheets.
+ ******************************************************/
+
+#include "workbook.h"
+
+/***********************************************
+*        Sheets Section
+***********************************************/
+
+bool CWorkbook::addSheet(const std::string &name) {
+    if (name.empty() || name.find('!') != std::string::npos || m_Sheets.count(name))
+        return false;
+
+    auto sheet = std::make_unique<CSpreadsheet>();
+    attach(name, *sheet);
+    m_Sheets.emplace(name, std::move(sheet));
+    return true;
+}
+
+bool CWorkbook::removeSheet(const std::string &name) {
+    return m_Sheets.erase(name) > 0;
+}
+
+CSpreadsheet *CWorkbook::getSheet(const std::string &name) {
+    auto sheet = m_Sheets.find(name);
+    return sheet != m_Sheets.end() ? sheet->second.get() : nullptr;
+}
+
+std::vector<std::string> CWorkbook::getSheetNames() const {
+    std::vector<std::string> names;
+    for (const auto &sheet : m_Sheets)
+        names.push_back(sheet.first);
+    return names;
+}
+
+bool CWorkbook::setCell(const std::string &sheet, CPos pos, std::string contents) {
+    CSpreadsheet *target = getSheet(sheet);
+    return target != nullptr && target->setCell(pos, std::move(contents));
+}
+
+CValue CWorkbook::getValue(const std::string &sheet, CPos pos) {
+    CSpreadsheet *target = getSheet(sheet);
+    return target != nullptr ? target->getValue(pos) : CValue();
+}
+
+std::map<std::string, CCell> *CWorkbook::table(const std::string &sheet) {
+    auto target = m_Sheets.find(sheet);
+    return target != m_Sheets.end() ? &target->second->m_Table : nullptr;
+}
+
+const CDependencyGraph *CWorkbook::graph(const std::string &sheet) const {
+    auto target = m_Sheets.find(sheet);
+    return target != m_Sheets.end() ? &target->second->m_Dependencies : nullptr;
+}
+
+void CWorkbook::attach(const std::string &name, CSpreadsheet &sheet) {
+    sheet.m_Sheets = this;
+    sheet.m_SheetName = name;
+}
+
+/***********************************************
+*        Recalculation Section
+***********************************************/
+
+std::map<std::string, std::shared_ptr<const CValueSnapshot>> CWorkbook::recalculate() {
+    CTraceSpan span("recalculate");
+    auto groups = groupSheets();
+
+    // Evaluation of a group touches cell caches of all its sheets, so a group never spans threads
+    std::vector<std::vector<std::shared_ptr<const CValueSnapshot>>> values(groups.size());
+    std::atomic<size_t> next = 0;
+    auto worker = [&groups, &values, &next]() {
+        for (size_t group = next++; group < groups.size(); group = next++) {
+            for (auto *sheet : groups[group])
+                values[group].push_back(sheet->second->evaluateAll());
+        }
+    };
+
+    size_t count = std::clamp<size_t>(groups.size(), 1, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+
+    std::map<std::string, std::shared_ptr<const CValueSnapshot>> result;
+    for (size_t group = 0; group < groups.size(); group++) {
+        for (size_t i = 0; i < groups[group].size(); i++)
+            result.emplace(groups[group][i]->first, std::move(values[group][i]));
+    }
+    return result;
+}
+
+std::vector<std::vector<std::pair<const std::string, std::unique_ptr<CSpreadsheet>>*>> CWorkbook::groupSheets() {
+    // Union-find over sheets, a reference joins the sheets at both of its ends
+    std::map<std::string, std::string> parent;
+    std::function<std::string(const std::string&)> root = [&parent, &root](const std::string &name) {
+        std::string &up = parent[name];
+        if (up.empty() || up == name)
+            return up = name;
+        return up = root(up);
+    };
+    for (const auto &[name, sheet] : m_Sheets) {
+        for (const auto &referenced : sheet->m_Dependencies.getReferencedSheets()) {
+            if (m_Sheets.count(referenced))
+                parent[root(referenced)] = root(name);
+        }
+    }
+
+    std::map<std::string, size_t> indices;
+    std::vector<std::vector<std::pair<const std::string, std::unique_ptr<CSpreadsheet>>*>> groups;
+    for (auto &sheet : m_Sheets) {
+        auto [index, inserted] = indices.emplace(root(sheet.first), groups.size());
+        if (inserted)
+            groups.emplace_back();
+        groups[index->second].push_back(&sheet);
+    }
+    return groups;
+}
+
+/***********************************************
+*        File IO Section
+***********************************************/
+
+bool CWorkbook::save(std::ostream &os, ESaveFormat format) const {
+    if (os.fail())
+        return false;
+
+    CTraceSpan span("saveWorkbook");
+    for (const auto &[name, sheet] : m_Sheets) {
+        std::ostringstream data;
+        if (!sheet->save(data, format))
+            return false;
+        std::string payload = data.str();
+        os << name.size() << ' ' << name << ' ' << payload.size() << '\n';
+        os.write(payload.data(), payload.size());
+        os << '\n';
+    }
+    return !os.fail();
+}
+
+bool CWorkbook::readField(std::istream &is, size_t length, std::string &out) {
+    static const size_t PIECE = 1 << 16;
+    out.clear();
+    while (out.size() < length) {
+        size_t piece = std::min(PIECE, length - out.size());
+        size_t offset = out.size();
+        out.resize(offset + piece);
+        if (!is.read(out.data() + offset, piece))
+            return false;
+    }
+    return true;
+}
+
+bool CWorkbook::load(std::istream &is) {
+    if (is.fail())
+        return false;
+
+    CTraceSpan span("loadWorkbook");
+    std::map<std::string, std::unique_ptr<CSpreadsheet>> sheets;
+    size_t nameLength;
+    while (is >> nameLength) {
+        std::string name;
+        size_t payloadLength;
+        if (is.get() != ' ' || !readField(is, nameLength, name) || is.get() != ' ' || !(is >> payloadLength) || is.get() != '\n')
+            return false;
+
+        std::string payload;
+        if (!readField(is, payloadLength, payload) || is.get() != '\n')
+            return false;
+        if (name.empty() || name.find('!') != std::string::npos || sheets.count(name))
+            return false;
+
+        // Formulas are only parsed while loading, so sheets may reference sheets loaded later
+        auto sheet = std::make_unique<CSpreadsheet>();
+        attach(name, *sheet);
+        std::istringstream data(payload);
+        if (!sheet->load(data))
+            return false;
+        sheets.emplace(name, std::move(sheet));
+    }
+    if (!is.eof())
+        return false;
+
+    m_Sheets = std::move(sheets);
+    return true;
+}
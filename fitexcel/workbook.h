@@ -0,0 +1,81 @@
+#include "spreadsheet.h"
+
+/**
+ * Named sheets whose formulas may reference each other (e.g. =Sheet2!A1*2, =sum('Q1 data'!A1:B5)).
+ * Cycles are detected across sheets and sheets not linked by references are recalculated concurrently
+*/
+class CWorkbook : public CSheetResolver {
+public:
+    CWorkbook() = default;
+    CWorkbook(const CWorkbook &workbook) = delete;
+    CWorkbook& operator=(const CWorkbook &workbook) = delete;
+
+    /**
+     * Adds empty sheet
+     * @param name Sheet name, it must not be empty or contain '!'
+     * @return False if the name is invalid or already used
+    */
+    bool addSheet(const std::string &name);
+
+    /**
+     * Removes sheet, references to its cells from other sheets become undefined
+     * @param name Sheet name
+     * @return False if there is no such sheet
+    */
+    bool removeSheet(const std::string &name);
+
+    /**
+     * @param name Sheet name
+     * @return Sheet or nullptr when there is no such sheet
+    */
+    CSpreadsheet *getSheet(const std::string &name);
+    std::vector<std::string> getSheetNames() const;
+    bool setCell(const std::string &sheet, CPos pos, std::string contents);
+    CValue getValue(const std::string &sheet, CPos pos);
+
+    /**
+     * Evaluates every cell of every sheet. Sheets linked by references are evaluated together,
+     * independent groups of sheets by separate threads
+     * @return Values of every sheet
+    */
+    std::map<std::string, std::shared_ptr<const CValueSnapshot>> recalculate();
+
+    /**
+     * Writes every sheet as "<name length> <name> <sheet length>\n<sheet>\n", sheets use the CSpreadsheet format
+     * @param os Output stream
+     * @param format Layout of every sheet
+     * @return True if write was successful
+    */
+    bool save(std::ostream &os, ESaveFormat format = ESaveFormat::TEXT) const;
+
+    /**
+     * Replaces all sheets by those stored by save, the workbook is kept when the input is invalid
+     * @param is Input stream
+     * @return True if load was successful
+    */
+    bool load(std::istream &is);
+
+    std::map<std::string, CCell> *table(const std::string &sheet) override;
+    const CDependencyGraph *graph(const std::string &sheet) const override;
+
+private:
+    /**
+     * Splits sheets into groups not linked by references in either direction
+     * @return Sheet groups
+    */
+    std::vector<std::vector<std::pair<const std::string, std::unique_ptr<CSpreadsheet>>*>> groupSheets();
+    void attach(const std::string &name, CSpreadsheet &sheet);
+
+    /**
+     * Reads field of a length given by the input in bounded pieces, so a damaged length does not allocate
+     * more than the stream really holds
+     * @param is Input stream
+     * @param length Field length
+     * @param out Field contents
+     * @return False if the stream ends before the field does
+    */
+    static bool readField(std::istream &is, size_t length, std::string &out);
+
+    // Sheets are kept at stable addresses, their formulas reach other sheets through the workbook
+    std::map<std::string, std::unique_ptr<CSpreadsheet>> m_Sheets;
+};